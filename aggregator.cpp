@@ -1,47 +1,203 @@
-/* 
+/*
  * File:   aggregator.cpp
  * Author: taozou
- * 
+ *
  * Created on December 18, 2012, 8:09 PM
  */
 
 #include "aggregator.h"
+#include <cstdio>
+#include <cstring>
 #include <mpi.h>
 
-aggregator::aggregator() {
-    for (int i = 0; i < K; ++i)
-        topk[K] = 0;
+using namespace webstor::internal;
+
+// How often rank 0 looks for messages/signals and prints progress.
+
+static const UInt32 c_pollMs = 10;
+static const UInt64 c_progressMs = 1000;
+
+aggregator::aggregator()
+    : selectorCount(0)
+    , released(false)
+    , matchLimit(0)
+    , matchesReceived(0)
+    , partialPending(false)
+{
+}
+
+bool aggregator::init(const char * querySpec, const char * filter)
+{
+    if (!queries.parse(querySpec, filter))
+        return false;
+
+    merged.resize(sizeof(Report) + queries.stateSize());
+    initReport((Report *) &merged[0], 0);
+    return true;
+}
+
+void aggregator::merge()
+{
+    Report *header = (Report *) &merged[0];
+    initReport(header, 0);
+    queries.reset();
+
+    for (std::map<int, std::vector<char> >::const_iterator it = sources.begin(); it != sources.end(); ++it)
+    {
+        const Report *report = (const Report *) &it->second[0];
+        header->done += report->done;
+        header->total += report->total;
+        header->matchesSent += report->matchesSent;
+        queries.merge(&it->second[sizeof(Report)]);
+    }
+    queries.save(&merged[sizeof(Report)]);
+}
+
+void aggregator::forward(int sendToRank)
+{
+    // Same policy as selectors: a partial report never blocks, a newer one
+    // always follows.
+
+    if (partialPending && !partialRequest.Test())
+        return;
+
+    partial = merged;
+    partialRequest = MPI::COMM_WORLD.Isend(&partial[0], partial.size(), MPI::CHAR, sendToRank, TagPartial);
+    partialPending = true;
+}
+
+void aggregator::printProgress()
+{
+    const Report *header = (const Report *) &merged[0];
+
+    if (!header->total || sinceProgress.elapsed() < c_progressMs)
+        return;
+
+    double ratio = (double)header->done / header->total;
+    UInt64 ms = elapsed.elapsed();
+
+    fprintf(stderr, "%5.1f%% (%d/%d)", 100.0 * ratio, header->done, header->total);
+    if (header->done)
+        fprintf(stderr, " eta %llus", (ms * (header->total - header->done) / header->done) / 1000);
+    fprintf(stderr, "\n");
+    queries.print(stderr);
+
+    sinceProgress.start();
+}
+
+void aggregator::release()
+{
+    if (released)
+        return;
+
+    for (int rank = 1; rank <= selectorCount; ++rank)
+        MPI::COMM_WORLD.Send(0, 0, MPI::CHAR, rank, TagStop);
+    released = true;
+}
+
+void aggregator::receiveMatches(const MPI::Status &status)
+{
+    Matches m;
+    MPI::COMM_WORLD.Recv(&m, sizeof(Matches), MPI::CHAR, status.Get_source(), TagMatch);
+    ++matchesReceived;
+
+    for (int i = 0; i < m.count && (int)matches.size() < matchLimit; ++i)
+        matches.push_back(std::make_pair(m.values[i], m.ids[i]));
+
+    if ((int)matches.size() >= matchLimit && !released)
+    {
+        // The predicate is satisfied, nobody needs to download anything else.
+
+        release();
+    }
 }
 
 void aggregator::run(int receiveCount, int sendToRank) {
-    int data[K];
-    while (receiveCount)
+    std::vector<char> data(merged.size());
+    MPI::Status status;
+    int finals = 0;
+
+    elapsed.start();
+    sinceProgress.start();
+
+    // Match messages go straight to rank 0, so it also waits for every
+    // match message the final reports say were sent.
+
+    while (finals < receiveCount || matchesReceived < ((const Report *) &merged[0])->matchesSent)
     {
-        MPI::COMM_WORLD.Recv(&data, K * sizeof(int), MPI::CHAR, MPI::ANY_SOURCE, MPI::ANY_TAG);
-        
-        for (int i = 0; i < K; ++i)
-            for (int j = 0; j < K; ++j)
-                if (topk[j] < data[i])
-                {
-                    topk[j] = data[i];
-                    break;
-                }
-        --receiveCount;
+        int source = MPI::ANY_SOURCE;
+        int tag = MPI::ANY_TAG;
+
+        if (sendToRank == -1)
+        {
+            // Rank 0 polls so that it can react to the stop signal while
+            // the scan is running.
+
+            if (stopSignaled && !released)
+            {
+                fprintf(stderr, "stopping, waiting for final reports\n");
+                release();
+            }
+
+            if (!MPI::COMM_WORLD.Iprobe(MPI::ANY_SOURCE, MPI::ANY_TAG, status))
+            {
+                taskSleep(c_pollMs);
+                continue;
+            }
+
+            if (status.Get_tag() == TagMatch)
+            {
+                receiveMatches(status);
+                continue;
+            }
+
+            // Receive exactly the probed message, a match may have come in since.
+
+            source = status.Get_source();
+            tag = status.Get_tag();
+        }
+
+        MPI::COMM_WORLD.Recv(&data[0], data.size(), MPI::CHAR, source, tag, status);
+
+        sources[status.Get_source()] = data;
+        if (status.Get_tag() == TagFinal)
+            ++finals;
+        merge();
+
+        if (finals < receiveCount)
+        {
+            if (sendToRank == -1)
+                printProgress();
+            else
+                forward(sendToRank);
+        }
     }
-    
-    
+
+    if (partialPending)
+        partialRequest.Wait();
+
     if (sendToRank == -1)
     {
-        for (int i = 0; i < K; ++i)
-            printf("%d ", topk[i]);
-        printf("\n");
+        release();
+
+        const Report *header = (const Report *) &merged[0];
+        if (header->done < header->total)
+            fprintf(stderr, "stopped early: %d of %d objects scanned\n", header->done, header->total);
+
+        queries.print(stdout);
+
+        if (matchLimit)
+        {
+            for (size_t i = 0; i < matches.size(); ++i)
+                printf("%d@%d ", matches[i].first, matches[i].second);
+            printf("\n");
+        }
     }
     else
     {
-        MPI::COMM_WORLD.Send(&topk, K * sizeof(int), MPI::CHAR, sendToRank, 0);
+        MPI::COMM_WORLD.Send(&merged[0], merged.size(), MPI::CHAR, sendToRank, TagFinal);
     }
 }
 
 aggregator::~aggregator() {
 }
-
@@ -8,18 +8,53 @@
 #ifndef AGGREGATOR_H
 #define	AGGREGATOR_H
 
-#define K 10
+#include "report.h"
+#include "query.h"
+#include "sysutils.h"
+#include <map>
+#include <vector>
+#include <mpi.h>
 
 class aggregator {
 public:
     aggregator();
     
+    bool init(const char * querySpec, const char * filter = NULL);
     void run(int, int);
     
     ~aggregator();
     
-    int topk[K];
+    void merge();
+    void forward(int sendToRank);
+    void printProgress();
+    void release();
+    void receiveMatches(const MPI::Status &status);
+    
+    QuerySet queries;
     int sendToRank, receiveCount;
+    
+    // Rank 0 only: selectors are ranks 1..selectorCount, each one is
+    // released with a TagStop message once the answer is known.
+    
+    int selectorCount;
+    bool released;
+    
+    // Rank 0 only: early termination, selectors are released as soon as
+    // matchLimit values satisfying the predicate have been found.
+    
+    int matchLimit;
+    int matchesReceived;
+    std::vector<std::pair<int, int> > matches;  // (value, object id)
+    
+    // Latest report of every source, a new report replaces the previous one.
+    
+    std::map<int, std::vector<char> > sources;
+    std::vector<char> merged;     // Report header followed by the merged query state
+    std::vector<char> partial;    // copy of merged while a partial report is in flight
+    bool partialPending;
+    MPI::Request partialRequest;
+    webstor::internal::Stopwatch elapsed;
+    webstor::internal::Stopwatch sinceProgress;
 };
 
 #endif	/* AGGREGATOR_H */
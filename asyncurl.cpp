@@ -42,9 +42,17 @@ namespace internal
 
 struct AsyncState
 {
+    // c_none -> c_finished: completed, a later cancellation just waits.
+    // c_none -> c_cancelRequested: the cancellation is in the ring, the asyncLoop 
+    //  finishes the request when it pops it (even if it has completed meanwhile).
+
+    enum CancelState { c_none, c_cancelRequested, c_finished };
+
                     AsyncState();
 
-    void            setCompleted() { completedEvent.set(); }
+    void            setCompleted() { completedEvent.set(); notify(); }  // nofail
+    void            notify();  // nofail
+    void            setCanceled() { completedEvent.set(); }
     bool            isCompleted() { return completedEvent.wait( 0 ); }
 
     static void         setToCurl( CURL *curl, AsyncState *as );  // nofail
@@ -53,9 +61,32 @@ struct AsyncState
     EventSync       completedEvent;
     CURLcode        opResult;
 
-    SocketHandle    socket;
     AsyncLoop *     asyncLoop;
 
+    // The request is in the multi-handle (accessed by the asyncLoop thread only).
+
+    bool            running;
+
+    // Whichever of cancelOp(..) and the completion comes first wins, see CancelState.
+
+    volatile int    cancelState;
+
+    // Where completions are pushed to, or who is called back with the tag
+    // of completionNode, if the owner attached one.
+
+    CompletionQueue *   completionQueue;
+    CompletionHandler * completionHandler;
+    CompletionNode      completionNode;
+
+    // The thread of the pool of the AsyncMan the request goes to, 
+    // -1 until assigned (see AsyncLoop::assignPoolLoop(..)).
+
+    size_t          poolLoop;
+
+    // Holds the request until it is submitted (asyncLoop is NULL meanwhile).
+
+    AsyncBatch *    batch;
+
 #ifdef PERF
     UInt64          creationTimestamp;
 #endif
@@ -64,8 +95,13 @@ struct AsyncState
 inline
 AsyncState::AsyncState()
     : opResult( CURLE_OK )
-    , socket( 0 )
     , asyncLoop( 0 )
+    , running( false )
+    , cancelState( c_none )
+    , completionQueue( 0 )
+    , completionHandler( 0 )
+    , poolLoop( ( size_t )-1 )
+    , batch( 0 )
 { 
     completedEvent.set();
 
@@ -74,6 +110,18 @@ AsyncState::AsyncState()
 #endif
 }
 
+inline void
+AsyncState::notify()  // nofail
+{
+    // After the event is set: whoever pops the tag must see the operation completed.
+    // The handler may pend the next operation, so nothing is touched after it.
+
+    if( completionQueue )
+        completionQueue->push( &completionNode );  // nofail
+    else if( completionHandler && cancelState != c_cancelRequested )
+        completionHandler->onCompleted( completionNode.tag );  // nofail
+}
+
 inline void
 AsyncState::setToCurl( CURL *curl, AsyncState *as )  // nofail
 {
@@ -91,6 +139,112 @@ AsyncState::getFromCurl( CURL *curl )  // nofail
     return as; 
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// RequestRing -- a bounded lock-free queue of requests, pushed by any thread
+// and popped by the asyncLoop thread only.
+// Every cell has a sequence number telling whose turn it is: a producer
+// claims the cell at m_tail when the sequence equals the position and
+// publishes it by advancing the sequence, the consumer hands the cell over
+// to the next lap.
+
+class RequestRing
+{
+public:
+    explicit        RequestRing( size_t capacity );  // a power of 2
+                    ~RequestRing();
+
+    bool            push( CURL *request );  // nofail, false if full
+    bool            pop( CURL **request );  // nofail, false if empty
+
+private:
+    struct Cell
+    {
+        volatile int    sequence;
+        CURL *          request;
+    };
+
+                    RequestRing( const RequestRing & );  // forbidden
+    RequestRing &   operator=( const RequestRing & );  // forbidden
+
+    // Positions wrap around, compare them as distances.
+
+    static int      distance( int from, int to ) { return ( int )( ( UInt32 )to - ( UInt32 )from ); }
+    static int      advance( int position, int by ) { return ( int )( ( UInt32 )position + by ); }
+
+    Cell *          m_cells;
+    int             m_mask;
+    volatile int    m_tail;     // the next position to push to
+    int             m_head;     // the next position to pop from
+};
+
+RequestRing::RequestRing( size_t capacity )
+    : m_cells( new Cell[ capacity ] )
+    , m_mask( ( int )capacity - 1 )
+    , m_tail( 0 )
+    , m_head( 0 )
+{
+    dbgAssert( capacity && !( capacity & ( capacity - 1 ) ) );
+
+    for( size_t i = 0; i < capacity; ++i )
+    {
+        m_cells[ i ].sequence = ( int )i;
+        m_cells[ i ].request = NULL;
+    }
+}
+
+RequestRing::~RequestRing()
+{
+    delete[] m_cells;
+}
+
+inline bool
+RequestRing::push( CURL *request )  // nofail
+{
+    while( true )
+    {
+        int position = m_tail;
+        Cell *const cell = &m_cells[ position & m_mask ];
+        int lag = distance( position, cell->sequence );
+
+        if( lag < 0 )
+        {
+            // The consumer has not popped this cell from the previous lap.
+
+            return false;
+        }
+
+        if( lag == 0 && atomicCompareExchange( &m_tail, advance( position, 1 ), position ) )
+        {
+            cell->request = request;
+            cpuMemStoreFence();
+            cell->sequence = advance( position, 1 );
+            return true;
+        }
+
+        // Another producer has claimed the cell, retry with the new tail.
+    }
+}
+
+inline bool
+RequestRing::pop( CURL **request )  // nofail
+{
+    dbgAssert( request );
+
+    Cell *const cell = &m_cells[ m_head & m_mask ];
+
+    if( cell->sequence != advance( m_head, 1 ) )
+    {
+        return false;
+    }
+
+    cpuMemLoadFence();
+    *request = cell->request;
+    cpuMemFullFence();
+    cell->sequence = advance( m_head, m_mask + 1 );
+    m_head = advance( m_head, 1 );
+    return true;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // AsyncLoop -- async cURL-multi object.
 
@@ -101,13 +255,39 @@ AsyncState::getFromCurl( CURL *curl )  // nofail
 class AsyncLoop
 {
 public:
-                    AsyncLoop();
+                    AsyncLoop( AsyncMan::EventBackend backend, size_t eventBatch, int cpu = -1 );
+    static AsyncLoop *  createPool( AsyncMan::EventBackend backend, size_t eventBatch, 
+                            size_t count, const int *cpus );
     static void     destroy( AsyncLoop *head );
 
+    AsyncMan::EventBackend  backend() const;  // nofail
+    int             cpu() const { return m_cpu; }
+
+    // The fixed pool, on the head only: the first poolSize() loops of the registry.
+
+    size_t          poolSize() const { return m_poolSize; }
+    AsyncLoop *     poolLoop( size_t loop ) const { return m_loops[ loop ]; }
+
     static void     pendOp( AsyncLoop *head, CURL *request, size_t connectionsPerThread );
+    static void     pendOps( AsyncLoop *head, CURL **requests, size_t count, 
+                        size_t connectionsPerThread, size_t *done );
     void            cancelOp( CURL *request );  // nofail
 private:
-    enum { c_maxSocketTimeout = 3000, c_interruptOnlyTimeout = -1 };
+    // Waits are bounded only while a socket is not watched by m_socketPool.
+
+    enum { c_unwatchedSocketTimeout = 3000, c_infiniteTimeout = -1 };
+
+    // No more requests than that are admitted to a loop, so neither ring
+    // can overflow: a request is pushed once to each at most.
+
+    enum { c_ringCapacity = AsyncMan::c_cConnectionsPerThreadLimit };
+
+    // The registry of loops is fixed-size, so it can be read without a lock;
+    // the number of choices tried before falling back to the sweep.
+
+    enum { c_maxLoops = 1024, c_choiceRounds = 2 };
+
+    void            finishRequest( AsyncState *asyncState );  // nofail
 
                     AsyncLoop( const AsyncLoop & );  // forbidden
     AsyncLoop &     operator=( const AsyncLoop & );  // forbidden
@@ -115,6 +295,15 @@ private:
                     ~AsyncLoop();
     bool            pendOp( CURL *request, size_t connectionsPerThread,
                         size_t *totalRequest );
+    size_t          pendOps( CURL *const *requests, size_t count, size_t connectionsPerThread );
+    size_t          admit( size_t count, size_t connectionsPerThread, size_t *totalRequest );  // nofail
+    void            appendRequest( CURL *request );  // nofail, admitted
+    void            signalPending();  // nofail
+    AsyncLoop *     appendLoop( int cpu = -1 );
+
+    size_t          loopCount() const;  // nofail
+    AsyncLoop *     chooseLoop();  // nofail
+    size_t          assignPoolLoop( AsyncState *asyncState );  // nofail
 
     void            asyncLoop();
     static TaskResult TASKAPI asyncLoopTask( void *arg );
@@ -125,7 +314,7 @@ private:
     void            removeCompletedRequests();
 
     void            addSocket( AsyncState *asyncState, curl_socket_t socket, int what ); // nofail
-    void            removeSocket( AsyncState *asyncState );  // nofail
+    void            removeSocket( curl_socket_t socket );  // nofail
 
     void            executeSocketAction( SocketHandle socket, SocketActionMask actionMask = 0 );  // nofail
 
@@ -144,44 +333,84 @@ private:
     bool            m_shutdown;
     TaskCtrl        m_asyncLoopTaskCtrl;
 
-    // Timeout recommended by curl.
-
-    UInt32          m_socketActionTimeout;
-
     // A pool of active sockets provided by curl through the handleAddRemoveSocket callback.
     // The field is used by asyncLoop thread only.
     // We don't have any synchronization for this field.
 
     SocketPool      m_socketPool;
 
+    // The backend and the event batch asked for, loops created on demand get them too.
+
+    AsyncMan::EventBackend  m_backend;
+    size_t          m_eventBatch;
+
+    // The cpu the thread is pinned to, -1 if not pinned.
+
+    int             m_cpu;
+
+    // The head of the registry this asyncLoop is in.
+
+    AsyncLoop *     m_head;
+
+    // The head only: the registry of all asyncLoops, the head first. 
+    // The head is always created by AsyncMan, subsequent asyncLoops get appended
+    // on demand and they never destroy. A slot is written before m_loopCount 
+    // covers it and never changes after that, so readers need no lock.
+
+    std::vector< AsyncLoop * >  m_loops;
+    volatile int    m_loopCount;    // all write access must go through the m_lock
+
+    // The head only: the size of the fixed pool set up by createPool(..), 
+    // the next pool thread to assign a request to and the sequence that seeds 
+    // the choice of loops.
+
+    size_t          m_poolSize;
+    volatile int    m_poolNext;
+    volatile int    m_choiceNext;
+
+    // Requests completed in one pass, their events are set together 
+    // (reserved to make removeCompletedRequests() nofail).
+
+    std::vector< AsyncState * > m_completedStates;
+    std::vector< EventSync * >  m_completedEvents;
+
+    // Guards appending to the registry of asyncLoops.
+
     ExLockSync      m_lock;
 
-    // The next asyncLoop item. Needed to handle more requests than one asyncLoop
-    // can process. 
-    // The head asyncLoop is always created by ConnectionAsyncManager.
-    // Subsequent asyncLoops get created on-demand and they never destroy. In other words,
-    // if 'next' is not NULL, it will stay not NULL and won't change.
+    // Pending new and canceled requests. Pushed by any thread without a lock, 
+    // popped by the asyncLoop thread only.
 
-    AsyncLoop *volatile     m_next;    // all write access must go through the m_lock
+    RequestRing     m_pendingRing;
+    RequestRing     m_canceledRing;
 
-    // Pending new and canceled request. Can be added by any thread but removed by asyncLoop thread only.
-    // (all access must be synchronized through the m_lock.)
+    // Requests popped in one pass (used by the asyncLoop thread only, reserved
+    // for the capacity of the rings).
 
     std::vector< CURL * >   m_pendingRequests; 
     std::vector< CURL * >   m_canceledRequests;
 
     // Number of running requests (number of easy handles in the multi-handle).
     // It's equal or greater than the number of sockets in the m_socketPool.
-    // The field is modified by the asyncLoop thread only after easy handle is
-    // added/removed to/from the multi-handle.
+    // The field is used by the asyncLoop thread only.
+
+    size_t          m_runningRequestCount;
 
-    volatile size_t m_runningRequestCount;
+    // Number of admitted requests, pending or running. Raised by the threads
+    // that pend (see admit(..)), lowered by the asyncLoop thread as requests 
+    // leave the multi-handle.
+
+    volatile int    m_requestCount;
 
     // A flag indicating if there are pending new or canceled requests.
 
-    volatile bool   m_hasPending;
+    volatile int    m_hasPending;
 };
 
+// The asyncLoop whose thread runs completion handlers, see removeCompletedRequests().
+
+static THREAD_LOCAL AsyncLoop *s_inlineLoop = 0;
+
 static void
 raiseIfError( CURLMcode multiCurlCode )
 {
@@ -200,14 +429,29 @@ raiseIfError( CURLMcode multiCurlCode )
     }
 }
 
-AsyncLoop::AsyncLoop()
+AsyncLoop::AsyncLoop( AsyncMan::EventBackend backend, size_t eventBatch, int cpu )
     : m_multiCurl( NULL )
     , m_shutdown( false )
-    , m_socketActionTimeout( c_maxSocketTimeout )
-    , m_next ( NULL )
+    , m_socketPool( backend == AsyncMan::c_uring, backend == AsyncMan::c_epollEdge, eventBatch )
+    , m_backend( backend )
+    , m_eventBatch( eventBatch )
+    , m_cpu( cpu )
+    , m_head( this )
+    , m_loopCount( 0 )
+    , m_poolSize( 0 )
+    , m_poolNext( 0 )
+    , m_choiceNext( 0 )
+    , m_pendingRing( c_ringCapacity )
+    , m_canceledRing( c_ringCapacity )
     , m_runningRequestCount( 0 )
-    , m_hasPending( false )
+    , m_requestCount( 0 )
+    , m_hasPending( 0 )
 {
+    CASSERT( !( c_ringCapacity & ( c_ringCapacity - 1 ) ) );
+
+    m_pendingRequests.reserve( c_ringCapacity );  // can throw std::bad_alloc
+    m_canceledRequests.reserve( c_ringCapacity );  // can throw std::bad_alloc
+
     // Allocate a multi-handle.
 
     m_multiCurl = curl_multi_init();
@@ -254,21 +498,61 @@ AsyncLoop::~AsyncLoop()
     // before AsyncMan can be destroyed.
 
     dbgAssert( m_runningRequestCount == 0 );
+    dbgAssert( m_requestCount == 0 );
 
     // Release the multi-handle.
 
     dbgVerify( curl_multi_cleanup( m_multiCurl ) == CURLM_OK );
 }
 
+AsyncLoop *
+AsyncLoop::createPool( AsyncMan::EventBackend backend, size_t eventBatch, size_t count, const int *cpus )
+{
+    AsyncLoop *const head = new AsyncLoop( backend, eventBatch, cpus && count ? cpus[ 0 ] : -1 );
+
+    try
+    {
+        head->m_loops.resize( c_maxLoops );  // can throw std::bad_alloc
+        head->m_loops[ 0 ] = head;
+        head->m_loopCount = 1;
+
+        for( size_t i = 1; i < count; ++i )
+        {
+            head->appendLoop( cpus ? cpus[ i ] : -1 );
+        }
+    }
+    catch( ... )
+    {
+        destroy( head );
+        throw;
+    }
+
+    head->m_poolSize = count;
+    return head;
+}
+
 void
 AsyncLoop::destroy( AsyncLoop *head ) // nofail
 {
-    while( head )
+    for( int i = head->m_loopCount - 1; i > 0; --i )
     {
-        AsyncLoop *next = head->m_next;
-        delete head;
-        head = next;
-    } 
+        delete head->m_loops[ i ];
+    }
+
+    delete head;
+}
+
+AsyncMan::EventBackend
+AsyncLoop::backend() const  // nofail
+{
+    // io_uring falls back to epoll.
+
+    if( m_socketPool.usesUring() )
+    {
+        return AsyncMan::c_uring;
+    }
+
+    return m_backend == AsyncMan::c_uring ? AsyncMan::c_epoll : m_backend;
 }
 
 TaskResult TASKAPI
@@ -286,6 +570,11 @@ AsyncLoop::asyncLoop()
 
     dbgAssert( m_multiCurl );
 
+    if( m_cpu >= 0 && !taskSetCpu( m_cpu ) )
+    {
+        LOG_TRACE( "cannot pin AsyncLoop: asyncLoop=0x%llx, cpu=%d", ( UInt64 )this, m_cpu );
+    }
+
     SocketActions socketActions;
 
     while( !m_shutdown )
@@ -300,43 +589,43 @@ AsyncLoop::asyncLoop()
                 dbgAssert( m_runningRequestCount >= m_socketPool.size() );
             }
 
-            size_t socketCount =  m_socketPool.size();
+            // Wait for any activity or curl's timer, it is in the same wait set, 
+            // so there is no need to poll.
 
-            if( m_runningRequestCount > socketCount )
-            {
-                // We have added more requests to the multi-handle than the number of sockets
-                // curl reported back to us yet. Execute 'timeout' action.
+            bool watchesAll = m_socketPool.watchesAll();
+            UInt32 timeout = watchesAll ? c_infiniteTimeout : c_unwatchedSocketTimeout;
+            bool timerExpired = false;
 
-                executeSocketAction( INVALID_SOCKET_HANDLE );
-            }
-            else
-            {
-                // Wait for any activity.
+            socketActions.reserve( m_socketPool.size() );
 
-                socketActions.reserve( socketCount );
+            if( m_socketPool.wait( timeout, timeout, &socketActions, &timerExpired ) )
+            {
+                // Some activity (or interrupt) has been detected, handle it.
 
-                if( m_socketPool.wait( m_socketActionTimeout, c_interruptOnlyTimeout, &socketActions ) )
+                for( SocketActions::const_iterator it = socketActions.begin();
+                    it != socketActions.end(); ++it )
                 {
-                    // Some activity (or interrupt) has been detected, handle it.
-
-                    for( SocketActions::const_iterator it = socketActions.begin();
-                        it != socketActions.end(); ++it )
-                    {
-                        executeSocketAction( it->first, it->second );
-                    }
+                    executeSocketAction( it->first, it->second );
                 }
-                else
+
+                if( timerExpired )
                 {
-                    // No activity, go through all sockets and check their status.
-                    // Note: curl_multi_socket_all(..) is deprecated but it doesn't seem
-                    // there is another way to check all sockets. Without this call some sockets
-                    // may stuck for very long.
-
-                    int stillRunning = 0;
-                    CURLMcode multiCurlCode = curl_multi_socket_all( m_multiCurl, &stillRunning );
-                    raiseIfError( multiCurlCode );
+                    // Execute 'timeout' action.
+
+                    executeSocketAction( INVALID_SOCKET_HANDLE );
                 }
             }
+            else if( !watchesAll )
+            {
+                // No activity, but a socket may be missing from the wait set,
+                // go through all sockets and check their status.
+                // Note: curl_multi_socket_all(..) is deprecated but it doesn't seem
+                // there is another way to check all sockets.
+
+                int stillRunning = 0;
+                CURLMcode multiCurlCode = curl_multi_socket_all( m_multiCurl, &stillRunning );
+                raiseIfError( multiCurlCode );
+            }
 
             // Remove completed requests.
 
@@ -387,7 +676,7 @@ AsyncLoop::handleAddRemoveSocket( CURL *curl, curl_socket_t socket, int what, vo
 
     if( what == CURL_POLL_REMOVE )
     {
-        asyncLoop->removeSocket( asyncState );  // nofail
+        asyncLoop->removeSocket( socket );  // nofail
 
         // Do not try to do anything with the socket here because it may be invalid.
     } 
@@ -405,49 +694,67 @@ AsyncLoop::handleTimeout( CURLM *multi, long msTimeout, void *ctx ) // nofail
     AsyncLoop *const asyncLoop = static_cast< AsyncLoop * >( ctx );
     dbgAssert( asyncLoop );
 
-    if( msTimeout == 0 )
-    {
-        // Execute 'timeout' action.
-
-        asyncLoop->executeSocketAction( INVALID_SOCKET_HANDLE );  // nofail
-        asyncLoop->m_socketActionTimeout = c_maxSocketTimeout;
-    }
-    else
-    {
-        asyncLoop->m_socketActionTimeout = std::min( static_cast< UInt32 >( msTimeout ),  // this handles -1 as well
-            static_cast< UInt32 >( c_maxSocketTimeout ) );
-    }
+    // The 'timeout' action is executed by the loop when the timer expires, 
+    // even if it is due now: curl must not be reentered from its callback.
+    // -1 deletes the timer.
 
+    asyncLoop->m_socketPool.setTimer( msTimeout < 0 ? ( UInt32 )EventSync::c_infinite : 
+        static_cast< UInt32 >( msTimeout ) );  // nofail
     return 0;
 }
 
 void
 AsyncLoop::handlePendingRequests() 
 {
-    m_lock.claimLock();  
-    ScopedExLock lock( &m_lock );
+    // Lower the flag first: whatever is pushed after this raises it again.
 
-    // Check if there are any new requests, add them to the multi-handle.
+    atomicExchange( &m_hasPending, 0 );
+
+    // Pop the cancellations before the new requests: a request is pushed before 
+    // it can be canceled, so every request canceled here is either running 
+    // or added below.
+
+    CURL *request = NULL;
+
+    while( m_canceledRing.pop( &request ) )
+    {
+        m_canceledRequests.push_back( request );  // nofail, reserved in the constructor
+    }
+
+    while( m_pendingRing.pop( &request ) )
+    {
+        m_pendingRequests.push_back( request );  // nofail, reserved in the constructor
+    }
+
+    try
+    {
+        // Add new requests to the multi-handle.
 
-    addNewRequests();
+        addNewRequests();
 
-    // Check if there are any canceled requests, remove them from the multi-handle.
+        // Remove canceled requests from the multi-handle.
 
-    removeCanceledRequests();
+        removeCanceledRequests();
+    }
+    catch( ... )
+    {
+        // The popped requests stay where they are, retry them on the next pass.
 
-    m_hasPending = false;
+        atomicExchange( &m_hasPending, 1 );
+        throw;
+    }
 }
 
 void
 AsyncLoop::addNewRequests() 
 {
-    dbgAssert( m_lock.dbgHoldLock() );
-
     CURLMcode multiCurlCode = CURLM_OK;
 
     // Reserve space in the socketList to ensure nofail in addSocket(..).
 
     m_socketPool.reserve( m_runningRequestCount + m_pendingRequests.size() );  // can throw std::bad_alloc.
+    m_completedStates.reserve( m_runningRequestCount + m_pendingRequests.size() );  // can throw std::bad_alloc.
+    m_completedEvents.reserve( m_runningRequestCount + m_pendingRequests.size() );  // can throw std::bad_alloc.
 
     // Add pending requests.
 
@@ -466,6 +773,7 @@ AsyncLoop::addNewRequests()
             if( ( multiCurlCode = curl_multi_add_handle( m_multiCurl, request ) ) == CURLM_OK )
             {
                 m_runningRequestCount++;
+                asyncState->running = true;
 
 #ifdef PERF
                 LOG_TRACE( "request enqueueing lag: request=0x%llx, runningCount=%llu, asyncLoop=0x%llx, elapsed=%llu", 
@@ -477,7 +785,7 @@ AsyncLoop::addNewRequests()
             {
                 dbgAssert( multiCurlCode == CURLM_OUT_OF_MEMORY );
                 asyncState->opResult = CURLE_OUT_OF_MEMORY;
-                asyncState->setCompleted();
+                finishRequest( asyncState );  // nofail
             }
         }
 
@@ -488,8 +796,6 @@ AsyncLoop::addNewRequests()
 void
 AsyncLoop::removeCanceledRequests() 
 {
-    dbgAssert( m_lock.dbgHoldLock() );
-
     if( !m_canceledRequests.empty() )
     {
         for( size_t i = 0; i < m_canceledRequests.size(); ++i )
@@ -501,13 +807,24 @@ AsyncLoop::removeCanceledRequests()
 
             m_canceledRequests[ i ] = NULL;
 
-            if( !asyncState->isCompleted() )
+            dbgAssert( asyncState->cancelState == AsyncState::c_cancelRequested );
+
+            // The request was pushed before its cancellation, so it has been added
+            // by now: it is either running or has completed and waits for us.
+
+            atomicAdd( &m_requestCount, -1 );
+
+            if( !asyncState->running )
+            {
+                asyncState->setCompleted();  // nofail
+            }
+            else
             {
-                dbgVerify( m_socketPool.remove( asyncState->socket ) );
                 dbgVerify( curl_multi_remove_handle( m_multiCurl, request ) == CURLM_OK );
                 dbgAssert( m_runningRequestCount );
                 m_runningRequestCount--;
-                asyncState->setCompleted();
+                asyncState->running = false;
+                asyncState->setCanceled();
             }
         }
 
@@ -516,10 +833,12 @@ AsyncLoop::removeCanceledRequests()
 }
 
 void
-AsyncLoop::removeSocket( AsyncState *asyncState )  // nofail
+AsyncLoop::removeSocket( curl_socket_t socket )  // nofail
 {
-    if( asyncState )
-        m_socketPool.remove( asyncState->socket );  // nofail
+    // The socket curl is done with: a connection outlives its requests in the 
+    // cache of the multi-handle, so the socket of a request is not a thing to remove.
+
+    m_socketPool.remove( ( SocketHandle )( socket ) );  // nofail
 }
 
 void
@@ -533,8 +852,7 @@ AsyncLoop::addSocket( AsyncState *asyncState, curl_socket_t socket, int what ) /
     // Assign the socket to the socketReady signal.
 
     CASSERT( sizeof( curl_socket_t ) == sizeof( SocketHandle ) );
-    asyncState->socket = ( SocketHandle )( socket );
-    m_socketPool.add( asyncState->socket, what );  // nofail 
+    m_socketPool.add( ( SocketHandle )( socket ), what );  // nofail 
 }
 
 void
@@ -561,7 +879,7 @@ AsyncLoop::removeCompletedRequests()
             AsyncState *const asyncState = AsyncState::getFromCurl( curl );  // nofail
             dbgAssert( asyncState );
 
-            removeSocket( asyncState );
+            asyncState->running = false;
 
             // Save if the request failed, the error will be raised by the thread that
             // calls completeXXX.
@@ -574,11 +892,56 @@ AsyncLoop::removeCompletedRequests()
                 timeElapsed() - asyncState->creationTimestamp );
 #endif
 
-            // Now tell everyone that the request has completed.
+            if( !atomicCompareExchange( &asyncState->cancelState, AsyncState::c_finished, AsyncState::c_none ) )
+            {
+                // Its cancellation is on the way, removeCanceledRequests() finishes it.
+
+                continue;
+            }
+
+            atomicAdd( &m_requestCount, -1 );
 
-            asyncState->setCompleted();
+            dbgAssert( m_completedStates.size() < m_completedStates.capacity() );
+            m_completedStates.push_back( asyncState );  // nofail, see addNewRequests()
+            m_completedEvents.push_back( &asyncState->completedEvent );  // nofail
         }
     }
+
+    if( m_completedStates.empty() )
+    {
+        return;
+    }
+
+    // Now tell everyone that the requests have completed: the events first, 
+    // in one go, then the completion queues and handlers. What the handlers
+    // pend to this asyncLoop is added as soon as we're back at the top of 
+    // the loop, see signalPending().
+
+    m_socketPool.setEvents( &m_completedEvents[ 0 ], m_completedEvents.size() );  // nofail
+
+    s_inlineLoop = this;
+
+    for( size_t i = 0; i < m_completedStates.size(); ++i )
+    {
+        m_completedStates[ i ]->notify();  // nofail
+    }
+
+    s_inlineLoop = 0;
+    m_completedStates.clear();
+    m_completedEvents.clear();
+}
+
+void
+AsyncLoop::finishRequest( AsyncState *asyncState )  // nofail
+{
+    // Completes a request that hasn't made it to the multi-handle, unless 
+    // its cancellation is on the way.
+
+    if( atomicCompareExchange( &asyncState->cancelState, AsyncState::c_finished, AsyncState::c_none ) )
+    {
+        atomicAdd( &m_requestCount, -1 );
+        asyncState->setCompleted();  // nofail
+    }
 }
 
 void
@@ -590,136 +953,318 @@ AsyncLoop::pendOp( AsyncLoop *head, CURL *request, size_t connectionsPerThread )
     //
     // Algorithm:
     //
-    // 1. if we have only 1 thread/asyncLoop:
-    //    then if number of requests < m_connectionsPerThread => append to that thread
-    //             else create a new thread/asyncLoop.
-    // 2. if we have multiple threads/asyncLoops:
-    //    then append to the first thread with number of requests < half of m_connectionsPerThread.
-    //    if we could not find such thread then find the min number of requests across all threads.
-    //    if min < m_connectionsPerThread => append to that thread else create a new thread/asyncLoop.
+    // 0. from a completion handler, append to the asyncLoop that runs it if 
+    //    the request may go there: the connection's next request stays on 
+    //    the thread that is awake and, likely, in its caches.
+    // 1. with a fixed pool, append to the thread assigned to the request.
+    // 2. pick two asyncLoops at random and append to the one with fewer requests
+    //    (the "power of two choices"), repeat c_choiceRounds times if it is full.
+    //    Only the two chosen loops are touched and no lock is taken, whatever
+    //    the number of loops.
+    // 3. if both choices were full, look for room in every asyncLoop, and if there is 
+    //    none create a new thread/asyncLoop. The sweep is as rare as the creation 
+    //    of a thread, it keeps the loops from multiplying while some have room.
+    //
 
-    while( true )
+    size_t totalRequest = 0;
+    AsyncLoop *const inlineLoop = s_inlineLoop;
+
+    if( inlineLoop && inlineLoop->m_head == head &&
+        ( !head->poolSize() || 
+          head->poolLoop( head->assignPoolLoop( AsyncState::getFromCurl( request ) ) ) == inlineLoop ) &&
+        inlineLoop->AsyncLoop::pendOp( request, connectionsPerThread, &totalRequest ) )
     {
-        size_t totalRequest = 0;
-        size_t minTotalRequest = 0;
+        return;
+    }
 
-        AsyncLoop *candidate = head;
-        AsyncLoop *last = head;
+    if( head->poolSize() && 
+        head->poolLoop( head->assignPoolLoop( AsyncState::getFromCurl( request ) ) )->AsyncLoop::pendOp( 
+            request, connectionsPerThread, &totalRequest ) )
+    {
+        return;
+    }
 
-        if( head->m_next )
+    for( int i = 0; i < c_choiceRounds; ++i )
+    {
+        if( head->chooseLoop()->AsyncLoop::pendOp( request, connectionsPerThread, &totalRequest ) )
         {
-            // We have multiple asyncLoops.
+            return;
+        }
+    }
 
-            size_t half = std::max( ( size_t )1, connectionsPerThread / 2 );
-            minTotalRequest = -1;
+    while( true )
+    {
+        size_t const count = head->loopCount();
 
-            for( AsyncLoop *cur = head; cur; cur = cur->m_next )
+        for( size_t i = 0; i < count; ++i )
+        {
+            if( head->m_loops[ i ]->AsyncLoop::pendOp( request, connectionsPerThread, &totalRequest ) )
             {
-                // Make sure we see memory pointed to by cur->m_next as
-                // initalized.
+                return;
+            }
+        }
 
-                cpuMemLoadFence();
+        // We don't have an asyncLoop that can accommodate a new request, create a new one.
 
-                // Try to append with limit set to 'half'.
+        if( head->appendLoop()->AsyncLoop::pendOp( request, connectionsPerThread, &totalRequest ) )
+        {
+            return;
+        }
 
-                if( cur->AsyncLoop::pendOp( request, half, &totalRequest ) )
-                {
-                    return;
-                }
+        // ops, other threads managed to fill the new asyncLoop we have just created.
+        // Repeat, we should be more lucky the next time.
+    }
+}
+
+size_t
+AsyncLoop::loopCount() const  // nofail
+{
+    // Called on the head. Make sure we see the registered asyncLoops as initialized.
 
-                // The current asyncLoop has more than 'half' requests.
+    size_t count = m_loopCount;
+    cpuMemLoadFence();
+    return count;
+}
 
-                if( totalRequest < minTotalRequest )
-                {
-                    // Remember the min.
+AsyncLoop *
+AsyncLoop::chooseLoop()  // nofail
+{
+    // Called on the head. Two distinct loops from a hash of a shared sequence, 
+    // the one with fewer admitted requests wins.
 
-                    minTotalRequest = totalRequest;
-                    candidate = cur;
-                }
+    size_t const count = loopCount();  // nofail
 
-                // Remember in case this is the last.
+    if( count == 1 )
+    {
+        return this;
+    }
 
-                last = cur;
-            }
-        }
+    UInt32 seed = ( UInt32 )atomicAdd( &m_choiceNext, 1 ) * 0x9e3779b9u;
+    seed ^= seed >> 15;
+    seed *= 0x85ebca6bu;
+    seed ^= seed >> 13;
 
-        // Try to append to the head (if this is the only asyncLoop) or
-        // to the found 'min' candidate (if there are multiple asyncLoops).
+    size_t const first = ( seed >> 16 ) % count;
+    size_t const second = ( first + 1 + ( seed & 0xffff ) % ( count - 1 ) ) % count;
 
-        dbgAssert( candidate );
+    AsyncLoop *const left = m_loops[ first ];
+    AsyncLoop *const right = m_loops[ second ];
 
-        if( minTotalRequest < connectionsPerThread &&
-            candidate->AsyncLoop::pendOp( request, connectionsPerThread, &totalRequest ) )
-        {
-            return;
-        }
+    return right->m_requestCount < left->m_requestCount ? right : left;
+}
 
-        // We don't have an asyncLoop that can accommodate a new request, create a new one.
+namespace
+{
 
-        candidate = new AsyncLoop();
+struct PoolLoopLess
+{
+    bool operator()( CURL *left, CURL *right ) const
+    {
+        return AsyncState::getFromCurl( left )->poolLoop < AsyncState::getFromCurl( right )->poolLoop;
+    }
+};
 
+}  // namespace
+
+size_t
+AsyncLoop::assignPoolLoop( AsyncState *asyncState )  // nofail
+{
+    // Called on the head. The round-robin makes the assignment depend on 
+    // the order of the first operations only.
+
+    dbgAssert( asyncState );
+    dbgAssert( poolSize() );
+
+    if( asyncState->poolLoop == ( size_t )-1 )
+    {
+        asyncState->poolLoop = ( unsigned int )atomicAdd( &m_poolNext, 1 );
+    }
+
+    asyncState->poolLoop %= m_poolSize;
+    return asyncState->poolLoop;
+}
+
+void
+AsyncLoop::pendOps( AsyncLoop *head, CURL **requests, size_t count, size_t connectionsPerThread, 
+    size_t *done )
+{
+    dbgAssert( head );
+    dbgAssert( implies( count, requests ) );
+    dbgAssert( done );
+
+    *done = 0;
+
+    if( head->poolSize() )
+    {
+        // Group the requests by their thread of the pool, hand each group over at once
+        // and what doesn't fit one by one, so that the first *done are always handed over.
+
+        for( size_t i = 0; i < count; ++i )
         {
-            head->m_lock.claimLock();  // nofail
-            ScopedExLock lock( &head->m_lock );
+            head->assignPoolLoop( AsyncState::getFromCurl( requests[ i ] ) );  // nofail
+        }
 
-            // While we were waiting for the lock, another thread could create and add a new asyncLoop.
-            // Find the real last item.
+        std::stable_sort( requests, requests + count, PoolLoopLess() );  // can throw std::bad_alloc
 
-            for( ; last->m_next; last = last->m_next ) {}
+        while( *done < count )
+        {
+            size_t const loop = AsyncState::getFromCurl( requests[ *done ] )->poolLoop;
+            size_t end = *done + 1;
 
-            // Add the created asyncLoop.
+            for( ; end < count && AsyncState::getFromCurl( requests[ end ] )->poolLoop == loop; ++end ) {}
 
-            last->m_next = candidate; 
+            *done += head->poolLoop( loop )->pendOps( requests + *done, end - *done, connectionsPerThread );
+
+            for( ; *done < end; ++( *done ) )
+            {
+                pendOp( head, requests[ *done ], connectionsPerThread );
+            }
         }
 
-        // Add the request to the created asyncLoop.
+        return;
+    }
+
+    // The same policy as pendOp(..), but every chosen loop takes its share of 
+    // the requests at once; a request no choice has room for goes the slow way.
+
+    while( *done < count )
+    {
+        size_t const loops = head->loopCount();
+        size_t const share = ( count - *done + loops - 1 ) / loops;
+        size_t const appended = head->chooseLoop()->pendOps( requests + *done, share, connectionsPerThread );
 
-        if( candidate->AsyncLoop::pendOp( request, connectionsPerThread, &totalRequest ) )
+        if( appended )
         {
-            return;
+            *done += appended;
+            continue;
         }
 
-        // ops, another thread managed to append its request(s) to the new asyncLoop we have just created.
-        // Repeat, we should be more lucky the next time.
+        pendOp( head, requests[ *done ], connectionsPerThread );
+        ++( *done );
     }
 }
 
-bool
-AsyncLoop::pendOp( CURL *request, size_t connectionsPerThread, size_t *totalRequest )
+AsyncLoop *
+AsyncLoop::appendLoop( int cpu )
 {
-    dbgAssert( request );
-    dbgAssert( totalRequest );
+    // Called on the head.
+
+    AsyncLoop *loop = new AsyncLoop( m_backend, m_eventBatch, cpu );
+    loop->m_head = this;
 
     {
-        m_lock.claimLock();
+        m_lock.claimLock();  // nofail
         ScopedExLock lock( &m_lock );
 
-        *totalRequest = m_runningRequestCount + m_pendingRequests.size();
+        // While we were waiting for the lock, another thread could register a new asyncLoop.
+
+        int const count = m_loopCount;
+
+        if( count < c_maxLoops )
+        {
+            // Publish the slot after the asyncLoop it points to.
+
+            m_loops[ count ] = loop;
+            cpuMemStoreFence();
+            m_loopCount = count + 1;
+            return loop;
+        }
+    }
+
+    delete loop;
+    throw std::runtime_error( "too many async loops" );
+}
+
+size_t
+AsyncLoop::pendOps( CURL *const *requests, size_t count, size_t connectionsPerThread )
+{
+    size_t totalRequest = 0;
+    size_t appended = admit( count, connectionsPerThread, &totalRequest );  // nofail
+
+    for( size_t i = 0; i < appended; ++i )
+    {
+        appendRequest( requests[ i ] );  // nofail
+    }
+
+    if( appended )
+    {
+        signalPending();  // nofail
+    }
+
+    return appended;
+}
+
+size_t
+AsyncLoop::admit( size_t count, size_t connectionsPerThread, size_t *totalRequest )  // nofail
+{
+    dbgAssert( totalRequest );
+    dbgAssert( connectionsPerThread <= c_ringCapacity );
+
+    // Take up to count of the free slots, the ring then has room for them.
+
+    while( true )
+    {
+        int admitted = m_requestCount;
+        *totalRequest = admitted;
 
         if( *totalRequest >= connectionsPerThread )
         {
-            return false;
+            return 0;
+        }
+
+        size_t n = std::min( count, connectionsPerThread - *totalRequest );
+
+        if( atomicCompareExchange( &m_requestCount, admitted + ( int )n, admitted ) )
+        {
+            *totalRequest += n;
+            return n;
         }
+    }
+}
+
+void
+AsyncLoop::appendRequest( CURL *request )  // nofail
+{
+    AsyncState *const asyncState = AsyncState::getFromCurl( request );  // nofail
+    dbgAssert( asyncState );
+
+    asyncState->completedEvent.reset();  // nofail
+    asyncState->opResult = CURLE_BAD_FUNCTION_ARGUMENT;
+    asyncState->asyncLoop = this;
+    asyncState->cancelState = AsyncState::c_none;
 
-        // Pre-allocate some space to avoid std::bad_alloc and ensure nofail in cancel(..).
+    dbgVerify( m_pendingRing.push( request ) );  // nofail because the request is admitted
+}
 
-        m_canceledRequests.reserve( *totalRequest + 1 );  // +1 one extra for the request being appended.
+void
+AsyncLoop::signalPending()  // nofail
+{
+    atomicExchange( &m_hasPending, 1 );
 
-        // Append pending request.
+    // A completion handler on our own thread needs no wakeup, the flag
+    // is checked before the next wait.
 
-        AsyncState *const asyncState = AsyncState::getFromCurl( request );  // nofail
-        dbgAssert( asyncState );
+    if( s_inlineLoop != this )
+    {
+        m_socketPool.signal(); // nofail
+    }
+}
 
-        m_pendingRequests.push_back( request );  // can throw std::bad_alloc
-        asyncState->completedEvent.reset();  // nofail
-        asyncState->opResult = CURLE_BAD_FUNCTION_ARGUMENT;
-        asyncState->asyncLoop = this;
-        ( *totalRequest )++;
+bool
+AsyncLoop::pendOp( CURL *request, size_t connectionsPerThread, size_t *totalRequest )
+{
+    dbgAssert( request );
+    dbgAssert( totalRequest );
 
-        m_hasPending = true;
+    if( !admit( 1, connectionsPerThread, totalRequest ) )  // nofail
+    {
+        return false;
     }
 
-    m_socketPool.signal(); // nofail
+    // Append pending request.
+
+    appendRequest( request );  // nofail
+    signalPending();  // nofail
     return true;
 }
 
@@ -730,25 +1275,17 @@ AsyncLoop::cancelOp( CURL *request ) // nofail
     AsyncState *const asyncState = AsyncState::getFromCurl( request );  // nofail
     dbgAssert( asyncState );
 
-    if( !asyncState->isCompleted() )
+    if( atomicCompareExchange( &asyncState->cancelState, AsyncState::c_cancelRequested, AsyncState::c_none ) )
     {
         // Append cancellation.
-        {
-            m_lock.claimLock();  
-            ScopedExLock lock( &m_lock );
 
-            dbgAssert( m_canceledRequests.capacity() > m_pendingRequests.size() );
-            m_canceledRequests.push_back( request ); // nofail because it has enough capacity reserved by pendOp(..)
-
-            m_hasPending = true;
-        }
-
-        m_socketPool.signal(); // nofail
+        dbgVerify( m_canceledRing.push( request ) ); // nofail, see c_ringCapacity
+        signalPending();  // nofail
+    }
 
-        // Wait for the complete event.
+    // Wait for the complete event.
 
-        asyncState->completedEvent.wait(); // nofail
-    }
+    asyncState->completedEvent.wait(); // nofail
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -778,10 +1315,18 @@ void
 AsyncCurl::pendOp( AsyncMan *opMan )
 {
     dbgAssert( opMan );
-    dbgAssert( !m_asyncState->asyncLoop );
+    dbgAssert( !m_asyncState->asyncLoop && !m_asyncState->batch );
     dbgAssert( !AsyncState::getFromCurl( m_curl ) || AsyncState::getFromCurl( m_curl ) == m_asyncState );
 
     AsyncState::setToCurl( m_curl, m_asyncState );
+
+    if( AsyncBatch *batch = opMan->batch() )
+    {
+        batch->hold( m_curl );
+        dbgAssert( m_asyncState->batch );
+        return;
+    }
+
     AsyncLoop::pendOp( opMan->head(), m_curl, opMan->connectionsPerThread() );
     dbgAssert( m_asyncState->asyncLoop );
 }
@@ -797,6 +1342,9 @@ AsyncCurl::completeOp()  // nofail
 void
 AsyncCurl::cancelOp()  // nofail
 {
+    if( m_asyncState->batch )
+        m_asyncState->batch->cancel( m_curl );  // nofail
+
     if( m_asyncState->asyncLoop )
         m_asyncState->asyncLoop->cancelOp( m_curl );
 
@@ -822,6 +1370,34 @@ AsyncCurl::completedEvent() const
     return &m_asyncState->completedEvent;
 }
 
+void
+AsyncCurl::setCompletionQueue( CompletionQueue *queue, void *tag )  // nofail
+{
+    dbgAssert( !m_asyncState->asyncLoop );
+
+    m_asyncState->completionQueue = queue;
+    m_asyncState->completionHandler = 0;
+    m_asyncState->completionNode.tag = tag;
+}
+
+void
+AsyncCurl::setCompletionHandler( CompletionHandler *handler, void *tag )  // nofail
+{
+    dbgAssert( !m_asyncState->asyncLoop );
+
+    m_asyncState->completionQueue = 0;
+    m_asyncState->completionHandler = handler;
+    m_asyncState->completionNode.tag = tag;
+}
+
+void
+AsyncCurl::setPoolLoop( size_t loop )  // nofail
+{
+    dbgAssert( !m_asyncState->asyncLoop );
+
+    m_asyncState->poolLoop = loop;
+}
+
 }  // namespace internal
 
 using namespace internal;
@@ -829,17 +1405,272 @@ using namespace internal;
 //////////////////////////////////////////////////////////////////////////////
 // AsyncCurlOpMan -- manager for async cURL operations.
 
-AsyncMan::AsyncMan( size_t connectionsPerThread )
-    : m_head( new AsyncLoop )
+AsyncMan::AsyncMan( size_t connectionsPerThread, EventBackend backend )
+    : m_head( AsyncLoop::createPool( backend, 0, 0, NULL ) )
     , m_connectionsPerThread( connectionsPerThread + !connectionsPerThread )
+    , m_batch( NULL )
+{
+    if( m_connectionsPerThread > c_cConnectionsPerThreadLimit )
+        m_connectionsPerThread = c_cConnectionsPerThreadLimit;
+}
+
+AsyncMan::AsyncMan( const LoopPool &pool, size_t connectionsPerThread, EventBackend backend )
+    : m_head( AsyncLoop::createPool( backend, pool.eventBatch, pool.loopCount, pool.cpus ) )
+    , m_connectionsPerThread( connectionsPerThread + !connectionsPerThread )
+    , m_batch( NULL )
+{
+    if( m_connectionsPerThread > c_cConnectionsPerThreadLimit )
+        m_connectionsPerThread = c_cConnectionsPerThreadLimit;
+}
+
+AsyncMan::AsyncMan( const AsyncMan *owner, AsyncBatch *batch )
+    : m_head( owner->m_head )
+    , m_connectionsPerThread( owner->m_connectionsPerThread )
+    , m_batch( batch )
 {
-    if( m_connectionsPerThread > c_cMaxConnectionsPerThread )
-        m_connectionsPerThread = c_cMaxConnectionsPerThread;
 }
 
 AsyncMan::~AsyncMan()
 {
-    AsyncLoop::destroy( m_head );
+    // A view doesn't own the loops.
+
+    if( !m_batch )
+        AsyncLoop::destroy( m_head );
+}
+
+AsyncMan::EventBackend
+AsyncMan::backend() const  // nofail
+{
+    return m_head->backend();
+}
+
+size_t
+AsyncMan::loopCount() const  // nofail
+{
+    return m_head->poolSize();
+}
+
+int
+AsyncMan::loopNode( size_t loop ) const  // nofail
+{
+    if( !m_head->poolSize() )
+        return -1;
+
+    int cpu = m_head->poolLoop( loop % m_head->poolSize() )->cpu();
+    return cpu < 0 ? -1 : cpuNode( cpu );
+}
+
+void *
+AsyncMan::allocBuffer( size_t size, size_t loop ) const
+{
+    return nodeAlloc( size, loopNode( loop ) );
+}
+
+void
+AsyncMan::freeBuffer( void *buffer, size_t size )  // nofail
+{
+    nodeFree( buffer, size );  // nofail
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// AsyncBatch -- async operations submitted together.
+
+AsyncBatch::AsyncBatch( AsyncMan *asyncMan )
+    : m_view( asyncMan, this )
+{
+    dbgAssert( asyncMan && !asyncMan->batch() );
+}
+
+AsyncBatch::~AsyncBatch()  // nofail
+{
+    try
+    {
+        submit();
+    }
+    catch( ... )
+    {
+        // submit() has failed the operations it could not hand over.
+    }
+}
+
+void
+AsyncBatch::hold( CURL *request )
+{
+    AsyncState *const asyncState = AsyncState::getFromCurl( request );  // nofail
+    dbgAssert( asyncState );
+
+    m_requests.push_back( request );  // can throw std::bad_alloc
+
+    // Not completed until the loop completes it, as with AsyncLoop::pendOp(..).
+
+    asyncState->completedEvent.reset();  // nofail
+    asyncState->opResult = CURLE_BAD_FUNCTION_ARGUMENT;
+    asyncState->batch = this;
+}
+
+void
+AsyncBatch::cancel( CURL *request )  // nofail
+{
+    AsyncState *const asyncState = AsyncState::getFromCurl( request );  // nofail
+    dbgAssert( asyncState && asyncState->batch == this );
+
+    m_requests.erase( std::find( m_requests.begin(), m_requests.end(), request ) );  // nofail
+    asyncState->batch = NULL;
+    asyncState->setCanceled();  // nofail
+}
+
+void
+AsyncBatch::submit()
+{
+    if( m_requests.empty() )
+    {
+        return;
+    }
+
+    // The loops may complete the requests right away: they must not look 
+    // held by then.
+
+    for( size_t i = 0; i < m_requests.size(); ++i )
+    {
+        AsyncState::getFromCurl( m_requests[ i ] )->batch = NULL;
+    }
+
+    size_t done = 0;
+
+    try
+    {
+        AsyncLoop::pendOps( m_view.head(), &m_requests[ 0 ], m_requests.size(), 
+            m_view.connectionsPerThread(), &done );
+    }
+    catch( ... )
+    {
+        // Fail what was not handed over, as AsyncLoop::addNewRequests() does.
+
+        for( size_t i = done; i < m_requests.size(); ++i )
+        {
+            AsyncState *const asyncState = AsyncState::getFromCurl( m_requests[ i ] );
+            asyncState->opResult = CURLE_OUT_OF_MEMORY;
+            asyncState->setCompleted();  // nofail
+        }
+
+        m_requests.clear();
+        throw;
+    }
+
+    m_requests.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// CompletionQueue -- tags of completed async operations.
+
+CompletionQueue::CompletionQueue()
+    : m_pushed( NULL )
+    , m_ready( NULL )
+    , m_sleeping( 0 )
+    , m_wakeup( new EventSync )
+{
+}
+
+CompletionQueue::~CompletionQueue()
+{
+    delete m_wakeup;
+}
+
+void
+CompletionQueue::push( CompletionNode *node )  // nofail
+{
+    dbgAssert( node );
+
+    if( atomicExchange( &node->queued, 1 ) )
+    {
+        // Still queued, the consumer is yet to see the previous completion.
+
+        return;
+    }
+
+    CompletionNode *head;
+
+    do
+    {
+        head = m_pushed;
+        node->next = head;
+    } 
+    while( !atomicCompareExchangePointer( &m_pushed, node, head ) );
+
+    // Pairs with the fence in pop(..): either the consumer sees the node 
+    // or we see it sleeping.
+
+    cpuMemFullFence();
+
+    if( m_sleeping )
+        m_wakeup->set();  // nofail
+}
+
+void
+CompletionQueue::grab()  // nofail
+{
+    dbgAssert( !m_ready );
+
+    // Take the whole stack at once, so there is no ABA, and reverse it.
+
+    CompletionNode *node = atomicExchangePointer( &m_pushed, ( CompletionNode * )NULL );
+
+    while( node )
+    {
+        CompletionNode *next = node->next;
+        node->next = m_ready;
+        m_ready = node;
+        node = next;
+    }
+}
+
+size_t
+CompletionQueue::pop( void **tags, size_t maxCount, long msTimeout )
+{
+    dbgAssert( tags );
+
+    Stopwatch stopwatch( true );
+
+    while( !m_ready )
+    {
+        grab();
+
+        if( m_ready || !maxCount )
+            break;
+
+        UInt64 elapsed = stopwatch.elapsed();
+
+        if( msTimeout >= 0 && elapsed >= ( UInt64 )msTimeout )
+            return 0;
+
+        m_sleeping = 1;
+        cpuMemFullFence();
+
+        if( !m_pushed )
+        {
+            m_wakeup->wait( msTimeout < 0 ? ( UInt32 )EventSync::c_infinite :
+                ( UInt32 )( msTimeout - elapsed ) );  // nofail
+        }
+
+        m_sleeping = 0;
+        m_wakeup->reset();  // nofail
+    }
+
+    size_t count = 0;
+
+    for( ; count < maxCount && m_ready; ++count )
+    {
+        CompletionNode *node = m_ready;
+
+        m_ready = node->next;
+        tags[ count ] = node->tag;
+
+        // A full barrier: a completion after this pushes the node again.
+
+        atomicExchange( &node->queued, 0 );
+    }
+
+    return count;
 }
 
 //////////////////////////////////////////////////////////////////////////////
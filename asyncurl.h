@@ -25,11 +25,15 @@
 //////////////////////////////////////////////////////////////////////////////
 
 #include <stddef.h>
+#include <vector>
 
 namespace webstor
 {
 
 class AsyncMan;
+class AsyncBatch;
+class CompletionHandler;
+class CompletionQueue;
 
 namespace internal
 {
@@ -40,6 +44,18 @@ struct AsyncState;
 class AsyncLoop;
 class EventSync;
 
+//////////////////////////////////////////////////////////////////////////////
+///@brief INTERNAL: CompletionNode -- a link of CompletionQueue, one per AsyncCurl.
+
+struct CompletionNode
+{
+                    CompletionNode() : next( 0 ), tag( 0 ), queued( 0 ) {}
+
+    CompletionNode *next;
+    void *          tag;
+    volatile int    queued;  // 1 while the node is in a queue
+};
+
 //////////////////////////////////////////////////////////////////////////////
 ///@brief INTERNAL: AsyncCurl -- cURL extended with async functionality.
 ///@remarks WARNING: async operations use CURLOPT_PRIVATE option, so it must not
@@ -63,6 +79,10 @@ public:
 
     EventSync *     completedEvent() const;
 
+    void            setCompletionQueue( CompletionQueue *queue, void *tag );  // nofail
+    void            setCompletionHandler( CompletionHandler *handler, void *tag );  // nofail
+    void            setPoolLoop( size_t loop );  // nofail
+
 private:
                     AsyncCurl( const AsyncCurl & );  // forbidden
     AsyncCurl &     operator=( const AsyncCurl & );  // forbidden
@@ -89,22 +109,56 @@ handleBackgroundError();  // nofail
 ///@remarks Thread-safety: the object is thread-safe and can be used by multiple
 /// connections from multiple threads.
 ///
+///@remarks To start many operations at once, pend them with the view of an
+/// AsyncBatch.
+///
 
 class AsyncMan
 {
 public:
 
-    /// Default number of connections per thread.
+    /// Default and the largest number of connections per thread.
+
+    enum { c_cMaxConnectionsPerThread = 128, c_cConnectionsPerThreadLimit = 4096 };
 
-    enum { c_cMaxConnectionsPerThread = 128 };
+    /// How a thread waits for its sockets.
+
+    enum EventBackend
+    {
+        c_epoll,
+        c_uring,    // io_uring, Linux 5.11 or later; epoll if not available
+        c_epollEdge // epoll with edge-triggered one-shot polls, armed again after curl has handled them
+    };
 
     ///@brief Constructs a new instance of AsyncMan. 
     ///@details </b>connectionsPerThread</b> specifies
     /// how many connections can be handled by a single thread.
     /// If more that <b>connectionsPerThread</b> async operation is started at
     /// the same time, the class can spawn extra threads as needed.
+    /// <b>backend</b> selects how the threads wait for sockets.
+
+    explicit        AsyncMan( size_t connectionsPerThread = c_cMaxConnectionsPerThread,
+                        EventBackend backend = c_epoll );
+
+    /// A fixed pool of threads.
+
+    struct LoopPool
+    {
+        size_t          loopCount;  // threads started by the constructor, 0 for none
+        const int *     cpus;       // loopCount cpus to pin the threads to, or NULL
+        size_t          eventBatch; // socket events a thread takes per wait (epoll), 0 for the default
+    };
+
+    ///@brief Constructs an AsyncMan with a fixed pool of threads.
+    ///@details A connection is assigned to the threads of the pool in turn at its first
+    /// async operation and stays with it (see S3Connection::setAsyncLoop(..)).
+    /// If its thread has <b>connectionsPerThread</b> operations already, the next 
+    /// threads of the pool are tried, then extra threads are started on demand
+    /// as without a pool.
 
-    explicit        AsyncMan( size_t connectionsPerThread = c_cMaxConnectionsPerThread );
+    explicit        AsyncMan( const LoopPool &pool, 
+                        size_t connectionsPerThread = c_cMaxConnectionsPerThread,
+                        EventBackend backend = c_epoll );
 
     /// Terminates AsyncMan.
 
@@ -114,15 +168,154 @@ public:
 
     size_t                  connectionsPerThread() const { return m_connectionsPerThread; }
 
+    /// The backend in use, c_epoll if c_uring was asked for but is not available.
+
+    EventBackend            backend() const;  // nofail
+
+    /// Number of threads in the pool, 0 if threads are started on demand only.
+
+    size_t                  loopCount() const;  // nofail
+
+    /// NUMA node of a thread of the pool, -1 if the thread is not pinned or unknown.
+
+    int                     loopNode( size_t loop ) const;  // nofail
+
+    ///@brief Allocates a buffer bound to the NUMA node of a thread of the pool,
+    /// for the connections assigned to it.
+    ///@details The buffer is page-aligned and released with freeBuffer(..).
+
+    void *                  allocBuffer( size_t size, size_t loop ) const;
+    static void             freeBuffer( void *buffer, size_t size );  // nofail
+
 public:
     internal::AsyncLoop *   head() const { return m_head; }
+    AsyncBatch *            batch() const { return m_batch; }
 
 private:
+    friend class AsyncBatch;
+
+                    AsyncMan( const AsyncMan *owner, AsyncBatch *batch );  // the view of a batch
                     AsyncMan( const AsyncMan & );  // forbidden
     AsyncMan& operator=( const AsyncMan & );  // forbidden
 
     internal::AsyncLoop *   m_head;
     size_t                  m_connectionsPerThread;
+    AsyncBatch *            m_batch;    // not NULL if this is the view of a batch
+};
+
+//////////////////////////////////////////////////////////////////////////////
+///@brief AsyncBatch -- async operations submitted together.
+///@details Operations pended with asyncMan() are held until submit() hands
+/// them over to the threads of the AsyncMan: each thread admits its share
+/// at once and is woken up once per batch rather than once per operation.
+///
+///@remarks An operation held by the batch must not be completed (waited for)
+/// before submit(); it can be canceled. The destructor submits what is left.
+///
+///@remarks Thread-safety: a batch is used by one thread at a time.
+
+class AsyncBatch
+{
+public:
+    explicit        AsyncBatch( AsyncMan *asyncMan );
+                    ~AsyncBatch();  // nofail
+
+    /// The AsyncMan to pend the operations of the batch with.
+
+    AsyncMan *      asyncMan() { return &m_view; }
+
+    /// Number of operations held.
+
+    size_t          size() const { return m_requests.size(); }
+
+    /// Submits the operations held.
+
+    void            submit();
+
+public:
+    void            hold( internal::CURL *request );  // INTERNAL
+    void            cancel( internal::CURL *request );  // nofail, INTERNAL
+
+private:
+                    AsyncBatch( const AsyncBatch & );  // forbidden
+    AsyncBatch &    operator=( const AsyncBatch & );  // forbidden
+
+    AsyncMan                        m_view;
+    std::vector< internal::CURL * > m_requests;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+///@brief CompletionQueue -- tags of completed async operations.
+///@details Connections are attached to a queue with a tag; when an async operation
+/// of an attached connection completes, the AsyncLoop thread pushes its tag. Pushing
+/// is lock-free and never fails, popping takes the completed tags in O(1) each and
+/// in batches, and there is no limit on the number of attached connections.
+///
+///@remarks A tag is in the queue at most once: a completion while the tag
+/// is still queued does not add it again. A tag may also be left behind by
+/// an operation canceled after it completed, so the consumer should check
+/// S3Connection::isAsyncCompleted() for every tag it pops.
+///
+///@remarks Thread-safety: any number of AsyncLoop threads push, one thread pops.
+/// Attached connections must outlive the queue or be detached while idle.
+
+class CompletionQueue
+{
+public:
+                    CompletionQueue();
+                    ~CompletionQueue();
+
+    ///@brief Pops up to <b>maxCount</b> tags, oldest first.
+    ///@details Waits up to <b>msTimeout</b> milliseconds (-1 is infinite) for
+    /// the first tag. Returns the number of tags stored in <b>tags</b>, 0 if timeout.
+
+    size_t          pop( void **tags, size_t maxCount, long msTimeout = -1 /* infinite */ );
+
+public:
+    void            push( internal::CompletionNode *node );  // nofail, INTERNAL
+
+private:
+                    CompletionQueue( const CompletionQueue & );  // forbidden
+    CompletionQueue & operator=( const CompletionQueue & );  // forbidden
+
+    void            grab();  // nofail
+
+    // Pushed nodes, the newest first; the consumer takes them all at once.
+
+    internal::CompletionNode *volatile  m_pushed;
+
+    // Nodes taken from m_pushed, the oldest first (consumer only).
+
+    internal::CompletionNode *          m_ready;
+
+    // The consumer is about to wait for m_wakeup, pushers must set it.
+
+    volatile int                        m_sleeping;
+    internal::EventSync *               m_wakeup;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+///@brief CompletionHandler -- a callback for completed async operations.
+///@details Connections are attached to a handler with a tag; when an async operation
+/// of an attached connection completes, the AsyncLoop thread calls onCompleted(..) 
+/// right away, so the completion doesn't cross threads. The handler may complete
+/// the operation and pend the next one: it goes to the same AsyncLoop if it has room
+/// there, and the AsyncLoop picks it up without being woken.
+///
+///@remarks The handler holds up the AsyncLoop thread, so it must be short and must not
+/// throw or wait: it may complete the operation it is called for but must not wait
+/// for another one (e.g. with waitAny(..) or cancelAsync(..)). Canceled operations
+/// don't call the handler; an operation that fails before it reaches an AsyncLoop
+/// calls it on the thread that pends the operation.
+///
+///@remarks Thread-safety: the handler owns the operation from its completion on, 
+/// the connection is canceled, detached or destroyed only after the handler 
+/// has seen its last operation.
+
+class CompletionHandler
+{
+public:
+    virtual void    onCompleted( void *tag ) = 0;  // nofail
 };
 
 //////////////////////////////////////////////////////////////////////////////
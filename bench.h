@@ -0,0 +1,43 @@
+/*
+ * File:   bench.h
+ * Author: taozou
+ *
+ * Helpers of the benchmark programs (make bench): a clock, and the S3
+ * endpoint the request benchmarks talk to.
+ */
+
+#ifndef BENCH_H
+#define	BENCH_H
+
+#include "s3conn.h"
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+
+inline unsigned long long benchNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Takes -h Host and -p Port at argv[*i], if that's what it is; keys come
+// from the environment, as for smart.
+
+inline bool benchEndpointOption(int argc, char **argv, int *i, webstor::S3Config *config)
+{
+    if (!strcmp(argv[*i], "-h") && *i + 1 < argc)
+        config->host = argv[++*i];
+    else if (!strcmp(argv[*i], "-p") && *i + 1 < argc)
+        config->port = argv[++*i];
+    else
+        return false;
+    return true;
+}
+
+inline bool benchKeys(webstor::S3Config *config)
+{
+    return (config->accKey = getenv("AWS_ACCESS_KEY")) && (config->secKey = getenv("AWS_SECRET_KEY"));
+}
+
+#endif	/* BENCH_H */
@@ -0,0 +1,181 @@
+/*
+ * File:   benchloops.cpp
+ * Author: taozou
+ *
+ * Scaling benchmark of the AsyncLoop choice: for 1, 2, 4... loops of an
+ * AsyncMan, gets of one object are pended while half of the connections
+ * the loops admit are busy, so each submission picks among loops with
+ * room. Prints the time a submission takes for each loop count, which
+ * should not grow with it.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+#include "bench.h"
+#include "sysutils.h"
+
+using namespace webstor;
+using namespace webstor::internal;
+
+#define BufferSize 65536
+
+// Waits for the requests in flight on cons to complete, pending the next
+// ones while there are any left; returns the number of failed requests.
+
+static int drive(AsyncMan *asyncMan, std::vector<S3Connection *> &cons, CompletionQueue *queue,
+                 const char *bucketName, const char *key, std::vector<char> *buf, int inFlight,
+                 int *left, unsigned long long *pendNs)
+{
+    int failed = 0;
+
+    while (inFlight)
+    {
+        void *tags[64];
+        size_t n = queue->pop(tags, 64, 60000);
+
+        if (!n)
+        {
+            fprintf(stderr, "no completion in 60s\n");
+            return failed + inFlight;
+        }
+
+        for (size_t j = 0; j < n; ++j)
+        {
+            int k = (int)(intptr_t)tags[j];
+            S3GetResponse response;
+
+            if (!cons[k]->isAsyncCompleted())
+                continue;
+
+            try
+            {
+                cons[k]->completeGet(&response);
+                failed += response.loadedContentLength == (size_t)-1;
+            }
+            catch (...)
+            {
+                ++failed;
+            }
+
+            if (!*left)
+            {
+                --inFlight;
+                continue;
+            }
+
+            unsigned long long start = benchNs();
+            cons[k]->pendGet(asyncMan, bucketName, key, &(*buf)[(size_t)k * BufferSize], BufferSize);
+            *pendNs += benchNs() - start;
+            --*left;
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    S3Config config = {};
+    int maxLoops = 64;
+    int perLoop = 4;
+    int requests = 5000;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if (benchEndpointOption(argc, argv, &i, &config))
+            continue;
+        if (!strcmp(argv[i], "-L") && i + 1 < argc)
+            maxLoops = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+            perLoop = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            requests = atoi(argv[++i]);
+        else
+            break;
+    }
+
+    if (argc - i != 2 || maxLoops <= 0 || perLoop < 2 || requests <= 0)
+    {
+        fprintf(stderr, "benchloops [-L MaxLoops(64)] [-c ConnectionsPerLoop(4)] [-n Requests(5000)]\n"
+                        "           [-h Host] [-p Port] Bucket Key\n"
+                        "      times the submission of gets of Key to 1, 2, 4... MaxLoops loops,\n"
+                        "      ConnectionsPerLoop at least 2\n");
+        return 1;
+    }
+
+    if (!benchKeys(&config))
+    {
+        fprintf(stderr, "no AWS_XXXX is set. \n");
+        return 1;
+    }
+
+    const char *bucketName = argv[i];
+    const char *key = argv[i + 1];
+
+    printf("loops  ns per pend  requests/s\n");
+
+    for (int loops = 1; loops <= maxLoops; loops *= 2)
+    {
+        AsyncMan asyncMan(perLoop);
+        CompletionQueue queue;
+        std::vector<S3Connection *> cons;
+        std::vector<char> buf((size_t)loops * perLoop * BufferSize);
+        unsigned long long pendNs = 0;
+        int failed = 0;
+
+        try
+        {
+            // All the connections at once start the loops, each admitting
+            // perLoop of them.
+
+            for (int k = 0; k < loops * perLoop; ++k)
+            {
+                cons.push_back(new S3Connection(config));
+                cons[k]->setCompletionQueue(&queue, (void *)(intptr_t)k);
+                cons[k]->pendGet(&asyncMan, bucketName, key, &buf[(size_t)k * BufferSize], BufferSize);
+            }
+
+            int left = 0;
+            failed = drive(&asyncMan, cons, &queue, bucketName, key, &buf, loops * perLoop, &left, &pendNs);
+
+            // Then half of them are kept busy.
+
+            unsigned long long start = benchNs();
+            int busy = std::min(loops * perLoop / 2, requests);
+
+            left = requests - busy;
+            for (int k = 0; k < busy; ++k)
+            {
+                unsigned long long pendStart = benchNs();
+                cons[k]->pendGet(&asyncMan, bucketName, key, &buf[(size_t)k * BufferSize], BufferSize);
+                pendNs += benchNs() - pendStart;
+            }
+            failed += drive(&asyncMan, cons, &queue, bucketName, key, &buf, busy, &left, &pendNs);
+
+            unsigned long long elapsed = benchNs() - start;
+            printf("%5d  %11.0f  %10.0f\n", loops, (double)pendNs / requests, requests * 1e9 / elapsed);
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            failed = 1;
+        }
+
+        for (size_t k = 0; k < cons.size(); ++k)
+        {
+            cons[k]->cancelAsync();
+            delete cons[k];
+        }
+
+        if (failed)
+        {
+            fprintf(stderr, "%d requests failed\n", failed);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * File:   benchpend.cpp
+ * Author: taozou
+ *
+ * Contention benchmark of the pending and cancel rings of AsyncLoop: many
+ * producer threads keep gets of one object in flight on a single loop of
+ * one AsyncMan, as the threads of a multi-threaded selector do. Prints the
+ * request rate and the time a producer spends pending a request.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+#include "bench.h"
+#include "sysutils.h"
+
+using namespace webstor;
+using namespace webstor::internal;
+
+#define BufferSize 65536
+
+struct Producer
+{
+    AsyncMan *asyncMan;
+    const S3Config *config;
+    const char *bucketName;
+    const char *key;
+    int connections;
+    int requests;
+    bool cancel;                // cancel every other request right away
+    unsigned long long pendNs;  // spent in pendGet and cancelAsync
+    int pended;
+    int failed;
+};
+
+// Pends the next requests on con until one is left in flight, false if
+// there are no more.
+
+static bool pend(Producer &p, S3Connection *con, char *buffer)
+{
+    while (p.pended < p.requests)
+    {
+        unsigned long long start = benchNs();
+        bool canceled = p.cancel && p.pended % 2;
+
+        con->pendGet(p.asyncMan, p.bucketName, p.key, buffer, BufferSize);
+        if (canceled)
+            con->cancelAsync();
+        p.pendNs += benchNs() - start;
+        ++p.pended;
+
+        if (!canceled)
+            return true;
+    }
+    return false;
+}
+
+static TaskResult TASKAPI produce(void *arg)
+{
+    Producer &p = *static_cast<Producer *>(arg);
+    CompletionQueue queue;
+    std::vector<S3Connection *> cons;
+    std::vector<char> buf((size_t)p.connections * BufferSize);
+    int inFlight = 0;
+
+    try
+    {
+        for (int k = 0; k < p.connections; ++k)
+        {
+            cons.push_back(new S3Connection(*p.config));
+            cons[k]->setCompletionQueue(&queue, (void *)(intptr_t)k);
+            inFlight += pend(p, cons[k], &buf[(size_t)k * BufferSize]);
+        }
+
+        while (inFlight)
+        {
+            void *tags[64];
+            size_t n = queue.pop(tags, 64, 60000);
+
+            if (!n)
+            {
+                fprintf(stderr, "no completion in 60s\n");
+                p.failed += inFlight;
+                break;
+            }
+
+            for (size_t j = 0; j < n; ++j)
+            {
+                int k = (int)(intptr_t)tags[j];
+                S3GetResponse response;
+
+                // Left behind by a canceled request, see CompletionQueue.
+
+                if (!cons[k]->isAsyncCompleted())
+                    continue;
+
+                try
+                {
+                    cons[k]->completeGet(&response);
+                    p.failed += response.loadedContentLength == (size_t)-1;
+                }
+                catch (...)
+                {
+                    ++p.failed;
+                }
+                inFlight += pend(p, cons[k], &buf[(size_t)k * BufferSize]) - 1;
+            }
+        }
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        p.failed += inFlight + 1;
+    }
+
+    for (size_t k = 0; k < cons.size(); ++k)
+    {
+        cons[k]->cancelAsync();
+        delete cons[k];
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    S3Config config = {};
+    int threads = 16;
+    int connections = 4;
+    int requests = 2000;
+    bool cancel = false;
+    AsyncMan::EventBackend backend = AsyncMan::c_epoll;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if (benchEndpointOption(argc, argv, &i, &config))
+            continue;
+        if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+            connections = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            requests = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-x"))
+            cancel = true;
+        else if (!strcmp(argv[i], "-U"))
+            backend = AsyncMan::c_uring;
+        else
+            break;
+    }
+
+    if (argc - i != 2 || threads <= 0 || connections <= 0 || requests <= 0 ||
+        threads * connections > AsyncMan::c_cConnectionsPerThreadLimit)
+    {
+        fprintf(stderr, "benchpend [-t Threads(16)] [-c ConnectionsPerThread(4)] [-n RequestsPerThread(2000)]\n"
+                        "          [-x] [-U] [-h Host] [-p Port] Bucket Key\n"
+                        "      Threads * ConnectionsPerThread gets of Key in flight on one AsyncLoop,\n"
+                        "      at most %d; -x cancels every other one, -U waits with io_uring\n",
+                        (int)AsyncMan::c_cConnectionsPerThreadLimit);
+        return 1;
+    }
+
+    if (!benchKeys(&config))
+    {
+        fprintf(stderr, "no AWS_XXXX is set. \n");
+        return 1;
+    }
+
+    // One loop admits all the connections: every producer pends on it.
+
+    AsyncMan asyncMan(threads * connections, backend);
+    std::vector<Producer> producers(threads);
+    std::vector<TaskCtrl> tasks(threads);
+    unsigned long long start = benchNs();
+
+    for (int t = 0; t < threads; ++t)
+    {
+        Producer p = { &asyncMan, &config, argv[i], argv[i + 1], connections, requests, cancel, 0, 0, 0 };
+        producers[t] = p;
+        taskStartAsync(&produce, &producers[t], &tasks[t]);
+    }
+
+    for (int t = 0; t < threads; ++t)
+        tasks[t].wait();
+
+    unsigned long long elapsed = benchNs() - start;
+    unsigned long long pendNs = 0;
+    long long pended = 0;
+    long long failed = 0;
+
+    for (int t = 0; t < threads; ++t)
+    {
+        pendNs += producers[t].pendNs;
+        pended += producers[t].pended;
+        failed += producers[t].failed;
+    }
+
+    printf("%d producers x %d connections: %lld requests (%lld failed) in %llu ms, %.0f requests/s, "
+           "%.0f ns per pend\n", threads, connections, pended, failed, elapsed / 1000000,
+           pended * 1e9 / elapsed, pended ? (double)pendNs / pended : 0.0);
+    return failed ? 1 : 0;
+}
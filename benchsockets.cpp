@@ -0,0 +1,208 @@
+/*
+ * File:   benchsockets.cpp
+ * Author: taozou
+ *
+ * Scaling benchmark of SocketPool, the wait set of an AsyncLoop: for each
+ * count of sockets (1k and 10k by default), all of them are added, then a
+ * few become readable each round and are waited for, and all are removed.
+ * Prints the cost of an add, of a round per ready socket and of a remove,
+ * none of which should grow with the count.
+ *
+ * The sockets are UDP ones on the loopback, one descriptor each, and one
+ * more sends them datagrams.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "bench.h"
+#include "sysutils.h"
+
+using namespace webstor;
+using namespace webstor::internal;
+
+// Opens count sockets bound to ports of the loopback; false if the
+// descriptors run out.
+
+static bool openSockets(int count, std::vector<int> *sockets, std::vector<sockaddr_in> *addresses)
+{
+    for (int k = 0; k < count; ++k)
+    {
+        sockaddr_in address = {};
+        socklen_t size = sizeof(address);
+        int s = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (s == -1)
+            return false;
+        sockets->push_back(s);
+
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(s, (sockaddr *) &address, sizeof(address)) || getsockname(s, (sockaddr *) &address, &size))
+            return false;
+        addresses->push_back(address);
+    }
+    return true;
+}
+
+static void closeSockets(std::vector<int> *sockets)
+{
+    for (size_t k = 0; k < sockets->size(); ++k)
+        close((*sockets)[k]);
+    sockets->clear();
+}
+
+// Adds, waits for and removes count sockets; false on a failure.
+
+static bool bench(int count, int rounds, int active, bool useUring, bool edge, size_t eventBatch)
+{
+    std::vector<int> sockets;
+    std::vector<sockaddr_in> addresses;
+    int sender = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    bool ok = false;
+
+    if (sender == -1 || !openSockets(count, &sockets, &addresses))
+    {
+        fprintf(stderr, "cannot open %d sockets: %s\n", count, strerror(errno));
+        closeSockets(&sockets);
+        if (sender != -1)
+            close(sender);
+        return false;
+    }
+
+    {
+        SocketPool pool(useUring, edge, eventBatch);
+        SocketActions actions;
+        unsigned long long start = benchNs();
+
+        pool.reserve(count);
+        for (int k = 0; k < count; ++k)
+            pool.add(sockets[k], SA_POLL_IN);
+
+        unsigned long long addNs = benchNs() - start;
+        unsigned long long waitNs = 0;
+        long long events = 0;
+        int next = 0;
+
+        for (int r = 0; r < rounds; ++r)
+        {
+            // A few sockets, spread over the set, get a datagram.
+
+            for (int a = 0; a < active; ++a)
+            {
+                next = (next + 7919) % count;
+                sendto(sender, "x", 1, 0, (sockaddr *) &addresses[next], sizeof(sockaddr_in));
+            }
+
+            start = benchNs();
+
+            for (int ready = 0; ready < active; )
+            {
+                bool timerExpired = false;
+
+                if (!pool.wait(1000, 1000, &actions, &timerExpired))
+                {
+                    fprintf(stderr, "%d of %d sockets are not reported ready\n", active - ready, active);
+                    goto done;
+                }
+
+                for (size_t k = 0; k < actions.size(); ++k)
+                {
+                    char byte;
+
+                    // A socket chosen twice in a round holds two datagrams.
+
+                    while (recv(actions[k].first, &byte, 1, 0) == 1)
+                        ++ready;
+                }
+                events += actions.size();
+            }
+
+            waitNs += benchNs() - start;
+        }
+
+        start = benchNs();
+        for (int k = 0; k < count; ++k)
+            pool.remove(sockets[k]);
+
+        printf("%7d  %6.0f  %18.0f  %9.0f\n", count, (double)addNs / count, (double)waitNs / events,
+               (double)(benchNs() - start) / count);
+        ok = true;
+    }
+
+done:
+    closeSockets(&sockets);
+    close(sender);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = 2000;
+    int active = 16;
+    int eventBatch = 0;
+    bool useUring = false;
+    bool edge = false;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            rounds = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-a") && i + 1 < argc)
+            active = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            eventBatch = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-U"))
+            useUring = true;
+        else if (!strcmp(argv[i], "-E"))
+            edge = true;
+        else
+            break;
+    }
+
+    std::vector<int> counts;
+
+    for (; i < argc && atoi(argv[i]) > 0; ++i)
+        counts.push_back(atoi(argv[i]));
+
+    if (i != argc || rounds <= 0 || active <= 0 || eventBatch < 0 || (useUring && edge))
+    {
+        fprintf(stderr, "benchsockets [-r Rounds(2000)] [-a ReadyPerRound(16)] [-b EventBatch(%d)]\n"
+                        "             [-U | -E] [Sockets...(1000 10000)]\n"
+                        "      -U waits with io_uring, -E with edge-triggered epoll\n",
+                        (int)SocketPool::c_defaultEventBatch);
+        return 1;
+    }
+
+    if (counts.empty())
+    {
+        counts.push_back(1000);
+        counts.push_back(10000);
+    }
+
+    // One descriptor per socket, and a few more.
+
+    rlimit limit;
+
+    if (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    printf("sockets  add ns  ns per ready socket  remove ns\n");
+
+    for (size_t c = 0; c < counts.size(); ++c)
+        if (!bench(counts[c], rounds, std::min(active, counts[c]), useUring, edge, eventBatch))
+            return 1;
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * File:   bloom.cpp
+ * Author: taozou
+ *
+ * Bloom filter sidecars.
+ */
+
+#include "bloom.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Odd multipliers, one per word of a block: word i of the block of a value
+// gets bit (key * BloomSalt[i]) >> 27.
+
+static const UInt32 BloomSalt[BloomBlockWords] = {
+    0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d, 0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31,
+    0x2a7c8b15, 0x3c6ef373, 0x1b873593, 0xcc9e2d51, 0x85ebca6b, 0xc2b2ae35, 0x27d4eb2f, 0x165667b1
+};
+
+// The high half picks the block, the low half is the key of the bits.
+
+static inline UInt64 bloomHash(int value)
+{
+    UInt64 h = (UInt32)value;
+
+    h *= 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 32;
+    h *= 0xd6e8feb86659fd93ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline size_t blockOf(UInt64 h, UInt32 blockCount)
+{
+    return ((h >> 32) * blockCount) >> 32;
+}
+
+static void insert(unsigned char *block, UInt32 key)
+{
+    for (int i = 0; i < BloomBlockWords; ++i)
+    {
+        UInt32 word;
+
+        memcpy(&word, block + i * 4, 4);
+        word |= 1u << ((key * BloomSalt[i]) >> 27);
+        memcpy(block + i * 4, &word, 4);
+    }
+}
+
+#ifdef __SSE2__
+
+// SSE2 has neither a 32-bit multiply keeping the low halves nor a shift by
+// a count per lane.
+
+static inline __m128i mullo32(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// 1 << n through the exponent of a float; 2^31 converts to 0x80000000,
+// which is the bit wanted.
+
+static inline __m128i bitOf(__m128i n)
+{
+    __m128i exponent = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+    return _mm_cvttps_epi32(_mm_castsi128_ps(exponent));
+}
+
+static inline bool contains(const unsigned char *block, UInt32 key)
+{
+    __m128i k = _mm_set1_epi32(key);
+
+    for (int i = 0; i < BloomBlockWords; i += 4)
+    {
+        __m128i salt = _mm_loadu_si128((const __m128i *)&BloomSalt[i]);
+        __m128i bits = bitOf(_mm_srli_epi32(mullo32(k, salt), 27));
+        __m128i words = _mm_loadu_si128((const __m128i *)(block + i * 4));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(words, bits), bits)) != 0xffff)
+            return false;
+    }
+    return true;
+}
+
+#else
+
+static inline bool contains(const unsigned char *block, UInt32 key)
+{
+    for (int i = 0; i < BloomBlockWords; ++i)
+    {
+        UInt32 word;
+        UInt32 bit = 1u << ((key * BloomSalt[i]) >> 27);
+
+        memcpy(&word, block + i * 4, 4);
+        if (!(word & bit))
+            return false;
+    }
+    return true;
+}
+
+#endif
+
+void buildBloom(const int *values, size_t count, int bitsPerValue, std::vector<char> *object)
+{
+    BloomHeader header = { BloomMagic, BloomVersion, BloomSegmentValues,
+                           (UInt32)((count + BloomSegmentValues - 1) / BloomSegmentValues), count };
+    std::vector<BloomSegment> segments(header.segmentCount);
+    std::vector<std::vector<int> > distinct(header.segmentCount);
+    UInt32 blockCount = 0;
+
+    for (UInt32 s = 0; s < header.segmentCount; ++s)
+    {
+        size_t first = (size_t)s * BloomSegmentValues;
+        size_t n = std::min((size_t)BloomSegmentValues, count - first);
+
+        distinct[s].assign(values + first, values + first + n);
+        std::sort(distinct[s].begin(), distinct[s].end());
+        distinct[s].erase(std::unique(distinct[s].begin(), distinct[s].end()), distinct[s].end());
+
+        segments[s].firstBlock = blockCount;
+        segments[s].blockCount = std::max((size_t)1,
+            (distinct[s].size() * bitsPerValue + BloomBlockSize * 8 - 1) / (BloomBlockSize * 8));
+        blockCount += segments[s].blockCount;
+    }
+
+    size_t at = object->size();
+    size_t blocksAt = at + sizeof(header) + segments.size() * sizeof(BloomSegment);
+
+    object->resize(blocksAt + (size_t)blockCount * BloomBlockSize);
+    memcpy(&(*object)[at], &header, sizeof(header));
+    if (!segments.empty())
+        memcpy(&(*object)[at + sizeof(header)], &segments[0], segments.size() * sizeof(BloomSegment));
+
+    unsigned char *blocks = (unsigned char *)&(*object)[blocksAt];
+
+    for (UInt32 s = 0; s < header.segmentCount; ++s)
+        for (size_t i = 0; i < distinct[s].size(); ++i)
+        {
+            UInt64 h = bloomHash(distinct[s][i]);
+            size_t b = segments[s].firstBlock + blockOf(h, segments[s].blockCount);
+
+            insert(blocks + b * BloomBlockSize, (UInt32)h);
+        }
+}
+
+bool BloomReader::init(const void *data, size_t size)
+{
+    if (size < sizeof(header))
+        return false;
+
+    memcpy(&header, data, sizeof(header));
+
+    size_t segmentsSize = (size_t)header.segmentCount * sizeof(BloomSegment);
+
+    if (header.magic != BloomMagic || header.version != BloomVersion || !header.segmentValues ||
+        size - sizeof(header) < segmentsSize ||
+        header.segmentCount != (header.valueCount + header.segmentValues - 1) / header.segmentValues)
+        return false;
+
+    segments = (const BloomSegment *)(static_cast<const char *>(data) + sizeof(header));
+    blocks = (const unsigned char *)(segments + header.segmentCount);
+
+    size_t blockCount = (size - sizeof(header) - segmentsSize) / BloomBlockSize;
+
+    for (UInt32 s = 0; s < header.segmentCount; ++s)
+        if (!segments[s].blockCount || (UInt64)segments[s].firstBlock + segments[s].blockCount > blockCount)
+            return false;
+    return true;
+}
+
+bool BloomReader::mayContain(size_t segment, int value) const
+{
+    UInt64 h = bloomHash(value);
+    size_t b = segments[segment].firstBlock + blockOf(h, segments[segment].blockCount);
+
+    return contains(blocks + b * BloomBlockSize, (UInt32)h);
+}
+
+void BloomReader::candidates(int value, size_t maxRange, std::vector<ByteRange> *ranges) const
+{
+    UInt64 segmentSize = (UInt64)header.segmentValues * sizeof(int);
+    UInt64 objectSize = header.valueCount * sizeof(int);
+
+    for (UInt32 s = 0; s < header.segmentCount; ++s)
+    {
+        if (!mayContain(s, value))
+            continue;
+
+        UInt64 offset = s * segmentSize;
+        size_t size = std::min(segmentSize, objectSize - offset);
+
+        if (!ranges->empty() && ranges->back().first + ranges->back().second == offset &&
+            ranges->back().second + size <= maxRange)
+            ranges->back().second += size;
+        else
+            ranges->push_back(ByteRange(offset, size));
+    }
+}
@@ -0,0 +1,82 @@
+/*
+ * File:   bloom.h
+ * Author: taozou
+ *
+ * Bloom filter sidecars: for a flat object of plain ints, a small object
+ * named key + BloomSuffix tells which segments of BloomSegmentValues ints
+ * may hold a given value, so a point lookup reads the filters and then
+ * only the candidate segments instead of the whole object.
+ *
+ * Layout, little endian:
+ *
+ *   BloomHeader, then segmentCount BloomSegment, then the blocks
+ *
+ * Each segment has its own split block filter, sized for its distinct
+ * values: a value sets one bit in each of the BloomBlockWords words of
+ * one block, a block being a cache line, so a probe touches one cache
+ * line and is a few SSE2 instructions.
+ *
+ * The sidecar's user metadata BloomEtagMetadataName is the etag of the
+ * object it was built for: a sidecar without it, or whose object has
+ * another one by now, is stale and the object is read whole.
+ */
+
+#ifndef BLOOM_H
+#define	BLOOM_H
+
+#include "columnar.h"
+#include <string>
+#include <vector>
+
+#define BloomMagic 0x4d4c4253       // "SBLM"
+#define BloomVersion 1
+#define BloomSuffix ".bloom"
+#define BloomSegmentValues 65536
+#define BloomBlockWords 16
+#define BloomBlockSize (BloomBlockWords * 4)
+#define BloomEtagMetadataName "object-etag"
+
+struct BloomHeader
+{
+    UInt32 magic;
+    UInt32 version;
+    UInt32 segmentValues;
+    UInt32 segmentCount;
+    UInt64 valueCount;
+};
+
+struct BloomSegment
+{
+    UInt32 firstBlock;
+    UInt32 blockCount;
+};
+
+// Builds the sidecar of count values with bitsPerValue bits per distinct
+// value of a segment.
+
+void buildBloom(const int *values, size_t count, int bitsPerValue, std::vector<char> *object);
+
+class BloomReader {
+public:
+    bool init(const void *data, size_t size);
+
+    bool mayContain(size_t segment, int value) const;
+
+    // Byte ranges of the object that may hold value: adjacent candidate
+    // segments are merged up to maxRange bytes per range.
+
+    void candidates(int value, size_t maxRange, std::vector<ByteRange> *ranges) const;
+
+    BloomHeader header;
+
+private:
+    const BloomSegment *segments;
+    const unsigned char *blocks;
+};
+
+inline std::string bloomKey(const char *key)
+{
+    return std::string(key) + BloomSuffix;
+}
+
+#endif	/* BLOOM_H */
@@ -0,0 +1,727 @@
+/*
+ * File:   codec.cpp
+ * Author: taozou
+ *
+ * Streaming compression of object payloads.
+ */
+
+#include "codec.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <zlib.h>
+
+#ifdef WEBSTOR_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#ifdef WEBSTOR_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace webstor;
+
+#define CodecScratchSize 65536
+
+Codec codecOfEncoding(const char *contentEncoding)
+{
+    if (!contentEncoding || !*contentEncoding || !strcasecmp(contentEncoding, "identity"))
+        return CodecNone;
+    if (!strcasecmp(contentEncoding, "gzip") || !strcasecmp(contentEncoding, "x-gzip") ||
+        !strcasecmp(contentEncoding, "deflate"))
+        return CodecGzip;
+    if (!strcasecmp(contentEncoding, "lz4"))
+        return CodecLz4;
+    if (!strcasecmp(contentEncoding, "zstd"))
+        return CodecZstd;
+    return CodecAuto;
+}
+
+Codec codecOfHeaders(const std::string &contentEncoding, const S3Metadata &metadata)
+{
+    S3Metadata::const_iterator it = metadata.find(CodecMetadataName);
+    Codec codec;
+
+    if (it != metadata.end() && parseCodec(it->second.c_str(), &codec))
+        return codec;
+    return contentEncoding.empty() ? CodecAuto : codecOfEncoding(contentEncoding.c_str());
+}
+
+bool parseCodec(const char *name, Codec *codec)
+{
+    if (!strcmp(name, "none"))
+        *codec = CodecNone;
+    else if (!strcmp(name, "gzip"))
+        *codec = CodecGzip;
+    else if (!strcmp(name, "lz4"))
+        *codec = CodecLz4;
+    else if (!strcmp(name, "zstd"))
+        *codec = CodecZstd;
+    else
+        return false;
+    return true;
+}
+
+const char *codecName(Codec codec)
+{
+    switch (codec)
+    {
+    case CodecNone: return "none";
+    case CodecGzip: return "gzip";
+    case CodecLz4: return "lz4";
+    case CodecZstd: return "zstd";
+    default: return "auto";
+    }
+}
+
+bool codecAvailable(Codec codec)
+{
+    switch (codec)
+    {
+#ifdef WEBSTOR_HAVE_LZ4
+    case CodecLz4:
+#endif
+#ifdef WEBSTOR_HAVE_ZSTD
+    case CodecZstd:
+#endif
+    case CodecNone:
+    case CodecGzip:
+    case CodecAuto:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Codec of a payload from its first n bytes (n <= 4): CodecAuto while the
+// bytes could still be the start of a magic number.
+
+static Codec sniff(const unsigned char *p, size_t n)
+{
+    static const unsigned char gzip[] = { 0x1f, 0x8b };
+    static const unsigned char lz4[] = { 0x04, 0x22, 0x4d, 0x18 };
+    static const unsigned char zstd[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+    if (!memcmp(p, gzip, std::min(n, sizeof(gzip))))
+        return n < sizeof(gzip) ? CodecAuto : CodecGzip;
+    if (!memcmp(p, lz4, n))
+        return n < sizeof(lz4) ? CodecAuto : CodecLz4;
+    if (!memcmp(p, zstd, n))
+        return n < sizeof(zstd) ? CodecAuto : CodecZstd;
+
+    // zlib header: deflate method, window <= 32K, check bits.
+
+    if (p[0] == 0x78)
+        return n < 2 ? CodecAuto : (p[0] * 256 + p[1]) % 31 ? CodecNone : CodecGzip;
+    return CodecNone;
+}
+
+// Decodes a stream for a DecompressingLoader. Output goes straight into
+// the loader's buffer while it has room, otherwise through scratch.
+
+class Decoder {
+public:
+    explicit Decoder(DecompressingLoader *loader) : loader(loader) {}
+    virtual ~Decoder() {}
+
+    // Returns false on a corrupt stream or when the output isn't taken.
+
+    virtual bool feed(const unsigned char *data, size_t size) = 0;
+
+protected:
+    char *space(size_t *size)
+    {
+        if (loader->buffer && loader->left)
+        {
+            *size = loader->left;
+            return loader->buffer;
+        }
+        scratch.resize(CodecScratchSize);
+        *size = scratch.size();
+        return &scratch[0];
+    }
+
+    bool commit(const char *p, size_t size)
+    {
+        if (!size)
+            return true;
+        if (p != loader->buffer)
+            return loader->pass(p, size);
+        loader->buffer += size;
+        loader->left -= size;
+        loader->decoded += size;
+        return true;
+    }
+
+    bool fail()
+    {
+        loader->error = true;
+        return false;
+    }
+
+private:
+    DecompressingLoader *loader;
+    std::vector<char> scratch;
+};
+
+class GzipDecoder : public Decoder {
+public:
+    explicit GzipDecoder(DecompressingLoader *loader) : Decoder(loader), ready(false)
+    {
+        memset(&z, 0, sizeof(z));
+        ready = inflateInit2(&z, 15 + 32) == Z_OK;    // gzip or zlib header
+    }
+
+    ~GzipDecoder()
+    {
+        if (ready)
+            inflateEnd(&z);
+    }
+
+    bool feed(const unsigned char *data, size_t size)
+    {
+        if (!ready)
+            return fail();
+
+        while (size)
+        {
+            size_t room;
+            char *out = space(&room);
+            uInt in = (uInt) std::min(size, (size_t)UINT_MAX);
+
+            z.next_in = (Bytef *) data;
+            z.avail_in = in;
+            z.next_out = (Bytef *) out;
+            z.avail_out = (uInt) std::min(room, (size_t)UINT_MAX);
+
+            uInt avail = z.avail_out;
+            int rc = inflate(&z, Z_NO_FLUSH);
+            size_t used = in - z.avail_in;
+
+            data += used;
+            size -= used;
+
+            if (!commit(out, avail - z.avail_out))
+                return false;
+
+            // Another member (e.g. of the next multipart part) may follow.
+
+            if (rc == Z_STREAM_END)
+            {
+                if (inflateReset(&z) != Z_OK)
+                    return fail();
+            }
+            else if (rc != Z_OK || (!used && avail == z.avail_out))
+                return fail();
+        }
+
+        return true;
+    }
+
+private:
+    z_stream z;
+    bool ready;
+};
+
+#ifdef WEBSTOR_HAVE_LZ4
+
+class Lz4Decoder : public Decoder {
+public:
+    explicit Lz4Decoder(DecompressingLoader *loader) : Decoder(loader), ctx(NULL)
+    {
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+            ctx = NULL;
+    }
+
+    ~Lz4Decoder()
+    {
+        if (ctx)
+            LZ4F_freeDecompressionContext(ctx);
+    }
+
+    bool feed(const unsigned char *data, size_t size)
+    {
+        if (!ctx)
+            return fail();
+
+        while (size)
+        {
+            size_t room;
+            char *out = space(&room);
+            size_t used = size;
+            size_t produced = room;
+
+            if (LZ4F_isError(LZ4F_decompress(ctx, out, &produced, data, &used, NULL)))
+                return fail();
+
+            data += used;
+            size -= used;
+
+            if (!commit(out, produced))
+                return false;
+            if (!used && !produced)
+                return fail();
+        }
+
+        return true;
+    }
+
+private:
+    LZ4F_dctx *ctx;
+};
+
+#endif
+
+#ifdef WEBSTOR_HAVE_ZSTD
+
+class ZstdDecoder : public Decoder {
+public:
+    explicit ZstdDecoder(DecompressingLoader *loader) : Decoder(loader), ds(ZSTD_createDStream()) {}
+
+    ~ZstdDecoder()
+    {
+        ZSTD_freeDStream(ds);
+    }
+
+    bool feed(const unsigned char *data, size_t size)
+    {
+        if (!ds)
+            return fail();
+
+        ZSTD_inBuffer in = { data, size, 0 };
+
+        while (in.pos < in.size)
+        {
+            size_t room;
+            size_t before = in.pos;
+            ZSTD_outBuffer out = { space(&room), 0, 0 };
+
+            out.size = room;
+            if (ZSTD_isError(ZSTD_decompressStream(ds, &out, &in)))
+                return fail();
+            if (!commit((char *) out.dst, out.pos))
+                return false;
+            if (in.pos == before && !out.pos)
+                return fail();
+        }
+
+        return true;
+    }
+
+private:
+    ZSTD_DStream *ds;
+};
+
+#endif
+
+DecompressingLoader::DecompressingLoader()
+    : downstream(NULL)
+    , buffer(NULL)
+    , left(0)
+    , detected(CodecAuto)
+    , decoder(NULL)
+    , headSize(0)
+    , decoded(0)
+    , error(false)
+    , full(false)
+{
+}
+
+DecompressingLoader::~DecompressingLoader()
+{
+    delete decoder;
+}
+
+void DecompressingLoader::reset(S3GetResponseLoader *downstream, Codec codec)
+{
+    delete decoder;
+    decoder = NULL;
+    this->downstream = downstream;
+    buffer = NULL;
+    left = 0;
+    detected = codec;
+    headSize = 0;
+    decoded = 0;
+    error = false;
+    full = false;
+
+    if (codec != CodecAuto)
+        start(codec);
+}
+
+void DecompressingLoader::reset(void *buffer, size_t size, Codec codec)
+{
+    reset((S3GetResponseLoader *) NULL, codec);
+    this->buffer = static_cast<char *>(buffer);
+    left = size;
+}
+
+bool DecompressingLoader::start(Codec codec)
+{
+    detected = codec;
+
+    switch (codec)
+    {
+    case CodecNone:
+        return true;
+    case CodecGzip:
+        decoder = new GzipDecoder(this);
+        return true;
+#ifdef WEBSTOR_HAVE_LZ4
+    case CodecLz4:
+        decoder = new Lz4Decoder(this);
+        return true;
+#endif
+#ifdef WEBSTOR_HAVE_ZSTD
+    case CodecZstd:
+        decoder = new ZstdDecoder(this);
+        return true;
+#endif
+    default:
+        error = true;
+        return false;
+    }
+}
+
+bool DecompressingLoader::pass(const void *data, size_t size)
+{
+    size_t taken;
+
+    if (downstream)
+        taken = downstream->onLoad(data, size, 0);
+    else
+    {
+        taken = std::min(size, left);
+        memcpy(buffer, data, taken);
+        buffer += taken;
+        left -= taken;
+    }
+
+    decoded += taken;
+    full = full || taken < size;
+    return taken == size;
+}
+
+bool DecompressingLoader::feed(const void *data, size_t size)
+{
+    if (error)
+        return false;
+    if (decoder)
+        return decoder->feed(static_cast<const unsigned char *>(data), size);
+    return pass(data, size);
+}
+
+void DecompressingLoader::onHeaders(const std::string &contentEncoding, const S3Metadata &metadata)
+{
+    if (detected != CodecAuto || decoder || headSize)
+        return;
+
+    Codec codec = codecOfHeaders(contentEncoding, metadata);
+
+    if (codec != CodecAuto)
+        start(codec);
+}
+
+size_t DecompressingLoader::onLoad(const void *chunkData, size_t chunkSize, size_t totalSizeHint)
+{
+    if (detected == CodecAuto)
+    {
+        // No header told the codec, the first bytes do; they may come in
+        // several chunks.
+
+        size_t take = std::min(chunkSize, sizeof(head) - headSize);
+        memcpy(head + headSize, chunkData, take);
+
+        Codec codec = sniff(head, headSize + take);
+
+        if (codec == CodecAuto)
+        {
+            headSize += take;
+            return chunkSize;
+        }
+
+        if (!start(codec))
+            return 0;
+
+        if ((!headSize || feed(head, headSize)) && feed(chunkData, chunkSize))
+        {
+            headSize = 0;
+            return chunkSize;
+        }
+
+        // Plain bytes may look like a magic number: a stream that is corrupt
+        // before it has produced anything is taken as plain.
+
+        if (!error || decoded)
+            return 0;
+
+        delete decoder;
+        decoder = NULL;
+        detected = CodecNone;
+        error = false;
+
+        bool ok = (!headSize || pass(head, headSize)) && pass(chunkData, chunkSize);
+        headSize = 0;
+        return ok ? chunkSize : 0;
+    }
+
+    return feed(chunkData, chunkSize) ? chunkSize : 0;
+}
+
+// Encoders append to a vector, growing it by CodecScratchSize at a time.
+
+class Encoder {
+public:
+    virtual ~Encoder() {}
+    virtual bool write(const void *data, size_t size, std::vector<char> *out) = 0;
+    virtual bool finish(std::vector<char> *out) = 0;
+};
+
+class GzipEncoder : public Encoder {
+public:
+    GzipEncoder() : ready(false)
+    {
+        memset(&z, 0, sizeof(z));
+        ready = deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+
+    ~GzipEncoder()
+    {
+        if (ready)
+            deflateEnd(&z);
+    }
+
+    bool write(const void *data, size_t size, std::vector<char> *out)
+    {
+        const Bytef *p = static_cast<const Bytef *>(data);
+
+        while (size)
+        {
+            uInt in = (uInt) std::min(size, (size_t)UINT_MAX);
+
+            z.next_in = (Bytef *) p;
+            z.avail_in = in;
+            if (!run(Z_NO_FLUSH, out))
+                return false;
+            p += in;
+            size -= in;
+        }
+        return true;
+    }
+
+    bool finish(std::vector<char> *out)
+    {
+        z.next_in = NULL;
+        z.avail_in = 0;
+        return run(Z_FINISH, out);
+    }
+
+private:
+    bool run(int flush, std::vector<char> *out)
+    {
+        int rc;
+
+        if (!ready)
+            return false;
+
+        do
+        {
+            size_t at = out->size();
+            out->resize(at + CodecScratchSize);
+            z.next_out = (Bytef *) &(*out)[at];
+            z.avail_out = CodecScratchSize;
+            rc = deflate(&z, flush);
+            out->resize(at + CodecScratchSize - z.avail_out);
+            if (rc == Z_STREAM_ERROR)
+                return false;
+        } while (!z.avail_out || (flush == Z_FINISH && rc != Z_STREAM_END));
+
+        return true;
+    }
+
+    z_stream z;
+    bool ready;
+};
+
+#ifdef WEBSTOR_HAVE_LZ4
+
+class Lz4Encoder : public Encoder {
+public:
+    Lz4Encoder() : ctx(NULL), started(false)
+    {
+        if (LZ4F_isError(LZ4F_createCompressionContext(&ctx, LZ4F_VERSION)))
+            ctx = NULL;
+    }
+
+    ~Lz4Encoder()
+    {
+        if (ctx)
+            LZ4F_freeCompressionContext(ctx);
+    }
+
+    bool write(const void *data, size_t size, std::vector<char> *out)
+    {
+        const char *p = static_cast<const char *>(data);
+
+        if (!begin(out))
+            return false;
+
+        while (size)
+        {
+            size_t n = std::min(size, (size_t)4 * 1024 * 1024);
+
+            if (!append(LZ4F_compressBound(n, NULL), out, p, n))
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool finish(std::vector<char> *out)
+    {
+        return begin(out) && append(LZ4F_compressBound(0, NULL), out, NULL, 0);
+    }
+
+private:
+    bool begin(std::vector<char> *out)
+    {
+        if (!ctx)
+            return false;
+        if (started)
+            return true;
+
+        size_t at = out->size();
+        out->resize(at + LZ4F_HEADER_SIZE_MAX);
+        size_t r = LZ4F_compressBegin(ctx, &(*out)[at], LZ4F_HEADER_SIZE_MAX, NULL);
+        if (LZ4F_isError(r))
+            return false;
+        out->resize(at + r);
+        started = true;
+        return true;
+    }
+
+    // Compresses p[0..n), or ends the frame if p is NULL.
+
+    bool append(size_t bound, std::vector<char> *out, const char *p, size_t n)
+    {
+        size_t at = out->size();
+        out->resize(at + bound);
+
+        size_t r = p ? LZ4F_compressUpdate(ctx, &(*out)[at], bound, p, n, NULL)
+                     : LZ4F_compressEnd(ctx, &(*out)[at], bound, NULL);
+        if (LZ4F_isError(r))
+            return false;
+        out->resize(at + r);
+        return true;
+    }
+
+    LZ4F_cctx *ctx;
+    bool started;
+};
+
+#endif
+
+#ifdef WEBSTOR_HAVE_ZSTD
+
+class ZstdEncoder : public Encoder {
+public:
+    ZstdEncoder() : cctx(ZSTD_createCCtx()) {}
+
+    ~ZstdEncoder()
+    {
+        ZSTD_freeCCtx(cctx);
+    }
+
+    bool write(const void *data, size_t size, std::vector<char> *out)
+    {
+        ZSTD_inBuffer in = { data, size, 0 };
+
+        while (in.pos < in.size)
+            if (!run(&in, ZSTD_e_continue, out))
+                return false;
+        return true;
+    }
+
+    bool finish(std::vector<char> *out)
+    {
+        ZSTD_inBuffer in = { NULL, 0, 0 };
+        size_t rest;
+
+        do
+        {
+            rest = run(&in, ZSTD_e_end, out);
+        } while (rest > 1);
+        return rest == 1;
+    }
+
+private:
+    // Returns 0 on an error, else 1 + what is left to flush.
+
+    size_t run(ZSTD_inBuffer *in, ZSTD_EndDirective end, std::vector<char> *out)
+    {
+        if (!cctx)
+            return 0;
+
+        size_t at = out->size();
+        out->resize(at + ZSTD_CStreamOutSize());
+
+        ZSTD_outBuffer o = { &(*out)[at], ZSTD_CStreamOutSize(), 0 };
+        size_t r = ZSTD_compressStream2(cctx, &o, in, end);
+
+        out->resize(at + o.pos);
+        return ZSTD_isError(r) ? 0 : r + 1;
+    }
+
+    ZSTD_CCtx *cctx;
+};
+
+#endif
+
+Compressor::Compressor(Codec codec)
+    : codec(codec)
+    , encoder(NULL)
+{
+    switch (codec)
+    {
+    case CodecGzip:
+        encoder = new GzipEncoder();
+        break;
+#ifdef WEBSTOR_HAVE_LZ4
+    case CodecLz4:
+        encoder = new Lz4Encoder();
+        break;
+#endif
+#ifdef WEBSTOR_HAVE_ZSTD
+    case CodecZstd:
+        encoder = new ZstdEncoder();
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+Compressor::~Compressor()
+{
+    delete encoder;
+}
+
+bool Compressor::write(const void *data, size_t size, std::vector<char> *out)
+{
+    if (!encoder)
+    {
+        if (codec != CodecNone)
+            return false;
+        out->insert(out->end(), static_cast<const char *>(data), static_cast<const char *>(data) + size);
+        return true;
+    }
+    return encoder->write(data, size, out);
+}
+
+bool Compressor::finish(std::vector<char> *out)
+{
+    if (!encoder)
+        return codec == CodecNone;
+    return encoder->finish(out);
+}
@@ -0,0 +1,135 @@
+/*
+ * File:   codec.h
+ * Author: taozou
+ *
+ * Streaming compression of object payloads. Decompression runs inside
+ * S3GetResponseLoader::onLoad as the bytes arrive, so it overlaps with the
+ * network instead of being a pass over the whole object afterwards.
+ *
+ * gzip/deflate use zlib. lz4 (frame format) and zstd are compiled in with
+ * -DWEBSTOR_HAVE_LZ4 / -DWEBSTOR_HAVE_ZSTD and the matching libraries.
+ * Concatenated streams (e.g. one per multipart part) decode as one.
+ */
+
+#ifndef CODEC_H
+#define	CODEC_H
+
+#include "s3conn.h"
+#include <vector>
+
+enum Codec
+{
+    CodecNone,
+    CodecGzip,      // gzip or zlib-wrapped deflate
+    CodecLz4,
+    CodecZstd,
+    CodecAuto       // decoding only: detect from the first bytes
+};
+
+// User metadata naming the codec of an object, as written by
+// uploadCompressed (see upload.h): "none", "gzip", "lz4" or "zstd".
+
+#define CodecMetadataName "codec"
+
+// Codec of a Content-Encoding value, CodecAuto if it isn't known.
+
+Codec codecOfEncoding(const char *contentEncoding);
+
+// Codec of an object from its headers: CodecMetadataName, else its
+// Content-Encoding; CodecAuto if neither tells.
+
+Codec codecOfHeaders(const std::string &contentEncoding, const webstor::S3Metadata &metadata);
+
+// Codec of a name as given on the command line ("none", "gzip", "lz4",
+// "zstd"), returns false if it isn't one.
+
+bool parseCodec(const char *name, Codec *codec);
+
+const char *codecName(Codec codec);
+
+// Whether the codec is compiled in.
+
+bool codecAvailable(Codec codec);
+
+class Decoder;
+class Encoder;
+
+// Decompresses a 'get' payload on the fly and passes the result to a
+// downstream loader or into a buffer. With CodecAuto the codec comes from
+// the headers of the object (see codecOfHeaders), or from its first bytes
+// if they don't tell; plain payloads pass through. Returning less than the
+// chunk from onLoad, as on a corrupt stream or a full buffer, stops the
+// request.
+
+class DecompressingLoader : public webstor::S3GetResponseLoader {
+public:
+    DecompressingLoader();
+    ~DecompressingLoader();
+
+    void reset(webstor::S3GetResponseLoader *downstream, Codec codec = CodecAuto);
+    void reset(void *buffer, size_t size, Codec codec = CodecAuto);
+
+    void onHeaders(const std::string &contentEncoding, const webstor::S3Metadata &metadata);
+    size_t onLoad(const void *chunkData, size_t chunkSize, size_t totalSizeHint);
+
+    // Codec of the payload, CodecAuto until the headers or the first bytes
+    // are seen.
+
+    Codec codec() const { return detected; }
+
+    // Decompressed bytes passed on so far.
+
+    size_t decodedSize() const { return decoded; }
+
+    // Set if the stream is corrupt or the codec isn't compiled in.
+
+    bool failed() const { return error; }
+
+    // Set if the buffer (or the downstream loader) took less than offered.
+
+    bool truncated() const { return full; }
+
+private:
+    DecompressingLoader(const DecompressingLoader &);
+    void operator=(const DecompressingLoader &);
+
+    bool start(Codec codec);
+    bool feed(const void *data, size_t size);
+    bool pass(const void *data, size_t size);
+
+    friend class Decoder;
+
+    webstor::S3GetResponseLoader *downstream;
+    char *buffer;
+    size_t left;
+    Codec detected;
+    Decoder *decoder;
+    unsigned char head[4];      // sniffing: first bytes, if they come split
+    size_t headSize;
+    size_t decoded;
+    bool error;
+    bool full;
+};
+
+// Compresses a stream in pieces, appending the output to a vector. Every
+// call fails if the codec isn't compiled in.
+
+class Compressor {
+public:
+    explicit Compressor(Codec codec);
+    ~Compressor();
+
+    // Returns false on a codec error.
+
+    bool write(const void *data, size_t size, std::vector<char> *out);
+    bool finish(std::vector<char> *out);
+
+private:
+    Compressor(const Compressor &);
+    void operator=(const Compressor &);
+
+    Codec codec;
+    Encoder *encoder;
+};
+
+#endif	/* CODEC_H */
@@ -0,0 +1,132 @@
+/*
+ * File:   columnar.cpp
+ * Author: taozou
+ *
+ * Columnar objects.
+ */
+
+#include "columnar.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+ColumnarFooter::Status ColumnarFooter::parseTail(const void *tail, size_t size)
+{
+    ColumnarTrailer trailer;
+
+    if (size < sizeof(trailer))
+        return Invalid;
+
+    memcpy(&trailer, static_cast<const char *>(tail) + size - sizeof(trailer), sizeof(trailer));
+
+    if (trailer.magic != ColumnarMagic || trailer.footerSize < sizeof(ColumnarHeader))
+        return Invalid;
+
+    footerOffset = trailer.footerOffset;
+    footerSize = trailer.footerSize;
+
+    if (trailer.footerSize > size - sizeof(trailer))
+        return NeedFooter;
+
+    const char *footer = static_cast<const char *>(tail) + size - sizeof(trailer) - footerSize;
+    return parseFooter(footer, footerSize) ? Complete : Invalid;
+}
+
+bool ColumnarFooter::parseFooter(const void *footer, size_t size)
+{
+    ColumnarHeader header;
+
+    if (size != footerSize || size < sizeof(header))
+        return false;
+
+    memcpy(&header, footer, sizeof(header));
+
+    if (header.version != ColumnarVersion ||
+        size != sizeof(header) + header.columnCount * sizeof(ColumnarColumn))
+        return false;
+
+    rowCount = header.rowCount;
+    columns.resize(header.columnCount);
+    if (header.columnCount)
+        memcpy(&columns[0], static_cast<const char *>(footer) + sizeof(header),
+               header.columnCount * sizeof(ColumnarColumn));
+    return true;
+}
+
+static void addRanges(UInt64 begin, UInt64 end, size_t maxSize, std::vector<ByteRange> *ranges)
+{
+    for (UInt64 off = begin; off < end; off += maxSize)
+        ranges->push_back(ByteRange(off, (size_t)std::min((UInt64)maxSize, end - off)));
+}
+
+bool ColumnarFooter::plan(const std::vector<int> &projection, size_t maxSize, std::vector<ByteRange> *ranges) const
+{
+    std::vector<int> sorted(projection);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+    maxSize -= maxSize % sizeof(int);
+    ranges->clear();
+
+    UInt64 begin = 0;
+    UInt64 end = 0;
+
+    for (size_t i = 0; i < sorted.size(); ++i)
+    {
+        if (sorted[i] < 0 || sorted[i] >= (int)columns.size())
+            return false;
+
+        const ColumnarColumn &c = columns[sorted[i]];
+
+        if (c.offset != end)
+        {
+            addRanges(begin, end, maxSize, ranges);
+            begin = end = c.offset;
+        }
+        end += c.size;
+    }
+
+    addRanges(begin, end, maxSize, ranges);
+    return true;
+}
+
+void buildColumnar(const int *records, size_t rowCount, int columnCount, std::vector<char> *object)
+{
+    size_t chunkSize = rowCount * sizeof(int);
+    ColumnarHeader header = { ColumnarVersion, (UInt32)columnCount, rowCount };
+    std::vector<ColumnarColumn> columns(columnCount);
+
+    object->resize(chunkSize * columnCount + sizeof(header) + columnCount * sizeof(ColumnarColumn) +
+                   sizeof(ColumnarTrailer));
+
+    for (int c = 0; c < columnCount; ++c)
+    {
+        int *chunk = (int *) &(*object)[c * chunkSize];
+        int lo = INT_MAX;
+        int hi = INT_MIN;
+
+        for (size_t r = 0; r < rowCount; ++r)
+        {
+            int v = records[r * columnCount + c];
+            chunk[r] = v;
+            lo = std::min(lo, v);
+            hi = std::max(hi, v);
+        }
+
+        columns[c].offset = c * chunkSize;
+        columns[c].size = chunkSize;
+        columns[c].min = lo;
+        columns[c].max = hi;
+    }
+
+    char *p = &(*object)[chunkSize * columnCount];
+    ColumnarTrailer trailer = { chunkSize * columnCount,
+                                (UInt32)(sizeof(header) + columnCount * sizeof(ColumnarColumn)), ColumnarMagic };
+
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    if (columnCount)
+        memcpy(p, &columns[0], columnCount * sizeof(ColumnarColumn));
+    p += columnCount * sizeof(ColumnarColumn);
+    memcpy(p, &trailer, sizeof(trailer));
+}
@@ -0,0 +1,90 @@
+/*
+ * File:   columnar.h
+ * Author: taozou
+ *
+ * Columnar objects: records of fixed-width int columns stored column by
+ * column, with a footer that tells where every column chunk is.
+ *
+ * Layout, little endian:
+ *
+ *   [column 0 chunk][column 1 chunk]...[footer][trailer]
+ *
+ *   chunk   = rowCount ints
+ *   footer  = ColumnarHeader, then columnCount ColumnarColumn
+ *   trailer = ColumnarTrailer
+ *
+ * A reader fetches the last ColumnarTailSize bytes with one suffix range
+ * request, which normally holds the whole footer, then only the chunks of
+ * the columns a query needs.
+ */
+
+#ifndef COLUMNAR_H
+#define	COLUMNAR_H
+
+#include "sysutils.h"
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+using webstor::internal::UInt32;
+using webstor::internal::UInt64;
+
+#define ColumnarMagic 0x4c4f4353     // "SCOL"
+#define ColumnarVersion 1
+#define ColumnarTailSize 65536
+
+struct ColumnarHeader
+{
+    UInt32 version;
+    UInt32 columnCount;
+    UInt64 rowCount;
+};
+
+struct ColumnarColumn
+{
+    UInt64 offset;      // from the start of the object
+    UInt64 size;        // bytes
+    int min;            // statistics, min > max if the column is empty
+    int max;
+};
+
+struct ColumnarTrailer
+{
+    UInt64 footerOffset;
+    UInt32 footerSize;
+    UInt32 magic;
+};
+
+// (offset, size) of a ranged read.
+
+typedef std::pair<UInt64, size_t> ByteRange;
+
+class ColumnarFooter {
+public:
+    enum Status { Invalid, Complete, NeedFooter };
+
+    // Parses the last bytes of an object. NeedFooter means the footer
+    // starts before the tail: read footerSize bytes at footerOffset and
+    // pass them to parseFooter().
+
+    Status parseTail(const void *tail, size_t size);
+    bool parseFooter(const void *footer, size_t size);
+
+    // Byte ranges to read for the given columns: chunks of adjacent columns
+    // are coalesced and ranges are split to at most maxSize bytes, a
+    // multiple of sizeof(int). Returns false if a column doesn't exist.
+
+    bool plan(const std::vector<int> &projection, size_t maxSize, std::vector<ByteRange> *ranges) const;
+
+    UInt64 footerOffset;
+    UInt32 footerSize;
+    UInt64 rowCount;
+    std::vector<ColumnarColumn> columns;
+};
+
+// Lays out rowCount records of columnCount ints (row-major, as produced by
+// the application) as a columnar object.
+
+void buildColumnar(const int *records, size_t rowCount, int columnCount, std::vector<char> *object);
+
+#endif	/* COLUMNAR_H */
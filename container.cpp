@@ -0,0 +1,152 @@
+/*
+ * File:   container.cpp
+ * Author: taozou
+ *
+ * Container objects.
+ */
+
+#include "container.h"
+#include <cstring>
+
+ContainerIndex::Status ContainerIndex::parseTail(const void *tail, size_t size)
+{
+    ContainerTrailer trailer;
+
+    if (size < sizeof(trailer))
+        return Invalid;
+
+    memcpy(&trailer, static_cast<const char *>(tail) + size - sizeof(trailer), sizeof(trailer));
+
+    if (trailer.magic != ContainerMagic || trailer.indexSize < sizeof(ContainerHeader))
+        return Invalid;
+
+    indexOffset = trailer.indexOffset;
+    indexSize = trailer.indexSize;
+
+    if (trailer.indexSize > size - sizeof(trailer))
+        return NeedIndex;
+
+    const char *index = static_cast<const char *>(tail) + size - sizeof(trailer) - indexSize;
+    return parseIndex(index, indexSize) ? Complete : Invalid;
+}
+
+bool ContainerIndex::parseIndex(const void *index, size_t size)
+{
+    ContainerHeader header;
+
+    if (size != indexSize || size < sizeof(header))
+        return false;
+
+    memcpy(&header, index, sizeof(header));
+
+    size_t membersSize = (size_t)header.memberCount * sizeof(ContainerMember);
+
+    if (header.version != ContainerVersion || size - sizeof(header) < membersSize)
+        return false;
+
+    const char *p = static_cast<const char *>(index) + sizeof(header);
+
+    members.resize(header.memberCount);
+    if (header.memberCount)
+        memcpy(&members[0], p, membersSize);
+    names.assign(p + membersSize, size - sizeof(header) - membersSize);
+
+    for (size_t i = 0; i < members.size(); ++i)
+        if (members[i].offset + members[i].size > indexOffset ||
+            (UInt64)members[i].nameOffset + members[i].nameSize > names.size())
+            return false;
+    return true;
+}
+
+int ContainerIndex::find(const char *name) const
+{
+    size_t length = strlen(name);
+
+    for (size_t i = 0; i < members.size(); ++i)
+        if (members[i].nameSize == length && !names.compare(members[i].nameOffset, length, name))
+            return i;
+    return -1;
+}
+
+std::string ContainerIndex::name(int i) const
+{
+    return names.substr(members[i].nameOffset, members[i].nameSize);
+}
+
+bool ContainerIndex::plan(size_t maxSize, std::vector<ByteRange> *ranges) const
+{
+    UInt64 begin = 0;
+    UInt64 end = 0;
+
+    ranges->clear();
+
+    for (size_t i = 0; i < members.size(); ++i)
+    {
+        const ContainerMember &m = members[i];
+
+        if (m.offset < end)
+            return false;
+        if (m.size > maxSize)
+            continue;
+
+        if (m.offset + m.size - begin > maxSize || m.offset - end >= ContainerAlign)
+        {
+            if (end > begin)
+                ranges->push_back(ByteRange(begin, (size_t)(end - begin)));
+            begin = m.offset;
+        }
+        end = m.offset + m.size;
+    }
+
+    if (end > begin)
+        ranges->push_back(ByteRange(begin, (size_t)(end - begin)));
+    return true;
+}
+
+void ContainerBuilder::add(const char *name, const void *data, size_t size)
+{
+    // Pad the previous member, so this one starts aligned.
+
+    object.resize(object.size() + (ContainerAlign - (written + object.size()) % ContainerAlign) % ContainerAlign);
+
+    ContainerMember m = { written + object.size(), size, (UInt32)names.size(), (UInt32)strlen(name) };
+
+    members.push_back(m);
+    names.append(name);
+    object.insert(object.end(), static_cast<const char *>(data), static_cast<const char *>(data) + size);
+}
+
+void ContainerBuilder::reserve(const char *name, UInt64 size)
+{
+    ContainerMember m = { written, size, (UInt32)names.size(), (UInt32)strlen(name) };
+
+    members.push_back(m);
+    names.append(name);
+    written += size;
+}
+
+void ContainerBuilder::finish()
+{
+    ContainerHeader header = { ContainerVersion, (UInt32)members.size() };
+    size_t indexSize = sizeof(header) + members.size() * sizeof(ContainerMember) + names.size();
+    ContainerTrailer trailer = { written + object.size(), (UInt32)indexSize, ContainerMagic };
+    size_t at = object.size();
+
+    object.resize(at + indexSize + sizeof(trailer));
+
+    char *p = &object[at];
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    if (!members.empty())
+        memcpy(p, &members[0], members.size() * sizeof(ContainerMember));
+    p += members.size() * sizeof(ContainerMember);
+    memcpy(p, names.data(), names.size());
+    p += names.size();
+    memcpy(p, &trailer, sizeof(trailer));
+}
+
+void ContainerBuilder::consumed()
+{
+    written += object.size();
+    object.clear();
+}
@@ -0,0 +1,118 @@
+/*
+ * File:   container.h
+ * Author: taozou
+ *
+ * Container objects: many small objects (members) packed into one large
+ * object with a trailing index, so a scan pays for one request instead of
+ * one per member, and a single member is still one ranged read away.
+ *
+ * Layout, little endian:
+ *
+ *   [member 0][pad][member 1][pad]...[index][trailer]
+ *
+ *   member  = its bytes, starting at a multiple of ContainerAlign
+ *   index   = ContainerHeader, then memberCount ContainerMember, then the
+ *             names, not terminated
+ *   trailer = ContainerTrailer
+ *
+ * Like columnar objects, the index is read with one suffix range request of
+ * ContainerTailSize bytes, and with a second one if it doesn't fit.
+ */
+
+#ifndef CONTAINER_H
+#define	CONTAINER_H
+
+#include "columnar.h"
+#include <string>
+
+#define ContainerMagic 0x4e4f4353    // "SCON"
+#define ContainerVersion 1
+#define ContainerTailSize 65536
+#define ContainerAlign 8
+
+struct ContainerHeader
+{
+    UInt32 version;
+    UInt32 memberCount;
+};
+
+struct ContainerMember
+{
+    UInt64 offset;      // from the start of the object
+    UInt64 size;        // bytes, without the padding
+    UInt32 nameOffset;  // from the start of the names
+    UInt32 nameSize;
+};
+
+struct ContainerTrailer
+{
+    UInt64 indexOffset;
+    UInt32 indexSize;
+    UInt32 magic;
+};
+
+class ContainerIndex {
+public:
+    enum Status { Invalid, Complete, NeedIndex };
+
+    // Parses the last bytes of an object (or the whole object). NeedIndex
+    // means the index starts before the tail: read indexSize bytes at
+    // indexOffset and pass them to parseIndex().
+
+    Status parseTail(const void *tail, size_t size);
+    bool parseIndex(const void *index, size_t size);
+
+    // Number of the member with the given name, -1 if there is none.
+
+    int find(const char *name) const;
+
+    std::string name(int i) const;
+
+    // Ranges of at most maxSize bytes that read the members in order, the
+    // members of a range being adjacent but for their padding. Members
+    // larger than maxSize are left out. False if the members are not in
+    // object order.
+
+    bool plan(size_t maxSize, std::vector<ByteRange> *ranges) const;
+
+    UInt64 indexOffset;
+    UInt32 indexSize;
+    std::vector<ContainerMember> members;
+    std::string names;
+};
+
+// Builds a container object, members are added in order. The object can
+// be taken away in pieces as it grows, e.g. to upload it while packing.
+
+class ContainerBuilder {
+public:
+    ContainerBuilder() : written(0) {}
+
+    void add(const char *name, const void *data, size_t size);
+
+    // Adds a member whose bytes are written by someone else, e.g. copied
+    // by the server into a multipart upload, right after the bytes taken
+    // so far; object must be empty. It is aligned only if the members
+    // before it are reserved ones of aligned sizes.
+
+    void reserve(const char *name, UInt64 size);
+
+    // Appends the index and the trailer; the object is complete.
+
+    void finish();
+
+    // The bytes in object have been taken away: clears it.
+
+    void consumed();
+
+    // Bytes of the object not yet taken away.
+
+    std::vector<char> object;
+
+private:
+    UInt64 written;
+    std::vector<ContainerMember> members;
+    std::string names;
+};
+
+#endif	/* CONTAINER_H */
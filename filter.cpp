@@ -0,0 +1,912 @@
+/*
+ * File:   filter.cpp
+ * Author: taozou
+ *
+ * Predicates over scanned values.
+ *
+ * A predicate is parsed into a tree of nodes. Value nodes produce a block of
+ * ints (the scanned value, a constant or arithmetic over them), predicate
+ * nodes produce a bitmask with one bit per value of the block. Comparison
+ * kernels are templates specialized per operator and use SSE2 when
+ * available, so the cost per value is a few instructions and the virtual
+ * calls happen once per block. The final mask is turned into a compacted
+ * array of the selected values that any operator can consume.
+ */
+
+#include "filter.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef unsigned long long Mask;
+
+static const size_t c_maskWords = (FilterBlock + 63) / 64;
+
+//////////////////////////////////////////////////////////////////////////////
+// Kernels.
+
+enum CmpOp { CmpLt, CmpLe, CmpGt, CmpGe, CmpEq, CmpNe };
+enum ArithOp { ArithAdd, ArithSub, ArithMul, ArithDiv, ArithMod };
+
+template <CmpOp op> struct Cmp;
+
+template <> struct Cmp<CmpLt>
+{
+    static inline bool scalar(int a, int b) { return a < b; }
+#ifdef __SSE2__
+    static inline __m128i simd(__m128i a, __m128i b) { return _mm_cmplt_epi32(a, b); }
+#endif
+};
+
+template <> struct Cmp<CmpGt>
+{
+    static inline bool scalar(int a, int b) { return a > b; }
+#ifdef __SSE2__
+    static inline __m128i simd(__m128i a, __m128i b) { return _mm_cmpgt_epi32(a, b); }
+#endif
+};
+
+template <> struct Cmp<CmpEq>
+{
+    static inline bool scalar(int a, int b) { return a == b; }
+#ifdef __SSE2__
+    static inline __m128i simd(__m128i a, __m128i b) { return _mm_cmpeq_epi32(a, b); }
+#endif
+};
+
+template <> struct Cmp<CmpLe>
+{
+    static inline bool scalar(int a, int b) { return a <= b; }
+#ifdef __SSE2__
+    static inline __m128i simd(__m128i a, __m128i b) { return _mm_xor_si128(_mm_cmpgt_epi32(a, b), _mm_set1_epi32(-1)); }
+#endif
+};
+
+template <> struct Cmp<CmpGe>
+{
+    static inline bool scalar(int a, int b) { return a >= b; }
+#ifdef __SSE2__
+    static inline __m128i simd(__m128i a, __m128i b) { return _mm_xor_si128(_mm_cmplt_epi32(a, b), _mm_set1_epi32(-1)); }
+#endif
+};
+
+template <> struct Cmp<CmpNe>
+{
+    static inline bool scalar(int a, int b) { return a != b; }
+#ifdef __SSE2__
+    static inline __m128i simd(__m128i a, __m128i b) { return _mm_xor_si128(_mm_cmpeq_epi32(a, b), _mm_set1_epi32(-1)); }
+#endif
+};
+
+// Comparison of a block against a constant (bConst) or another block.
+
+template <CmpOp op, bool bConst>
+static void compare(const int *a, const int *b, int c, size_t count, Mask *mask)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i vc = _mm_set1_epi32(c);
+
+    for (; i + 64 <= count; i += 64)
+    {
+        Mask word = 0;
+
+        for (int j = 0; j < 64; j += 4)
+        {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i + j));
+            __m128i vb = bConst ? vc : _mm_loadu_si128((const __m128i *)(b + i + j));
+            Mask bits = _mm_movemask_ps(_mm_castsi128_ps(Cmp<op>::simd(va, vb)));
+            word |= bits << j;
+        }
+        mask[i / 64] = word;
+    }
+#endif
+
+    for (; i < count; i += 64)
+    {
+        Mask word = 0;
+        size_t n = std::min((size_t)64, count - i);
+
+        for (size_t j = 0; j < n; ++j)
+            word |= (Mask)Cmp<op>::scalar(a[i + j], bConst ? c : b[i + j]) << j;
+        mask[i / 64] = word;
+    }
+}
+
+// lo <= a < lo + span, one unsigned comparison per value.
+
+static void range(const int *a, int lo, unsigned span, size_t count, Mask *mask)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i vlo = _mm_set1_epi32(lo);
+    __m128i bias = _mm_set1_epi32(INT_MIN);
+    __m128i vspan = _mm_xor_si128(_mm_set1_epi32((int)span), bias);
+
+    for (; i + 64 <= count; i += 64)
+    {
+        Mask word = 0;
+
+        for (int j = 0; j < 64; j += 4)
+        {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i + j));
+            __m128i off = _mm_xor_si128(_mm_sub_epi32(va, vlo), bias);
+            Mask bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(off, vspan)));
+            word |= bits << j;
+        }
+        mask[i / 64] = word;
+    }
+#endif
+
+    for (; i < count; i += 64)
+    {
+        Mask word = 0;
+        size_t n = std::min((size_t)64, count - i);
+
+        for (size_t j = 0; j < n; ++j)
+            word |= (Mask)((unsigned)a[i + j] - (unsigned)lo < span) << j;
+        mask[i / 64] = word;
+    }
+}
+
+// Arithmetic wraps around like the hardware does; division by zero gives 0.
+
+template <ArithOp op> struct Arith;
+
+template <> struct Arith<ArithAdd>
+{
+    static inline int apply(int a, int b) { return (int)((unsigned)a + (unsigned)b); }
+};
+
+template <> struct Arith<ArithSub>
+{
+    static inline int apply(int a, int b) { return (int)((unsigned)a - (unsigned)b); }
+};
+
+template <> struct Arith<ArithMul>
+{
+    static inline int apply(int a, int b) { return (int)((unsigned)a * (unsigned)b); }
+};
+
+template <> struct Arith<ArithDiv>
+{
+    static inline int apply(int a, int b) { return b == 0 ? 0 : b == -1 ? (int)(0u - (unsigned)a) : a / b; }
+};
+
+template <> struct Arith<ArithMod>
+{
+    static inline int apply(int a, int b) { return b == 0 || b == -1 ? 0 : a % b; }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Nodes. All nodes of a filter are owned by its FilterProgram, so a node can
+// be referenced twice (chained comparisons do that).
+
+class ValueNode {
+public:
+    virtual ~ValueNode() {}
+
+    // Returns count values, either data itself or an internal buffer.
+
+    virtual const int *eval(const int *data, size_t count) = 0;
+
+    virtual bool isConst(int *value) const { return false; }
+
+    // Bounds of the values given the bounds of the scanned values, false
+    // if unknown.
+
+    virtual bool bounds(int min, int max, long long *lo, long long *hi) const { return false; }
+};
+
+class ColumnNode : public ValueNode {
+public:
+    const int *eval(const int *data, size_t count) { return data; }
+
+    bool bounds(int min, int max, long long *lo, long long *hi) const { *lo = min; *hi = max; return true; }
+};
+
+class ConstNode : public ValueNode {
+public:
+    explicit ConstNode(int value) : value(value), filled(false) {}
+
+    const int *eval(const int *data, size_t count)
+    {
+        if (!filled)
+        {
+            std::fill(buf, buf + FilterBlock, value);
+            filled = true;
+        }
+        return buf;
+    }
+
+    bool isConst(int *v) const { *v = value; return true; }
+
+    bool bounds(int min, int max, long long *lo, long long *hi) const { *lo = *hi = value; return true; }
+
+    int value;
+    bool filled;
+    int buf[FilterBlock];
+};
+
+template <ArithOp op, bool rConst>
+class ArithNode : public ValueNode {
+public:
+    ArithNode(ValueNode *l, ValueNode *r, int c) : l(l), r(r), c(c) {}
+
+    const int *eval(const int *data, size_t count)
+    {
+        const int *a = l->eval(data, count);
+
+        if (rConst)
+        {
+            for (size_t i = 0; i < count; ++i)
+                buf[i] = Arith<op>::apply(a[i], c);
+        }
+        else
+        {
+            const int *b = r->eval(data, count);
+            for (size_t i = 0; i < count; ++i)
+                buf[i] = Arith<op>::apply(a[i], b[i]);
+        }
+        return buf;
+    }
+
+    ValueNode *l;
+    ValueNode *r;
+    int c;
+    int buf[FilterBlock];
+};
+
+class PredicateNode {
+public:
+    virtual ~PredicateNode() {}
+
+    // Sets bit i of mask if value i satisfies the predicate. Bits past
+    // count are undefined.
+
+    virtual void eval(const int *data, size_t count, Mask *mask) = 0;
+
+    virtual FilterCoverage classify(int min, int max) const { return FilterSome; }
+};
+
+class ConstPredicateNode : public PredicateNode {
+public:
+    explicit ConstPredicateNode(bool value) : value(value) {}
+
+    void eval(const int *data, size_t count, Mask *mask)
+    {
+        std::fill(mask, mask + (count + 63) / 64, value ? ~0ULL : 0);
+    }
+
+    FilterCoverage classify(int min, int max) const { return value ? FilterAll : FilterNone; }
+
+    bool value;
+};
+
+template <CmpOp op, bool bConst>
+class CompareNode : public PredicateNode {
+public:
+    CompareNode(ValueNode *l, ValueNode *r, int c) : l(l), r(r), c(c) {}
+
+    void eval(const int *data, size_t count, Mask *mask)
+    {
+        const int *a = l->eval(data, count);
+        const int *b = bConst ? 0 : r->eval(data, count);
+        compare<op, bConst>(a, b, c, count, mask);
+    }
+
+    FilterCoverage classify(int min, int max) const
+    {
+        long long lo, hi, rlo, rhi;
+
+        if (!l->bounds(min, max, &lo, &hi))
+            return FilterSome;
+        if (bConst)
+            rlo = rhi = c;
+        else if (!r->bounds(min, max, &rlo, &rhi))
+            return FilterSome;
+
+        // True for every pair of values / for none of them.
+
+        bool all, none;
+        switch (op)
+        {
+        case CmpLt: all = hi < rlo; none = lo >= rhi; break;
+        case CmpLe: all = hi <= rlo; none = lo > rhi; break;
+        case CmpGt: all = lo > rhi; none = hi <= rlo; break;
+        case CmpGe: all = lo >= rhi; none = hi < rlo; break;
+        case CmpEq: all = lo == hi && rlo == rhi && lo == rlo; none = hi < rlo || lo > rhi; break;
+        default:    all = hi < rlo || lo > rhi; none = lo == hi && rlo == rhi && lo == rlo; break;
+        }
+        return all ? FilterAll : none ? FilterNone : FilterSome;
+    }
+
+    ValueNode *l;
+    ValueNode *r;
+    int c;
+};
+
+class RangeNode : public PredicateNode {
+public:
+    RangeNode(ValueNode *v, int lo, unsigned span) : v(v), lo(lo), span(span) {}
+
+    void eval(const int *data, size_t count, Mask *mask)
+    {
+        range(v->eval(data, count), lo, span, count, mask);
+    }
+
+    FilterCoverage classify(int min, int max) const
+    {
+        long long vlo, vhi, end = (long long)lo + span;
+
+        if (!v->bounds(min, max, &vlo, &vhi))
+            return FilterSome;
+        if (vlo >= lo && vhi < end)
+            return FilterAll;
+        if (vhi < lo || vlo >= end)
+            return FilterNone;
+        return FilterSome;
+    }
+
+    ValueNode *v;
+    int lo;
+    unsigned span;
+};
+
+class AndNode : public PredicateNode {
+public:
+    AndNode(PredicateNode *l, PredicateNode *r) : l(l), r(r) {}
+
+    void eval(const int *data, size_t count, Mask *mask)
+    {
+        size_t words = (count + 63) / 64;
+        Mask any = 0;
+
+        l->eval(data, count, mask);
+        for (size_t i = 0; i < words; ++i)
+            any |= mask[i];
+
+        // Nothing selected, don't bother with the right side.
+
+        if (!any)
+            return;
+
+        r->eval(data, count, tmp);
+        for (size_t i = 0; i < words; ++i)
+            mask[i] &= tmp[i];
+    }
+
+    FilterCoverage classify(int min, int max) const
+    {
+        FilterCoverage a = l->classify(min, max);
+        FilterCoverage b = r->classify(min, max);
+        return a == FilterNone || b == FilterNone ? FilterNone : a == FilterAll && b == FilterAll ? FilterAll : FilterSome;
+    }
+
+    PredicateNode *l;
+    PredicateNode *r;
+    Mask tmp[c_maskWords];
+};
+
+class OrNode : public PredicateNode {
+public:
+    OrNode(PredicateNode *l, PredicateNode *r) : l(l), r(r) {}
+
+    void eval(const int *data, size_t count, Mask *mask)
+    {
+        size_t words = (count + 63) / 64;
+        l->eval(data, count, mask);
+        r->eval(data, count, tmp);
+        for (size_t i = 0; i < words; ++i)
+            mask[i] |= tmp[i];
+    }
+
+    FilterCoverage classify(int min, int max) const
+    {
+        FilterCoverage a = l->classify(min, max);
+        FilterCoverage b = r->classify(min, max);
+        return a == FilterAll || b == FilterAll ? FilterAll : a == FilterNone && b == FilterNone ? FilterNone : FilterSome;
+    }
+
+    PredicateNode *l;
+    PredicateNode *r;
+    Mask tmp[c_maskWords];
+};
+
+class NotNode : public PredicateNode {
+public:
+    explicit NotNode(PredicateNode *p) : p(p) {}
+
+    void eval(const int *data, size_t count, Mask *mask)
+    {
+        size_t words = (count + 63) / 64;
+        p->eval(data, count, mask);
+        for (size_t i = 0; i < words; ++i)
+            mask[i] = ~mask[i];
+    }
+
+    FilterCoverage classify(int min, int max) const
+    {
+        FilterCoverage a = p->classify(min, max);
+        return a == FilterAll ? FilterNone : a == FilterNone ? FilterAll : FilterSome;
+    }
+
+    PredicateNode *p;
+};
+
+class FilterProgram {
+public:
+    FilterProgram() : root(0) {}
+
+    ~FilterProgram()
+    {
+        for (size_t i = 0; i < values.size(); ++i)
+            delete values[i];
+        for (size_t i = 0; i < predicates.size(); ++i)
+            delete predicates[i];
+    }
+
+    ValueNode *add(ValueNode *node) { values.push_back(node); return node; }
+    PredicateNode *add(PredicateNode *node) { predicates.push_back(node); return node; }
+
+    std::vector<ValueNode *> values;
+    std::vector<PredicateNode *> predicates;
+    ColumnNode column;
+    PredicateNode *root;
+    Mask mask[c_maskWords];
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Parser.
+
+class Parser {
+public:
+    Parser(const char *text, FilterProgram *program)
+        : p(text), program(program), failed(false)
+    {
+        next();
+    }
+
+    PredicateNode *parse()
+    {
+        PredicateNode *node = orExpr();
+        if (!failed && tok != "")
+            fail("unexpected '" + tok + "'");
+        return failed ? 0 : node;
+    }
+
+    std::string error;
+
+private:
+    // Tokenizer.
+
+    void next()
+    {
+        while (*p == ' ' || *p == '\t')
+            ++p;
+
+        start = p;
+
+        if (!*p)
+        {
+            tok = "";
+            return;
+        }
+
+        if (*p >= '0' && *p <= '9')
+        {
+            while (*p >= '0' && *p <= '9')
+                ++p;
+        }
+        else if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || *p == '_')
+        {
+            while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || *p == '_' || (*p >= '0' && *p <= '9'))
+                ++p;
+        }
+        else if (!strncmp(p, "<=", 2) || !strncmp(p, ">=", 2) || !strncmp(p, "==", 2) ||
+            !strncmp(p, "!=", 2) || !strncmp(p, "&&", 2) || !strncmp(p, "||", 2))
+        {
+            p += 2;
+        }
+        else
+        {
+            ++p;
+        }
+
+        tok.assign(start, p - start);
+    }
+
+    void fail(const std::string &msg)
+    {
+        if (!failed)
+            error = msg;
+        failed = true;
+    }
+
+    bool accept(const char *t)
+    {
+        if (tok != t)
+            return false;
+        next();
+        return true;
+    }
+
+    static bool cmpOp(const std::string &t, CmpOp *op)
+    {
+        if (t == "<") *op = CmpLt;
+        else if (t == "<=") *op = CmpLe;
+        else if (t == ">") *op = CmpGt;
+        else if (t == ">=") *op = CmpGe;
+        else if (t == "==" || t == "=") *op = CmpEq;
+        else if (t == "!=") *op = CmpNe;
+        else return false;
+        return true;
+    }
+
+    // Grammar.
+
+    PredicateNode *orExpr()
+    {
+        PredicateNode *node = andExpr();
+        while (!failed && (accept("or") || accept("||")))
+            node = program->add(new OrNode(node, andExpr()));
+        return node;
+    }
+
+    PredicateNode *andExpr()
+    {
+        PredicateNode *node = notExpr();
+        while (!failed && (accept("and") || accept("&&")))
+            node = makeAnd(node, notExpr());
+        return node;
+    }
+
+    PredicateNode *notExpr()
+    {
+        if (accept("not") || accept("!"))
+            return program->add(new NotNode(notExpr()));
+
+        if (tok == "(")
+        {
+            // Either a parenthesized predicate or arithmetic that starts a
+            // comparison, e.g. "(x + 1) * 2 > 10". Try the former first.
+
+            const char *saved = start;
+            next();
+            PredicateNode *node = orExpr();
+            CmpOp op;
+
+            if (!failed && tok == ")")
+            {
+                next();
+                if (!cmpOp(tok, &op) && tok != "+" && tok != "-" && tok != "*" && tok != "/" && tok != "%")
+                    return node;
+            }
+
+            p = saved;
+            failed = false;
+            error.clear();
+            next();
+        }
+
+        return comparison();
+    }
+
+    PredicateNode *comparison()
+    {
+        ValueNode *l = additive();
+        CmpOp op;
+
+        if (failed)
+            return 0;
+
+        if (!cmpOp(tok, &op))
+        {
+            fail(tok == "" ? "expected a comparison" : "expected a comparison before '" + tok + "'");
+            return 0;
+        }
+
+        PredicateNode *node = 0;
+
+        // Chained comparisons: a < b <= c means a < b and b <= c.
+
+        while (!failed && cmpOp(tok, &op))
+        {
+            next();
+            ValueNode *r = additive();
+            if (failed)
+                return 0;
+
+            PredicateNode *cmp = makeCompare(op, l, r);
+            node = node ? makeAnd(node, cmp) : cmp;
+            l = r;
+        }
+
+        return node;
+    }
+
+    ValueNode *additive()
+    {
+        ValueNode *node = multiplicative();
+        while (!failed)
+        {
+            if (accept("+"))
+                node = makeArith(ArithAdd, node, multiplicative());
+            else if (accept("-"))
+                node = makeArith(ArithSub, node, multiplicative());
+            else
+                break;
+        }
+        return node;
+    }
+
+    ValueNode *multiplicative()
+    {
+        ValueNode *node = unary();
+        while (!failed)
+        {
+            if (accept("*"))
+                node = makeArith(ArithMul, node, unary());
+            else if (accept("/"))
+                node = makeArith(ArithDiv, node, unary());
+            else if (accept("%"))
+                node = makeArith(ArithMod, node, unary());
+            else
+                break;
+        }
+        return node;
+    }
+
+    ValueNode *unary()
+    {
+        if (accept("-"))
+            return makeArith(ArithSub, program->add(new ConstNode(0)), unary());
+
+        if (accept("("))
+        {
+            ValueNode *node = additive();
+            if (!failed && !accept(")"))
+                fail("expected ')'");
+            return node;
+        }
+
+        if (tok == "x" || tok == "value")
+        {
+            next();
+            return &program->column;
+        }
+
+        if (tok != "" && tok[0] >= '0' && tok[0] <= '9')
+        {
+            long long v = strtoll(tok.c_str(), 0, 10);
+            if (v > INT_MAX)
+            {
+                fail("constant out of range: " + tok);
+                return 0;
+            }
+            next();
+            return program->add(new ConstNode((int)v));
+        }
+
+        fail(tok == "" ? "unexpected end of expression" : "unexpected '" + tok + "'");
+        return 0;
+    }
+
+    // Node construction with constant folding and kernel selection.
+
+    ValueNode *makeArith(ArithOp op, ValueNode *l, ValueNode *r)
+    {
+        int a, b;
+
+        if (failed)
+            return 0;
+
+        if (r->isConst(&b) && b == 0 && (op == ArithDiv || op == ArithMod))
+        {
+            fail("division by zero");
+            return 0;
+        }
+
+        if (l->isConst(&a) && r->isConst(&b))
+        {
+            switch (op)
+            {
+            case ArithAdd: return program->add(new ConstNode(Arith<ArithAdd>::apply(a, b)));
+            case ArithSub: return program->add(new ConstNode(Arith<ArithSub>::apply(a, b)));
+            case ArithMul: return program->add(new ConstNode(Arith<ArithMul>::apply(a, b)));
+            case ArithDiv: return program->add(new ConstNode(Arith<ArithDiv>::apply(a, b)));
+            case ArithMod: return program->add(new ConstNode(Arith<ArithMod>::apply(a, b)));
+            }
+        }
+
+        bool c = r->isConst(&b);
+
+        switch (op)
+        {
+        case ArithAdd: return c ? program->add(new ArithNode<ArithAdd, true>(l, r, b)) : program->add(new ArithNode<ArithAdd, false>(l, r, 0));
+        case ArithSub: return c ? program->add(new ArithNode<ArithSub, true>(l, r, b)) : program->add(new ArithNode<ArithSub, false>(l, r, 0));
+        case ArithMul: return c ? program->add(new ArithNode<ArithMul, true>(l, r, b)) : program->add(new ArithNode<ArithMul, false>(l, r, 0));
+        case ArithDiv: return c ? program->add(new ArithNode<ArithDiv, true>(l, r, b)) : program->add(new ArithNode<ArithDiv, false>(l, r, 0));
+        case ArithMod: return c ? program->add(new ArithNode<ArithMod, true>(l, r, b)) : program->add(new ArithNode<ArithMod, false>(l, r, 0));
+        }
+        return 0;
+    }
+
+    static CmpOp flip(CmpOp op)
+    {
+        switch (op)
+        {
+        case CmpLt: return CmpGt;
+        case CmpLe: return CmpGe;
+        case CmpGt: return CmpLt;
+        case CmpGe: return CmpLe;
+        default: return op;
+        }
+    }
+
+    template <bool bConst>
+    PredicateNode *newCompare(CmpOp op, ValueNode *l, ValueNode *r, int c)
+    {
+        switch (op)
+        {
+        case CmpLt: return program->add(new CompareNode<CmpLt, bConst>(l, r, c));
+        case CmpLe: return program->add(new CompareNode<CmpLe, bConst>(l, r, c));
+        case CmpGt: return program->add(new CompareNode<CmpGt, bConst>(l, r, c));
+        case CmpGe: return program->add(new CompareNode<CmpGe, bConst>(l, r, c));
+        case CmpEq: return program->add(new CompareNode<CmpEq, bConst>(l, r, c));
+        case CmpNe: return program->add(new CompareNode<CmpNe, bConst>(l, r, c));
+        }
+        return 0;
+    }
+
+    PredicateNode *makeCompare(CmpOp op, ValueNode *l, ValueNode *r)
+    {
+        int a, b;
+
+        if (l->isConst(&a) && r->isConst(&b))
+        {
+            return program->add(new ConstPredicateNode(
+                op == CmpLt ? a < b : op == CmpLe ? a <= b : op == CmpGt ? a > b :
+                op == CmpGe ? a >= b : op == CmpEq ? a == b : a != b));
+        }
+
+        // Keep the constant on the right so the constant kernels apply.
+
+        if (l->isConst(&a))
+        {
+            std::swap(l, r);
+            op = flip(op);
+        }
+
+        if (r->isConst(&b))
+            return newCompare<true>(op, l, r, b);
+
+        return newCompare<false>(op, l, r, 0);
+    }
+
+    // Lower/upper bound of a comparison against a constant, normalized to
+    // lo <= v and v < hi. Returns false if it isn't one.
+
+    static bool bound(PredicateNode *node, ValueNode **v, long long *lo, long long *hi)
+    {
+        *lo = INT_MIN;
+        *hi = (long long)INT_MAX + 1;
+
+        if (CompareNode<CmpGe, true> *n = dynamic_cast<CompareNode<CmpGe, true> *>(node))
+            { *v = n->l; *lo = n->c; return true; }
+        if (CompareNode<CmpGt, true> *n = dynamic_cast<CompareNode<CmpGt, true> *>(node))
+            { *v = n->l; *lo = (long long)n->c + 1; return true; }
+        if (CompareNode<CmpLt, true> *n = dynamic_cast<CompareNode<CmpLt, true> *>(node))
+            { *v = n->l; *hi = n->c; return true; }
+        if (CompareNode<CmpLe, true> *n = dynamic_cast<CompareNode<CmpLe, true> *>(node))
+            { *v = n->l; *hi = (long long)n->c + 1; return true; }
+        return false;
+    }
+
+    PredicateNode *makeAnd(PredicateNode *l, PredicateNode *r)
+    {
+        ValueNode *v1, *v2;
+        long long lo1, hi1, lo2, hi2;
+
+        if (failed)
+            return 0;
+
+        // lo <= v and v < hi over the same value becomes a single range check.
+
+        if (bound(l, &v1, &lo1, &hi1) && bound(r, &v2, &lo2, &hi2) && v1 == v2)
+        {
+            long long lo = std::max(lo1, lo2);
+            long long hi = std::min(hi1, hi2);
+
+            if (lo >= hi)
+                return program->add(new ConstPredicateNode(false));
+
+            if (hi - lo <= (long long)UINT_MAX)
+                return program->add(new RangeNode(v1, (int)lo, (unsigned)(hi - lo)));
+        }
+
+        return program->add(new AndNode(l, r));
+    }
+
+    const char *p;
+    const char *start;
+    std::string tok;
+    FilterProgram *program;
+    bool failed;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Filter.
+
+Filter::Filter(const char *text, FilterProgram *program)
+    : m_text(text)
+    , m_program(program)
+{
+}
+
+Filter::~Filter()
+{
+    delete m_program;
+}
+
+Filter *Filter::compile(const char *text, std::string *error)
+{
+    FilterProgram *program = new FilterProgram;
+    Parser parser(text, program);
+
+    if (!(program->root = parser.parse()))
+    {
+        if (error)
+            *error = parser.error;
+        delete program;
+        return 0;
+    }
+
+    return new Filter(text, program);
+}
+
+FilterCoverage Filter::classify(int min, int max) const
+{
+    return m_program->root->classify(min, max);
+}
+
+size_t Filter::select(const int *data, size_t count, int *out) const
+{
+    Mask *mask = m_program->mask;
+    size_t words = (count + 63) / 64;
+    size_t n = 0;
+
+    m_program->root->eval(data, count, mask);
+
+    if (count % 64)
+        mask[words - 1] &= (1ULL << (count % 64)) - 1;
+
+    for (size_t w = 0; w < words; ++w)
+    {
+        Mask m = mask[w];
+        const int *p = data + w * 64;
+
+        if (m == ~0ULL)
+        {
+            memcpy(out + n, p, 64 * sizeof(int));
+            n += 64;
+            continue;
+        }
+
+        while (m)
+        {
+            out[n++] = p[__builtin_ctzll(m)];
+            m &= m - 1;
+        }
+    }
+
+    return n;
+}
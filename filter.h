@@ -0,0 +1,64 @@
+/*
+ * File:   filter.h
+ * Author: taozou
+ *
+ * Predicates over scanned values, compiled once at startup into a tree of
+ * block-at-a-time kernels.
+ */
+
+#ifndef FILTER_H
+#define	FILTER_H
+
+#include <cstddef>
+#include <string>
+
+// Filters work on blocks of at most FilterBlock values; QuerySet::scan
+// hands them blocks of exactly this size.
+
+#define FilterBlock 4096
+
+class FilterProgram;
+
+// What a filter selects from a block, given only the block's min and max.
+
+enum FilterCoverage { FilterNone, FilterSome, FilterAll };
+
+// Expression language (the scanned value is 'x'):
+//
+//   x >= 10 and x < 100
+//   10 <= x < 100                 (chained comparisons are ranges)
+//   x % 7 == 3 or not (x * 2 + 1 > 500)
+//
+// Operators: + - * / %, < <= > >= == !=, and or not (also && || !), parens.
+
+class Filter {
+public:
+    ~Filter();
+
+    // Returns NULL and fills error if the text doesn't parse.
+
+    static Filter *compile(const char *text, std::string *error);
+
+    // Writes the values of data[0..count) that satisfy the predicate to
+    // out, returns how many were written. count <= FilterBlock.
+
+    size_t select(const int *data, size_t count, int *out) const;
+
+    // Zone maps: tells from the bounds of a block whether select() would
+    // return none, some or all of its values (FilterSome if unsure).
+
+    FilterCoverage classify(int min, int max) const;
+
+    const std::string &text() const { return m_text; }
+
+private:
+    Filter(const char *text, FilterProgram *program);
+    Filter(const Filter &);
+    Filter &operator=(const Filter &);
+
+    std::string m_text;
+    FilterProgram *m_program;
+};
+
+#endif	/* FILTER_H */
+
@@ -0,0 +1,211 @@
+/*
+ * File:   packed.cpp
+ * Author: taozou
+ *
+ * Packed objects.
+ */
+
+#include "packed.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static unsigned bitsFor(UInt32 range)
+{
+    return range ? 32 - __builtin_clz(range) : 0;
+}
+
+// Packs 128 values of 'bits' bits each: value 4 * j + lane goes to bits
+// [j * bits, (j + 1) * bits) of the lane, lane words are interleaved.
+
+static void packGroup(const UInt32 *u, unsigned bits, UInt32 *w)
+{
+    memset(w, 0, 4 * bits * sizeof(UInt32));
+
+    for (unsigned j = 0; j < 32; ++j)
+    {
+        unsigned pos = j * bits;
+        unsigned word = pos / 32;
+        unsigned shift = pos % 32;
+
+        for (unsigned lane = 0; lane < 4; ++lane)
+        {
+            UInt32 v = u[4 * j + lane];
+            w[4 * word + lane] |= v << shift;
+            if (shift + bits > 32)
+                w[4 * (word + 1) + lane] |= v >> (32 - shift);
+        }
+    }
+}
+
+// Unpacks 128 values and adds reference to each.
+
+static void unpackGroup(const char *w, unsigned bits, int reference, int *out)
+{
+    if (!bits)
+    {
+        std::fill(out, out + PackedGroupValues, reference);
+        return;
+    }
+
+#ifdef __SSE2__
+    __m128i mask = _mm_set1_epi32(bits == 32 ? -1 : (int)((1u << bits) - 1));
+    __m128i ref = _mm_set1_epi32(reference);
+
+    for (unsigned j = 0; j < 32; ++j)
+    {
+        unsigned pos = j * bits;
+        unsigned word = pos / 32;
+        unsigned shift = pos % 32;
+        __m128i v = _mm_srl_epi32(_mm_loadu_si128((const __m128i *)(w + 16 * word)), _mm_cvtsi32_si128(shift));
+
+        if (shift + bits > 32)
+        {
+            __m128i hi = _mm_loadu_si128((const __m128i *)(w + 16 * (word + 1)));
+            v = _mm_or_si128(v, _mm_sll_epi32(hi, _mm_cvtsi32_si128(32 - shift)));
+        }
+
+        _mm_storeu_si128((__m128i *)(out + 4 * j), _mm_add_epi32(_mm_and_si128(v, mask), ref));
+    }
+#else
+    UInt32 mask = bits == 32 ? ~0u : (1u << bits) - 1;
+    UInt32 words[4 * 32];
+
+    memcpy(words, w, 4 * bits * sizeof(UInt32));
+
+    for (unsigned j = 0; j < 32; ++j)
+    {
+        unsigned pos = j * bits;
+        unsigned word = pos / 32;
+        unsigned shift = pos % 32;
+
+        for (unsigned lane = 0; lane < 4; ++lane)
+        {
+            UInt32 v = words[4 * word + lane] >> shift;
+            if (shift + bits > 32)
+                v |= words[4 * (word + 1) + lane] << (32 - shift);
+            out[4 * j + lane] = (int)((v & mask) + (UInt32)reference);
+        }
+    }
+#endif
+}
+
+bool isPacked(const void *data, size_t size)
+{
+    PackedHeader header;
+
+    if (size < sizeof(header))
+        return false;
+
+    memcpy(&header, data, sizeof(header));
+    return header.magic == PackedMagic && header.version == PackedVersion;
+}
+
+// Encodes one block, plain or delta, whichever is smaller.
+
+static void packBlock(const int *v, size_t count, bool delta, std::vector<char> *object)
+{
+    PackedBlockHeader h;
+    UInt32 u[PackedBlockValues] = {};
+    int d[PackedBlockValues];
+
+    h.min = *std::min_element(v, v + count);
+    h.max = *std::max_element(v, v + count);
+    h.reference = h.min;
+    h.first = 0;
+    h.count = count;
+    h.bits = bitsFor((UInt32)h.max - (UInt32)h.min);
+    h.flags = 0;
+    h.reserved = 0;
+
+    if (delta && count > 1)
+    {
+        d[0] = 0;
+        for (size_t i = 1; i < count; ++i)
+            d[i] = (int)((UInt32)v[i] - (UInt32)v[i - 1]);
+
+        int lo = *std::min_element(d, d + count);
+        int hi = *std::max_element(d, d + count);
+        unsigned bits = bitsFor((UInt32)hi - (UInt32)lo);
+
+        if (bits < h.bits)
+        {
+            h.reference = lo;
+            h.first = v[0];
+            h.bits = bits;
+            h.flags = PackedDelta;
+            v = d;
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+        u[i] = (UInt32)v[i] - (UInt32)h.reference;
+
+    size_t at = object->size();
+    object->resize(at + sizeof(h) + packedWords(h) * sizeof(UInt32));
+    memcpy(&(*object)[at], &h, sizeof(h));
+
+    UInt32 *w = (UInt32 *) &(*object)[at + sizeof(h)];
+    for (size_t g = 0; g < count; g += PackedGroupValues)
+        packGroup(u + g, h.bits, w + g / PackedGroupValues * 4 * h.bits);
+}
+
+void packValues(const int *values, size_t count, bool delta, std::vector<char> *object)
+{
+    PackedHeader header = { PackedMagic, PackedVersion, count };
+
+    object->resize(sizeof(header));
+    memcpy(&(*object)[0], &header, sizeof(header));
+
+    for (size_t off = 0; off < count; off += PackedBlockValues)
+        packBlock(values + off, std::min((size_t)PackedBlockValues, count - off), delta, object);
+}
+
+bool PackedReader::init(const void *data, size_t size)
+{
+    if (!isPacked(data, size))
+        return false;
+
+    p = static_cast<const char *>(data) + sizeof(PackedHeader);
+    end = static_cast<const char *>(data) + size;
+    return true;
+}
+
+bool PackedReader::next(const PackedBlockHeader **header, const void **words)
+{
+    if (end - p < (ptrdiff_t)sizeof(PackedBlockHeader))
+        return false;
+
+    const PackedBlockHeader *h = (const PackedBlockHeader *) p;
+
+    if (h->count > PackedBlockValues || h->bits > 32 ||
+        (size_t)(end - p) < sizeof(*h) + packedWords(*h) * sizeof(UInt32))
+        return false;
+
+    *header = h;
+    *words = p + sizeof(*h);
+    p += sizeof(*h) + packedWords(*h) * sizeof(UInt32);
+    return true;
+}
+
+void unpackBlock(const PackedBlockHeader &header, const void *words, int *out)
+{
+    const char *w = static_cast<const char *>(words);
+
+    for (size_t g = 0; g < header.count; g += PackedGroupValues)
+        unpackGroup(w + g / PackedGroupValues * 16 * header.bits, header.bits, header.reference, out + g);
+
+    if (header.flags & PackedDelta)
+    {
+        UInt32 v = (UInt32)header.first;
+
+        for (size_t i = 0; i < header.count; ++i)
+        {
+            v += (UInt32)out[i];
+            out[i] = (int)v;
+        }
+    }
+}
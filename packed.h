@@ -0,0 +1,96 @@
+/*
+ * File:   packed.h
+ * Author: taozou
+ *
+ * Packed objects: int values in blocks of frame-of-reference + bit-packed
+ * (optionally delta) encoding. Values that fit in 12-20 bits take 12-20
+ * bits on the wire and in memory instead of 32.
+ *
+ * Layout, little endian:
+ *
+ *   PackedHeader, then blocks of PackedBlockHeader + words
+ *
+ * A block holds up to PackedBlockValues values. They are stored as
+ * value - reference (or, with PackedDelta, as the difference to the
+ * previous value minus reference) in 'bits' bits each, in groups of 128
+ * values laid out vertically over 4 lanes: value i goes to lane i % 4, so
+ * SSE2 decodes four values per instruction. The header keeps the min and
+ * max of the block, which lets a scan skip blocks that can't change its
+ * result without decoding them.
+ */
+
+#ifndef PACKED_H
+#define	PACKED_H
+
+#include "sysutils.h"
+#include <cstddef>
+#include <vector>
+
+using webstor::internal::UInt32;
+using webstor::internal::UInt64;
+
+#define PackedMagic 0x4b415053      // "SPAK"
+#define PackedVersion 1
+#define PackedBlockValues 4096
+#define PackedGroupValues 128
+
+// PackedBlockHeader::flags
+
+#define PackedDelta 1
+
+struct PackedHeader
+{
+    UInt32 magic;
+    UInt32 version;
+    UInt64 valueCount;
+};
+
+struct PackedBlockHeader
+{
+    int min;                // zone map
+    int max;
+    int reference;          // frame of reference
+    int first;              // PackedDelta: the value before the first one
+    UInt32 count;           // values in the block
+    unsigned char bits;     // per value, 0..32
+    unsigned char flags;
+    unsigned short reserved;
+};
+
+// Number of 32-bit words after the header of a block.
+
+inline size_t packedWords(const PackedBlockHeader &h)
+{
+    return (h.count + PackedGroupValues - 1) / PackedGroupValues * 4 * h.bits;
+}
+
+// Tells whether data is a packed object.
+
+bool isPacked(const void *data, size_t size);
+
+// Encodes count values as a packed object.
+
+void packValues(const int *values, size_t count, bool delta, std::vector<char> *object);
+
+// Iterates over the blocks of a packed object.
+
+class PackedReader {
+public:
+    // Returns false if data isn't a well-formed packed object.
+
+    bool init(const void *data, size_t size);
+
+    // Returns false at the end. The words may be unaligned.
+
+    bool next(const PackedBlockHeader **header, const void **words);
+
+private:
+    const char *p;
+    const char *end;
+};
+
+// Decodes a block into out[0..header.count), out holds PackedBlockValues.
+
+void unpackBlock(const PackedBlockHeader &header, const void *words, int *out);
+
+#endif	/* PACKED_H */
@@ -0,0 +1,424 @@
+/*
+ * File:   query.cpp
+ * Author: taozou
+ *
+ * Scan operators and query sets.
+ */
+
+#include "query.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <functional>
+
+// Values per block in QuerySet::scan, 16KB stays in L1/L2 while all
+// filters and operators go over it.
+
+static const size_t c_blockInts = FilterBlock;
+
+//////////////////////////////////////////////////////////////////////////////
+// TopKOperator
+
+TopKOperator::TopKOperator(int k)
+    : heap(k > 0 ? k : 1, INT_MIN)
+{
+}
+
+inline void TopKOperator::push(int value)
+{
+    std::pop_heap(heap.begin(), heap.end(), std::greater<int>());
+    heap.back() = value;
+    std::push_heap(heap.begin(), heap.end(), std::greater<int>());
+}
+
+void TopKOperator::consume(const int *data, size_t count)
+{
+    int threshold = heap[0];
+
+    for (size_t i = 0; i < count; ++i)
+        if (data[i] > threshold)
+        {
+            push(data[i]);
+            threshold = heap[0];
+        }
+}
+
+void TopKOperator::reset()
+{
+    std::fill(heap.begin(), heap.end(), INT_MIN);
+}
+
+void TopKOperator::save(void *state) const
+{
+    memcpy(state, &heap[0], stateSize());
+}
+
+void TopKOperator::merge(const void *state)
+{
+    consume(static_cast<const int *>(state), heap.size());
+}
+
+void TopKOperator::print(FILE *f) const
+{
+    std::vector<int> sorted(heap);
+    std::sort(sorted.begin(), sorted.end(), std::greater<int>());
+
+    for (size_t i = 0; i < sorted.size() && sorted[i] != INT_MIN; ++i)
+        fprintf(f, "%d ", sorted[i]);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// AggregateOperator
+
+AggregateOperator::AggregateOperator(Kind kind)
+    : kind(kind)
+{
+    reset();
+}
+
+void AggregateOperator::consume(const int *data, size_t count)
+{
+    switch (kind)
+    {
+    case Count:
+        value += count;
+        break;
+    case Sum:
+        for (size_t i = 0; i < count; ++i)
+            value += data[i];
+        break;
+    case Min:
+        for (size_t i = 0; i < count; ++i)
+            if (data[i] < value)
+                value = data[i];
+        break;
+    case Max:
+        for (size_t i = 0; i < count; ++i)
+            if (data[i] > value)
+                value = data[i];
+        break;
+    }
+}
+
+void AggregateOperator::reset()
+{
+    value = kind == Min ? LLONG_MAX : kind == Max ? LLONG_MIN : 0;
+}
+
+void AggregateOperator::save(void *state) const
+{
+    memcpy(state, &value, sizeof(value));
+}
+
+void AggregateOperator::merge(const void *state)
+{
+    long long other;
+    memcpy(&other, state, sizeof(other));
+
+    switch (kind)
+    {
+    case Count:
+    case Sum:
+        value += other;
+        break;
+    case Min:
+        value = std::min(value, other);
+        break;
+    case Max:
+        value = std::max(value, other);
+        break;
+    }
+}
+
+bool AggregateOperator::wants(int min, int max) const
+{
+    return kind == Min ? min < value : kind == Max ? max > value : true;
+}
+
+void AggregateOperator::print(FILE *f) const
+{
+    if ((kind == Min && value == LLONG_MAX) || (kind == Max && value == LLONG_MIN))
+        return;
+    fprintf(f, "%lld", value);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// PluginOperator
+
+PluginOperator::PluginOperator(void *handle, const smart_plugin *plugin, void *self)
+    : handle(handle)
+    , plugin(plugin)
+    , self(self)
+    , size(plugin->state_size(self))
+{
+}
+
+PluginOperator::~PluginOperator()
+{
+    plugin->destroy(self);
+    dlclose(handle);
+}
+
+PluginOperator *PluginOperator::load(const char *path, const char *args)
+{
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+
+    if (!handle)
+    {
+        fprintf(stderr, "cannot load plugin: %s\n", dlerror());
+        return NULL;
+    }
+
+    smart_plugin_entry_fn entry = (smart_plugin_entry_fn) dlsym(handle, SMART_PLUGIN_ENTRY);
+    const smart_plugin *plugin = entry ? entry() : NULL;
+    void *self = NULL;
+
+    if (!plugin)
+        fprintf(stderr, "%s: no %s\n", path, SMART_PLUGIN_ENTRY);
+    else if (plugin->abi_version != SMART_PLUGIN_ABI_VERSION)
+        fprintf(stderr, "%s: plugin ABI version %d, expected %d\n", path,
+                plugin->abi_version, SMART_PLUGIN_ABI_VERSION);
+    else if (!plugin->create || !plugin->destroy || !plugin->reset || !plugin->state_size ||
+             !plugin->consume || !plugin->save || !plugin->merge || !plugin->print)
+        fprintf(stderr, "%s: incomplete plugin\n", path);
+    else if (!(self = plugin->create(args)))
+        fprintf(stderr, "%s: invalid arguments '%s'\n", path, args);
+
+    if (!self)
+    {
+        dlclose(handle);
+        return NULL;
+    }
+
+    return new PluginOperator(handle, plugin, self);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// QuerySet
+
+QuerySet::QuerySet()
+{
+}
+
+QuerySet::~QuerySet()
+{
+    for (size_t i = 0; i < operators.size(); ++i)
+        delete operators[i];
+    for (size_t i = 0; i < filters.size(); ++i)
+        delete filters[i];
+}
+
+int QuerySet::addFilter(const std::string &text)
+{
+    for (size_t i = 0; i < filters.size(); ++i)
+        if (filters[i]->text() == text)
+            return i;
+
+    std::string error;
+    Filter *f = Filter::compile(text.c_str(), &error);
+
+    if (!f)
+    {
+        fprintf(stderr, "bad filter '%s': %s\n", text.c_str(), error.c_str());
+        return -1;
+    }
+
+    filters.push_back(f);
+    selected.push_back(std::vector<int>(c_blockInts));
+    selectedCount.push_back(0);
+    coverage.push_back(FilterSome);
+    return filters.size() - 1;
+}
+
+bool QuerySet::parse(const char *spec, const char *defaultFilter)
+{
+    std::string s(spec);
+    size_t pos = 0;
+
+    while (pos <= s.size())
+    {
+        // Commas inside a filter don't separate queries.
+
+        size_t end = pos;
+        int depth = 0;
+        for (; end < s.size() && (depth || s[end] != ','); ++end)
+            depth += s[end] == '[' ? 1 : s[end] == ']' ? -1 : 0;
+
+        std::string name = s.substr(pos, end - pos);
+        std::string filter = defaultFilter ? defaultFilter : "";
+        size_t bracket = name.find('[');
+
+        if (bracket != std::string::npos)
+        {
+            if (name[name.size() - 1] != ']')
+            {
+                fprintf(stderr, "unterminated filter in '%s'\n", name.c_str());
+                return false;
+            }
+            filter = name.substr(bracket + 1, name.size() - bracket - 2);
+        }
+
+        std::string op = name.substr(0, std::min(name.find(':'), bracket));
+        std::string argText = name.find(':') < bracket ?
+            name.substr(name.find(':') + 1, std::min(bracket, name.size()) - name.find(':') - 1) : "";
+        int arg = atoi(argText.c_str());
+        ScanOperator *o = NULL;
+        int f = -1;
+
+        if (!filter.empty() && (f = addFilter(filter)) < 0)
+            return false;
+
+        if (op == "topk")
+            o = new TopKOperator(arg > 0 ? arg : 10);
+        else if (op == "count")
+            o = new AggregateOperator(AggregateOperator::Count);
+        else if (op == "sum")
+            o = new AggregateOperator(AggregateOperator::Sum);
+        else if (op == "min")
+            o = new AggregateOperator(AggregateOperator::Min);
+        else if (op == "max")
+            o = new AggregateOperator(AggregateOperator::Max);
+        else if (op == "plugin")
+        {
+            size_t colon = argText.find(':');
+            std::string path = argText.substr(0, colon);
+            std::string args = colon != std::string::npos ? argText.substr(colon + 1) : "";
+
+            if (!(o = PluginOperator::load(path.c_str(), args.c_str())))
+                return false;
+        }
+        else
+        {
+            fprintf(stderr, "unknown query '%s'\n", name.c_str());
+            return false;
+        }
+
+        o->name = bracket == std::string::npos && f >= 0 ? name + "[" + filter + "]" : name;
+        operators.push_back(o);
+        filterOf.push_back(f);
+        active.push_back(true);
+        pos = end + 1;
+    }
+
+    return !operators.empty();
+}
+
+void QuerySet::scan(const int *data, size_t count)
+{
+    for (size_t off = 0; off < count; off += c_blockInts)
+    {
+        size_t n = std::min(c_blockInts, count - off);
+        for (size_t i = 0; i < filters.size(); ++i)
+            selectedCount[i] = filters[i]->select(data + off, n, &selected[i][0]);
+
+        for (size_t i = 0; i < operators.size(); ++i)
+        {
+            int f = filterOf[i];
+
+            if (f < 0)
+                operators[i]->consume(data + off, n);
+            else if (selectedCount[f])
+                operators[i]->consume(&selected[f][0], selectedCount[f]);
+        }
+    }
+}
+
+bool QuerySet::needs(int min, int max)
+{
+    bool any = false;
+
+    for (size_t i = 0; i < filters.size(); ++i)
+        coverage[i] = filters[i]->classify(min, max);
+
+    for (size_t i = 0; i < operators.size(); ++i)
+    {
+        int f = filterOf[i];
+        active[i] = (f < 0 || coverage[f] != FilterNone) && operators[i]->wants(min, max);
+        any = any || active[i];
+    }
+
+    return any;
+}
+
+void QuerySet::scanBlock(const int *data, size_t count)
+{
+    for (size_t i = 0; i < filters.size(); ++i)
+        if (coverage[i] == FilterSome)
+            selectedCount[i] = filters[i]->select(data, count, &selected[i][0]);
+
+    for (size_t i = 0; i < operators.size(); ++i)
+    {
+        int f = filterOf[i];
+
+        if (!active[i])
+            continue;
+
+        if (f < 0 || coverage[f] == FilterAll)
+            operators[i]->consume(data, count);
+        else if (selectedCount[f])
+            operators[i]->consume(&selected[f][0], selectedCount[f]);
+    }
+}
+
+void QuerySet::reset()
+{
+    for (size_t i = 0; i < operators.size(); ++i)
+        operators[i]->reset();
+}
+
+size_t QuerySet::sortedTail() const
+{
+    size_t tail = 0;
+
+    // A filter may reject the last values, whatever it is.
+
+    for (size_t i = 0; i < operators.size(); ++i)
+    {
+        size_t n = operators[i]->sortedTail();
+        if (!n || filterOf[i] >= 0)
+            return 0;
+        tail = std::max(tail, n);
+    }
+    return tail;
+}
+
+size_t QuerySet::stateSize() const
+{
+    size_t size = 0;
+    for (size_t i = 0; i < operators.size(); ++i)
+        size += operators[i]->stateSize();
+    return size;
+}
+
+void QuerySet::save(void *state) const
+{
+    char *p = static_cast<char *>(state);
+    for (size_t i = 0; i < operators.size(); ++i)
+    {
+        operators[i]->save(p);
+        p += operators[i]->stateSize();
+    }
+}
+
+void QuerySet::merge(const void *state)
+{
+    const char *p = static_cast<const char *>(state);
+    for (size_t i = 0; i < operators.size(); ++i)
+    {
+        operators[i]->merge(p);
+        p += operators[i]->stateSize();
+    }
+}
+
+void QuerySet::print(FILE *f) const
+{
+    for (size_t i = 0; i < operators.size(); ++i)
+    {
+        if (operators.size() > 1)
+            fprintf(f, "%s: ", operators[i]->name.c_str());
+        operators[i]->print(f);
+        fprintf(f, "\n");
+    }
+}
@@ -0,0 +1,173 @@
+/*
+ * File:   query.h
+ * Author: taozou
+ *
+ * Scan operators and query sets: several queries share one pass over
+ * every downloaded buffer.
+ */
+
+#ifndef QUERY_H
+#define	QUERY_H
+
+#include "filter.h"
+#include "smart_plugin.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// A scan operator consumes values and keeps a fixed-size state that can be
+// serialized and merged with the state of the same operator on another rank.
+
+class ScanOperator {
+public:
+    virtual ~ScanOperator() {}
+
+    virtual void consume(const int *data, size_t count) = 0;
+
+    virtual void reset() = 0;
+    virtual size_t stateSize() const = 0;
+    virtual void save(void *state) const = 0;
+    virtual void merge(const void *state) = 0;
+
+    virtual void print(FILE *f) const = 0;
+
+    // Zone maps: false if no values within [min, max] can change the state.
+
+    virtual bool wants(int min, int max) const { return true; }
+
+    // Sorted objects: the number of largest values of an object that
+    // decide the state, 0 if any value may.
+
+    virtual size_t sortedTail() const { return 0; }
+
+    std::string name;
+};
+
+class TopKOperator : public ScanOperator {
+public:
+    explicit TopKOperator(int k);
+
+    void consume(const int *data, size_t count);
+    void reset();
+    size_t stateSize() const { return heap.size() * sizeof(int); }
+    void save(void *state) const;
+    void merge(const void *state);
+    void print(FILE *f) const;
+    bool wants(int min, int max) const { return max > heap[0]; }
+    size_t sortedTail() const { return heap.size(); }
+
+private:
+    inline void push(int value);
+
+    // Min-heap of the k largest values, heap[0] is the admission threshold.
+
+    std::vector<int> heap;
+};
+
+class AggregateOperator : public ScanOperator {
+public:
+    enum Kind { Count, Sum, Min, Max };
+
+    explicit AggregateOperator(Kind kind);
+
+    void consume(const int *data, size_t count);
+    void reset();
+    size_t stateSize() const { return sizeof(long long); }
+    void save(void *state) const;
+    void merge(const void *state);
+    void print(FILE *f) const;
+    bool wants(int min, int max) const;
+    size_t sortedTail() const { return kind == Max; }
+
+private:
+    Kind kind;
+    long long value;
+};
+
+// An operator implemented by a shared library, see smart_plugin.h.
+
+class PluginOperator : public ScanOperator {
+public:
+    ~PluginOperator();
+
+    // Returns NULL and reports to stderr if the library can't be used.
+
+    static PluginOperator *load(const char *path, const char *args);
+
+    void consume(const int *data, size_t count) { plugin->consume(self, data, count); }
+    void reset() { plugin->reset(self); }
+    size_t stateSize() const { return size; }
+    void save(void *state) const { plugin->save(self, state); }
+    void merge(const void *state) { plugin->merge(self, state); }
+    void print(FILE *f) const { plugin->print(self, f); }
+
+private:
+    PluginOperator(void *handle, const smart_plugin *plugin, void *self);
+    PluginOperator(const PluginOperator &);
+    PluginOperator &operator=(const PluginOperator &);
+
+    void *handle;               // dlopen handle
+    const smart_plugin *plugin;
+    void *self;                 // plugin instance
+    size_t size;
+};
+
+// A list of queries evaluated together. Every rank parses the same spec, so
+// all of them agree on the operators and on the layout of the state.
+
+class QuerySet {
+public:
+    QuerySet();
+    ~QuerySet();
+
+    // Spec is a comma separated list: "topk:10,count,sum,min,max". A query
+    // may carry its own filter in brackets, "count[x % 2 == 0]"; the others
+    // get defaultFilter, if any. "plugin:path.so[:args]" loads an operator
+    // from a shared library.
+
+    bool parse(const char *spec, const char *defaultFilter = NULL);
+
+    // Feeds the buffer through all operators, block by block, so that a
+    // block is still in cache when the next operator reads it. Each distinct
+    // filter is evaluated once per block and its selection is shared by the
+    // operators that use it.
+
+    void scan(const int *data, size_t count);
+
+    // Zone maps: needs() tells whether any operator needs the values of a
+    // block known to be within [min, max]; if so, the caller decodes the
+    // block and passes it to scanBlock(), which skips the operators and
+    // filters that the bounds already decided. count <= FilterBlock.
+
+    bool needs(int min, int max);
+    void scanBlock(const int *data, size_t count);
+
+    // Number of last values of an object sorted ascending that answer all
+    // queries, 0 if some query needs the whole object.
+
+    size_t sortedTail() const;
+
+    void reset();
+    size_t stateSize() const;
+    void save(void *state) const;
+    void merge(const void *state);
+    void print(FILE *f) const;
+
+    std::vector<ScanOperator *> operators;
+
+private:
+    int addFilter(const std::string &text);
+
+    std::vector<Filter *> filters;
+    std::vector<int> filterOf;                  // per operator, -1 if none
+    std::vector<std::vector<int> > selected;    // per filter, current block
+    std::vector<size_t> selectedCount;
+    std::vector<FilterCoverage> coverage;       // per filter, set by needs()
+    std::vector<char> active;                   // per operator, set by needs()
+
+    QuerySet(const QuerySet &);
+    QuerySet &operator=(const QuerySet &);
+};
+
+#endif	/* QUERY_H */
+
@@ -0,0 +1,34 @@
+/*
+ * File:   report.cpp
+ * Author: taozou
+ *
+ * Messages exchanged between selectors, aggregators and rank 0.
+ */
+
+#include "report.h"
+#include <cstring>
+
+volatile sig_atomic_t stopSignaled = 0;
+
+static void onStopSignal(int)
+{
+    stopSignaled = 1;
+}
+
+void installStopHandler()
+{
+    // mpirun forwards SIGUSR1 to every rank, so all of them must survive it.
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onStopSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, 0);
+}
+
+void initReport(Report *report, int total)
+{
+    report->done = 0;
+    report->total = total;
+    report->matchesSent = 0;
+}
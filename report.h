@@ -0,0 +1,57 @@
+/*
+ * File:   report.h
+ * Author: taozou
+ *
+ * Messages exchanged between selectors, aggregators and rank 0.
+ */
+
+#ifndef REPORT_H
+#define	REPORT_H
+
+#include <signal.h>
+
+// MPI tags. Final reports keep tag 0 so the last message of a scan looks
+// exactly like the single result message selectors used to send.
+
+enum ReportTag
+{
+    TagFinal = 0,       // last report from a selector/aggregator
+    TagPartial = 1,     // running report, superseded by the next one from the same rank
+    TagStop = 2,        // rank 0 -> selector: stop scanning (sent exactly once per selector)
+    TagMatch = 3        // selector -> rank 0: values satisfying the stop predicate
+};
+
+// A report is cumulative: it carries everything its sender has seen so far,
+// so a receiver keeps only the latest report of every source.
+// On the wire the header is followed by QuerySet::stateSize() bytes of
+// query state.
+
+struct Report
+{
+    int done;       // objects scanned
+    int total;      // objects to scan
+    int matchesSent; // TagMatch messages sent to rank 0
+};
+
+// Early termination: "find values above threshold", stop once limit values
+// have been found anywhere.
+
+#define MaxMatches 64
+
+struct Matches
+{
+    int count;
+    int values[MaxMatches];
+    int ids[MaxMatches];    // object ids the values were found in
+};
+
+void initReport(Report *report, int total);
+
+// Set by SIGUSR1: the user asked to stop the scan and report what we have.
+
+extern volatile sig_atomic_t stopSignaled;
+
+void installStopHandler();
+
+#endif	/* REPORT_H */
+
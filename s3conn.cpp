@@ -32,6 +32,7 @@
 #include <openssl/ssl.h>
 
 #include <algorithm>
+#include <cctype>
 #include <memory>
 #include <sstream>
 
@@ -386,6 +387,11 @@ static const char s_aclHeaderValue[] = "public-read";
 static const char s_encryptHeaderKey[] = "x-amz-server-side-encryption";
 static const char s_encryptHeaderValue[] = "AES256";
 
+static const char s_copySourceHeaderKey[] = "x-amz-copy-source";
+static const char s_copyRangeHeaderKey[] = "x-amz-copy-source-range";
+
+static const char s_metadataHeaderPrefix[] = "x-amz-meta-";
+
 static inline void
 appendSigHeader( const char *key, const char *value, std::string *ptoSign )
 {
@@ -406,6 +412,7 @@ appendSigHeader( const char *key, const char *value, std::string *ptoSign )
 static void
 calcSignature( const std::string &accKey, const std::string &secKey,
     const char *contentMd5, const char *contentType, const char *date, bool makePublic, bool srvEncrypt,
+    const char *copySource, const char *copyRange, const S3Metadata *metadata,
     const char *action, const char *bucketName, const char *key, bool isWalrus, 
     std::string *signature )
 {
@@ -425,9 +432,29 @@ calcSignature( const std::string &accKey, const std::string &secKey,
     appendSigHeader( 0, contentType, &toSign );
     appendSigHeader( 0, date, &toSign );
 
+    // x-amz-* headers go in lexicographical order.
+
     if( makePublic )
         appendSigHeader( s_aclHeaderKey, s_aclHeaderValue, &toSign );
 
+    if( copySource )
+        appendSigHeader( s_copySourceHeaderKey, copySource, &toSign );
+
+    if( copyRange )
+        appendSigHeader( s_copyRangeHeaderKey, copyRange, &toSign );
+
+    // Metadata names are lowercase and the map keeps them sorted.
+
+    if( metadata )
+    {
+        for( S3Metadata::const_iterator it = metadata->begin(); it != metadata->end(); ++it )
+        {
+            std::string header( s_metadataHeaderPrefix );
+            header.append( it->first );
+            appendSigHeader( header.c_str(), it->second.c_str(), &toSign );
+        }
+    }
+
     if( srvEncrypt )
         appendSigHeader( s_encryptHeaderKey, s_encryptHeaderValue, &toSign );
 
@@ -509,7 +536,8 @@ static void
 setRequestHeaders( const std::string &accKey, const std::string &secKey,
     const char *contentMd5, const char *contentType, bool makePublic, bool srvEncrypt,
     const char *action, const char *bucketName, const char *key, bool isWalrus, 
-    ScopedCurlList *plist, size_t low, size_t high )
+    ScopedCurlList *plist, const char *range, const char *copySource, const char *copyRange,
+    const S3Metadata *metadata )
 {
     dbgAssert( plist );
 
@@ -540,7 +568,7 @@ setRequestHeaders( const std::string &accKey, const std::string &secKey,
 
     calcSignature( accKey, secKey,
         contentMd5, contentType, date, makePublic, srvEncrypt,
-        action, bucketName, key, isWalrus,
+        copySource, copyRange, metadata, action, bucketName, key, isWalrus,
         &signature );
 
     // Set request headers.
@@ -581,16 +609,22 @@ setRequestHeaders( const std::string &accKey, const std::string &secKey,
     if( srvEncrypt )
         appendRequestHeader( s_encryptHeaderKey, s_encryptHeaderValue, plist );
 
-    appendRequestHeader( "Accept", "", plist );
-    
-    if (low <= high)
+    appendRequestHeader( s_copySourceHeaderKey, copySource, plist );
+    appendRequestHeader( s_copyRangeHeaderKey, copyRange, plist );
+
+    if( metadata )
     {
-        std::ostringstream r;
-        r << "bytes=";
-        r << low << "-" << high - 1;
-        appendRequestHeader( "Range", r.str().c_str(), plist);
-    }    
-    
+        for( S3Metadata::const_iterator it = metadata->begin(); it != metadata->end(); ++it )
+        {
+            std::string header( s_metadataHeaderPrefix );
+            header.append( it->first );
+            appendRequestHeader( header.c_str(), it->second.c_str(), plist );
+        }
+    }
+
+    appendRequestHeader( "Accept", "", plist );
+    appendRequestHeader( "Range", range, plist );
+
     appendRequestHeader( "Authorization", signature.c_str(), plist );
     appendRequestHeader( "Connection", "Keep-Alive", plist );
     appendRequestHeader( "Expect", "", plist );
@@ -714,9 +748,12 @@ struct S3ResponseDetails
     std::string     httpDate;
     size_t          httpContentLength;
     std::string     httpContentType;
+    std::string     httpContentRange;
+    std::string     httpContentEncoding;
     std::string     amazonId;
     std::string     requestId;
     std::string     etag;
+    S3Metadata      metadata;
 
     // Common xml body elements.
 
@@ -1337,6 +1374,28 @@ S3Request::handleHeader_( const void *headerData,
 
             setPayloadHandler();
         }
+        else if( startsWith( p, size, STRING_WITH_LEN( "Content-Range: " ), &prefixLen ) )
+        {
+            m_responseDetails.httpContentRange.assign( p + prefixLen, size - prefixLen ); 
+        }
+        else if( startsWith( p, size, STRING_WITH_LEN( "Content-Encoding: " ), &prefixLen ) )
+        {
+            m_responseDetails.httpContentEncoding.assign( p + prefixLen, size - prefixLen ); 
+        }
+        else if( startsWith( p, size, STRING_WITH_LEN( s_metadataHeaderPrefix ), &prefixLen ) )
+        {
+            // User metadata: "x-amz-meta-name: value".
+
+            const char *colon = static_cast< const char * >( memchr( p, ':', size ) );
+
+            if( colon )
+            {
+                const char *value = colon + 1;
+                while( value < p + size && *value == ' ' ) { ++value; }
+
+                m_responseDetails.metadata[ std::string( p + prefixLen, colon ) ].assign( value, p + size - value );
+            }
+        }
         else if( startsWith( p, size, STRING_WITH_LEN( "Content-Type: " ), &prefixLen ) )    
         {
             m_responseDetails.httpContentType.assign( p + prefixLen, size - prefixLen );
@@ -1585,12 +1644,14 @@ private:
 
     S3GetResponseBufferLoader m_builtinLoader;
     S3GetResponseLoader *m_loader;
+    bool            m_loading;      // the loader has been told the headers
 };
 
 S3GetRequest::S3GetRequest( const char *name, S3GetResponseLoader *loader )
     : S3Request( name )
     , m_builtinLoader( NULL, 0 )
     , m_loader( loader )
+    , m_loading( false )
 {
 }
 
@@ -1598,12 +1659,19 @@ S3GetRequest::S3GetRequest( const char *name, void *buffer, size_t size )
     : S3Request( name )
     , m_builtinLoader( buffer, size )
     , m_loader( &m_builtinLoader )
+    , m_loading( false )
 {
 }
 
 size_t  
 S3GetRequest::onLoadBinary( const void *chunkData, size_t chunkSize, size_t totalSizeHint )
 {
+    if( !m_loading )
+    {
+        m_loading = true;
+        m_loader->onHeaders( m_responseDetails.httpContentEncoding, m_responseDetails.metadata );
+    }
+
     return m_loader->onLoad( chunkData, chunkSize, totalSizeHint );
 }
 
@@ -1615,232 +1683,734 @@ S3GetRequest::onPrepare( CURL *curl )
 }
 
 //////////////////////////////////////////////////////////////////////////////
-// Response handling for 'put' operation.
+// Response handling for multi-range 'get' operation.
+//
+// Data of the response is scattered into the requested ranges by its offset
+// in the object, which is known for each of the possible responses:
+//
+// * 206 with multipart/byteranges payload: from Content-Range of every part,
+// * 206 with a single range: from the Content-Range header.
+//
+// A 200 means the server ignores multi-range (Amazon S3 does): the payload,
+// the whole object, is dropped at once. Whatever is missing afterwards is
+// requested separately, one range at a time.
 
-class S3PutRequest : public S3Request
+static bool
+startsWithNoCase( const char *p, size_t size, const char *prefix, size_t prefixLen )
 {
-public:
-                    S3PutRequest( const char *name, S3PutRequestUploader *uploader,
-                        size_t totalSize );
-                    S3PutRequest( const char *name, const void *data = NULL, size_t size = 0 );
-
-    void            setUpload( const void *data, size_t size );
+    if( size < prefixLen )
+    {
+        return false;
+    }
 
-private:
-    virtual size_t  onUploadBinary( void *chunkBuf, size_t chunkSize );
-    virtual void    onPrepare( CURL *curl );
-    virtual const char *onHttpVerb() { return "PUT"; }
+    for( size_t i = 0; i < prefixLen; ++i )
+    {
+        if( tolower( static_cast< unsigned char >( p[ i ] ) ) != 
+            tolower( static_cast< unsigned char >( prefix[ i ] ) ) )
+        {
+            return false;
+        }
+    }
 
-    S3PutRequestBufferUploader m_builtinUploader;
-    S3PutRequestUploader *m_uploader;
-    size_t          m_totalSize;
-};
+    return true;
+}
 
+// Parses "bytes first-last/total", total may be '*'.
 
-S3PutRequest::S3PutRequest( const char *name, S3PutRequestUploader *uploader,
-                            size_t totalSize )
-    : S3Request( name )
-    , m_builtinUploader( NULL, 0 )
-    , m_uploader( uploader )
-    , m_totalSize( totalSize )
+static bool
+parseContentRange( const char *p, size_t size, UInt64 *first, UInt64 *last, UInt64 *total )
 {
-}
+    std::string s( p, size );
+    const char *str = s.c_str();
+    char *end = NULL;
 
-S3PutRequest::S3PutRequest( const char *name, const void *data, size_t size )
-    : S3Request( name )
-    , m_builtinUploader( data, size )
-    , m_uploader( &m_builtinUploader )
-    , m_totalSize( size )
-{
-}
+    if( strncmp( str, "bytes ", 6 ) )
+    {
+        return false;
+    }
 
-size_t
-S3PutRequest::onUploadBinary( void *chunkBuf, size_t chunkSize )
-{
-     return m_uploader->onUpload( chunkBuf, chunkSize );
+    *first = strtoull( str + 6, &end, 10 );
+
+    if( *end != '-' )
+    {
+        return false;
+    }
+
+    *last = strtoull( end + 1, &end, 10 );
+
+    if( *end != '/' || *last < *first )
+    {
+        return false;
+    }
+
+    *total = end[ 1 ] == '*' ? static_cast< UInt64 >( -1 ) : strtoull( end + 1, NULL, 10 );
+    return true;
 }
 
-void
-S3PutRequest::setUpload( const void *data, size_t size )
+// Loader into the buffers of S3ByteRange.
+
+struct S3GetRangeBufferLoader : public S3GetRangeLoader
 {
-    dbgAssert( m_curl );
-    dbgAssert( &m_builtinUploader == m_uploader );
+    explicit        S3GetRangeBufferLoader( const std::vector< S3ByteRange > &ranges ) : ranges( ranges ) {}
 
-    m_builtinUploader.setUpload( data, size );
-    m_totalSize = size;
-    curl_easy_setopt_checked( m_curl, CURLOPT_INFILESIZE, size );
-}
+    size_t          onLoadRange( size_t index, size_t offset, const void *chunkData, size_t chunkSize );
 
-void
-S3PutRequest::onPrepare( CURL *curl )
+    const std::vector< S3ByteRange > &ranges;
+};
+
+size_t
+S3GetRangeBufferLoader::onLoadRange( size_t index, size_t offset, const void *chunkData, size_t chunkSize )
 {
-    S3Request::onPrepare( curl );
-    curl_easy_setopt_checked( curl, CURLOPT_INFILESIZE, m_totalSize );
-    curl_easy_setopt_checked( curl, CURLOPT_UPLOAD, 1 );
+    dbgAssert( index < ranges.size() );
+    dbgAssert( offset + chunkSize <= ranges[ index ].size );
+
+    memcpy( static_cast< char * >( ranges[ index ].buffer ) + offset, chunkData, chunkSize );
+    return chunkSize;
 }
 
-//////////////////////////////////////////////////////////////////////////////
-// Response handling for 'del' operation.
+// Adapts a range loader to a single range request for the rest of a range.
 
-class S3DelRequest: public S3Request
+struct S3GetRangeRestLoader : public S3GetResponseLoader
 {
-public:
-                    S3DelRequest( const char *name = NULL );
-private:
-    virtual void    onPrepare( CURL *curl );
-    virtual const char *onHttpVerb() { return "DELETE"; }
+                    S3GetRangeRestLoader( S3GetRangeLoader *_loader, size_t _index, size_t _offset, size_t _left )
+                        : loader( _loader ), index( _index ), offset( _offset ), left( _left ) {}
+
+    size_t          onLoad( const void *chunkData, size_t chunkSize, size_t totalSizeHint );
+
+    S3GetRangeLoader *loader;
+    size_t          index;
+    size_t          offset;
+    size_t          left;
 };
 
-S3DelRequest::S3DelRequest( const char *name )
-    : S3Request( name )
+size_t
+S3GetRangeRestLoader::onLoad( const void *chunkData, size_t chunkSize, size_t totalSizeHint )
 {
-}
+    size_t loaded = loader->onLoadRange( index, offset, chunkData, std::min( chunkSize, left ) );
 
-void
-S3DelRequest::onPrepare( CURL *curl )
-{
-    S3Request::onPrepare( curl );
-    curl_easy_setopt_checked( m_curl, CURLOPT_CUSTOMREQUEST, httpVerb() );
+    offset += loaded;
+    left -= loaded;
+    return loaded;
 }
 
-//////////////////////////////////////////////////////////////////////////////
-// Response handling for 'listObjects' operation.
-
-class S3ListBucketsRequest : public S3Request
+class S3RangeGetRequest : public S3Request
 {
 public:
-                    S3ListBucketsRequest( std::vector< S3Bucket > *buckets );
+                    S3RangeGetRequest( const char *name, const char *bucketName, 
+                        const S3ByteRange *ranges, size_t count, S3GetRangeLoader *loader );
+
+    // Value of the Range header, just the first range if firstOnly.
+
+    std::string     rangeHeader( bool firstOnly = false ) const;
+
+    const char *    bucketName() const { return m_bucketName.c_str(); }
+    S3GetRangeLoader *loader() { return m_loader; }
+    size_t          count() const { return m_ranges.size(); }
+    const S3ByteRange &range( size_t index ) const { return m_ranges[ index ]; }
+    size_t &        received( size_t index ) { return m_received[ index ]; }
+
+    // Tells whether range 'index' needs another request.
+
+    bool            isMissing( size_t index ) const;
+
+    // Tells whether the server answered with the whole object.
+
+    bool            isRangeIgnored() const { return m_rangeIgnored; }
 
 private:
-    virtual bool    onExpectXmlPayload() const { return true; }
-    virtual bool    onStartXmlElement();
-    virtual bool    onEndXmlElement();
-    virtual bool    onSetXmlValue( const char *value, int len );
-   
+    virtual size_t  onLoadBinary( const void *chunkData, size_t chunkSize, size_t totalSizeHint );
     virtual void    onPrepare( CURL *curl );
     virtual const char *onHttpVerb() { return "GET"; }
 
-private:
-    bool            isBucketNode();
-    
-    S3Bucket        m_current;
-    std::vector< S3Bucket > *m_buckets;
-};
+    void            start();
+    size_t          scatter( const char *p, size_t size );
+    void            parsePartHeader();
 
+    enum Mode { ModeNone, ModeSingle, ModeMultipart };
+    enum PartState { PartDelimiter, PartHeaders, PartBody, PartDone };
 
-S3ListBucketsRequest::S3ListBucketsRequest( std::vector< S3Bucket > *buckets )
-    : S3Request()
-    , m_buckets( buckets )
-{
-    dbgAssert( buckets );
-}
+    std::string     m_bucketName;
+    std::vector< S3ByteRange > m_ranges;
+    std::vector< size_t > m_received;
+    S3GetRangeBufferLoader m_builtinLoader;
+    S3GetRangeLoader *m_loader;
 
-bool    
-S3ListBucketsRequest::onStartXmlElement() 
-{ 
-    if( isBucketNode() )
-    {
-        m_current.clear();
-    }
+    Mode            m_mode;
+    bool            m_rangeIgnored; // 200, the payload is the whole object
+    bool            m_stopped;      // the loader didn't take all the data
+    UInt64          m_pos;          // offset in the object of the next payload byte
+    UInt64          m_left;         // bytes left in the current part
+    UInt64          m_objectSize;   // -1 if unknown
 
-    return true;
-}
+    // Multipart parser.
 
-bool
-S3ListBucketsRequest::onEndXmlElement() 
-{ 
-    if( isBucketNode() )
-    {
-        m_buckets->push_back( m_current );
-    }
+    PartState       m_partState;
+    std::string     m_boundary;     // "--" + boundary
+    std::string     m_line;
+};
 
-    return true;
+S3RangeGetRequest::S3RangeGetRequest( const char *name, const char *bucketName, 
+    const S3ByteRange *ranges, size_t count, S3GetRangeLoader *loader )
+    : S3Request( name )
+    , m_bucketName( bucketName )
+    , m_ranges( ranges, ranges + count )
+    , m_received( count )
+    , m_builtinLoader( m_ranges )
+    , m_loader( loader ? loader : &m_builtinLoader )
+    , m_mode( ModeNone )
+    , m_rangeIgnored( false )
+    , m_stopped( false )
+    , m_pos( 0 )
+    , m_left( static_cast< UInt64 >( -1 ) )
+    , m_objectSize( static_cast< UInt64 >( -1 ) )
+    , m_partState( PartDelimiter )
+{
 }
 
-bool
-S3ListBucketsRequest::onSetXmlValue( const char *value, int len ) 
+std::string
+S3RangeGetRequest::rangeHeader( bool firstOnly ) const
 {
-    if( m_stackTop < 3 )
-    {
-        return true;
-    }
+    std::string range( "bytes=" );
+    char buf[ 64 ];
 
-    switch( m_stack[ m_stackTop - 1 ] )
+    for( size_t i = 0; i < ( firstOnly ? 1 : m_ranges.size() ); ++i )
     {
-    case S3_RESPONSE_NODE_NAME:
-        m_current.name.assign( value, len );
-        break;
-
-    case S3_RESPONSE_NODE_CREATION_DATE:
-        m_current.creationDate.assign( value, len );
-        break;
+        dbgAssert( m_ranges[ i ].size );
+        snprintf( buf, sizeof( buf ), "%s%llu-%llu", i ? "," : "", 
+            ( unsigned long long )m_ranges[ i ].offset,
+            ( unsigned long long )( m_ranges[ i ].offset + m_ranges[ i ].size - 1 ) );
+        range.append( buf );
     }
 
-    return true;
+    return range;
 }
 
 bool
-S3ListBucketsRequest::isBucketNode()
+S3RangeGetRequest::isMissing( size_t index ) const
 {
-    return ( m_stackTop == 3 || m_stackTop == 4 ) && 
-        ( m_stack[ m_stackTop - 1 ] == S3_RESPONSE_NODE_BUCKET );
+    const S3ByteRange &r = m_ranges[ index ];
+
+    // The loader has stopped or the range starts past the end of the object:
+    // there is nothing more to get.
+
+    return !m_stopped && m_received[ index ] < r.size && 
+        r.offset + m_received[ index ] < m_objectSize;
 }
 
 void 
-S3ListBucketsRequest::onPrepare( CURL *curl )
+S3RangeGetRequest::onPrepare( CURL *curl )
 {
     S3Request::onPrepare( curl );
     curl_easy_setopt_checked( curl, CURLOPT_HTTPGET, 1 );
 }
 
+void
+S3RangeGetRequest::start()
+{
+    const S3ResponseDetails &details = m_responseDetails;
+    const char *contentType = details.httpContentType.c_str();
+    UInt64 first, last;
 
-//////////////////////////////////////////////////////////////////////////////
-// Response handling for 'listObjects' operation.
+    if( strncmp( details.httpStatus.c_str(), "206", 3 ) )
+    {
+        // Multi-range is not supported, the payload is the whole object:
+        // streaming it to the last range would read more than the ranges
+        // do on their own.
 
-class S3ListObjectsRequest : public S3Request
-{
-public:
-                    S3ListObjectsRequest( const char *prefix, 
-                        S3ObjectEnum *objectEnum, bool isWalrus );
+        m_mode = ModeSingle;
+        m_rangeIgnored = true;
+    }
+    else if( startsWithNoCase( contentType, strlen( contentType ), STRING_WITH_LEN( "multipart/byteranges" ) ) )
+    {
+        const char *boundary = strstr( contentType, "boundary=" );
 
-    const std::string & nextMarker() const { return m_nextMarker.empty() ? m_current.key : m_nextMarker; }
-private:
-    virtual bool    onExpectXmlPayload() const { return true; }
-    virtual bool    onStartXmlElement( ) ;
-    virtual bool    onEndXmlElement( ) ;
-    virtual bool    onSetXmlValue( const char *value, int len ) ;
-   
-    virtual void    onPrepare( CURL *curl );
-    virtual const char *onHttpVerb() { return "GET"; }
+        if( !boundary )
+        {
+            throw S3Exception( errParser );
+        }
 
-    bool            isObjectNode();
-    
-    S3Object        m_current;
-    S3ObjectEnum   *m_objectEnum;
-    bool            m_isWalrus;
-    std::string     m_prefix;
-    std::string     m_nextMarker;
-};
+        boundary += sizeof( "boundary=" ) - 1;
 
+        std::string b( boundary, strcspn( boundary, ";" ) );
 
-S3ListObjectsRequest::S3ListObjectsRequest( const char *prefix, 
-    S3ObjectEnum *objectEnum, bool isWalrus )
-    : S3Request( prefix )
-    , m_objectEnum( objectEnum )
-    , m_isWalrus( isWalrus )
-{
-    dbgAssert( objectEnum );
-}
+        if( b.size() >= 2 && b[ 0 ] == '"' && b[ b.size() - 1 ] == '"' )
+        {
+            b = b.substr( 1, b.size() - 2 );
+        }
 
-bool
-S3ListObjectsRequest::onStartXmlElement() 
-{ 
-    if( isObjectNode() )
-    {
-        m_current.clear();
+        m_mode = ModeMultipart;
+        m_boundary = "--" + b;
     }
+    else
+    {
+        // A single range, the server may have coalesced the requested ones.
 
-    return true;
+        if( !parseContentRange( details.httpContentRange.data(), details.httpContentRange.size(), 
+                &first, &last, &m_objectSize ) )
+        {
+            throw S3Exception( errParser );
+        }
+
+        m_mode = ModeSingle;
+        m_pos = first;
+    }
+}
+
+size_t
+S3RangeGetRequest::scatter( const char *p, size_t size )
+{
+    UInt64 end = m_pos + size;
+
+    for( size_t i = 0; i < m_ranges.size(); ++i )
+    {
+        const S3ByteRange &r = m_ranges[ i ];
+        UInt64 next = r.offset + m_received[ i ];
+        UInt64 last = std::min( end, static_cast< UInt64 >( r.offset + r.size ) );
+
+        // Bytes of a range are delivered in order, so take data only if it
+        // continues the range.
+
+        if( next >= m_pos && next < last )
+        {
+            size_t chunkSize = static_cast< size_t >( last - next );
+            size_t loaded = m_loader->onLoadRange( i, m_received[ i ], p + ( next - m_pos ), chunkSize );
+
+            m_received[ i ] += loaded;
+
+            if( loaded < chunkSize )
+            {
+                m_stopped = true;
+            }
+        }
+    }
+
+    m_pos = end;
+    return m_stopped ? 0 : size;
+}
+
+void
+S3RangeGetRequest::parsePartHeader()
+{
+    UInt64 first, last, total;
+    size_t prefixLen = sizeof( "Content-Range:" ) - 1;
+
+    if( !startsWithNoCase( m_line.data(), m_line.size(), STRING_WITH_LEN( "Content-Range:" ) ) )
+    {
+        return;
+    }
+
+    size_t valuePos = m_line.find_first_not_of( ' ', prefixLen );
+
+    if( valuePos == std::string::npos || 
+        !parseContentRange( m_line.data() + valuePos, m_line.size() - valuePos, &first, &last, &total ) )
+    {
+        throw S3Exception( errParser );
+    }
+
+    m_pos = first;
+    m_left = last - first + 1;
+
+    if( total != static_cast< UInt64 >( -1 ) )
+    {
+        m_objectSize = total;
+    }
+}
+
+size_t  
+S3RangeGetRequest::onLoadBinary( const void *chunkData, size_t chunkSize, size_t totalSizeHint )
+{
+    const char *p = static_cast< const char * >( chunkData );
+    size_t size = chunkSize;
+
+    if( m_mode == ModeNone )
+    {
+        start();
+    }
+
+    if( m_rangeIgnored )
+    {
+        return 0;
+    }
+
+    if( m_mode == ModeSingle )
+    {
+        return scatter( p, size );
+    }
+
+    while( size )
+    {
+        if( m_partState == PartBody )
+        {
+            size_t n = static_cast< size_t >( std::min( m_left, static_cast< UInt64 >( size ) ) );
+
+            if( scatter( p, n ) < n )
+            {
+                return 0;
+            }
+
+            p += n;
+            size -= n;
+            m_left -= n;
+
+            if( !m_left )
+            {
+                m_partState = PartDelimiter;
+            }
+
+            continue;
+        }
+
+        if( m_partState == PartDone )
+        {
+            break;
+        }
+
+        // Delimiter and part headers are lines.
+
+        const char *eol = static_cast< const char * >( memchr( p, '\n', size ) );
+        size_t n = eol ? eol - p + 1 : size;
+
+        m_line.append( p, n );
+        p += n;
+        size -= n;
+
+        if( !eol )
+        {
+            if( m_line.size() > 4096 )
+            {
+                throw S3Exception( errParser );
+            }
+
+            continue;
+        }
+
+        while( !m_line.empty() && ( m_line[ m_line.size() - 1 ] == '\n' || m_line[ m_line.size() - 1 ] == '\r' ) )
+        {
+            m_line.resize( m_line.size() - 1 );
+        }
+
+        if( m_partState == PartDelimiter )
+        {
+            if( m_line == m_boundary )
+            {
+                m_partState = PartHeaders;
+                m_left = static_cast< UInt64 >( -1 );
+            }
+            else if( m_line == m_boundary + "--" )
+            {
+                m_partState = PartDone;
+            }
+        }
+        else if( m_line.empty() )
+        {
+            // End of the part headers.
+
+            if( m_left == static_cast< UInt64 >( -1 ) )
+            {
+                throw S3Exception( errParser );
+            }
+
+            m_partState = PartBody;
+        }
+        else
+        {
+            parsePartHeader();
+        }
+
+        m_line.clear();
+    }
+
+    return chunkSize;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Response handling for 'put' operation.
+
+class S3PutRequest : public S3Request
+{
+public:
+                    S3PutRequest( const char *name, S3PutRequestUploader *uploader,
+                        size_t totalSize );
+                    S3PutRequest( const char *name, const void *data = NULL, size_t size = 0 );
+
+    void            setUpload( const void *data, size_t size );
+
+private:
+    virtual size_t  onUploadBinary( void *chunkBuf, size_t chunkSize );
+    virtual void    onPrepare( CURL *curl );
+    virtual const char *onHttpVerb() { return "PUT"; }
+
+    S3PutRequestBufferUploader m_builtinUploader;
+    S3PutRequestUploader *m_uploader;
+    size_t          m_totalSize;
+};
+
+
+S3PutRequest::S3PutRequest( const char *name, S3PutRequestUploader *uploader,
+                            size_t totalSize )
+    : S3Request( name )
+    , m_builtinUploader( NULL, 0 )
+    , m_uploader( uploader )
+    , m_totalSize( totalSize )
+{
+}
+
+S3PutRequest::S3PutRequest( const char *name, const void *data, size_t size )
+    : S3Request( name )
+    , m_builtinUploader( data, size )
+    , m_uploader( &m_builtinUploader )
+    , m_totalSize( size )
+{
+}
+
+size_t
+S3PutRequest::onUploadBinary( void *chunkBuf, size_t chunkSize )
+{
+     return m_uploader->onUpload( chunkBuf, chunkSize );
+}
+
+void
+S3PutRequest::setUpload( const void *data, size_t size )
+{
+    dbgAssert( m_curl );
+    dbgAssert( &m_builtinUploader == m_uploader );
+
+    m_builtinUploader.setUpload( data, size );
+    m_totalSize = size;
+    curl_easy_setopt_checked( m_curl, CURLOPT_INFILESIZE, size );
+}
+
+void
+S3PutRequest::onPrepare( CURL *curl )
+{
+    S3Request::onPrepare( curl );
+    curl_easy_setopt_checked( curl, CURLOPT_INFILESIZE, m_totalSize );
+    curl_easy_setopt_checked( curl, CURLOPT_UPLOAD, 1 );
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Response handling for 'copy' and 'putPartCopy' operations.
+//
+// The request is a PUT without payload, the new etag comes in the 
+// <CopyObjectResult> or <CopyPartResult> payload. Note that S3 may answer
+// with 200 and still report an error in the payload.
+
+class S3CopyRequest : public S3PutRequest
+{
+public:
+    explicit        S3CopyRequest( const char *name ) : S3PutRequest( name ) {}
+
+private:
+    virtual bool    onExpectXmlPayload() const { return true; }
+    virtual bool    onSetXmlValue( const char *value, int len );
+};
+
+bool
+S3CopyRequest::onSetXmlValue( const char *value, int len )
+{
+    if( m_stackTop == 2 && m_stack[ 0 ] == S3_RESPONSE_NODE_ERROR )
+    {
+        m_responseDetails.status = S3_RESPONSE_STATUS_FAILURE_WITH_DETAILS;
+    }
+    else if( m_stackTop == 2 && m_stack[ m_stackTop - 1 ] == S3_RESPONSE_NODE_ETAG )
+    {
+        // Skip beginning and trailing quotes.
+
+        if( len != 1 || *value != '"' )
+        {
+            m_responseDetails.etag.append( value, len );
+        }
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Response handling for 'del' operation.
+
+class S3DelRequest: public S3Request
+{
+public:
+                    S3DelRequest( const char *name = NULL );
+private:
+    virtual void    onPrepare( CURL *curl );
+    virtual const char *onHttpVerb() { return "DELETE"; }
+};
+
+S3DelRequest::S3DelRequest( const char *name )
+    : S3Request( name )
+{
+}
+
+void
+S3DelRequest::onPrepare( CURL *curl )
+{
+    S3Request::onPrepare( curl );
+    curl_easy_setopt_checked( m_curl, CURLOPT_CUSTOMREQUEST, httpVerb() );
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Response handling for 'head' operation.
+
+class S3HeadRequest: public S3Request
+{
+public:
+                    S3HeadRequest( const char *name = NULL );
+private:
+    virtual void    onPrepare( CURL *curl );
+    virtual const char *onHttpVerb() { return "HEAD"; }
+};
+
+S3HeadRequest::S3HeadRequest( const char *name )
+    : S3Request( name )
+{
+}
+
+void
+S3HeadRequest::onPrepare( CURL *curl )
+{
+    S3Request::onPrepare( curl );
+    curl_easy_setopt_checked( m_curl, CURLOPT_NOBODY, 1 );
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Response handling for 'listObjects' operation.
+
+class S3ListBucketsRequest : public S3Request
+{
+public:
+                    S3ListBucketsRequest( std::vector< S3Bucket > *buckets );
+
+private:
+    virtual bool    onExpectXmlPayload() const { return true; }
+    virtual bool    onStartXmlElement();
+    virtual bool    onEndXmlElement();
+    virtual bool    onSetXmlValue( const char *value, int len );
+   
+    virtual void    onPrepare( CURL *curl );
+    virtual const char *onHttpVerb() { return "GET"; }
+
+private:
+    bool            isBucketNode();
+    
+    S3Bucket        m_current;
+    std::vector< S3Bucket > *m_buckets;
+};
+
+
+S3ListBucketsRequest::S3ListBucketsRequest( std::vector< S3Bucket > *buckets )
+    : S3Request()
+    , m_buckets( buckets )
+{
+    dbgAssert( buckets );
+}
+
+bool    
+S3ListBucketsRequest::onStartXmlElement() 
+{ 
+    if( isBucketNode() )
+    {
+        m_current.clear();
+    }
+
+    return true;
+}
+
+bool
+S3ListBucketsRequest::onEndXmlElement() 
+{ 
+    if( isBucketNode() )
+    {
+        m_buckets->push_back( m_current );
+    }
+
+    return true;
+}
+
+bool
+S3ListBucketsRequest::onSetXmlValue( const char *value, int len ) 
+{
+    if( m_stackTop < 3 )
+    {
+        return true;
+    }
+
+    switch( m_stack[ m_stackTop - 1 ] )
+    {
+    case S3_RESPONSE_NODE_NAME:
+        m_current.name.assign( value, len );
+        break;
+
+    case S3_RESPONSE_NODE_CREATION_DATE:
+        m_current.creationDate.assign( value, len );
+        break;
+    }
+
+    return true;
+}
+
+bool
+S3ListBucketsRequest::isBucketNode()
+{
+    return ( m_stackTop == 3 || m_stackTop == 4 ) && 
+        ( m_stack[ m_stackTop - 1 ] == S3_RESPONSE_NODE_BUCKET );
+}
+
+void 
+S3ListBucketsRequest::onPrepare( CURL *curl )
+{
+    S3Request::onPrepare( curl );
+    curl_easy_setopt_checked( curl, CURLOPT_HTTPGET, 1 );
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Response handling for 'listObjects' operation.
+
+class S3ListObjectsRequest : public S3Request
+{
+public:
+                    S3ListObjectsRequest( const char *prefix, 
+                        S3ObjectEnum *objectEnum, bool isWalrus );
+
+    const std::string & nextMarker() const { return m_nextMarker.empty() ? m_current.key : m_nextMarker; }
+private:
+    virtual bool    onExpectXmlPayload() const { return true; }
+    virtual bool    onStartXmlElement( ) ;
+    virtual bool    onEndXmlElement( ) ;
+    virtual bool    onSetXmlValue( const char *value, int len ) ;
+   
+    virtual void    onPrepare( CURL *curl );
+    virtual const char *onHttpVerb() { return "GET"; }
+
+    bool            isObjectNode();
+    
+    S3Object        m_current;
+    S3ObjectEnum   *m_objectEnum;
+    bool            m_isWalrus;
+    std::string     m_prefix;
+    std::string     m_nextMarker;
+};
+
+
+S3ListObjectsRequest::S3ListObjectsRequest( const char *prefix, 
+    S3ObjectEnum *objectEnum, bool isWalrus )
+    : S3Request( prefix )
+    , m_objectEnum( objectEnum )
+    , m_isWalrus( isWalrus )
+{
+    dbgAssert( objectEnum );
+}
+
+bool
+S3ListObjectsRequest::onStartXmlElement() 
+{ 
+    if( isObjectNode() )
+    {
+        m_current.clear();
+    }
+
+    return true;
 }
 
 bool
@@ -2240,6 +2810,7 @@ S3Connection::S3Connection( const S3Config &config )
     , m_sslCertFile( config.sslCertFile ? config.sslCertFile : "" )
     , m_traceCallback( NULL )
     , m_asyncRequest( NULL )
+    , m_multiRangeIgnored( false )
     , m_timeout( s_defaultTimeout )      
     , m_connectTimeout( s_defaultConnectTimeout )
 {
@@ -2364,6 +2935,30 @@ S3Connection::waitAny( S3Connection **cons, size_t count, size_t startFrom, long
     return ( res + startFrom ) % count;
 }
 
+void
+S3Connection::setCompletionQueue( CompletionQueue *queue, void *tag ) // nofail
+{
+    dbgAssert( !isAsyncPending() );
+
+    m_curl.setCompletionQueue( queue, tag );  // nofail
+}
+
+void
+S3Connection::setCompletionHandler( CompletionHandler *handler, void *tag ) // nofail
+{
+    dbgAssert( !isAsyncPending() );
+
+    m_curl.setCompletionHandler( handler, tag );  // nofail
+}
+
+void
+S3Connection::setAsyncLoop( size_t loop ) // nofail
+{
+    dbgAssert( !isAsyncPending() );
+
+    m_curl.setPoolLoop( loop );  // nofail
+}
+
 static curl_socket_t 
 onSocketOpen( void *, curlsocktype, curl_sockaddr *addr )
 {
@@ -2392,7 +2987,8 @@ writeNoop( const void *chunkData, size_t count, size_t elementSize, void *ctx )
 
 void
 S3Connection::prepare( S3Request *request, const char *bucketName, const char *key,
-        const char *contentType, bool makePublic, bool useSrvEncrypt, size_t low, size_t high)
+        const char *contentType, bool makePublic, bool useSrvEncrypt, const char *range,
+        const char *copySource, const char *copyRange, const S3Metadata *metadata )
 {
     dbgAssert( !m_asyncRequest ); // some async operation is in progress, need to complete/cancel it first 
                                   // before starting a new one.
@@ -2484,7 +3080,7 @@ S3Connection::prepare( S3Request *request, const char *bucketName, const char *k
     setRequestHeaders( m_accKey, m_secKey,
         0 /* contentMd5 */, contentType, makePublic, useSrvEncrypt,
         request->httpVerb(), bucketName, key, m_isWalrus,
-        &request->headers, low, high );
+        &request->headers, range, copySource, copyRange, metadata );
 
     curl_easy_setopt_checked( m_curl, CURLOPT_HTTPHEADER, static_cast< curl_slist * >( request->headers ) );
 
@@ -2496,7 +3092,8 @@ S3Connection::prepare( S3Request *request, const char *bucketName, const char *k
 void
 S3Connection::init( S3Request *request, const char *bucketName, const char *key, 
                       const char *keySuffix, const char *contentType, 
-                      bool makePublic,  bool useSrvEncrypt, size_t low, size_t high )
+                      bool makePublic,  bool useSrvEncrypt, const char *range,
+                      const char *copySource, const char *copyRange, const S3Metadata *metadata )
 {
     dbgAssert( bucketName );
 
@@ -2504,7 +3101,8 @@ S3Connection::init( S3Request *request, const char *bucketName, const char *key,
     std::string escapedKey;
     composeUrl( m_baseUrl, bucketName, key, keySuffix, &url, &escapedKey );
 
-    prepare( request, bucketName, key ? escapedKey.c_str() : NULL, contentType, makePublic, useSrvEncrypt, low ,high );
+    prepare( request, bucketName, key ? escapedKey.c_str() : NULL, contentType, makePublic, useSrvEncrypt, range,
+        copySource, copyRange, metadata );
 
     request->setUrl( url.c_str() );
 }
@@ -2604,11 +3202,26 @@ completePut( S3ResponseDetails &responseDetails, S3PutResponse *response )
     }
 }
 
+static void
+composePartSuffix( const char *uploadId, int partNumber, std::string *keySuffix )
+{
+    dbgAssert( uploadId );
+    dbgAssert( keySuffix );
+
+    char partNumberBuf[ 16 ];
+
+    keySuffix->reserve( 256 );
+    keySuffix->append( STRING_WITH_LEN( "?partNumber=" ) );
+    keySuffix->append( uitoa( partNumber, partNumberBuf ) );
+    keySuffix->append( STRING_WITH_LEN( "&uploadId=" ) );
+    keySuffix->append( uploadId );
+}
+
 void
 S3Connection::put( S3Request *request, const char *bucketName, const char *key, 
                   const char *uploadId, int partNumber,
                   bool makePublic, bool useSrvEncrypt, const char *contentType,
-                  S3PutResponse *response )
+                  S3PutResponse *response, const S3Metadata *metadata )
 {
     dbgAssert( request );
     dbgAssert( bucketName );
@@ -2618,16 +3231,12 @@ S3Connection::put( S3Request *request, const char *bucketName, const char *key,
     
     if( uploadId )
     {
-        keySuffix.reserve( 256 );
-        keySuffix.append( STRING_WITH_LEN( "?partNumber=" ) );
-        char partNumberBuf[ 16 ];
-        keySuffix.append( uitoa( partNumber, partNumberBuf ) );
-        keySuffix.append( STRING_WITH_LEN( "&uploadId=" ) );
-        keySuffix.append( uploadId );
+        composePartSuffix( uploadId, partNumber, &keySuffix );
     }
 
     init( request, bucketName, key, uploadId ? keySuffix.c_str() : NULL, 
-        contentType ? contentType : s_contentTypeBinary, makePublic, useSrvEncrypt );
+        contentType ? contentType : s_contentTypeBinary, makePublic, useSrvEncrypt, NULL /* range */,
+        NULL /* copySource */, NULL /* copyRange */, metadata );
 
     // Execute the request.
 
@@ -2635,78 +3244,320 @@ S3Connection::put( S3Request *request, const char *bucketName, const char *key,
 
     // Complete the request.
 
-    ::webstor::completePut( responseDetails, response );
+    ::webstor::completePut( responseDetails, response );
+}
+
+void
+S3Connection::put( const char *bucketName, const char *key, const void *data, 
+    size_t size, bool makePublic, bool useSrvEncrypt, const char *contentType, S3PutResponse *response,
+    const S3Metadata *metadata )
+{
+    dbgAssert( bucketName );
+    dbgAssert( implies( size, data ) );
+    dbgAssert( key );
+
+    LOG_TRACE( "enter put: conn=0x%llx", ( UInt64 )this );
+
+    try
+    {
+        S3PutRequest request( key, data, size );
+        put( &request, bucketName, key, NULL /* uploadId */, 0 /* partNumber */,
+            makePublic, useSrvEncrypt, contentType, response, metadata );
+    }
+    catch( ... )
+    {
+        throwSummary( "put", key );
+    }
+
+    LOG_TRACE( "leave put: conn=0x%llx", ( UInt64 )this );
+}
+
+
+void 
+S3Connection::put( const char *bucketName, const char *key, S3PutRequestUploader *uploader, 
+    size_t totalSize, bool makePublic, bool useSrvEncrypt, const char *contentType, S3PutResponse *response,
+    const S3Metadata *metadata )
+{
+    dbgAssert( bucketName );
+    dbgAssert( uploader );
+    dbgAssert( key );
+
+    LOG_TRACE( "enter put: conn=0x%llx", ( UInt64 )this );
+
+    try
+    {
+        S3PutRequest request( key, uploader, totalSize );
+        put( &request, bucketName, key, NULL /* uploadId */, 0 /* partNumber */,
+            makePublic, useSrvEncrypt, contentType, response, metadata );
+    }
+    catch( ... )
+    {
+        throwSummary( "put", key );
+    }
+
+    LOG_TRACE( "leave put: conn=0x%llx", ( UInt64 )this );
+}
+
+// The value of an If-Match header for an etag.
+
+static std::string
+quoteEtag( const std::string &etag )
+{
+    std::string quoted;
+    quoted.reserve( etag.size() + 2 );
+    quoted.append( 1, '"' );
+    quoted.append( etag );
+    quoted.append( 1, '"' );
+    return quoted;
+}
+
+bool
+S3Connection::putIf( const char *bucketName, const char *key, const void *data, size_t size,
+    const std::string &etag, S3PutResponse *response, const S3Metadata *metadata )
+{
+    dbgAssert( bucketName );
+    dbgAssert( implies( size, data ) );
+    dbgAssert( key );
+
+    LOG_TRACE( "enter putIf: conn=0x%llx", ( UInt64 )this );
+
+    bool stored = true;
+
+    try
+    {
+        S3PutRequest request( key, data, size );
+
+        init( &request, bucketName, key, NULL /* keySuffix */, s_contentTypeBinary, false /* makePublic */,
+            false /* useSrvEncrypt */, NULL /* range */, NULL /* copySource */, NULL /* copyRange */, metadata );
+
+        // Conditions are standard headers, they are not signed.
+
+        if( etag.empty() )
+        {
+            appendRequestHeader( "If-None-Match", "*", &request.headers );
+        }
+        else
+        {
+            appendRequestHeader( "If-Match", quoteEtag( etag ).c_str(), &request.headers );
+        }
+
+        curl_easy_setopt_checked( m_curl, CURLOPT_HTTPHEADER, static_cast< curl_slist * >( request.headers ) );
+
+        // Execute the request.
+
+        S3ResponseDetails &responseDetails = request.execute();
+
+        // 412 if the condition doesn't hold, 409 if another conditional 
+        // write to the object is in progress.
+
+        if( !strncmp( responseDetails.httpStatus.c_str(), "412", 3 ) ||
+            !strncmp( responseDetails.httpStatus.c_str(), "409", 3 ) )
+        {
+            stored = false;
+        }
+        else
+        {
+            ::webstor::completePut( responseDetails, response );
+        }
+    }
+    catch( ... )
+    {
+        throwSummary( "putIf", key );
+    }
+
+    LOG_TRACE( "leave putIf: conn=0x%llx", ( UInt64 )this );
+    return stored;
+}
+
+
+void
+S3Connection::pendPut( AsyncMan *asyncMan, const char *bucketName, 
+                      const char *key, const void *data, size_t size,
+                      bool makePublic, bool useSrvEncrypt, const S3Metadata *metadata )
+{
+    dbgAssert( asyncMan != NULL );
+    dbgAssert( bucketName );
+    dbgAssert( implies( size, data ) );
+    dbgAssert( key );
+    dbgAssert( !m_asyncRequest );  // another async operation is in progress.
+
+    LOG_TRACE( "enter pendPut: conn=0x%llx", ( UInt64 )this );
+
+    try
+    {
+        // Initialize Put request.
+
+        std::auto_ptr< S3PutRequest > request( new S3PutRequest( key, data, size ) );
+        init( request.get(), bucketName, key, NULL /* keySuffix */, s_contentTypeBinary, makePublic, useSrvEncrypt,
+            NULL /* range */, NULL /* copySource */, NULL /* copyRange */, metadata );
+
+        // Start async.
+
+        m_curl.pendOp( asyncMan );
+        m_asyncRequest = request.release(); // nofail
+    }
+    catch( ... )
+    {
+        throwSummary( "pendPut", key );
+    }
+
+    LOG_TRACE( "leave pendPut: conn=0x%llx", ( UInt64 )this );
+}
+
+void
+S3Connection::pendPutPart( AsyncMan *asyncMan, const char *bucketName, const char *key, 
+                          const char *uploadId, int partNumber, const void *data, size_t size )
+{
+    dbgAssert( asyncMan != NULL );
+    dbgAssert( bucketName );
+    dbgAssert( key );
+    dbgAssert( uploadId );
+    dbgAssert( partNumber > 0 );
+    dbgAssert( implies( size, data ) );
+    dbgAssert( !m_isWalrus );
+    dbgAssert( !m_asyncRequest );  // another async operation is in progress.
+
+    LOG_TRACE( "enter pendPutPart: conn=0x%llx", ( UInt64 )this );
+
+    try
+    {
+        // Initialize Put request, see putPart(..).
+
+        std::string keySuffix;
+        composePartSuffix( uploadId, partNumber, &keySuffix );
+
+        std::auto_ptr< S3PutRequest > request( new S3PutRequest( key, data, size ) );
+        init( request.get(), bucketName, key, keySuffix.c_str(), s_contentTypeBinary, 
+            false /* makePublic */, false /* useSrvEncrypt */ );
+
+        // Start async.
+
+        m_curl.pendOp( asyncMan );
+        m_asyncRequest = request.release(); // nofail
+    }
+    catch( ... )
+    {
+        throwSummary( "pendPutPart", key );
+    }
+
+    LOG_TRACE( "leave pendPutPart: conn=0x%llx", ( UInt64 )this );
+}
+
+void
+S3Connection::initCopy( S3Request *request, const char *bucketName, const char *key, 
+                       const char *uploadId, int partNumber,
+                       const char *srcBucketName, const char *srcKey, size_t srcOffset, size_t srcSize,
+                       bool makePublic, bool useSrvEncrypt )
+{
+    dbgAssert( srcBucketName );
+    dbgAssert( srcKey );
+    dbgAssert( implies( srcOffset != static_cast< size_t >( -1 ), srcSize ) );
+
+    // Copy source is "/bucket/key" with the key url-encoded.
+
+    std::string copySource;
+    copySource.reserve( 256 );
+    copySource.append( 1, '/' );
+    copySource.append( srcBucketName );
+    copySource.append( 1, '/' );
+    appendEscapedUrl( &copySource, srcKey );
+
+    char copyRange[ 64 ];
+
+    if( srcOffset != static_cast< size_t >( -1 ) )
+    {
+        snprintf( copyRange, sizeof( copyRange ), "bytes=%llu-%llu", ( unsigned long long )srcOffset, 
+            ( unsigned long long )( srcOffset + srcSize - 1 ) );
+    }
+
+    std::string keySuffix;
+
+    if( uploadId )
+    {
+        composePartSuffix( uploadId, partNumber, &keySuffix );
+    }
+
+    init( request, bucketName, key, uploadId ? keySuffix.c_str() : NULL, s_contentTypeBinary, 
+        makePublic, useSrvEncrypt, NULL /* range */, copySource.c_str(), 
+        srcOffset != static_cast< size_t >( -1 ) ? copyRange : NULL );
 }
 
 void
-S3Connection::put( const char *bucketName, const char *key, const void *data, 
-    size_t size, bool makePublic, bool useSrvEncrypt, const char *contentType, S3PutResponse *response )
+S3Connection::copy( const char *srcBucketName, const char *srcKey, const char *bucketName, const char *key,
+                   bool makePublic, bool useSrvEncrypt, S3PutResponse *response )
 {
     dbgAssert( bucketName );
-    dbgAssert( implies( size, data ) );
     dbgAssert( key );
 
-    LOG_TRACE( "enter put: conn=0x%llx", ( UInt64 )this );
+    LOG_TRACE( "enter copy: conn=0x%llx", ( UInt64 )this );
 
     try
     {
-        S3PutRequest request( key, data, size );
-        put( &request, bucketName, key, NULL /* uploadId */, 0 /* partNumber */,
-            makePublic, useSrvEncrypt, contentType, response );
+        S3CopyRequest request( key );
+        initCopy( &request, bucketName, key, NULL /* uploadId */, 0 /* partNumber */, 
+            srcBucketName, srcKey, -1 /* srcOffset */, 0 /* srcSize */, makePublic, useSrvEncrypt );
+
+        S3ResponseDetails &responseDetails = request.execute();  
+        ::webstor::completePut( responseDetails, response );
     }
     catch( ... )
     {
-        throwSummary( "put", key );
+        throwSummary( "copy", key );
     }
 
-    LOG_TRACE( "leave put: conn=0x%llx", ( UInt64 )this );
+    LOG_TRACE( "leave copy: conn=0x%llx", ( UInt64 )this );
 }
 
-
-void 
-S3Connection::put( const char *bucketName, const char *key, S3PutRequestUploader *uploader, 
-    size_t totalSize, bool makePublic, bool useSrvEncrypt, const char *contentType, S3PutResponse *response )
+void
+S3Connection::pendCopy( AsyncMan *asyncMan, const char *srcBucketName, const char *srcKey, 
+                       const char *bucketName, const char *key, bool makePublic, bool useSrvEncrypt )
 {
+    dbgAssert( asyncMan != NULL );
     dbgAssert( bucketName );
-    dbgAssert( uploader );
     dbgAssert( key );
+    dbgAssert( !m_asyncRequest );  // another async operation is in progress.
 
-    LOG_TRACE( "enter put: conn=0x%llx", ( UInt64 )this );
+    LOG_TRACE( "enter pendCopy: conn=0x%llx", ( UInt64 )this );
 
     try
     {
-        S3PutRequest request( key, uploader, totalSize );
-        put( &request, bucketName, key, NULL /* uploadId */, 0 /* partNumber */,
-            makePublic, useSrvEncrypt, contentType, response );
+        std::auto_ptr< S3CopyRequest > request( new S3CopyRequest( key ) );
+        initCopy( request.get(), bucketName, key, NULL /* uploadId */, 0 /* partNumber */, 
+            srcBucketName, srcKey, -1 /* srcOffset */, 0 /* srcSize */, makePublic, useSrvEncrypt );
+
+        // Start async.
+
+        m_curl.pendOp( asyncMan );
+        m_asyncRequest = request.release(); // nofail
     }
     catch( ... )
     {
-        throwSummary( "put", key );
+        throwSummary( "pendCopy", key );
     }
 
-    LOG_TRACE( "leave put: conn=0x%llx", ( UInt64 )this );
+    LOG_TRACE( "leave pendCopy: conn=0x%llx", ( UInt64 )this );
 }
 
-
 void
-S3Connection::pendPut( AsyncMan *asyncMan, const char *bucketName, 
-                      const char *key, const void *data, size_t size,
-                      bool makePublic, bool useSrvEncrypt )
+S3Connection::pendPutPartCopy( AsyncMan *asyncMan, const char *bucketName, const char *key, 
+                              const char *uploadId, int partNumber,
+                              const char *srcBucketName, const char *srcKey, size_t srcOffset, size_t srcSize )
 {
     dbgAssert( asyncMan != NULL );
     dbgAssert( bucketName );
-    dbgAssert( implies( size, data ) );
     dbgAssert( key );
+    dbgAssert( uploadId );
+    dbgAssert( partNumber > 0 );
+    dbgAssert( !m_isWalrus );
     dbgAssert( !m_asyncRequest );  // another async operation is in progress.
 
-    LOG_TRACE( "enter pendPut: conn=0x%llx", ( UInt64 )this );
+    LOG_TRACE( "enter pendPutPartCopy: conn=0x%llx", ( UInt64 )this );
 
     try
     {
-        // Initialize Put request.
-
-        std::auto_ptr< S3PutRequest > request( new S3PutRequest( key, data, size ) );
-        init( request.get(), bucketName, key, NULL /* keySuffix */, s_contentTypeBinary, makePublic, useSrvEncrypt );
+        std::auto_ptr< S3CopyRequest > request( new S3CopyRequest( key ) );
+        initCopy( request.get(), bucketName, key, uploadId, partNumber, 
+            srcBucketName, srcKey, srcOffset, srcSize, false /* makePublic */, false /* useSrvEncrypt */ );
 
         // Start async.
 
@@ -2715,10 +3566,10 @@ S3Connection::pendPut( AsyncMan *asyncMan, const char *bucketName,
     }
     catch( ... )
     {
-        throwSummary( "pendPut", key );
+        throwSummary( "pendPutPartCopy", key );
     }
 
-    LOG_TRACE( "leave pendPut: conn=0x%llx", ( UInt64 )this );
+    LOG_TRACE( "leave pendPutPartCopy: conn=0x%llx", ( UInt64 )this );
 }
 
 void
@@ -2776,6 +3627,8 @@ completeGet( S3ResponseDetails &responseDetails, S3GetResponse *response )
         response->loadedContentLength = responseDetails.loadedContentLength;
         response->isTruncated = responseDetails.isTruncated;
         response->etag.swap( responseDetails.etag );
+        response->contentEncoding.swap( responseDetails.httpContentEncoding );
+        response->metadata.swap( responseDetails.metadata );
     }
 }
 
@@ -2824,8 +3677,226 @@ S3Connection::get( const char *bucketName, const char *key, void *buffer, size_t
     get( bucketName, key, &loader, response );
 }
 
+void
+S3Connection::completeRangeGet( S3RangeGetRequest *request, const std::string &etag, S3GetResponse *response )
+{
+    dbgAssert( request );
+
+    bool changed = false;
+
+    // Once a server ignores multi-range, ask it for one range at a time.
+
+    if( request->isRangeIgnored() )
+    {
+        m_multiRangeIgnored = true;
+    }
+
+    // Fetch what the multi-range response didn't have, one range at a time,
+    // from the object it came from.
+
+    for( size_t i = 0; i < request->count(); ++i )
+    {
+        if( !request->isMissing( i ) )
+        {
+            continue;
+        }
+
+        const S3ByteRange &r = request->range( i );
+        size_t &received = request->received( i );
+        S3GetRangeRestLoader loader( request->loader(), i, received, r.size - received );
+        S3GetRequest rest( request->name(), &loader );
+        S3GetResponse restResponse;
+        char range[ 64 ];
+
+        snprintf( range, sizeof( range ), "bytes=%llu-%llu", ( unsigned long long )( r.offset + received ), 
+            ( unsigned long long )( r.offset + r.size - 1 ) );
+        init( &rest, request->bucketName(), request->name(), NULL /* keySuffix */, NULL /* contentType */, 
+            false /* makePublic */, false /* useSrvEncrypt */, range );
+
+        if( !etag.empty() )
+        {
+            appendRequestHeader( "If-Match", quoteEtag( etag ).c_str(), &rest.headers );
+            curl_easy_setopt_checked( m_curl, CURLOPT_HTTPHEADER, static_cast< curl_slist * >( rest.headers ) );
+        }
+
+        S3ResponseDetails &restDetails = rest.execute();
+
+        // 412 if the object has been overwritten in the meantime: the ranges
+        // got so far are of another version.
+
+        if( !strncmp( restDetails.httpStatus.c_str(), "412", 3 ) )
+        {
+            changed = true;
+            break;
+        }
+
+        ::webstor::completeGet( restDetails, &restResponse );
+        received = loader.offset;
+
+        if( restResponse.loadedContentLength == static_cast< size_t >( -1 ) )
+        {
+            break;  // deleted in the meantime
+        }
+    }
+
+    if( response )
+    {
+        response->loadedContentLength = 0;
+        response->isTruncated = changed;
+
+        for( size_t i = 0; i < request->count(); ++i )
+        {
+            response->loadedContentLength += request->received( i );
+            response->isTruncated = response->isTruncated || request->received( i ) < request->range( i ).size;
+        }
+    }
+}
+
+void
+S3Connection::get( const char *bucketName, const char *key, const S3ByteRange *ranges, size_t count,
+                    S3GetRangeLoader *loader, S3GetResponse *response /* out */ )
+{
+    dbgAssert( bucketName );
+    dbgAssert( key );
+    dbgAssert( ranges && count );
+
+    LOG_TRACE( "enter get ranges: conn=0x%llx, count=%llu", ( UInt64 )this, ( UInt64 )count );
+
+    try
+    {
+        // Initialize Get request.
+
+        S3RangeGetRequest request( key, bucketName, ranges, count, loader );
+        init( &request, bucketName, key, NULL /* keySuffix */, NULL /* contentType */, 
+            false /* makePublic */, false /* useSrvEncrypt */, request.rangeHeader( m_multiRangeIgnored ).c_str() );
+
+        // Execute the request.
+
+        S3ResponseDetails &responseDetails = request.execute();  
+
+        // Complete the request.
+
+        S3GetResponse getResponse;
+        ::webstor::completeGet( responseDetails, &getResponse );
+
+        if( getResponse.loadedContentLength == static_cast< size_t >( -1 ) )
+        {
+            if( response )
+            {
+                *response = getResponse;
+            }
+        }
+        else
+        {
+            completeRangeGet( &request, getResponse.etag, response );
+
+            if( response )
+            {
+                response->etag.swap( getResponse.etag );
+            }
+        }
+    }
+    catch( ... )
+    {
+        throwSummary( "get", key );
+    }
+
+    LOG_TRACE( "leave get ranges: conn=0x%llx", ( UInt64 )this );
+}
+
 void
 S3Connection::pendGet( AsyncMan *asyncMan, const char *bucketName, const char *key, void *buffer, size_t size, size_t offset)
+{
+    // A range needs at least one byte, offset -1 means the whole object.
+
+    if( offset == static_cast< size_t >( -1 ) || !size )
+    {
+        pendGet( asyncMan, bucketName, key, buffer, size, static_cast< const char * >( NULL ) );
+        return;
+    }
+
+    char range[ 64 ];
+    snprintf( range, sizeof( range ), "bytes=%llu-%llu", ( unsigned long long )offset, 
+        ( unsigned long long )( offset + size - 1 ) );
+    pendGet( asyncMan, bucketName, key, buffer, size, range );
+}
+
+void
+S3Connection::pendGet( AsyncMan *asyncMan, const char *bucketName, const char *key, 
+    const S3ByteRange *ranges, size_t count, S3GetRangeLoader *loader )
+{
+    dbgAssert( asyncMan != NULL );
+    dbgAssert( bucketName );
+    dbgAssert( key );
+    dbgAssert( ranges && count );
+    dbgAssert( !m_asyncRequest );  // another async operation is in progress.
+
+    LOG_TRACE( "enter pendGet ranges: conn=0x%llx, count=%llu", ( UInt64 )this, ( UInt64 )count );
+ 
+    try
+    {
+        // Initialize Get request.
+
+        std::auto_ptr< S3RangeGetRequest > request( new S3RangeGetRequest( key, bucketName, ranges, count, loader ) );
+        init( request.get(), bucketName, key, NULL /* keySuffix */, NULL /* contentType */, 
+            false /* makePublic */, false /* useSrvEncrypt */, request->rangeHeader( m_multiRangeIgnored ).c_str() );
+
+        // Start async.
+
+        m_curl.pendOp( asyncMan );
+        m_asyncRequest = request.release(); // nofail
+    }
+    catch( ... )
+    {
+        throwSummary( "pendGet", key );
+    }
+
+    LOG_TRACE( "leave pendGet ranges: conn=0x%llx", ( UInt64 )this );
+}
+
+void
+S3Connection::pendGetTail( AsyncMan *asyncMan, const char *bucketName, const char *key, void *buffer, size_t size )
+{
+    dbgAssert( size );
+
+    char range[ 64 ];
+    snprintf( range, sizeof( range ), "bytes=-%llu", ( unsigned long long )size );
+    pendGet( asyncMan, bucketName, key, buffer, size, range );
+}
+
+void
+S3Connection::pendGet( AsyncMan *asyncMan, const char *bucketName, const char *key, S3GetResponseLoader *loader )
+{
+    dbgAssert( asyncMan != NULL );
+    dbgAssert( bucketName );
+    dbgAssert( key );
+    dbgAssert( loader );
+    dbgAssert( !m_asyncRequest );  // another async operation is in progress.
+
+    LOG_TRACE( "enter pendGet loader: conn=0x%llx", ( UInt64 )this );
+ 
+    try
+    {
+        // Initialize Get request.
+
+        std::auto_ptr< S3GetRequest > request( new S3GetRequest( key, loader ) );
+        init( request.get(), bucketName, key );
+
+        // Start async.
+
+        m_curl.pendOp( asyncMan );
+        m_asyncRequest = request.release(); // nofail
+    }
+    catch( ... )
+    {
+        throwSummary( "pendGet", key );
+    }
+
+    LOG_TRACE( "leave pendGet loader: conn=0x%llx", ( UInt64 )this );
+}
+
+void
+S3Connection::pendGet( AsyncMan *asyncMan, const char *bucketName, const char *key, void *buffer, size_t size, const char *range )
 {
     dbgAssert( asyncMan != NULL );
     dbgAssert( bucketName );
@@ -2840,15 +3911,8 @@ S3Connection::pendGet( AsyncMan *asyncMan, const char *bucketName, const char *k
         // Initialize Get request.
 
         std::auto_ptr< S3GetRequest > request( new S3GetRequest( key, buffer, size ) );
-        
-        if (offset >= 0 )
-        {
-            init( request.get(), bucketName, key, NULL, NULL, false, false,  offset, offset + size);
-        }
-        else
-        {
-            init( request.get(), bucketName, key);
-        }
+        init( request.get(), bucketName, key, NULL /* keySuffix */, NULL /* contentType */, 
+            false /* makePublic */, false /* useSrvEncrypt */, range );
 
         // Start async.
 
@@ -2867,7 +3931,7 @@ void
 S3Connection::completeGet( S3GetResponse *response )
 {
     dbgAssert( m_asyncRequest );
-    dbgAssert( dynamic_cast< S3GetRequest *>( m_asyncRequest ) );
+    dbgAssert( dynamic_cast< S3GetRequest *>( m_asyncRequest ) || dynamic_cast< S3RangeGetRequest *>( m_asyncRequest ) );
 
     LOG_TRACE( "enter completeGet: conn=0x%llx", ( UInt64 )this );
 
@@ -2885,7 +3949,34 @@ S3Connection::completeGet( S3GetResponse *response )
         // Complete the request.
 
         S3ResponseDetails &responseDetails = request->complete( static_cast< CURLcode >( m_curl.opResult() ) );
-        ::webstor::completeGet( responseDetails, response );
+        S3RangeGetRequest *rangeRequest = dynamic_cast< S3RangeGetRequest * >( request.get() );
+
+        if( !rangeRequest )
+        {
+            ::webstor::completeGet( responseDetails, response );
+        }
+        else
+        {
+            S3GetResponse getResponse;
+            ::webstor::completeGet( responseDetails, &getResponse );
+
+            if( getResponse.loadedContentLength == static_cast< size_t >( -1 ) )
+            {
+                if( response )
+                {
+                    *response = getResponse;
+                }
+            }
+            else
+            {
+                completeRangeGet( rangeRequest, getResponse.etag, response );
+
+                if( response )
+                {
+                    response->etag.swap( getResponse.etag );
+                }
+            }
+        }
     }
     catch( ... )
     {
@@ -3071,6 +4162,45 @@ S3Connection::del( const char *bucketName, const char *key, S3DelResponse *respo
     LOG_TRACE( "leave del: conn=0x%llx", ( UInt64 )this );
 }
 
+void
+S3Connection::head( const char *bucketName, const char *key, S3HeadResponse *response )
+{
+    dbgAssert( bucketName );
+    dbgAssert( key );
+    dbgAssert( response );
+
+    LOG_TRACE( "enter head: conn=0x%llx", ( UInt64 )this );
+
+    try
+    {
+        S3HeadRequest request( key );
+        init( &request, bucketName, key );
+
+        S3ResponseDetails &responseDetails = request.execute();  
+
+        // There is no payload to tell why, a missing object is just 404.
+
+        if( responseDetails.status == S3_RESPONSE_STATUS_HTTP_RESOURSE_NOT_FOUND )
+        {
+            responseDetails.status = S3_RESPONSE_STATUS_SUCCESS;
+            responseDetails.httpContentLength = -1;
+        }
+
+        handleErrors( responseDetails );
+
+        response->contentLength = responseDetails.httpContentLength;
+        response->etag.swap( responseDetails.etag );
+        response->contentEncoding.swap( responseDetails.httpContentEncoding );
+        response->metadata.swap( responseDetails.metadata );
+    }
+    catch( ... )
+    {
+        throwSummary( "head", key );
+    }
+
+    LOG_TRACE( "leave head: conn=0x%llx", ( UInt64 )this );
+}
+
 void
 S3Connection::pendDel( AsyncMan *asyncMan, const char *bucketName, const char *key )
 {
@@ -3163,7 +4293,7 @@ S3Connection::delAll( const char *bucketName, const char *prefix, unsigned int m
 void 
 S3Connection::initiateMultipartUpload( const char *bucketName, const char *key, 
                         bool makePublic, bool useSrvEncrypt, const char *contentType,
-                        S3InitiateMultipartUploadResponse *response /* out */  )
+                        S3InitiateMultipartUploadResponse *response /* out */, const S3Metadata *metadata )
 {
     dbgAssert( bucketName );
     dbgAssert( key );
@@ -3175,7 +4305,8 @@ S3Connection::initiateMultipartUpload( const char *bucketName, const char *key,
     {
         S3InitiateMultipartUploadRequest request( key );
         init( &request, bucketName, key, "?uploads" /* keySuffix */, 
-            contentType ? contentType : s_contentTypeBinary, makePublic, useSrvEncrypt );
+            contentType ? contentType : s_contentTypeBinary, makePublic, useSrvEncrypt, NULL /* range */,
+            NULL /* copySource */, NULL /* copyRange */, metadata );
 
         S3ResponseDetails &responseDetails = request.execute();  
         handleErrors( responseDetails );
@@ -3268,6 +4399,41 @@ S3Connection::putPart( const char *bucketName, const char *key, const char *uplo
     LOG_TRACE( "leave putPart: conn=0x%llx", ( UInt64 )this );
 }
 
+void
+S3Connection::putPartCopy( const char *bucketName, const char *key, const char *uploadId, int partNumber,
+                          const char *srcBucketName, const char *srcKey, size_t srcOffset, size_t srcSize,
+                          S3PutResponse *response /* out */ )
+{
+    dbgAssert( bucketName );
+    dbgAssert( key );
+    dbgAssert( uploadId );
+    dbgAssert( partNumber > 0 );
+    dbgAssert( !m_isWalrus );
+
+    LOG_TRACE( "enter putPartCopy: conn=0x%llx", ( UInt64 )this );
+
+    try
+    {
+        S3CopyRequest request( key );
+        initCopy( &request, bucketName, key, uploadId, partNumber, 
+            srcBucketName, srcKey, srcOffset, srcSize, false /* makePublic */, false /* useSrvEncrypt */ );
+
+        S3ResponseDetails &responseDetails = request.execute();  
+        ::webstor::completePut( responseDetails, response );
+
+        if( response )
+        {
+            response->partNumber = partNumber;
+        }
+    }
+    catch( ... )
+    {
+        throwSummary( "putPartCopy", key );
+    }
+
+    LOG_TRACE( "leave putPartCopy: conn=0x%llx", ( UInt64 )this );
+}
+
 void 
 S3Connection::completeMultipartUpload( const char *bucketName, const char *key, 
                         const char *uploadId, const S3PutResponse *parts, size_t size, 
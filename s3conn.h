@@ -35,6 +35,7 @@
 #include "asyncurl.h"
 
 #include <exception>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -131,6 +132,13 @@ S3Bucket::clear()
     creationDate.clear();
 }
 
+//////////////////////////////////////////////////////////////////////////////
+///@brief User metadata of an S3 object ("x-amz-meta-*" headers).
+///@details Maps lowercase names, without the "x-amz-meta-" prefix, to values.
+/// Amazon S3 limits the whole metadata to 2KB.
+
+typedef std::map< std::string, std::string > S3Metadata;
+
 //////////////////////////////////////////////////////////////////////////////
 ///@brief Response from 'put' and 'putPart' requests.
 
@@ -178,6 +186,14 @@ struct S3GetResponse
     /// Object's etag.
 
     std::string     etag;
+
+    /// Content-Encoding of the object (e.g. "gzip"), empty if it has none.
+
+    std::string     contentEncoding;
+
+    /// User metadata of the object.
+
+    S3Metadata      metadata;
 };
 
 ///@brief An abstract class to download 'get' payload.
@@ -190,6 +206,68 @@ struct S3GetResponseLoader
     /// stopped.
 
     virtual size_t  onLoad( const void *chunkData, size_t chunkSize, size_t totalSizeHint ) = 0; 
+
+    ///@brief   A callback made once before the first onLoad(..) of a response.
+    ///@details Passes the Content-Encoding of the object (empty if it has none)
+    /// and its user metadata, e.g. to tell how to decode the payload.
+
+    virtual void    onHeaders( const std::string &contentEncoding, const S3Metadata &metadata ) {}
+};
+
+///@brief A byte range of an S3 object for multi-range 'get' requests.
+
+struct S3ByteRange
+{
+    /// Offset of the first byte of the range in the object.
+
+    size_t          offset;
+
+    /// Number of bytes in the range, must not be 0.
+
+    size_t          size;
+
+    /// Buffer of at least <b>size</b> bytes that receives the range, used only 
+    /// if no S3GetRangeLoader is given.
+
+    void           *buffer;
+};
+
+///@brief An abstract class to download multi-range 'get' payload.
+
+struct S3GetRangeLoader
+{
+    ///@brief   A callback to fetch a part of the range number <b>index</b>. 
+    ///@details <b>offset</b> is relative to the start of the range. Bytes of a range 
+    /// come in order but ranges may come in any order.
+    /// The method is supposed to return a number of bytes it has read,
+    /// if the return value is less than the chunkSize, the farther processing will be
+    /// stopped.
+
+    virtual size_t  onLoadRange( size_t index, size_t offset, const void *chunkData, size_t chunkSize ) = 0; 
+};
+
+//////////////////////////////////////////////////////////////////////////////
+///@brief Response from 'head' request.
+
+struct S3HeadResponse  
+{
+                    S3HeadResponse() : contentLength( -1 ) {}
+
+    /// Size of the object, -1 means object is not found.
+
+    size_t          contentLength;  
+
+    /// Object's etag.
+
+    std::string     etag;
+
+    /// Content-Encoding of the object (e.g. "gzip"), empty if it has none.
+
+    std::string     contentEncoding;
+
+    /// User metadata of the object.
+
+    S3Metadata      metadata;
 };
 
 //////////////////////////////////////////////////////////////////////////////
@@ -367,6 +445,7 @@ typedef int ( TraceCallback ) ( void *handle, TraceInfo type, unsigned char *dat
 
 
 class S3Request;
+class S3RangeGetRequest;
 
 //////////////////////////////////////////////////////////////////////////////
 ///@brief S3Connection to access Amazon S3 storage.
@@ -411,21 +490,31 @@ public:
 
    ///@brief Synchronously creates an S3 object.
    ///@details Creates S3 object identified by a <b>key</b> in a given <b>bucket</b> and 
-   /// uploads <b>data</b>.
+   /// uploads <b>data</b>. The object gets the user <b>metadata</b>, if any.
 
    void             put( const char *bucketName, const char *key, const void *data, size_t size,
                         bool makePublic = false, bool useSrvEncrypt = false, const char *contentType = NULL,
-                        S3PutResponse *response = NULL /* out */ );
+                        S3PutResponse *response = NULL /* out */, const S3Metadata *metadata = NULL );
 
    ///@brief Synchronously creates an S3 object.
    ///@details Creates S3 object identified by a <b>key</b> in a given <b>bucket</b> and 
    /// uploads data with <b>uploader</b>. 
    /// Total size of the data being uploaded must be
-   /// specified in <b>totalSize</b>.
+   /// specified in <b>totalSize</b>. The object gets the user <b>metadata</b>, if any.
 
    void             put( const char *bucketName, const char *key, S3PutRequestUploader *uploader, size_t totalSize,
                        bool makePublic = false, bool useSrvEncrypt = false, const char *contentType = NULL,
-                       S3PutResponse *response = NULL /* out */ );
+                       S3PutResponse *response = NULL /* out */, const S3Metadata *metadata = NULL );
+
+   ///@brief Synchronously replaces an S3 object if nobody else did.
+   ///@details Like put(), but Amazon S3 stores <b>data</b> only if the object
+   /// identified by a <b>key</b> still has the <b>etag</b>, or is still missing if
+   /// <b>etag</b> is empty (If-Match/If-None-Match).
+   ///@return false if the object has changed, it is left as it is.
+
+   bool             putIf( const char *bucketName, const char *key, const void *data, size_t size,
+                        const std::string &etag, S3PutResponse *response = NULL /* out */,
+                        const S3Metadata *metadata = NULL );
 
    ///@brief Synchronously loads an S3 object.
    ///@details Fetches content of an S3 object identified by a <b>key</b> from
@@ -453,6 +542,34 @@ public:
    void             get( const char *bucketName, const char *key, void *buffer, size_t size, 
                         S3GetResponse *response = NULL /* out */ );
 
+   ///@brief Synchronously loads several byte ranges of an S3 object.
+   ///@details Fetches <b>count</b> <b>ranges</b> of an S3 object identified by a <b>key</b> from
+   /// a given <b>bucket</b> with a single multi-range request ("Range: bytes=a-b,c-d,.."),
+   /// parses the multipart/byteranges response and passes every range to the <b>loader</b>,
+   /// or copies it into the range's <b>buffer</b> if there is no loader.
+   /// If it answers with fewer ranges than requested, the rest is fetched with 
+   /// one request per missing range, conditional on the etag of the first response.
+   /// If the server answers with the whole object, multi-range is not supported:
+   /// the ranges are fetched one at a time and so are those of later requests
+   /// of the connection.
+   /// <b>loadedContentLength</b> (in S3GetResponse) is the number of bytes loaded into 
+   /// the ranges, -1 if the object is missing.
+   /// <b>isTruncated</b> is set if some range could not be loaded completely 
+   /// (e.g. it ends past the end of the object, or the object has been overwritten 
+   /// while its ranges were fetched).
+
+   void             get( const char *bucketName, const char *key, 
+                        const S3ByteRange *ranges, size_t count,
+                        S3GetRangeLoader *loader = NULL, 
+                        S3GetResponse *response = NULL /* out */ );
+
+   ///@brief Synchronously gets S3 object properties.
+   ///@details Fetches the size, etag and user metadata of an S3 object identified by a <b>key</b> 
+   /// in a given <b>bucket</b> without its content ("HEAD" request).
+   /// If <b>contentLength</b> (in S3HeadResponse) is set to -1, the object is missing.
+
+   void             head( const char *bucketName, const char *key, S3HeadResponse *response /* out */ );
+
    ///@brief Synchronously gets a page of S3 object identifiers.
    ///@details Lists up to the <b>maxKeys</b> objects (or 'directories') in a given <b>bucket</b> and 
    /// calls the provided <b>objectEnum</b> for each object name.
@@ -517,10 +634,12 @@ public:
    ///@details Initiates a multipart upload of an object identified by a <b>key</b> into a given <b>bucket</b>.
    /// Returns an <b>uploadId</b> (in S3InitiateMultipartUploadResponse) that needs to be used 
    /// by subsequent putPart(..) and completeMultipartUpload(..) methods.
+   /// The object gets the user <b>metadata</b>, if any.
 
    void             initiateMultipartUpload( const char *bucketName, const char *key, 
                         bool makePublic = false, bool useSrvEncrypt = false, const char *contentType = NULL,
-                        S3InitiateMultipartUploadResponse *response = NULL /* out */  );
+                        S3InitiateMultipartUploadResponse *response = NULL /* out */,
+                        const S3Metadata *metadata = NULL );
 
    ///@brief Synchronously uploads a single part.
    ///@details Uploads a single part with a given <b>partNumber</b> for a multipart
@@ -542,6 +661,27 @@ public:
    void             putPart( const char *bucketName, const char *key, const char *uploadId, int partNumber,
                         S3PutRequestUploader *uploader, size_t partSize, S3PutResponse *response = NULL /* out */  );
 
+   ///@brief Synchronously copies an S3 object.
+   ///@details Creates S3 object identified by a <b>key</b> in a given <b>bucket</b> as 
+   /// a copy of <b>srcKey</b> in <b>srcBucketName</b> ("x-amz-copy-source"). The data
+   /// is copied by the server and doesn't pass through the client. Objects larger than
+   /// 5GB must be copied with a multipart upload and putPartCopy(..).
+
+   void             copy( const char *srcBucketName, const char *srcKey, 
+                        const char *bucketName, const char *key,
+                        bool makePublic = false, bool useSrvEncrypt = false,
+                        S3PutResponse *response = NULL /* out */ );
+
+   ///@brief Synchronously uploads a single part as a copy of a source object range.
+   ///@details Same as putPart(..) but the part is <b>srcSize</b> bytes of <b>srcKey</b> in
+   /// <b>srcBucketName</b> at <b>srcOffset</b> ("UploadPartCopy" with "x-amz-copy-source-range"), 
+   /// copied by the server. <b>srcOffset</b> -1 means the whole source object.
+   /// The part must be at least 5MB unless it's the last one.
+
+   void             putPartCopy( const char *bucketName, const char *key, const char *uploadId, int partNumber,
+                        const char *srcBucketName, const char *srcKey, size_t srcOffset, size_t srcSize,
+                        S3PutResponse *response = NULL /* out */ );
+
    ///@brief Synchronously commits a multipart upload.
    ///@details Commits a multipart upload consisting of parts specified in the <b>parts</b> array
    /// (<b>parts</b> is the pointer to the first element and <b>size</b> is the number of elements in the array).
@@ -630,7 +770,7 @@ public:
    
    void             pendPut( AsyncMan *asyncMan, const char *bucketName, const char *key, 
                         const void *data, size_t size,
-                        bool makePublic = false, bool useSrvEncrypt = false);
+                        bool makePublic = false, bool useSrvEncrypt = false, const S3Metadata *metadata = NULL );
 
    ///@brief Waits and completes the asynchronous <b>put</b> request.
    ///@details Completes the started asynchronous put operation. The method blocks till the operation finishes.
@@ -638,6 +778,32 @@ public:
 
    void             completePut( S3PutResponse *response = NULL /* out */ );
 
+   ///@brief Starts asynchronous <b>putPart</b> request.
+   ///@details Asynchronously uploads a single part, see putPart(..), so that the 
+   /// caller can prepare the next part meanwhile. Complete it with completePut(..), 
+   /// which doesn't set <b>partNumber</b> of the response.
+   /// Both <b>asyncMan</b> and the <b>data</b> buffer must be available till the 
+   /// completePut(..) or cancelAsync(..) methods are called.
+
+   void             pendPutPart( AsyncMan *asyncMan, const char *bucketName, const char *key, 
+                        const char *uploadId, int partNumber, const void *data, size_t size );
+
+   ///@brief Starts asynchronous <b>copy</b> request.
+   ///@details Asynchronous version of copy(..). Complete it with completePut(..).
+
+   void             pendCopy( AsyncMan *asyncMan, const char *srcBucketName, const char *srcKey, 
+                        const char *bucketName, const char *key,
+                        bool makePublic = false, bool useSrvEncrypt = false );
+
+   ///@brief Starts asynchronous <b>putPartCopy</b> request.
+   ///@details Asynchronous version of putPartCopy(..), so that many parts can be 
+   /// copied at once over several S3Connections. Complete it with completePut(..), 
+   /// which doesn't set <b>partNumber</b> of the response.
+
+   void             pendPutPartCopy( AsyncMan *asyncMan, const char *bucketName, const char *key, 
+                        const char *uploadId, int partNumber,
+                        const char *srcBucketName, const char *srcKey, size_t srcOffset, size_t srcSize );
+
    ///@brief Starts asynchronous <b>get</b> request.
    ///@details Asynchronously fetches content of an S3 object identified by a <b>key</b> from
    /// a given <b>bucket</b> and writes the content into the provided <b>buffer</b>.
@@ -650,6 +816,34 @@ public:
    void             pendGet( AsyncMan *asyncMan, const char *bucketName, const char *key, 
                         void *buffer, size_t size, size_t offset = -1);
 
+   ///@brief Starts asynchronous <b>get</b> of the last bytes of an S3 object.
+   ///@details Same as pendGet(..) but fetches at most <b>size</b> bytes from the end
+   /// of the object (or the whole object if it is smaller), e.g. to read a footer
+   /// without knowing the object size. Complete it with completeGet(..).
+
+   void             pendGetTail( AsyncMan *asyncMan, const char *bucketName, const char *key, 
+                        void *buffer, size_t size );
+
+   ///@brief Starts asynchronous <b>get</b> request.
+   ///@details Same as pendGet(..) but passes the content to the <b>loader</b>, 
+   /// which is called on the <b>asyncMan</b> thread as the data arrives, e.g. to 
+   /// decompress it while the rest is still on the wire. 
+   /// The <b>loader</b> must be available till the completeGet(..) or cancelAsync(..) 
+   /// methods are called.
+
+   void             pendGet( AsyncMan *asyncMan, const char *bucketName, const char *key, 
+                        S3GetResponseLoader *loader );
+
+   ///@brief Starts asynchronous multi-range <b>get</b> request.
+   ///@details Asynchronous version of the multi-range get(..). The <b>ranges</b> are copied,
+   /// but the <b>loader</b> or the range buffers must be available till the 
+   /// completeGet(..) or cancelAsync(..) methods are called. completeGet(..) may send 
+   /// the fallback requests for missing ranges, synchronously.
+
+   void             pendGet( AsyncMan *asyncMan, const char *bucketName, const char *key, 
+                        const S3ByteRange *ranges, size_t count,
+                        S3GetRangeLoader *loader = NULL );
+
    ///@brief Waits and completes the asynchronous <b>get</b> request.
    ///@details Completes the started asynchronous get operation. The method blocks till the operation finishes.
    /// After the method returns, the caller can start another sync or async operation.
@@ -700,6 +894,29 @@ public:
    static int       waitAny( S3Connection **cons, size_t count, size_t startFrom = 0,
                             long timeout = -1 /* infinite */ );
 
+   ///@brief Attaches the connection to <b>queue</b>: when an async operation completes, 
+   /// <b>tag</b> is pushed to it (see CompletionQueue). NULL detaches.
+   ///@details Unlike waitAny(..), the cost per completion does not depend on the number
+   /// of connections. Detaches the connection from its CompletionHandler, if any.
+   /// Must not be called while an async operation is pending.
+
+   void             setCompletionQueue( CompletionQueue *queue, void *tag ); // nofail
+
+   ///@brief Attaches the connection to <b>handler</b>: when an async operation completes,
+   /// it is called with <b>tag</b> on the AsyncLoop thread (see CompletionHandler). NULL detaches.
+   ///@details The handler can complete the operation and pend the next one with no handoff
+   /// to another thread. Detaches the connection from its CompletionQueue, if any.
+   /// Must not be called while an async operation is pending.
+
+   void             setCompletionHandler( CompletionHandler *handler, void *tag ); // nofail
+
+   ///@brief Assigns the connection to a thread of the pool of the AsyncMan it pends
+   /// operations with (modulo the number of threads), see AsyncMan::LoopPool.
+   ///@details Without it, the connection is assigned at its first async operation.
+   /// Must not be called while an async operation is pending.
+
+   void             setAsyncLoop( size_t loop ); // nofail
+
    /// Sets timeouts, in milliseconds.
 
    void             setTimeout( long timeout ); 
@@ -718,16 +935,31 @@ private:
 
     void            prepare( S3Request *request, const char *bucketName, const char *key,
                         const char *contentType = NULL,
-                        bool makePublic = false, bool useSrvEncrypt = false, size_t low = 0, size_t high = 0);
+                        bool makePublic = false, bool useSrvEncrypt = false, const char *range = NULL,
+                        const char *copySource = NULL, const char *copyRange = NULL, 
+                        const S3Metadata *metadata = NULL );
 
     void            init( S3Request *request, const char *bucketName, const char *key, 
                         const char *keySuffix = NULL, const char *contentType = NULL, 
-                        bool makePublic = false, bool useSrvEncrypt = false, size_t low = 0, size_t high = 0);
+                        bool makePublic = false, bool useSrvEncrypt = false, const char *range = NULL,
+                        const char *copySource = NULL, const char *copyRange = NULL, 
+                        const S3Metadata *metadata = NULL );
+
+    void            initCopy( S3Request *request, const char *bucketName, const char *key, 
+                        const char *uploadId, int partNumber,
+                        const char *srcBucketName, const char *srcKey, size_t srcOffset, size_t srcSize,
+                        bool makePublic, bool useSrvEncrypt );
+
+    void            pendGet( AsyncMan *asyncMan, const char *bucketName, const char *key, 
+                        void *buffer, size_t size, const char *range );
+
+    void            completeRangeGet( S3RangeGetRequest *request, const std::string &etag, 
+                        S3GetResponse *response );
 
     void            put( S3Request *request, const char *bucketName, const char *key, 
                         const char *uploadId, int partNumber, 
                         bool makePublic, bool useSrvEncrypt, const char *contentType,
-                        S3PutResponse *response );
+                        S3PutResponse *response, const S3Metadata *metadata = NULL );
 
     void            del( const char *bucketName, const char *key, const char *keySuffix, 
                         S3DelResponse *response );
@@ -750,6 +982,11 @@ private:
 
     S3Request *     m_asyncRequest;
 
+    // The server has answered a multi-range get with the whole object, so
+    // ranges are requested one at a time.
+
+    bool            m_multiRangeIgnored;
+
     // Timeouts.
 
     long            m_timeout;          // in milliseconds
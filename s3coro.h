@@ -0,0 +1,782 @@
+#ifndef INCLUDED_S3CORO_H
+#define INCLUDED_S3CORO_H
+
+//////////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2011-2012, OblakSoft LLC.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//
+// Authors: Maxim Mazeev <mazeev@hotmail.com>
+//          Artem Livshits <artem.livshits@gmail.com>
+
+//////////////////////////////////////////////////////////////////////////////
+// C++20 coroutines over S3Connection async operations.
+//////////////////////////////////////////////////////////////////////////////
+
+#include "s3conn.h"
+#include "sysutils.h"
+
+#if defined( __cpp_impl_coroutine ) && __has_include( <coroutine> )
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace webstor
+{
+
+class S3Executor;
+
+//////////////////////////////////////////////////////////////////////////////
+///@brief S3Canceled -- thrown by an operation awaited after S3Executor::cancel().
+
+class S3Canceled : public std::exception
+{
+public:
+    virtual const char *    what() const throw() { return "The async operation is canceled."; }
+};
+
+namespace internal
+{
+
+//////////////////////////////////////////////////////////////////////////////
+///@brief INTERNAL: S3TaskPromiseBase -- the promise of S3Task but the result.
+
+struct S3TaskPromiseBase
+{
+    // Resumes the awaiting coroutine, if any, or tells the executor that
+    // the spawned task is over.
+
+    struct FinalAwaiter
+    {
+        bool            await_ready() const noexcept { return false; }
+
+        template< class Promise >
+        std::coroutine_handle<>  await_suspend( std::coroutine_handle< Promise > handle ) noexcept;
+
+        void            await_resume() const noexcept {}
+    };
+
+                    S3TaskPromiseBase() : executor( 0 ), rootIndex( 0 ) {}
+
+    std::suspend_always initial_suspend() const noexcept { return std::suspend_always(); }
+    FinalAwaiter    final_suspend() const noexcept { return FinalAwaiter(); }
+    void            unhandled_exception() noexcept { exception = std::current_exception(); }
+
+    std::coroutine_handle<>     continuation;   // the awaiting coroutine
+    S3Executor *                executor;       // set if the task is spawned
+    size_t                      rootIndex;      // in the spawned tasks of the executor
+    std::exception_ptr          exception;
+};
+
+template< class T >
+struct S3TaskPromise : S3TaskPromiseBase
+{
+    void            return_value( T v ) { value.emplace( std::move( v ) ); }
+
+    T               result()
+                    {
+                        if( exception )
+                            std::rethrow_exception( exception );
+                        return std::move( *value );
+                    }
+
+    std::optional< T >  value;
+};
+
+template<>
+struct S3TaskPromise< void > : S3TaskPromiseBase
+{
+    void            return_void() noexcept {}
+
+    void            result()
+                    {
+                        if( exception )
+                            std::rethrow_exception( exception );
+                    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+///@brief INTERNAL: S3Op -- an async operation of an S3Connection, the base
+/// of the awaitables returned by S3Executor.
+///@details The operation is pended when it is created, so several of them
+/// (on different connections) run at once and are awaited in any order.
+/// The connection is attached to the executor's CompletionQueue with the
+/// operation as the tag, and detached before the operation goes away, so
+/// a tag left in the queue is never a dangling pointer.
+
+class S3Op
+{
+public:
+    bool            await_ready();  // nofail
+    void            await_suspend( std::coroutine_handle<> handle ) noexcept { m_handle = handle; }
+
+protected:
+                    S3Op( S3Executor *executor, S3Connection *con );
+                    ~S3Op();  // nofail, cancels the operation if it is not completed
+
+    // Attaches the connection, false if the executor is canceled.
+
+    bool            attach();  // nofail
+    void            started();  // nofail, the operation is pended
+
+    // Throws S3Canceled if the operation is canceled, otherwise the caller
+    // completes it while the returned guard is alive.
+
+    struct Completion
+    {
+        explicit        Completion( S3Op *op ) : m_op( op ) {}
+                        ~Completion() { m_op->detach(); }
+
+        S3Op *          m_op;
+    };
+
+    void            checkCanceled() const;
+
+    S3Executor *    m_executor;
+    S3Connection *  m_con;
+
+private:
+    friend class webstor::S3Executor;
+
+                    S3Op( const S3Op & );  // forbidden
+    S3Op &          operator=( const S3Op & );  // forbidden
+
+    void            detach();  // nofail
+
+    std::coroutine_handle<>     m_handle;   // the awaiting coroutine
+    S3Op *                      m_prev;     // pending operations of the executor
+    S3Op *                      m_next;     // or canceled ones to resume
+    bool                        m_attached;
+    bool                        m_active;   // pended, not yet completed or canceled
+    bool                        m_pending;  // its completion is yet to be seen
+    bool                        m_canceled;
+};
+
+}  // namespace internal
+
+//////////////////////////////////////////////////////////////////////////////
+///@brief S3Task -- a coroutine of S3 operations, awaited by another S3Task or
+/// spawned with S3Executor::spawn(..).
+///@details The task starts when it is awaited (or spawned) and resumes its
+/// awaiter when it is over, returning a <b>T</b> or throwing what the
+/// coroutine has thrown. A suspended task is just its coroutine frame, it
+/// doesn't hold a thread.
+///@code
+/// S3Task< size_t >
+/// getBoth( S3Executor *ex, S3Connection *a, S3Connection *b, char *buf, size_t size )
+/// {
+///     S3GetOp first = ex->get( a, "bucket", "key1", buf, size );
+///     S3GetOp second = ex->get( b, "bucket", "key2", buf + size, size );
+///
+///     size_t loaded = ( co_await first ).loadedContentLength;
+///     co_return loaded + ( co_await second ).loadedContentLength;
+/// }
+///@endcode
+
+template< class T = void >
+class S3Task
+{
+public:
+    struct promise_type : internal::S3TaskPromise< T >
+    {
+        S3Task          get_return_object()
+                        { return S3Task( std::coroutine_handle< promise_type >::from_promise( *this ) ); }
+    };
+
+    typedef std::coroutine_handle< promise_type > Handle;
+
+                    S3Task( S3Task &&other ) noexcept : m_handle( std::exchange( other.m_handle, nullptr ) ) {}
+                    ~S3Task() { if( m_handle ) m_handle.destroy(); }
+
+    bool            await_ready() const noexcept { return !m_handle || m_handle.done(); }
+
+    std::coroutine_handle<>  await_suspend( std::coroutine_handle<> awaiting ) noexcept
+                    {
+                        m_handle.promise().continuation = awaiting;
+                        return m_handle;
+                    }
+
+    T               await_resume() { return m_handle.promise().result(); }
+
+private:
+    friend class S3Executor;
+
+    explicit        S3Task( Handle handle ) : m_handle( handle ) {}
+                    S3Task( const S3Task & );  // forbidden
+    S3Task &        operator=( const S3Task & );  // forbidden
+
+    Handle          m_handle;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+///@brief Awaitables of S3Executor operations, co_await returns the response.
+
+class S3GetOp : public internal::S3Op
+{
+public:
+    S3GetResponse   await_resume();
+
+private:
+    friend class S3Executor;
+
+                    S3GetOp( S3Executor *executor, S3Connection *con, const char *bucketName,
+                        const char *key, void *buffer, size_t size, size_t offset );
+                    S3GetOp( S3Executor *executor, S3Connection *con, const char *bucketName,
+                        const char *key, S3GetResponseLoader *loader );
+};
+
+class S3PutOp : public internal::S3Op
+{
+public:
+    S3PutResponse   await_resume();
+
+private:
+    friend class S3Executor;
+
+                    S3PutOp( S3Executor *executor, S3Connection *con, const char *bucketName,
+                        const char *key, const void *data, size_t size,
+                        bool makePublic, bool useSrvEncrypt, const S3Metadata *metadata );
+};
+
+class S3DelOp : public internal::S3Op
+{
+public:
+    S3DelResponse   await_resume();
+
+private:
+    friend class S3Executor;
+
+                    S3DelOp( S3Executor *executor, S3Connection *con, const char *bucketName,
+                        const char *key );
+};
+
+//////////////////////////////////////////////////////////////////////////////
+///@brief S3Executor -- runs S3Tasks on the thread that calls run(..).
+///@details The AsyncLoop threads push completed operations to the executor's
+/// CompletionQueue; run(..) pops them and resumes the tasks awaiting them,
+/// so the cost per completion doesn't depend on the number of tasks or
+/// connections.
+///
+///@remarks Cancellation is structured: cancel() cancels every pending operation
+/// of the executor and every operation awaited after it throws S3Canceled,
+/// which unwinds the tasks through their awaiters. A task that must outlive
+/// a cancellation runs on an executor of its own.
+///
+///@remarks Thread-safety: the executor, its tasks and the operations are used
+/// by the thread that calls run(..). Connections must outlive the executor,
+/// an operation is started on an idle connection only, and a connection is
+/// used by one executor at a time.
+
+class S3Executor
+{
+public:
+    explicit        S3Executor( AsyncMan *asyncMan );
+
+    /// Cancels the pending operations and destroys the tasks left.
+
+                    ~S3Executor();  // nofail
+
+    AsyncMan *      asyncMan() const { return m_asyncMan; }
+
+    ///@brief Starts <b>task</b>: it runs till it awaits, run(..) resumes it.
+
+    void            spawn( S3Task<> task );
+
+    ///@brief Resumes the tasks as their operations complete, till all spawned tasks
+    /// are over or no operation completes for <b>msTimeout</b> milliseconds (-1 is infinite).
+    ///@details Returns the number of tasks left. If a spawned task has thrown,
+    /// its exception is rethrown (once) and the other tasks go on.
+
+    size_t          run( long msTimeout = -1 /* infinite */ );
+
+    /// Cancels the pending operations, see the remarks.
+
+    void            cancel();  // nofail
+    bool            isCanceled() const { return m_canceled; }
+
+    /// Number of spawned tasks not over yet.
+
+    size_t          taskCount() const { return m_roots.size() - m_finished.size(); }
+
+    ///@brief Operations, see the S3Connection methods of the same arguments.
+    ///@details The operation is pended at once, the connection and the buffers
+    /// must be available till it is awaited or destroyed.
+
+    S3GetOp         get( S3Connection *con, const char *bucketName, const char *key,
+                        void *buffer, size_t size, size_t offset = -1 )
+                    { return S3GetOp( this, con, bucketName, key, buffer, size, offset ); }
+
+    S3GetOp         get( S3Connection *con, const char *bucketName, const char *key,
+                        S3GetResponseLoader *loader )
+                    { return S3GetOp( this, con, bucketName, key, loader ); }
+
+    S3PutOp         put( S3Connection *con, const char *bucketName, const char *key,
+                        const void *data, size_t size,
+                        bool makePublic = false, bool useSrvEncrypt = false, const S3Metadata *metadata = NULL )
+                    { return S3PutOp( this, con, bucketName, key, data, size, makePublic, useSrvEncrypt, metadata ); }
+
+    S3DelOp         del( S3Connection *con, const char *bucketName, const char *key )
+                    { return S3DelOp( this, con, bucketName, key ); }
+
+public:
+    void            finish( internal::S3TaskPromiseBase *promise );  // nofail, INTERNAL
+
+private:
+    friend class internal::S3Op;
+
+    enum { c_popBatch = 64 };
+
+    struct Root
+    {
+        std::coroutine_handle<>         handle;
+        internal::S3TaskPromiseBase *   promise;
+    };
+
+                    S3Executor( const S3Executor & );  // forbidden
+    S3Executor &    operator=( const S3Executor & );  // forbidden
+
+    void            link( internal::S3Op *op );  // nofail
+    void            unlink( internal::S3Op *op );  // nofail
+    void            reap();
+
+    AsyncMan *                  m_asyncMan;
+    CompletionQueue             m_queue;
+    internal::S3Op *            m_pending;      // pended operations, their completions are yet to be seen
+    size_t                      m_pendingCount;
+    internal::S3Op *            m_ready;        // canceled operations with a coroutine to resume
+    std::vector< Root >         m_roots;        // spawned tasks
+    std::vector< internal::S3TaskPromiseBase * >   m_finished;  // spawned tasks that are over, reserved
+    bool                        m_canceled;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Implementation.
+
+namespace internal
+{
+
+template< class Promise >
+inline std::coroutine_handle<>
+S3TaskPromiseBase::FinalAwaiter::await_suspend( std::coroutine_handle< Promise > handle ) noexcept
+{
+    S3TaskPromiseBase &promise = handle.promise();
+
+    if( promise.continuation )
+    {
+        return promise.continuation;
+    }
+
+    if( promise.executor )
+    {
+        promise.executor->finish( &promise );  // nofail
+    }
+
+    return std::noop_coroutine();
+}
+
+inline
+S3Op::S3Op( S3Executor *executor, S3Connection *con )
+    : m_executor( executor )
+    , m_con( con )
+    , m_prev( 0 )
+    , m_next( 0 )
+    , m_attached( false )
+    , m_active( false )
+    , m_pending( false )
+    , m_canceled( false )
+{
+    dbgAssert( executor );
+    dbgAssert( con );
+}
+
+inline
+S3Op::~S3Op()  // nofail
+{
+    if( m_pending )
+    {
+        m_executor->unlink( this );  // nofail
+    }
+
+    if( m_active )
+    {
+        m_con->cancelAsync();  // nofail
+    }
+
+    detach();  // nofail
+}
+
+inline bool
+S3Op::attach()  // nofail
+{
+    if( m_executor->isCanceled() )
+    {
+        m_canceled = true;
+        return false;
+    }
+
+    m_con->setCompletionQueue( &m_executor->m_queue, this );  // nofail
+    m_attached = true;
+    return true;
+}
+
+inline void
+S3Op::started()  // nofail
+{
+    m_active = true;
+    m_executor->link( this );  // nofail
+}
+
+inline void
+S3Op::detach()  // nofail
+{
+    // A completion left in the queue is seen with no tag.
+
+    m_active = false;
+
+    if( m_attached )
+    {
+        m_con->setCompletionQueue( 0, 0 );  // nofail
+        m_attached = false;
+    }
+}
+
+inline bool
+S3Op::await_ready()  // nofail
+{
+    if( m_pending && m_con->isAsyncCompleted() )
+    {
+        m_executor->unlink( this );  // nofail
+    }
+
+    return !m_pending;
+}
+
+inline void
+S3Op::checkCanceled() const
+{
+    // An operation completed before cancel() is canceled too if it is 
+    // awaited after it.
+
+    if( m_canceled || m_executor->isCanceled() )
+    {
+        throw S3Canceled();
+    }
+}
+
+}  // namespace internal
+
+inline
+S3GetOp::S3GetOp( S3Executor *executor, S3Connection *con, const char *bucketName,
+    const char *key, void *buffer, size_t size, size_t offset )
+    : S3Op( executor, con )
+{
+    if( attach() )
+    {
+        m_con->pendGet( m_executor->asyncMan(), bucketName, key, buffer, size, offset );
+        started();  // nofail
+    }
+}
+
+inline
+S3GetOp::S3GetOp( S3Executor *executor, S3Connection *con, const char *bucketName,
+    const char *key, S3GetResponseLoader *loader )
+    : S3Op( executor, con )
+{
+    if( attach() )
+    {
+        m_con->pendGet( m_executor->asyncMan(), bucketName, key, loader );
+        started();  // nofail
+    }
+}
+
+inline S3GetResponse
+S3GetOp::await_resume()
+{
+    checkCanceled();
+
+    S3GetResponse response;
+    Completion completion( this );
+
+    m_con->completeGet( &response );
+    return response;
+}
+
+inline
+S3PutOp::S3PutOp( S3Executor *executor, S3Connection *con, const char *bucketName,
+    const char *key, const void *data, size_t size,
+    bool makePublic, bool useSrvEncrypt, const S3Metadata *metadata )
+    : S3Op( executor, con )
+{
+    if( attach() )
+    {
+        m_con->pendPut( m_executor->asyncMan(), bucketName, key, data, size, makePublic, useSrvEncrypt, metadata );
+        started();  // nofail
+    }
+}
+
+inline S3PutResponse
+S3PutOp::await_resume()
+{
+    checkCanceled();
+
+    S3PutResponse response;
+    Completion completion( this );
+
+    m_con->completePut( &response );
+    return response;
+}
+
+inline
+S3DelOp::S3DelOp( S3Executor *executor, S3Connection *con, const char *bucketName, const char *key )
+    : S3Op( executor, con )
+{
+    if( attach() )
+    {
+        m_con->pendDel( m_executor->asyncMan(), bucketName, key );
+        started();  // nofail
+    }
+}
+
+inline S3DelResponse
+S3DelOp::await_resume()
+{
+    checkCanceled();
+
+    S3DelResponse response;
+    Completion completion( this );
+
+    m_con->completeDel( &response );
+    return response;
+}
+
+inline
+S3Executor::S3Executor( AsyncMan *asyncMan )
+    : m_asyncMan( asyncMan )
+    , m_pending( 0 )
+    , m_pendingCount( 0 )
+    , m_ready( 0 )
+    , m_canceled( false )
+{
+    dbgAssert( asyncMan );
+}
+
+inline
+S3Executor::~S3Executor()  // nofail
+{
+    cancel();  // nofail
+
+    // Destroying a task destroys the tasks it awaits, and their operations.
+
+    for( size_t i = 0; i < m_roots.size(); ++i )
+    {
+        m_roots[ i ].handle.destroy();
+    }
+
+    // A connection isn't queued again till its completion is popped, so
+    // pop what is left for the connections to be used with another queue.
+
+    void *tags[ c_popBatch ];
+
+    while( m_queue.pop( tags, c_popBatch, 0 ) )
+    {
+    }
+}
+
+inline void
+S3Executor::spawn( S3Task<> task )
+{
+    dbgAssert( task.m_handle );
+
+    m_roots.reserve( m_roots.size() + 1 );  // can throw std::bad_alloc
+    m_finished.reserve( m_roots.size() + 1 );  // can throw std::bad_alloc
+
+    S3Task<>::Handle handle = std::exchange( task.m_handle, nullptr );
+    Root root = { handle, &handle.promise() };
+
+    handle.promise().executor = this;
+    handle.promise().rootIndex = m_roots.size();
+    m_roots.push_back( root );  // nofail because of reserve(..)
+
+    handle.resume();
+}
+
+inline void
+S3Executor::finish( internal::S3TaskPromiseBase *promise )  // nofail
+{
+    dbgAssert( m_finished.size() < m_finished.capacity() );
+    m_finished.push_back( promise );  // nofail because of reserve(..)
+}
+
+inline void
+S3Executor::reap()
+{
+    std::exception_ptr exception;
+
+    while( !m_finished.empty() )
+    {
+        internal::S3TaskPromiseBase *promise = m_finished.back();
+        size_t index = promise->rootIndex;
+
+        m_finished.pop_back();
+
+        if( !exception )
+        {
+            exception = promise->exception;
+        }
+
+        // Destroys the promise too.
+
+        m_roots[ index ].handle.destroy();
+        m_roots[ index ] = m_roots.back();
+        m_roots[ index ].promise->rootIndex = index;
+        m_roots.pop_back();
+    }
+
+    if( exception )
+    {
+        std::rethrow_exception( exception );
+    }
+}
+
+inline size_t
+S3Executor::run( long msTimeout )
+{
+    std::coroutine_handle<> handles[ c_popBatch ];
+    void *tags[ c_popBatch ];
+
+    while( true )
+    {
+        // Canceled operations first.
+
+        while( m_ready )
+        {
+            internal::S3Op *op = m_ready;
+            m_ready = op->m_next;
+            op->m_next = 0;
+            op->m_handle.resume();
+        }
+
+        reap();
+
+        if( !taskCount() || !m_pendingCount )
+        {
+            // Over, or the tasks left await nothing this executor can complete.
+
+            break;
+        }
+
+        size_t count = m_queue.pop( tags, c_popBatch, msTimeout );
+
+        if( !count )
+        {
+            break;
+        }
+
+        // Take all the completions before resuming anything: a resumed task may
+        // destroy an operation whose tag is popped already.
+
+        size_t resumeCount = 0;
+
+        for( size_t i = 0; i < count; ++i )
+        {
+            internal::S3Op *op = static_cast< internal::S3Op * >( tags[ i ] );
+
+            if( !op || !op->m_pending || !op->m_con->isAsyncCompleted() )
+            {
+                // A completion of an operation awaited or canceled already.
+
+                continue;
+            }
+
+            unlink( op );  // nofail
+
+            if( op->m_handle )
+            {
+                handles[ resumeCount++ ] = op->m_handle;
+            }
+        }
+
+        for( size_t i = 0; i < resumeCount; ++i )
+        {
+            handles[ i ].resume();
+        }
+    }
+
+    return taskCount();
+}
+
+inline void
+S3Executor::cancel()  // nofail
+{
+    m_canceled = true;
+
+    while( m_pending )
+    {
+        internal::S3Op *op = m_pending;
+
+        unlink( op );  // nofail
+        op->m_con->cancelAsync();  // nofail
+        op->detach();  // nofail
+        op->m_canceled = true;
+
+        if( op->m_handle )
+        {
+            op->m_next = m_ready;
+            m_ready = op;
+        }
+    }
+}
+
+inline void
+S3Executor::link( internal::S3Op *op )  // nofail
+{
+    dbgAssert( !op->m_pending );
+
+    op->m_prev = 0;
+    op->m_next = m_pending;
+
+    if( m_pending )
+        m_pending->m_prev = op;
+
+    m_pending = op;
+    op->m_pending = true;
+    ++m_pendingCount;
+}
+
+inline void
+S3Executor::unlink( internal::S3Op *op )  // nofail
+{
+    dbgAssert( op->m_pending );
+
+    if( op->m_prev )
+        op->m_prev->m_next = op->m_next;
+    else
+        m_pending = op->m_next;
+
+    if( op->m_next )
+        op->m_next->m_prev = op->m_prev;
+
+    op->m_prev = op->m_next = 0;
+    op->m_pending = false;
+    --m_pendingCount;
+}
+
+}  // namespace webstor
+
+#endif  // __cpp_impl_coroutine
+
+#endif // !INCLUDED_S3CORO_H
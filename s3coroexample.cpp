@@ -0,0 +1,156 @@
+/*
+ * File:   s3coroexample.cpp
+ * Author: taozou
+ *
+ * Example of the C++20 coroutines of s3coro.h, built with -std=c++20: a get
+ * of Key, a get that fails and a get that is canceled, each a task run by
+ * an S3Executor. Exits with 0 if all three go as expected.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include "bench.h"
+#include "s3coro.h"
+
+using namespace webstor;
+using namespace webstor::internal;
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#define BufferSize 65536
+
+// Loads Key, the number of bytes goes to *loaded.
+
+static S3Task<> getObject(S3Executor *ex, S3Connection *con, const char *bucketName, const char *key,
+                          char *buf, long long *loaded)
+{
+    S3GetResponse response = co_await ex->get(con, bucketName, key, buf, BufferSize);
+    *loaded = (long long)response.loadedContentLength;
+}
+
+// Awaits a get of Key; after cancel() the await throws S3Canceled.
+
+static S3Task<> getCanceled(S3Executor *ex, S3Connection *con, const char *bucketName, const char *key,
+                            char *buf, bool *canceled)
+{
+    try
+    {
+        co_await ex->get(con, bucketName, key, buf, BufferSize);
+    }
+    catch (const S3Canceled &)
+    {
+        *canceled = true;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    S3Config config = {};
+    const char *missingBucket = "webstor-no-such-bucket";
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if (!benchEndpointOption(argc, argv, &i, &config))
+            break;
+    }
+
+    if (argc - i != 2 && argc - i != 3)
+    {
+        fprintf(stderr, "s3coroexample [-h Host] [-p Port] Bucket Key [MissingBucket(%s)]\n"
+                        "      gets Key, gets it from MissingBucket, which fails, and cancels\n"
+                        "      a get of it\n", missingBucket);
+        return 1;
+    }
+
+    if (!benchKeys(&config))
+    {
+        fprintf(stderr, "no AWS_XXXX is set. \n");
+        return 1;
+    }
+
+    const char *bucketName = argv[i];
+    const char *key = argv[i + 1];
+    int failed = 0;
+
+    if (argc - i == 3)
+        missingBucket = argv[i + 2];
+
+    AsyncMan asyncMan;
+    S3Connection con(config);
+    std::vector<char> buf(BufferSize);
+
+    // A get, its task resumed by run() once the loop completes it.
+
+    {
+        S3Executor ex(&asyncMan);
+        long long loaded = -1;
+
+        try
+        {
+            ex.spawn(getObject(&ex, &con, bucketName, key, &buf[0], &loaded));
+            ex.run();
+            printf("get: %s/%s has %lld bytes\n", bucketName, key, loaded);
+            failed += loaded < 0;
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "get: %s\n", e.what());
+            ++failed;
+        }
+    }
+
+    // A failed get: the S3Exception of the await leaves the task and run()
+    // rethrows it.
+
+    {
+        S3Executor ex(&asyncMan);
+        long long loaded = -1;
+
+        try
+        {
+            ex.spawn(getObject(&ex, &con, missingBucket, key, &buf[0], &loaded));
+            ex.run();
+            fprintf(stderr, "failure: %s/%s has %lld bytes\n", missingBucket, key, loaded);
+            ++failed;
+        }
+        catch (const std::exception &e)
+        {
+            printf("failure: %s\n", e.what());
+        }
+    }
+
+    // A canceled get: spawn() runs the task till it awaits the get in
+    // flight, cancel() cancels it and run() resumes the task with S3Canceled.
+
+    {
+        S3Executor ex(&asyncMan);
+        bool canceled = false;
+
+        try
+        {
+            ex.spawn(getCanceled(&ex, &con, bucketName, key, &buf[0], &canceled));
+            ex.cancel();
+            ex.run();
+            printf("cancel: the get is %s\n", canceled ? "canceled" : "not canceled");
+            failed += !canceled;
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "cancel: %s\n", e.what());
+            ++failed;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
+
+#else
+
+int main()
+{
+    fprintf(stderr, "s3coroexample needs a compiler with C++20 coroutines\n");
+    return 1;
+}
+
+#endif
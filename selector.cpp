@@ -6,13 +6,41 @@
  */
 
 #include "selector.h"
+#include <algorithm>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
+#include <stdint.h>
 #include <mpi.h>
 
 selector::selector()
+    : reportEvery(0)
+    , reportMs(0)
+    , threshold(0)
+    , matchLimit(0)
+    , matchesFound(0)
+    , matchesSent(0)
+    , multiRange(false)
+    , decompress(false)
+    , sortedTail(false)
+    , topIndexOwner(false)
+    , useTopIndex(false)
+    , lookup(false)
+    , lookupValue(0)
+    , text(false)
+    , uring(false)
+    , loops(0)
+    , toDelete(false)
+    , released(false)
+    , partialPending(false)
+    , buf(NULL)
+    , cons(NULL)
 {
+    for ( int i = 0; i < AsyncManCount; ++i )
+    {
+        asyncMans[i] = NULL;
+        batches[i] = NULL;
+    }
 }
 
 inline void selector::getKey(char* buf, int id)
@@ -20,21 +48,571 @@ inline void selector::getKey(char* buf, int id)
     sprintf(buf, "%d/16mb", id);
 }
 
-void selector::preProcess(unsigned char* buf)
+void selector::preProcess(unsigned char* buf, size_t count)
 {
-    int* data = (int *) buf;
-    int count = BucketSize / sizeof(int);
-    
-    for (int i = 0; i < count ; ++i)
-        for (int j = 0 ; j < K; ++j)
-            if (topk[j] < data[i])
+    queries.scan((const int *) buf, count);
+}
+
+void selector::collectMatches(const int* data, size_t count, int id, Matches* m)
+{
+    for (size_t i = 0; i < count && matchesFound + m->count < matchLimit; ++i)
+        if (data[i] > threshold)
+        {
+            m->values[m->count] = data[i];
+            m->ids[m->count] = id;
+            ++m->count;
+        }
+}
+
+void selector::sendMatches(const Matches& m)
+{
+    if (!m.count)
+        return;
+
+    // Tell rank 0 right away, it decides when the whole job has enough.
+
+    MPI::COMM_WORLD.Send(&m, sizeof(Matches), MPI::CHAR, 0, TagMatch);
+    matchesFound += m.count;
+    ++matchesSent;
+}
+
+void selector::findMatches(unsigned char* buf, size_t count, int id)
+{
+    if (matchesFound >= matchLimit)
+        return;
+
+    Matches m;
+    m.count = 0;
+    collectMatches((const int *) buf, count, id, &m);
+    sendMatches(m);
+}
+
+// Packed objects are scanned block by block; blocks whose min/max show
+// they can't matter to any query or to the stop predicate aren't decoded.
+
+void selector::scanPacked(unsigned char* buf, size_t size, int id)
+{
+    PackedReader reader;
+    const PackedBlockHeader *h;
+    const void *words;
+    Matches m;
+
+    m.count = 0;
+    decoded.resize(PackedBlockValues);
+
+    if (!reader.init(buf, size))
+        return;
+
+    while (reader.next(&h, &words))
+    {
+        bool match = matchLimit && matchesFound + m.count < matchLimit && h->max > threshold;
+        bool scan = queries.needs(h->min, h->max);
+
+        if (!match && !scan)
+            continue;
+
+        unpackBlock(*h, words, &decoded[0]);
+        if (scan)
+            queries.scanBlock(&decoded[0], h->count);
+        if (match)
+            collectMatches(&decoded[0], h->count, id, &m);
+    }
+
+    sendMatches(m);
+}
+
+// A flat object: packed, or plain ints.
+
+void selector::scanData(unsigned char* buf, size_t size, int id)
+{
+    if (isPacked(buf, size))
+    {
+        scanPacked(buf, size, id);
+        return;
+    }
+
+    size_t count = size / sizeof(int);
+    preProcess(buf, count);
+    if (matchLimit)
+        findMatches(buf, count, id);
+}
+
+// Prints every occurrence; position is that of data[0] in the object.
+
+void selector::lookupValues(const int* data, size_t count, int id, UInt64 position)
+{
+    size_t found = 0;
+    char key[100];
+
+    getKey(key, id);
+    for (size_t i = 0; i < count; ++i)
+        if (data[i] == lookupValue)
+        {
+            printf("%d at %s %llu\n", lookupValue, key, (unsigned long long)(position + i));
+            ++found;
+        }
+
+    if (found)
+    {
+        std::vector<int> occurrences(found, lookupValue);
+        queries.scan(&occurrences[0], found);
+    }
+}
+
+// A whole flat object: packed blocks that can't hold the value are skipped.
+
+void selector::lookupData(unsigned char* buf, size_t size, int id)
+{
+    if (!isPacked(buf, size))
+    {
+        lookupValues((const int *) buf, size / sizeof(int), id, 0);
+        return;
+    }
+
+    PackedReader reader;
+    const PackedBlockHeader *h;
+    const void *words;
+    UInt64 position = 0;
+
+    decoded.resize(PackedBlockValues);
+    if (!reader.init(buf, size))
+        return;
+
+    for ( ; reader.next(&h, &words); position += h->count)
+    {
+        if (lookupValue < h->min || lookupValue > h->max)
+            continue;
+        unpackBlock(*h, words, &decoded[0]);
+        lookupValues(&decoded[0], h->count, id, position);
+    }
+}
+
+// The data of the request just completed on connection k: the object, or
+// candidate segments of it.
+
+void selector::lookupRead(int k, size_t size)
+{
+    ObjectRead &r = reads[k];
+
+    if (r.ranges.empty())
+        lookupData(buf[k], size, r.id);
+    else if (!multiRange)
+        lookupValues((const int *) buf[k], size / sizeof(int), r.id, r.ranges[r.next - 1].first / sizeof(int));
+    else
+        for (size_t i = 0; i < r.batch.size(); ++i)
+            lookupValues((const int *) r.batch[i].buffer, r.batch[i].size / sizeof(int), r.id,
+                         r.batch[i].offset / sizeof(int));
+}
+
+void selector::start(int k, int id)
+{
+    char key[100];
+    ObjectRead &r = reads[k];
+    size_t tail = sortedTail && columns.empty() && !matchLimit && !text ? queries.sortedTail() : 0;
+
+    getKey(key, id);
+    r.id = id;
+    r.ranges.clear();
+    r.batch.clear();
+    r.next = 0;
+
+    if (text)
+    {
+        r.stage = ObjectRead::ReadData;
+        r.text.reset();
+        if (decompress)
+        {
+            r.inflate.reset(&r.text);
+            cons[k]->pendGet( batches[k % AsyncManCount]->asyncMan(), bucketName, key, &r.inflate);
+        }
+        else
+        {
+            cons[k]->pendGet( batches[k % AsyncManCount]->asyncMan(), bucketName, key, &r.text);
+        }
+    }
+    else if (lookup)
+    {
+        r.stage = ObjectRead::ReadBloom;
+        cons[k]->pendGet( batches[k % AsyncManCount]->asyncMan(), bucketName, bloomKey(key).c_str(), buf[k], BucketSize);
+    }
+    else if (tail)
+    {
+        r.stage = ObjectRead::ReadSortedTail;
+        cons[k]->pendGetTail( batches[k % AsyncManCount]->asyncMan(), bucketName, key, buf[k],
+                              std::min(tail, (size_t)BucketSize / sizeof(int)) * sizeof(int));
+    }
+    else if (columns.empty())
+    {
+        pendObject(k);
+    }
+    else
+    {
+        r.stage = ObjectRead::ReadTail;
+        cons[k]->pendGetTail( batches[k % AsyncManCount]->asyncMan(), bucketName, key, buf[k], ColumnarTailSize);
+    }
+}
+
+// Reads a flat object whole.
+
+void selector::pendObject(int k)
+{
+    char key[100];
+    ObjectRead &r = reads[k];
+
+    getKey(key, r.id);
+    r.stage = ObjectRead::ReadData;
+
+    if (decompress)
+    {
+        r.inflate.reset(buf[k], BucketSize);
+        cons[k]->pendGet( batches[k % AsyncManCount]->asyncMan(), bucketName, key, &r.inflate);
+    }
+    else
+    {
+        cons[k]->pendGet( batches[k % AsyncManCount]->asyncMan(), bucketName, key, buf[k], BucketSize);
+    }
+}
+
+void selector::pendRange(int k, const ByteRange &range)
+{
+    char key[100];
+
+    getKey(key, reads[k].id);
+    cons[k]->pendGet( batches[k % AsyncManCount]->asyncMan(), bucketName, key, buf[k], range.second, range.first);
+}
+
+void selector::pendData(int k)
+{
+    ObjectRead &r = reads[k];
+
+    if (!multiRange)
+    {
+        pendRange(k, r.ranges[r.next++]);
+        return;
+    }
+
+    // Ranges are at most BucketSize each, so at least one fits.
+
+    size_t used = 0;
+    r.batch.clear();
+
+    for ( ; r.next < r.ranges.size() && used + r.ranges[r.next].second <= BucketSize; ++r.next)
+    {
+        S3ByteRange range = { (size_t)r.ranges[r.next].first, r.ranges[r.next].second, buf[k] + used };
+        r.batch.push_back(range);
+        used += range.size;
+    }
+
+    char key[100];
+    getKey(key, r.id);
+    cons[k]->pendGet( batches[k % AsyncManCount]->asyncMan(), bucketName, key, &r.batch[0], r.batch.size());
+}
+
+// The members of a container within range, whose bytes are at data.
+
+void selector::scanMembers(int k, unsigned char* data, const ByteRange &range)
+{
+    ObjectRead &r = reads[k];
+    const std::vector<ContainerMember> &members = r.container.members;
+
+    // Members before the range were left out, see planMembers().
+
+    for ( ; r.member < members.size() && members[r.member].offset < range.first + range.second; ++r.member)
+        if (members[r.member].offset >= range.first)
+            scanData(data + (members[r.member].offset - range.first), members[r.member].size, r.id);
+}
+
+// The index of a container too large to read whole is known: read its
+// members by ranges. Returns true when there is nothing to read.
+
+bool selector::planMembers(int k)
+{
+    ObjectRead &r = reads[k];
+
+    if (!r.container.plan(BucketSize, &r.ranges))
+    {
+        fprintf(stderr, "bad container index in %d\n", r.id);
+        return true;
+    }
+
+    for (size_t i = 0; i < r.container.members.size(); ++i)
+        if (r.container.members[i].size > BucketSize)
+            fprintf(stderr, "%s in %d is larger than %d bytes, skipped\n", r.container.name(i).c_str(), r.id,
+                    BucketSize);
+
+    r.next = 0;
+    r.member = 0;
+    if (r.ranges.empty())
+        return true;
+
+    r.stage = ObjectRead::ReadMembers;
+    pendData(k);
+    return false;
+}
+
+// A text object is done: its last record may lack the newline.
+
+void selector::mergeText(int k)
+{
+    TextLoader &t = reads[k].text;
+    std::vector<char> state(t.queries.stateSize());
+
+    t.scanner.finish();
+    if (!state.empty())
+    {
+        t.queries.save(&state[0]);
+        queries.merge(&state[0]);
+    }
+    if (t.scanner.skipped)
+        fprintf(stderr, "%d: %llu of %llu records have no value\n", reads[k].id,
+                (unsigned long long)t.scanner.skipped, (unsigned long long)t.scanner.records);
+}
+
+// Completes the request pending on connection k. Returns true when the
+// object is done (or failed), false if its next request is pending.
+
+bool selector::complete(int k)
+{
+    ObjectRead &r = reads[k];
+    S3GetResponse response;
+
+    try
+    {
+        cons[k]->completeGet(&response);
+    }
+    catch ( ... ) {
+        fprintf(stderr, "get fail on %d\n", r.id);
+        return true;
+    }
+
+    // A missing Bloom sidecar is not an error, see below.
+
+    if (response.loadedContentLength == (size_t)-1 && r.stage != ObjectRead::ReadBloom)
+    {
+        fprintf(stderr, "get fail on %d\n", r.id);
+        return true;
+    }
+
+    switch (r.stage)
+    {
+    case ObjectRead::ReadBloom:
+        {
+            BloomReader bloom;
+            S3Metadata::const_iterator it = response.metadata.find(BloomEtagMetadataName);
+
+            // Without a usable filter, the whole object is looked through.
+
+            if (response.loadedContentLength == (size_t)-1 || response.isTruncated ||
+                it == response.metadata.end() || it->second.empty() ||
+                !bloom.init(buf[k], response.loadedContentLength))
             {
-                topk[j] = data[i];
-                break;
+                pendObject(k);
+                return false;
+            }
+
+            // The filters hold only for the object they were built for,
+            // which the etag of the first range read tells. With no
+            // candidate, the first int is read for it: the filters say
+            // it isn't the value.
+
+            r.etag = it->second;
+            bloom.candidates(lookupValue, BucketSize, &r.ranges);
+            if (r.ranges.empty() && !bloom.header.valueCount)
+            {
+                pendObject(k);
+                return false;
+            }
+            if (r.ranges.empty())
+                r.ranges.push_back(ByteRange(0, sizeof(int)));
+            r.stage = ObjectRead::ReadData;
+            pendData(k);
+            return false;
+        }
+
+    case ObjectRead::ReadSortedTail:
+        {
+            S3Metadata::const_iterator it = response.metadata.find(SortedMetadataName);
+
+            if (it == response.metadata.end() || it->second != "1")
+            {
+                pendObject(k);
+                return false;
+            }
+            preProcess(buf[k], response.loadedContentLength / sizeof(int));
+            return true;
+        }
+
+    case ObjectRead::ReadTail:
+        switch (r.footer.parseTail(buf[k], response.loadedContentLength))
+        {
+        case ColumnarFooter::Invalid:
+            fprintf(stderr, "%d is not a columnar object\n", r.id);
+            return true;
+        case ColumnarFooter::NeedFooter:
+            if (r.footer.footerSize > BucketSize)
+            {
+                fprintf(stderr, "footer of %d is too large\n", r.id);
+                return true;
+            }
+            r.stage = ObjectRead::ReadFooter;
+            pendRange(k, ByteRange(r.footer.footerOffset, r.footer.footerSize));
+            return false;
+        case ColumnarFooter::Complete:
+            break;
+        }
+        break;
+
+    case ObjectRead::ReadFooter:
+        if (!r.footer.parseFooter(buf[k], response.loadedContentLength))
+        {
+            fprintf(stderr, "bad footer in %d\n", r.id);
+            return true;
+        }
+        break;
+
+    case ObjectRead::ReadContainerTail:
+        switch (r.container.parseTail(&r.tail[0], response.loadedContentLength))
+        {
+        case ContainerIndex::Invalid:
+            // A flat object: its first bytes are all that is scanned.
+
+            scanData(buf[k], r.headSize, r.id);
+            return true;
+        case ContainerIndex::NeedIndex:
+            if (r.container.indexSize > BucketSize)
+            {
+                fprintf(stderr, "container index of %d is too large\n", r.id);
+                return true;
+            }
+            r.stage = ObjectRead::ReadContainerIndex;
+            pendRange(k, ByteRange(r.container.indexOffset, r.container.indexSize));
+            return false;
+        case ContainerIndex::Complete:
+            break;
+        }
+        return planMembers(k);
+
+    case ObjectRead::ReadContainerIndex:
+        if (!r.container.parseIndex(buf[k], response.loadedContentLength))
+        {
+            fprintf(stderr, "bad container index in %d\n", r.id);
+            return true;
+        }
+        return planMembers(k);
+
+    case ObjectRead::ReadMembers:
+        if (response.isTruncated && !r.batch.empty())
+        {
+            fprintf(stderr, "get fail on %d\n", r.id);
+            return true;
+        }
+        if (!multiRange)
+            scanMembers(k, buf[k], r.ranges[r.next - 1]);
+        else
+            for (size_t i = 0; i < r.batch.size(); ++i)
+                scanMembers(k, (unsigned char *) r.batch[i].buffer, ByteRange(r.batch[i].offset, r.batch[i].size));
+        if (r.next == r.ranges.size())
+            return true;
+        pendData(k);
+        return false;
+
+    case ObjectRead::ReadData:
+        if (text)
+        {
+            if (decompress && r.inflate.failed())
+                fprintf(stderr, "cannot decompress %d (%s)\n", r.id, codecName(r.inflate.codec()));
+            else
+                mergeText(k);
+            return true;
+        }
+        if (response.isTruncated && !r.batch.empty())
+        {
+            fprintf(stderr, "get fail on %d\n", r.id);
+            return true;
+        }
+        if (columns.empty() && decompress)
+        {
+            if (r.inflate.failed())
+            {
+                fprintf(stderr, "cannot decompress %d (%s)\n", r.id, codecName(r.inflate.codec()));
+                return true;
+            }
+            if (r.inflate.truncated())
+            {
+                // Only a plain object can be scanned from its first bytes,
+                // a partly decoded one is reported instead.
+
+                if (r.inflate.codec() != CodecNone)
+                {
+                    fprintf(stderr, "%d decompresses to more than %d bytes (%s)\n", r.id,
+                        BucketSize, codecName(r.inflate.codec()));
+                    return true;
+                }
+                response.isTruncated = true;
+            }
+            response.loadedContentLength = r.inflate.decodedSize();
+        }
+        if (lookup)
+        {
+            if (!r.ranges.empty() && response.etag != r.etag)
+            {
+                fprintf(stderr, "Bloom filters of %d are stale, reading it whole\n", r.id);
+                r.ranges.clear();
+                r.next = 0;
+                pendObject(k);
+                return false;
             }
+            lookupRead(k, response.loadedContentLength);
+        }
+        else if (columns.empty() && response.isTruncated && r.ranges.empty())
+        {
+            // Too large to read whole: if it is a container, its index is at
+            // the end and its members are read by ranges.
+
+            char key[100];
+
+            getKey(key, r.id);
+            r.headSize = response.loadedContentLength;
+            r.tail.resize(ContainerTailSize);
+            r.stage = ObjectRead::ReadContainerTail;
+            cons[k]->pendGetTail( batches[k % AsyncManCount]->asyncMan(), bucketName, key, &r.tail[0], ContainerTailSize);
+            return false;
+        }
+        else if (columns.empty() && !response.isTruncated &&
+            r.container.parseTail(buf[k], response.loadedContentLength) == ContainerIndex::Complete)
+        {
+            // A container read whole: scan its members one by one.
+
+            for (size_t i = 0; i < r.container.members.size(); ++i)
+                scanData(buf[k] + r.container.members[i].offset, r.container.members[i].size, r.id);
+        }
+        else
+        {
+            scanData(buf[k], response.loadedContentLength, r.id);
+        }
+        if (r.next == r.ranges.size())
+            return true;
+        pendData(k);
+        return false;
+    }
+
+    // The footer is known, read the projected columns only.
+
+    if (!r.footer.plan(columns, BucketSize, &r.ranges))
+    {
+        fprintf(stderr, "%d has only %d columns\n", r.id, (int)r.footer.columns.size());
+        return true;
+    }
+
+    if (r.ranges.empty())
+        return true;
+
+    r.stage = ObjectRead::ReadData;
+    pendData(k);
+    return false;
 }
 
-bool selector::init(char * bucketName) {
+bool selector::init(char * bucketName, const char * querySpec, const char * filter) {
     toDelete = false;
     S3Config config = {};
     
@@ -45,59 +623,247 @@ bool selector::init(char * bucketName) {
         return false;
     }
 
-    memset(topk, 0 , K * sizeof(int));
+    if (!queries.parse(querySpec, filter))
+        return false;
+
+    for ( int i = 0; text && i < ConnectionCount; ++i )
+        if (!reads[i].text.init(textField, querySpec, filter))
+            return false;
+
     strcpy(this->bucketName, bucketName);
 
+    std::vector<int> cpus(std::max(loops, 0) * AsyncManCount);
+    size_t allowed = loops > 0 ? taskCpus(&cpus[0], cpus.size()) : 0;
+
+    for ( size_t i = allowed; allowed && i < cpus.size(); ++i )
+        cpus[i] = cpus[i % allowed];
+
+    for ( int i = 0; i < AsyncManCount; ++i )
+    {
+        AsyncMan::LoopPool pool = { (size_t)std::max(loops, 0), allowed ? &cpus[i * loops] : NULL, 0 };
+
+        asyncMans[i] = new AsyncMan(pool, AsyncMan::c_cMaxConnectionsPerThread,
+                                    uring ? AsyncMan::c_uring : AsyncMan::c_epoll);
+        batches[i] = new AsyncBatch(asyncMans[i]);
+    }
+
     cons = new S3Connection*[ConnectionCount];
     buf = new unsigned char*[ConnectionCount];
     
     for ( int i = 0; i < ConnectionCount; ++i )
     {
         cons[i] = new S3Connection(config);
-        buf[i] = new unsigned char[ BucketSize ];
+        cons[i]->setCompletionQueue(&completions, (void *)(intptr_t)i);
+        cons[i]->setAsyncLoop(i / AsyncManCount);
+        buf[i] = (unsigned char *)asyncMans[i % AsyncManCount]->allocBuffer(BucketSize, i / AsyncManCount);
     }
     toDelete = true;
+
+    if (!topIndexKey.empty() && !lookup)
+    {
+        size_t tail = queries.sortedTail();
+
+        try
+        {
+            if (!readTopIndex(cons[0], bucketName, topIndexKey.c_str(), &topIndex))
+                fprintf(stderr, "no top index %s\n", topIndexKey.c_str());
+            else if (!tail || matchLimit || !topIndex.answers(tail))
+            {
+                if (topIndexOwner)
+                    fprintf(stderr, "top index %s doesn't answer these queries, scanning everything\n",
+                            topIndexKey.c_str());
+            }
+            else
+                useTopIndex = true;
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            return false;
+        }
+    }
     return true;
 }
 
+static void fillReport(std::vector<char> *msg, const QuerySet &queries,
+    int done, int total, int matchesSent)
+{
+    msg->resize(sizeof(Report) + queries.stateSize());
+
+    Report *header = (Report *) &(*msg)[0];
+    header->done = done;
+    header->total = total;
+    header->matchesSent = matchesSent;
+    queries.save(&(*msg)[sizeof(Report)]);
+}
+
+void selector::report(int done, int total, int sendToRank, bool final)
+{
+    if (!final)
+    {
+        // Never block the scan on a partial report: if the previous one is
+        // still in flight, skip this one, the next report supersedes it anyway.
+
+        if (partialPending && !partialRequest.Test())
+            return;
+
+        fillReport(&partial, queries, done, total, matchesSent);
+        partialRequest = MPI::COMM_WORLD.Isend(&partial[0], partial.size(), MPI::CHAR, sendToRank, TagPartial);
+        partialPending = true;
+        sinceReport.start();
+        return;
+    }
+
+    if (partialPending)
+    {
+        partialRequest.Wait();
+        partialPending = false;
+    }
+
+    std::vector<char> last;
+    fillReport(&last, queries, done, total, matchesSent);
+    MPI::COMM_WORLD.Send(&last[0], last.size(), MPI::CHAR, sendToRank, TagFinal);
+}
+
+bool selector::stopRequested()
+{
+    if (!released && MPI::COMM_WORLD.Iprobe(0, TagStop))
+    {
+        MPI::COMM_WORLD.Recv(0, 0, MPI::CHAR, 0, TagStop);
+        released = true;
+    }
+    return released || stopSignaled || (matchLimit && matchesFound >= matchLimit);
+}
+
 void selector::run(int idLow, int idHigh, int sendToRank) {
-    char key[100];
-    int totalKey = idHigh - idLow;
-    for ( int i = 0; i < ConnectionCount && i < totalKey; ++i )
+    std::vector<int> ids;
+    std::vector<int> values;
+    std::vector<bool> covered(topIndex.keys.size());
+    
+    // The entries stand for the covered objects of this range only, and
+    // only if they still hold their largest values; else they are scanned.
+    
+    for (int id = idLow; useTopIndex && id < idHigh; ++id)
+    {
+        char key[100];
+        getKey(key, id);
+        int object = topIndex.find(key);
+        if (object >= 0)
+            covered[object] = true;
+    }
+    
+    for (size_t i = 0; i < topIndex.entries.size(); ++i)
+        if (covered[topIndex.entries[i].object])
+            values.push_back(topIndex.entries[i].value);
+    
+    if (useTopIndex && !topIndex.complete && values.size() < queries.sortedTail())
+    {
+        useTopIndex = false;
+        values.clear();
+    }
+    
+    for (int id = idLow; id < idHigh; ++id)
     {
-        getKey(key, idLow+i);
-        cons[i]->pendGet( &asyncMans[i % AsyncManCount],
-                bucketName, key, buf[i], BucketSize);
+        char key[100];
+        getKey(key, id);
+        if (!useTopIndex || topIndex.find(key) < 0)
+            ids.push_back(id);
     }
+    
+    if (useTopIndex)
+        queries.scan(values.empty() ? NULL : &values[0], values.size());
+    
+    int totalKey = ids.size();
+    int started = 0;
+    int done = 0;
+    bool progressive = reportEvery > 0 || reportMs > 0;
+    bool stopped = false;
+
+    if (progressive)
+        report(done, totalKey, sendToRank, false);
 
-    for ( int i = ConnectionCount; i < totalKey; ++i)
+    for ( ; started < ConnectionCount && started < totalKey; ++started )
+        start(started, ids[started]);
+    submit();
+
+    // Keep every connection busy while there are objects left; a columnar
+    // object takes several requests on the same connection.
+
+    void *tags[ConnectionCount];
+
+    while (started < totalKey && !stopped)
     {
-        int k = S3Connection::waitAny( cons, ConnectionCount, i % ConnectionCount);
+        size_t count = completions.pop(tags, ConnectionCount);
 
-        //S3GetResponse response;
-        try
+        for (size_t j = 0; j < count && started < totalKey; ++j)
         {
-            cons[k]->completeGet();
-        }
-        catch ( ... ) {
-            fprintf(stderr, "get fail on %d\n", idLow + i);
+            int k = (int)(intptr_t)tags[j];
+
+            if (!cons[k]->isAsyncCompleted())
+                continue;
+
+            bool finished = complete(k);
+
+            if (finished)
+                ++done;
+
+            if (stopRequested())
+            {
+                stopped = true;
+                break;
+            }
+
+            if (!finished)
+                continue;
+
+            if (progressive &&
+                ((reportEvery > 0 && done % reportEvery == 0) ||
+                 (reportMs > 0 && sinceReport.elapsed() >= (UInt64)reportMs)))
+                report(done, totalKey, sendToRank, false);
+
+            start(k, ids[started++]);
         }
-        
-        preProcess(buf[k]);
-        
-        getKey(key, idLow+i);
-        cons[k]->pendGet( &asyncMans[i % AsyncManCount], 
-            bucketName, key, buf[k], BucketSize);
+
+        submit();
     }
     
     for ( int i = 0; i < ConnectionCount; ++i )
     {
-        cons[i]->completeGet();
-        preProcess(buf[i]);
+        while (cons[i]->isAsyncPending())
+        {
+            if (stopped || stopRequested())
+            {
+                stopped = true;
+                cons[i]->cancelAsync();
+                break;
+            }
+
+            if (complete(i))
+                ++done;
+            submit();
+        }
     }
     //double bandwidth = 1000.0 * objectMB * totalKey/ stopwatch.elapsed();
     //std::cout << rank << ": " << bandwidth << "MiB/s\n";
-    MPI::COMM_WORLD.Send(&topk, K * sizeof(int), MPI::CHAR, sendToRank, 0);
+    report(done, totalKey, sendToRank, true);
+
+    // Rank 0 releases every selector exactly once, wait for it so that no
+    // message is left unreceived at MPI::Finalize.
+
+    if (!released)
+    {
+        MPI::COMM_WORLD.Recv(0, 0, MPI::CHAR, 0, TagStop);
+        released = true;
+    }
+}
+
+// Hands the requests pended since the last call to the loops, one wakeup
+// per AsyncMan.
+
+void selector::submit()
+{
+    for ( int i = 0; i < AsyncManCount; ++i )
+        batches[i]->submit();
 }
 
 selector::~selector() {
@@ -105,10 +871,16 @@ selector::~selector() {
     {
         for ( int i = 0; i < ConnectionCount; ++i )
         {
-            delete[] buf[i];
+            AsyncMan::freeBuffer(buf[i], BucketSize);
             delete cons[i];
         }
         delete cons;
     }
+
+    for ( int i = 0; i < AsyncManCount; ++i )
+    {
+        delete batches[i];
+        delete asyncMans[i];
+    }
 }
 
@@ -10,34 +10,168 @@
 
 #include "s3conn.h"
 #include "sysutils.h"
+#include "report.h"
+#include "query.h"
+#include "columnar.h"
+#include "packed.h"
+#include "codec.h"
+#include "container.h"
+#include "upload.h"
+#include "topindex.h"
+#include "bloom.h"
+#include "textscan.h"
+#include <mpi.h>
 
 #define AsyncManCount 2
 #define ConnectionCount 16
 #define BucketSize 16777216
-#define K 10
 
 using namespace std;
 using namespace webstor;
 using namespace webstor::internal;
 
+// An object being read on one connection: flat objects take one request
+// (after a tail request if they may be sorted), columnar ones a tail
+// request, maybe a footer request, then one request per range of projected
+// column chunks. Lookups read the Bloom filter sidecar, then the candidate
+// segments.
+
+struct ObjectRead
+{
+    enum Stage { ReadTail, ReadFooter, ReadData, ReadSortedTail, ReadBloom,
+                 ReadContainerTail, ReadContainerIndex, ReadMembers };
+
+    int id;
+    Stage stage;
+    ColumnarFooter footer;
+    std::vector<ByteRange> ranges;
+    size_t next;                    // next range to request
+    std::vector<S3ByteRange> batch; // ranges of the pending multi-range request
+    DecompressingLoader inflate;    // flat objects, if they may be compressed
+    ContainerIndex container;       // flat objects that are containers
+    std::vector<char> tail;         // last bytes of a flat object too large to read whole
+    size_t headSize;                // bytes of it read whole, in the buffer
+    size_t member;                  // next container member to scan
+    TextLoader text;                // text objects, scanned as they arrive
+    std::string etag;               // of the object, as its Bloom sidecar says
+};
+
 class selector {
 public:
     selector();
     ~selector();
     
-    bool init(char * bucketName);
+    bool init(char * bucketName, const char * querySpec, const char * filter = NULL);
     
     void run(int idLow, int idHigh, int sendToRank);
 
     
     inline void getKey(char *buf, int id);
-    void preProcess(unsigned char * buf);
+    void preProcess(unsigned char * buf, size_t count);
+    
+    void findMatches(unsigned char * buf, size_t count, int id);
+    void collectMatches(const int * data, size_t count, int id, Matches * m);
+    void sendMatches(const Matches & m);
+    void scanPacked(unsigned char * buf, size_t size, int id);
+    void scanData(unsigned char * buf, size_t size, int id);
+    void lookupValues(const int * data, size_t count, int id, UInt64 position);
+    void lookupData(unsigned char * buf, size_t size, int id);
+    void lookupRead(int k, size_t size);
+    void scanMembers(int k, unsigned char * data, const ByteRange &range);
+    bool planMembers(int k);
+    void mergeText(int k);
+    void start(int k, int id);
+    void pendObject(int k);
+    bool complete(int k);
+    void submit();
+    void pendRange(int k, const ByteRange &range);
+    void pendData(int k);
+    void report(int done, int total, int sendToRank, bool final);
+    bool stopRequested();
+    
+    // Progressive mode: send a partial report every reportEvery objects
+    // and/or every reportMs milliseconds (0 disables either trigger).
+    
+    int reportEvery;
+    int reportMs;
+    
+    // Early termination: stop as soon as matchLimit values greater than
+    // threshold have been found (matchLimit == 0 disables it).
+    
+    int threshold;
+    int matchLimit;
+    int matchesFound;
+    int matchesSent;
+    
+    // Columnar objects: only these columns are read and scanned (empty
+    // means objects are flat int arrays).
+    
+    std::vector<int> columns;
+    
+    // Columnar objects: read the chunks with multi-range requests, as
+    // many as fit in a buffer per request.
+    
+    bool multiRange;
+    
+    // Flat objects may be compressed (gzip, lz4, zstd, told by their codec
+    // metadata or Content-Encoding, else by their first bytes): they are
+    // decompressed into the buffer as they arrive.
+    
+    bool decompress;
+    
+    // Flat objects may be sorted (SortedMetadataName): if the queries need
+    // only the largest values, read the last ones first, and the whole
+    // object only if its metadata says it isn't sorted.
+    
+    bool sortedTail;
+    
+    // Top index (see topindex.h): if it answers the queries, the objects it
+    // covers are skipped and each selector scans the entries of those in
+    // its range. The owner reports an index that doesn't answer them.
+    
+    std::string topIndexKey;
+    bool topIndexOwner;
+    bool useTopIndex;
+    TopIndex topIndex;
+    
+    // Point lookup: find where lookupValue occurs in flat objects, reading
+    // only the segments their Bloom filters (see bloom.h) allow, or all of
+    // the objects that have none. The queries see the occurrences only.
+    
+    bool lookup;
+    int lookupValue;
+    
+    // Text objects (see textscan.h): each connection scans what it loads
+    // with its own queries, merged into queries when the object is done.
+    
+    bool text;
+    TextField textField;
+    
+    // The AsyncMan threads wait for their sockets with io_uring (epoll if
+    // the kernel doesn't support it).
+    
+    bool uring;
+    
+    // Each AsyncMan starts loops threads up front, pinned in turn to the cpus
+    // the process may run on; a connection and its buffer stay with one of
+    // them (0: threads are started on demand, not pinned).
+    
+    int loops;
+    ObjectRead reads[ConnectionCount];
     
     bool toDelete;
+    bool released;
+    std::vector<char> partial;
+    bool partialPending;
+    MPI::Request partialRequest;
+    Stopwatch sinceReport;
     char bucketName[100];
-    int topk[K];
+    QuerySet queries;
+    std::vector<int> decoded;       // a block of a packed object
     unsigned char** buf;
-    AsyncMan asyncMans[AsyncManCount];
+    AsyncMan *asyncMans[AsyncManCount];
+    AsyncBatch *batches[AsyncManCount];     // requests are pended here, see submit()
+    CompletionQueue completions;    // tag: the connection index
     S3Connection **cons;
 };
 
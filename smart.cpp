@@ -1,6 +1,7 @@
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <vector>
 #include <mpi.h>
 #include "selector.h"
 #include "aggregator.h"
@@ -10,12 +11,30 @@ char bucketName[100] = "scanspeed";
 int main( int argc, char **argv )
 {
     MPI::Init(argc, argv);
+    installStopHandler();
     int rank = MPI::COMM_WORLD.Get_rank();
     int size = MPI::COMM_WORLD.Get_size();
 
     int sCount = -1;
     int aCount = 0;
     int keyHigh = -1;
+    int reportEvery = 0;
+    int reportMs = 0;
+    int threshold = 0;
+    int matchLimit = 0;
+    const char *querySpec = "topk:10";
+    const char *filter = NULL;
+    std::vector<int> columns;
+    bool multiRange = false;
+    bool decompress = false;
+    bool sortedTail = false;
+    const char *topIndexKey = NULL;
+    bool lookup = false;
+    bool text = false;
+    TextField textField;
+    int lookupValue = 0;
+    bool uring = false;
+    int loops = 0;
     
     for (int i = 1; i < argc; ++i)
     {
@@ -31,16 +50,138 @@ int main( int argc, char **argv )
         {
             keyHigh = atoi(argv[++i]);
         }
+        else if (!strcmp(argv[i], "-q"))
+        {
+            querySpec = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-c"))
+        {
+            for (char *p = argv[++i]; *p; ++p)
+            {
+                columns.push_back(strtol(p, &p, 10));
+                if (!*p)
+                    break;
+            }
+        }
+        else if (!strcmp(argv[i], "-M"))
+        {
+            multiRange = true;
+        }
+        else if (!strcmp(argv[i], "-z"))
+        {
+            decompress = true;
+        }
+        else if (!strcmp(argv[i], "-S"))
+        {
+            sortedTail = true;
+        }
+        else if (!strcmp(argv[i], "-I"))
+        {
+            topIndexKey = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-T"))
+        {
+            text = true;
+            if (!parseTextField(argv[++i], &textField))
+            {
+                if (rank == 0)
+                    fprintf(stderr, "bad text field %s\n", argv[i]);
+                MPI::Finalize();
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "-U"))
+        {
+            uring = true;
+        }
+        else if (!strcmp(argv[i], "-L"))
+        {
+            loops = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-f"))
+        {
+            lookup = true;
+            lookupValue = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-w"))
+        {
+            filter = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-p"))
+        {
+            reportEvery = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-P"))
+        {
+            reportMs = (int)(atof(argv[++i]) * 1000);
+        }
+        else if (!strcmp(argv[i], "-t"))
+        {
+            threshold = atoi(argv[++i]);
+            if (!matchLimit)
+                matchLimit = 1;
+        }
+        else if (!strcmp(argv[i], "-l"))
+        {
+            matchLimit = atoi(argv[++i]);
+        }
     }
     
     if (sCount == -1)
     {
          if (rank == 0)
-            fprintf(stderr, "smart [-s SelectorCount] [-a AggregatorCount(0)] [-k KeyRange 0-k(s)]\n");
+            fprintf(stderr, "smart [-s SelectorCount] [-a AggregatorCount(0)] [-k KeyRange 0-k(s)]\n"
+                            "      [-q Queries(topk:10), e.g. topk:10,count,sum,min,max,count[x %% 2 == 0]]\n"
+                            "      [-q plugin:lib.so[:args] loads a scan operator, see smart_plugin.h]\n"
+                            "      [-c Columns, e.g. 0,3: objects are columnar, scan these columns only]\n"
+                            "      [-M read the columns with multi-range requests]\n"
+                            "      [-z objects may be compressed (gzip, lz4, zstd), decompress them]\n"
+                            "      [-S objects may be sorted (smartput -s): topk and max read their tail only]\n"
+                            "      [-I TopIndex (smartput -x): topk and max come from it and from the\n"
+                            "       objects it doesn't cover yet]\n"
+                            "      [-f Value: print where Value occurs, reading only what the Bloom\n"
+                            "       filters of the objects (smartput -b) allow; queries, count by\n"
+                            "       default, see the occurrences only]\n"
+                            "      [-T Field, e.g. csv:2, tsv:0, json:price: objects are text records,\n"
+                            "       scan this numeric field]\n"
+                            "      [-w Filter, e.g. 'x >= 100 and x < 1000']\n"
+                            "      [-U wait for sockets with io_uring rather than epoll]\n"
+                            "      [-L Loops: start Loops network threads per AsyncMan up front, pinned\n"
+                            "       to the cpus of the process, with the buffers on their NUMA nodes]\n"
+                            "      [-p ReportEveryNObjects] [-P ReportEveryTSeconds]\n"
+                            "      [-t StopWhenValueAbove] [-l StopAfterNMatches(1)]\n"
+                            "      (send SIGUSR1 to stop early and print the result so far)\n");
          MPI::Finalize();
          return 1;
     }
     
+    if ((lookup || text) && !columns.empty())
+    {
+        if (rank == 0)
+            fprintf(stderr, "-f and -T work on flat objects only\n");
+        MPI::Finalize();
+        return 1;
+    }
+
+    if (text && matchLimit)
+    {
+        if (rank == 0)
+            fprintf(stderr, "-t and -l don't work with -T\n");
+        MPI::Finalize();
+        return 1;
+    }
+
+    if (lookup && (text || decompress))
+    {
+        if (rank == 0)
+            fprintf(stderr, "-f works on plain int objects only\n");
+        MPI::Finalize();
+        return 1;
+    }
+
+    if (lookup && !strcmp(querySpec, "topk:10"))
+        querySpec = "count";
+
     if (aCount + sCount + 1 > size)
     {
         if (rank == 0)
@@ -49,6 +190,14 @@ int main( int argc, char **argv )
         return 1;          
     }
 
+    if (matchLimit > MaxMatches)
+    {
+        if (rank == 0)
+            fprintf(stderr, "-l is at most %d\n", MaxMatches);
+        MPI::Finalize();
+        return 1;
+    }
+
     if (keyHigh == -1)
         keyHigh = sCount;
     
@@ -71,18 +220,51 @@ int main( int argc, char **argv )
     if (rank == 0)
     {
         aggregator a;
+        if (!a.init(querySpec, filter))
+        {
+            MPI::Finalize();
+            return 1;
+        }
+        a.selectorCount = sCount;
+        a.matchLimit = matchLimit;
         a.run(aCount, -1);
     }
     else if (rank <= sCount)
     {
         int idA = (rank - 1) / perAggr + 1;
         selector s;
-        s.init(bucketName);
+        s.reportEvery = reportEvery;
+        s.reportMs = reportMs;
+        s.threshold = threshold;
+        s.matchLimit = matchLimit;
+        s.columns = columns;
+        s.multiRange = multiRange;
+        s.decompress = decompress;
+        s.sortedTail = sortedTail;
+        if (topIndexKey)
+            s.topIndexKey = topIndexKey;
+        s.topIndexOwner = rank == 1;
+        s.lookup = lookup;
+        s.lookupValue = lookupValue;
+        s.text = text;
+        s.textField = textField;
+        s.uring = uring;
+        s.loops = loops;
+        if (!s.init(bucketName, querySpec, filter))
+        {
+            MPI::Finalize();
+            return 1;
+        }
         s.run(idLow, idHigh, idA + sCount);
     }
     else if (rank <= sCount + aCount)
     {
         aggregator a;
+        if (!a.init(querySpec, filter))
+        {
+            MPI::Finalize();
+            return 1;
+        }
         if ( ((rank - sCount) * perAggr) > sCount)
             a.run( sCount - (rank - sCount -1 ) * perAggr, 0);
         else
@@ -0,0 +1,99 @@
+/*
+ * File:   smart_plugin.h
+ * Author: taozou
+ *
+ * C ABI of scan operator plugins.
+ *
+ * A plugin is a shared library that exports smart_plugin_entry(). smart
+ * loads it with dlopen on every rank when the query spec names it:
+ *
+ *   smart -s 4 -q plugin:/opt/scan/libmyscan.so:k=5,count
+ *
+ * The args ("k=5") run up to the next comma. Selectors call consume() on
+ * every block of downloaded values, then save() the state into their
+ * reports; aggregators and rank 0 merge() the states they receive and
+ * rank 0 print()s the result. The state must have
+ * the same size on every rank, for the same args. Nothing but this header
+ * is shared with smart, so a plugin can be rebuilt without rebuilding or
+ * redeploying smart.
+ *
+ * Example:
+ *
+ *   #include "smart_plugin.h"
+ *
+ *   static void *create(const char *args) { return calloc(1, sizeof(long long)); }
+ *   static void destroy(void *self) { free(self); }
+ *   static void reset(void *self) { *(long long *)self = 0; }
+ *   static size_t stateSize(void *self) { return sizeof(long long); }
+ *   static void consume(void *self, const int *data, size_t count)
+ *   {
+ *       for (size_t i = 0; i < count; ++i)
+ *           *(long long *)self += data[i] & 1;
+ *   }
+ *   static void save(void *self, void *state) { memcpy(state, self, sizeof(long long)); }
+ *   static void merge(void *self, const void *state)
+ *   {
+ *       long long v; memcpy(&v, state, sizeof(v)); *(long long *)self += v;
+ *   }
+ *   static void print(void *self, FILE *f) { fprintf(f, "%lld", *(long long *)self); }
+ *
+ *   static const smart_plugin plugin = { SMART_PLUGIN_ABI_VERSION, "odd",
+ *       create, destroy, reset, stateSize, consume, save, merge, print };
+ *
+ *   const smart_plugin *smart_plugin_entry(void) { return &plugin; }
+ */
+
+#ifndef SMART_PLUGIN_H
+#define	SMART_PLUGIN_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bumped on every incompatible change of struct smart_plugin.
+
+#define SMART_PLUGIN_ABI_VERSION 1
+
+typedef struct smart_plugin
+{
+    int abi_version;            // SMART_PLUGIN_ABI_VERSION the plugin was built with
+    const char *name;
+
+    // Returns a new instance, or NULL if args are invalid. args is the text
+    // after the library path in the query spec, "" if none.
+
+    void *(*create)(const char *args);
+    void (*destroy)(void *self);
+
+    // Back to the state of a fresh instance.
+
+    void (*reset)(void *self);
+
+    // Size of the serialized state, fixed for the life of the instance.
+
+    size_t (*state_size)(void *self);
+
+    // Hot path: called once per block of up to a few thousand values.
+
+    void (*consume)(void *self, const int *data, size_t count);
+
+    void (*save)(void *self, void *state);
+    void (*merge)(void *self, const void *state);
+
+    void (*print)(void *self, FILE *f);
+} smart_plugin;
+
+typedef const smart_plugin *(*smart_plugin_entry_fn)(void);
+
+#define SMART_PLUGIN_ENTRY "smart_plugin_entry"
+
+const smart_plugin *smart_plugin_entry(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* SMART_PLUGIN_H */
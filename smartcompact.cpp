@@ -0,0 +1,254 @@
+/*
+ * File:   smartcompact.cpp
+ * Author: taozou
+ *
+ * Compacts the objects under a prefix into one container object (see
+ * container.h). Objects of at least CopyMinPartSize are copied by S3 into
+ * parts of a multipart upload (UploadPartCopy), their bytes don't pass
+ * through this node. Smaller ones can't be parts of their own, so they are
+ * read and packed into parts of at least MultipartPartSize, followed by the
+ * index.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include "container.h"
+#include "upload.h"
+
+using namespace webstor;
+
+// S3 limits: parts but the last are at least 5MB, a copied part is at
+// most 5GB.
+
+#define CopyMinPartSize (5 * 1024 * 1024)
+#define CopyMaxPartSize (1024 * 1024 * 1024)
+#define ConnectionCount 16
+
+// The selector scans container members of at most this size, see
+// smartpack.cpp.
+
+#define ScanBufferSize 16777216
+
+// A part copied from a range of a source object.
+
+struct CopyPart
+{
+    const S3Object *source;
+    UInt64 offset;
+    UInt64 size;
+};
+
+static void copyParts(std::vector<S3Connection *> &cons, AsyncMan *asyncMan,
+                      const char *bucketName, const char *key, const char *uploadId,
+                      const std::vector<CopyPart> &copies, std::vector<S3PutResponse> *parts)
+{
+    // Up to one copy per connection in flight, part i + 1 is copies[i].
+
+    for (size_t i = 0; i < copies.size(); i += cons.size())
+    {
+        size_t n = std::min(cons.size(), copies.size() - i);
+
+        for (size_t k = 0; k < n; ++k)
+        {
+            const CopyPart &c = copies[i + k];
+            cons[k]->pendPutPartCopy(asyncMan, bucketName, key, uploadId, i + k + 1,
+                                     bucketName, c.source->key.c_str(), c.offset, c.size);
+        }
+
+        for (size_t k = 0; k < n; ++k)
+        {
+            parts->push_back(S3PutResponse());
+            cons[k]->completePut(&parts->back());
+            parts->back().partNumber = i + k + 1;
+        }
+    }
+}
+
+static void putPart(S3Connection *con, const char *bucketName, const char *key, const char *uploadId,
+                    const char *data, size_t size, std::vector<S3PutResponse> *parts)
+{
+    parts->push_back(S3PutResponse());
+    con->putPart(bucketName, key, uploadId, parts->size(), data, size, &parts->back());
+}
+
+static int compact(std::vector<S3Connection *> &cons, const char *bucketName, const char *prefix,
+                   const char *key, bool deleteSources)
+{
+    std::vector<S3Object> objects;
+    std::vector<const S3Object *> large;
+    std::vector<const S3Object *> small;
+
+    cons[0]->listAllObjects(bucketName, prefix, NULL, &objects);
+
+    for (size_t i = 0; i < objects.size(); ++i)
+        if (!objects[i].isDir && objects[i].key != key)
+            (objects[i].size >= CopyMinPartSize ? large : small).push_back(&objects[i]);
+
+    if (large.empty() && small.empty())
+    {
+        fprintf(stderr, "nothing under %s\n", prefix);
+        return 1;
+    }
+
+    // Large objects go first, split evenly so no part is under the minimum.
+
+    ContainerBuilder builder;
+    std::vector<CopyPart> copies;
+    UInt64 copied = 0;
+
+    for (size_t i = 0; i < large.size(); ++i)
+    {
+        UInt64 size = large[i]->size;
+        UInt64 count = (size + CopyMaxPartSize - 1) / CopyMaxPartSize;
+        UInt64 partSize = (size + count - 1) / count;
+
+        for (UInt64 off = 0; off < size; off += partSize)
+        {
+            CopyPart c = { large[i], off, std::min(partSize, size - off) };
+            copies.push_back(c);
+        }
+
+        if (size > ScanBufferSize)
+            fprintf(stderr, "note: %s is %llu bytes, smart scans members of at most %d\n",
+                    large[i]->key.c_str(), (unsigned long long)size, ScanBufferSize);
+
+        builder.reserve(large[i]->key.c_str(), size);
+        copied += size;
+    }
+
+    S3InitiateMultipartUploadResponse upload;
+    std::vector<S3PutResponse> parts;
+    AsyncMan asyncMan;
+    S3Metadata metadata;
+
+    // The container itself isn't compressed, whatever its members start with.
+
+    metadata[CodecMetadataName] = codecName(CodecNone);
+    cons[0]->initiateMultipartUpload(bucketName, key, false, false, NULL, &upload, &metadata);
+
+    try
+    {
+        copyParts(cons, &asyncMan, bucketName, key, upload.uploadId.c_str(), copies, &parts);
+
+        // Small objects are read a batch at a time, one per connection.
+
+        std::vector<std::vector<char> > data(cons.size());
+
+        for (size_t i = 0; i < small.size(); i += cons.size())
+        {
+            size_t n = std::min(cons.size(), small.size() - i);
+
+            for (size_t k = 0; k < n; ++k)
+            {
+                data[k].resize(small[i + k]->size);
+                cons[k]->pendGet(&asyncMan, bucketName, small[i + k]->key.c_str(),
+                                 data[k].empty() ? NULL : &data[k][0], data[k].size());
+            }
+
+            for (size_t k = 0; k < n; ++k)
+            {
+                S3GetResponse response;
+
+                cons[k]->completeGet(&response);
+                if (response.loadedContentLength != data[k].size() || response.isTruncated)
+                    throw std::runtime_error(small[i + k]->key + " changed while compacting");
+                builder.add(small[i + k]->key.c_str(), data[k].empty() ? NULL : &data[k][0], data[k].size());
+            }
+
+            if (builder.object.size() >= MultipartPartSize)
+            {
+                putPart(cons[0], bucketName, key, upload.uploadId.c_str(), &builder.object[0],
+                        builder.object.size(), &parts);
+                builder.consumed();
+            }
+        }
+
+        builder.finish();
+        putPart(cons[0], bucketName, key, upload.uploadId.c_str(), &builder.object[0],
+                builder.object.size(), &parts);
+        cons[0]->completeMultipartUpload(bucketName, key, upload.uploadId.c_str(), &parts[0], parts.size());
+    }
+    catch (...)
+    {
+        for (size_t k = 0; k < cons.size(); ++k)
+            if (cons[k]->isAsyncPending())
+                cons[k]->cancelAsync();
+        try
+        {
+            cons[0]->abortMultipartUpload(bucketName, key, upload.uploadId.c_str());
+        }
+        catch (...)
+        {
+        }
+        throw;
+    }
+
+    printf("%s: %d objects, %llu bytes copied by S3, %d objects read\n", key,
+           (int)(large.size() + small.size()), (unsigned long long)copied, (int)small.size());
+
+    if (deleteSources)
+    {
+        for (size_t i = 0; i < large.size(); ++i)
+            cons[0]->del(bucketName, large[i]->key.c_str());
+        for (size_t i = 0; i < small.size(); ++i)
+            cons[0]->del(bucketName, small[i]->key.c_str());
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bool deleteSources = false;
+    int connections = ConnectionCount;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if (!strcmp(argv[i], "-d"))
+            deleteSources = true;
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            connections = std::max(1, atoi(argv[++i]));
+        else
+            break;
+    }
+
+    if (argc - i != 3)
+    {
+        fprintf(stderr, "smartcompact [-d] [-n Connections(16)] Bucket Prefix Key\n"
+                        "      merges the objects under Prefix into the container object Key\n"
+                        "      -d deletes them once Key is complete\n");
+        return 1;
+    }
+
+    S3Config config = {};
+
+    if( !( config.accKey = getenv( "AWS_ACCESS_KEY" ) ) ||
+        !( config.secKey = getenv( "AWS_SECRET_KEY" ) )  )
+    {
+        fprintf(stderr, "no AWS_XXXX is set. \n");
+        return 1;
+    }
+
+    std::vector<S3Connection *> cons;
+    int rc = 1;
+
+    try
+    {
+        for (int k = 0; k < connections; ++k)
+            cons.push_back(new S3Connection(config));
+        rc = compact(cons, argv[i], argv[i + 1], argv[i + 2], deleteSources);
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+    }
+
+    for (size_t k = 0; k < cons.size(); ++k)
+        delete cons[k];
+    return rc;
+}
@@ -0,0 +1,176 @@
+/*
+ * File:   smartpack.cpp
+ * Author: taozou
+ *
+ * Packs small files into one container object (see container.h), or reads
+ * one member back with ranged requests.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "container.h"
+#include "upload.h"
+
+using namespace webstor;
+
+// The selector reads an object into a buffer of this size; larger
+// containers are read member by member, so only a member larger than
+// this is skipped by a scan.
+
+#define ScanBufferSize 16777216
+
+static bool readFile(const char *path, std::vector<char> *data)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return false;
+
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        data->insert(data->end(), chunk, chunk + n);
+
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+static int pack(S3Connection *con, const char *bucketName, const char *key, char **files, int count)
+{
+    S3Metadata metadata;
+    metadata[CodecMetadataName] = codecName(CodecNone);
+
+    MultipartWriter writer(con, bucketName, key, &metadata);
+    ContainerBuilder builder;
+
+    for (int i = 0; i < count; ++i)
+    {
+        std::vector<char> data;
+
+        if (!readFile(files[i], &data))
+        {
+            fprintf(stderr, "cannot read %s\n", files[i]);
+            return 1;
+        }
+
+        if (data.size() > ScanBufferSize)
+            fprintf(stderr, "note: %s is %llu bytes, smart scans members of at most %d\n",
+                    files[i], (unsigned long long)data.size(), ScanBufferSize);
+
+        builder.add(files[i], data.empty() ? NULL : &data[0], data.size());
+        writer.write(builder.object.empty() ? NULL : &builder.object[0], builder.object.size());
+        builder.consumed();
+    }
+
+    builder.finish();
+    writer.write(&builder.object[0], builder.object.size());
+    writer.finish();
+    return 0;
+}
+
+// A point lookup: the tail holds the index, then the member is one
+// ranged read.
+
+static int extract(S3Connection *con, const char *bucketName, const char *key, const char *name, FILE *out)
+{
+    std::vector<char> tail(ContainerTailSize);
+    S3GetResponse response;
+    ContainerIndex index;
+
+    {
+        AsyncMan asyncMan;
+        con->pendGetTail(&asyncMan, bucketName, key, &tail[0], tail.size());
+        con->completeGet(&response);
+    }
+
+    if (response.loadedContentLength == (size_t)-1)
+    {
+        fprintf(stderr, "%s not found\n", key);
+        return 1;
+    }
+
+    switch (index.parseTail(&tail[0], response.loadedContentLength))
+    {
+    case ContainerIndex::Invalid:
+        fprintf(stderr, "%s is not a container\n", key);
+        return 1;
+    case ContainerIndex::NeedIndex:
+        {
+            std::vector<char> data(index.indexSize);
+            S3ByteRange range = { (size_t)index.indexOffset, data.size(), &data[0] };
+
+            con->get(bucketName, key, &range, 1, NULL, &response);
+            if (response.isTruncated || !index.parseIndex(&data[0], data.size()))
+            {
+                fprintf(stderr, "bad index in %s\n", key);
+                return 1;
+            }
+        }
+        break;
+    case ContainerIndex::Complete:
+        break;
+    }
+
+    int i = index.find(name);
+    if (i < 0)
+    {
+        fprintf(stderr, "%s has no %s\n", key, name);
+        return 1;
+    }
+
+    const ContainerMember &m = index.members[i];
+    if (!m.size)
+        return 0;
+
+    std::vector<char> data(m.size);
+    S3ByteRange range = { (size_t)m.offset, data.size(), &data[0] };
+
+    con->get(bucketName, key, &range, 1, NULL, &response);
+    if (response.isTruncated)
+    {
+        fprintf(stderr, "cannot read %s from %s\n", name, key);
+        return 1;
+    }
+
+    return fwrite(&data[0], 1, data.size(), out) == data.size() ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    bool get = argc > 1 && !strcmp(argv[1], "-g");
+    int i = get ? 2 : 1;
+
+    if ((get && argc - i != 3) || (!get && argc - i < 3))
+    {
+        fprintf(stderr, "smartpack Bucket Key File...\n"
+                        "      packs the files into one container object, named by their paths\n"
+                        "smartpack -g Bucket Key Name\n"
+                        "      writes the member Name of a container to stdout\n");
+        return 1;
+    }
+
+    S3Config config = {};
+
+    if( !( config.accKey = getenv( "AWS_ACCESS_KEY" ) ) ||
+        !( config.secKey = getenv( "AWS_SECRET_KEY" ) )  )
+    {
+        fprintf(stderr, "no AWS_XXXX is set. \n");
+        return 1;
+    }
+
+    try
+    {
+        S3Connection con(config);
+
+        if (get)
+            return extract(&con, argv[i], argv[i + 1], argv[i + 2], stdout);
+        return pack(&con, argv[i], argv[i + 1], argv + i + 2, argc - i - 2);
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+}
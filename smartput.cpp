@@ -0,0 +1,237 @@
+/*
+ * File:   smartput.cpp
+ * Author: taozou
+ *
+ * Ingest tool: uploads a file of native ints as an object smart can scan.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "columnar.h"
+#include "packed.h"
+#include "codec.h"
+#include "upload.h"
+#include "topindex.h"
+#include "bloom.h"
+
+using namespace webstor;
+
+// Times the top index is read again when another ingest wrote it first.
+
+#define IndexAttempts 10
+
+static bool readFile(const char *path, std::vector<char> *data)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return false;
+
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        data->insert(data->end(), chunk, chunk + n);
+
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int columnCount = 0;
+    bool pack = false;
+    bool delta = false;
+    bool sorted = false;
+    const char *indexKey = NULL;
+    int indexCapacity = TopIndexCapacity;
+    int bloomBits = 0;
+    Codec codec = CodecNone;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if (!strcmp(argv[i], "-c") && i + 1 < argc)
+            columnCount = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-e"))
+            pack = true;
+        else if (!strcmp(argv[i], "-d"))
+            pack = delta = true;
+        else if (!strcmp(argv[i], "-s"))
+            sorted = true;
+        else if (!strcmp(argv[i], "-x") && i + 1 < argc)
+            indexKey = argv[++i];
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            indexCapacity = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            bloomBits = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-z") && i + 1 < argc)
+        {
+            if (!parseCodec(argv[++i], &codec) || !codecAvailable(codec))
+            {
+                fprintf(stderr, "codec %s is not supported\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+            break;
+    }
+
+    if (argc - i != 3 || (pack && columnCount > 0) || (sorted && (pack || columnCount > 0 || codec != CodecNone)) ||
+        (indexKey && columnCount > 0) || indexCapacity <= 0 ||
+        bloomBits < 0 || (bloomBits && (pack || columnCount > 0 || codec != CodecNone)))
+    {
+        fprintf(stderr, "smartput [-c ColumnCount | -e | -d | -s] [-z Codec] [-x IndexKey [-n N(1000)]]\n"
+                        "         [-b BitsPerValue] Bucket Key File\n"
+                        "      File holds native ints; with -c it holds records of ColumnCount ints\n"
+                        "      which are stored as a columnar object (see columnar.h)\n"
+                        "      -e stores the ints bit-packed, -d delta + bit-packed (see packed.h)\n"
+                        "      -z compresses the object with gzip, lz4 or zstd (read it with smart -z)\n"
+                        "      -s marks the object as sorted, the ints must be in ascending order\n"
+                        "      (smart -S reads only the last values of such objects for top-k)\n"
+                        "      -x adds the N largest ints to the top index IndexKey, made if missing\n"
+                        "      (smart -I answers top-k from it, see topindex.h)\n"
+                        "      -b also uploads Key" BloomSuffix ", Bloom filters of the ints with\n"
+                        "      BitsPerValue bits per distinct value, 16 gives 0.2%% false positives\n"
+                        "      (smart -f reads them, see bloom.h)\n");
+        return 1;
+    }
+
+    const char *bucketName = argv[i];
+    const char *key = argv[i + 1];
+    std::vector<char> data;
+
+    if (!readFile(argv[i + 2], &data))
+    {
+        fprintf(stderr, "cannot read %s\n", argv[i + 2]);
+        return 1;
+    }
+
+    S3Metadata metadata;
+
+    if (sorted)
+    {
+        const int *values = data.empty() ? NULL : (const int *) &data[0];
+        size_t count = data.size() / sizeof(int);
+
+        for (size_t k = 1; k < count; ++k)
+            if (values[k] < values[k - 1])
+            {
+                fprintf(stderr, "%s is not sorted at int %llu\n", argv[i + 2], (unsigned long long)k);
+                return 1;
+            }
+        metadata[SortedMetadataName] = "1";
+    }
+
+    S3Config config = {};
+
+    if( !( config.accKey = getenv( "AWS_ACCESS_KEY" ) ) ||
+        !( config.secKey = getenv( "AWS_SECRET_KEY" ) )  )
+    {
+        fprintf(stderr, "no AWS_XXXX is set. \n");
+        return 1;
+    }
+
+    // The index is over the ints of the file, whatever the object looks like.
+
+    TopIndex index(indexCapacity);
+    std::string indexEtag;
+    std::vector<char> unpacked;     // the ints, if data no longer holds them
+    const std::vector<char> *ints = &data;
+
+    if (indexKey)
+    {
+        try
+        {
+            S3Connection con(config);
+            readTopIndex(&con, bucketName, indexKey, &index, &indexEtag);
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+        index.add(key, data.empty() ? NULL : (const int *) &data[0], data.size() / sizeof(int));
+    }
+
+    std::vector<char> bloom;
+
+    if (bloomBits)
+        buildBloom(data.empty() ? NULL : (const int *) &data[0], data.size() / sizeof(int), bloomBits, &bloom);
+
+    if (columnCount > 0)
+    {
+        size_t recordSize = columnCount * sizeof(int);
+
+        if (data.size() % recordSize)
+        {
+            fprintf(stderr, "file size is not a multiple of %d ints\n", columnCount);
+            return 1;
+        }
+
+        std::vector<char> object;
+        buildColumnar(data.empty() ? NULL : (const int *) &data[0], data.size() / recordSize,
+                      columnCount, &object);
+        data.swap(object);
+    }
+    else if (pack)
+    {
+        std::vector<char> object;
+        packValues(data.empty() ? NULL : (const int *) &data[0], data.size() / sizeof(int), delta, &object);
+        if (indexKey)
+        {
+            unpacked.swap(data);
+            ints = &unpacked;
+        }
+        data.swap(object);
+    }
+
+    // smart -z takes the codec from the metadata rather than from the first
+    // bytes, which plain ints may happen to share with a compressed stream.
+
+    metadata[CodecMetadataName] = codecName(CodecNone);
+
+    try
+    {
+        S3Connection con(config);
+        std::string etag;
+
+        if (codec != CodecNone)
+            uploadCompressed(&con, bucketName, key, data.empty() ? NULL : &data[0], data.size(), codec);
+        else
+            uploadObject(&con, bucketName, key, data.empty() ? NULL : &data[0], data.size(), &metadata, &etag);
+
+        // Filters and index describe the object once it's there.
+
+        if (bloomBits)
+        {
+            S3Metadata bloomMetadata;
+            bloomMetadata[BloomEtagMetadataName] = etag;
+            uploadObject(&con, bucketName, bloomKey(key).c_str(), &bloom[0], bloom.size(), &bloomMetadata);
+        }
+
+        // Another ingest may have written the index since it was read: add
+        // the object to that one instead.
+
+        for (int attempt = 1; indexKey && !writeTopIndex(&con, bucketName, indexKey, index, indexEtag); ++attempt)
+        {
+            if (attempt == IndexAttempts)
+            {
+                fprintf(stderr, "%s keeps changing, %s is not in it\n", indexKey, key);
+                return 1;
+            }
+            index = TopIndex(indexCapacity);
+            indexEtag.clear();
+            readTopIndex(&con, bucketName, indexKey, &index, &indexEtag);
+            index.add(key, ints->empty() ? NULL : (const int *) &(*ints)[0], ints->size() / sizeof(int));
+        }
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
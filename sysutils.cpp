@@ -32,15 +32,28 @@
 #else  // !_WIN32
 #include <errno.h> 
 #include <sys/eventfd.h> 
+#include <sys/timerfd.h> 
 #include <sys/epoll.h> 
 #include <poll.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <sched.h>
+
+#ifdef __has_include
+#if __has_include( <linux/io_uring.h> ) && defined( __NR_io_uring_setup )
+#define WEBSTOR_URING
+#include <linux/io_uring.h>
+#endif
+#endif
 #endif  // !_WIN32
 
 #include <stdarg.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -435,7 +448,7 @@ waitAny( pollfd *fds, size_t count, UInt32 msTimeout )  // nofail
 
         for( size_t i = 0; i < count; ++i )
         {
-            if( fds[ i ].revents | POLLIN )
+            if( fds[ i ].revents & POLLIN )
             {
                 return i;
             }
@@ -599,13 +612,69 @@ SocketHandle sh( SOCKET socket )
      return reinterpret_cast< SocketHandle >( socket );
 }
 
-struct SocketPoolState : public std::vector< pollfd > {};
+// The timer is a deadline the waits are cut to.
+
+struct SocketPoolState : public std::vector< pollfd > 
+{
+                    SocketPoolState() : timerDeadline( ( UInt64 )-1 ) {}
+
+    UInt64          timerDeadline;  // ( UInt64 )-1 if disarmed
+};
+
+static UInt32
+timerLeft( const SocketPoolState *pool, UInt32 msTimeout )  // nofail
+{
+    if( pool->timerDeadline == ( UInt64 )-1 )
+    {
+        return msTimeout;
+    }
+
+    UInt64 now = GetTickCount64();
+    return now >= pool->timerDeadline ? 0 : ( UInt32 )std::min( ( UInt64 )msTimeout, pool->timerDeadline - now );
+}
+
+static bool
+expireTimer( SocketPoolState *pool )  // nofail
+{
+    if( pool->timerDeadline == ( UInt64 )-1 || GetTickCount64() < pool->timerDeadline )
+    {
+        return false;
+    }
+
+    pool->timerDeadline = ( UInt64 )-1;
+    return true;
+}
 
-SocketPool::SocketPool() 
+SocketPool::SocketPool( bool, bool, size_t ) 
     : m_pool( new SocketPoolState() )
 {
 }
 
+void
+SocketPool::setTimer( UInt32 msDelay )  // nofail
+{
+    m_pool->timerDeadline = msDelay == INFINITE ? ( UInt64 )-1 : GetTickCount64() + msDelay;
+}
+
+bool
+SocketPool::watchesAll() const  // nofail
+{
+    return true;
+}
+
+void
+SocketPool::setEvents( EventSync *const *events, size_t count )  // nofail
+{
+    for( size_t i = 0; i < count; ++i )
+        events[ i ]->set();
+}
+
+bool
+SocketPool::usesUring() const  // nofail
+{
+    return false;
+}
+
 static int 
 pollfdLess( const pollfd& v1, const pollfd& v2 )
 {
@@ -712,10 +781,16 @@ getActionMask( UInt32 events, UInt32 revents )
 }
 
 bool
-SocketPool::wait( UInt32 msTimeout, UInt32 msInterruptOnlyTimeout, SocketActions *socketActions )   
+SocketPool::wait( UInt32 msTimeout, UInt32 msInterruptOnlyTimeout, SocketActions *socketActions,
+    bool *timerExpired )
 {
     dbgAssert( socketActions );
+    dbgAssert( timerExpired );
     socketActions->clear();
+    *timerExpired = false;
+
+    msTimeout = timerLeft( m_pool, msTimeout );
+    msInterruptOnlyTimeout = timerLeft( m_pool, msInterruptOnlyTimeout );
 
     if( m_pool->size() == 0 )
     {
@@ -735,7 +810,8 @@ SocketPool::wait( UInt32 msTimeout, UInt32 msInterruptOnlyTimeout, SocketActions
 #endif
 
         m_interrupt.reset();
-        return res == WAIT_OBJECT_0;  // true if interrupt.
+        *timerExpired = expireTimer( m_pool );
+        return res == WAIT_OBJECT_0 || *timerExpired;  // true if interrupt or timer.
     }
   
     // It would be great to be able to wait for all sockets and the interrupt event together.
@@ -768,7 +844,6 @@ SocketPool::wait( UInt32 msTimeout, UInt32 msInterruptOnlyTimeout, SocketActions
     // them.
     //
 
-    dbgAssert( msTimeout < INFINITE );
     const UInt32 spinTimeout = 15;
 
     while( msTimeout )
@@ -803,7 +878,8 @@ SocketPool::wait( UInt32 msTimeout, UInt32 msInterruptOnlyTimeout, SocketActions
 
             // Reduce the overall timeout and repeat.
 
-            msTimeout -= spinTimeout;
+            if( msTimeout != INFINITE )
+                msTimeout -= spinTimeout;
             continue;
         }
 
@@ -822,7 +898,8 @@ SocketPool::wait( UInt32 msTimeout, UInt32 msInterruptOnlyTimeout, SocketActions
         break;
     }
 
-    return !socketActions->empty(); // true if activity has been detected.
+    *timerExpired = expireTimer( m_pool );
+    return !socketActions->empty() || *timerExpired; // true if activity has been detected.
 }
 
 #else  // !_WIN32
@@ -833,264 +910,1159 @@ int s( SocketHandle socket )
     return socket;
 }
 
-struct SocketPoolState
+static inline SocketActionMask
+getActionMask( UInt32 events )
 {
-                    SocketPoolState();
-                    ~SocketPoolState();
-
-    std::vector< SocketHandle >     sockets;
-    int                             epoll;
-};
+    SocketActionMask actionMask = 0;
 
+    if( events & ( EPOLLIN  | EPOLLERR | EPOLLHUP ) )
+    {
+        actionMask |= SA_POLL_IN;
+    }
 
-SocketPoolState::SocketPoolState()
-    : epoll( 0 )
-{
-    epoll = epoll_create( 32 /* hint */ );
+    if( events & ( EPOLLOUT ) )
+    {
+        actionMask |= SA_POLL_OUT;
+    }
 
-    if( epoll == -1 )
+    if( events & ( EPOLLERR | EPOLLHUP  | EPOLLPRI ) )
     {
-        throwSystemError( errno, "epoll_create" );
+        actionMask |= SA_POLL_ERR;
     }
+
+    return actionMask;
 }
 
-SocketPoolState::~SocketPoolState()
+// The state of the sockets is kept in flat tables indexed by the socket, 
+// which is a small int. Makes the table cover the socket, false if out of memory.
+
+template< class T >
+static bool
+coverSocket( std::vector< T > *table, SocketHandle socket )  // nofail
 {
-    dbgVerify( !close( epoll ) );
+    dbgAssert( socket >= 0 );
+
+    if( ( size_t )socket < table->size() )
+    {
+        return true;
+    }
+
+    try
+    {
+        table->resize( std::max( ( size_t )socket + 1, table->size() * 2 ) );  // can throw std::bad_alloc
+    }
+    catch( ... )
+    {
+        return false;
+    }
+
+    return true;
 }
 
-SocketPool::SocketPool() 
-    : m_pool( NULL )
+#ifdef WEBSTOR_URING
+
+//////////////////////////////////////////////////////////////////////////////
+// Uring -- the io_uring backend of SocketPool, on raw system calls.
+//
+// A socket has a one-shot poll, armed again once its completion is handled.
+// A poll checks readiness when it is armed, so this is level-triggered, which
+// curl needs (it doesn't read sockets until EAGAIN), and the arming goes to
+// the kernel with the next wait, in the same system call as all other
+// poll-add and poll-remove requests queued meanwhile. The interrupt event 
+// and the timer are registered files with a multishot poll each.
+
+CASSERT( EPOLLIN == POLLIN && EPOLLOUT == POLLOUT && EPOLLRDHUP == POLLRDHUP );
+CASSERT( EPOLLERR == POLLERR && EPOLLHUP == POLLHUP && EPOLLPRI == POLLPRI );
+
+enum
 {
-    std::auto_ptr< SocketPoolState > pool( new SocketPoolState() );
+    c_uringEntries = 1024,
 
-    // Add the interrupt handler to the epoll.
+    // The low 2 bits of user_data tell what has completed.
 
-    epoll_event ev = {};
-    ev.events = EPOLLIN;
-    ev.data.fd = m_interrupt.m_handle;
+    c_tagPoll = 0,
+    c_tagWrite = 1,         // the rest is the EventSync
+    c_tagInterrupt = 2,     // the rest is the index of the registered file
+    c_tagIgnore = 3,
 
-    if( epoll_ctl( pool->epoll, EPOLL_CTL_ADD, m_interrupt.m_handle, &ev ) == -1 )
-    {
-        throwSystemError( errno, "epoll_ctl" );
-    }
+    // The registered files.
 
-    // Commit changes.
+    c_fileInterrupt = 0,
+    c_fileTimer = 1,
+    c_fileCount = 2
+};
 
-    m_pool = pool.release();  // nofail
-}
+static const UInt64 s_eventIncrement = 1;
 
-bool 
-SocketPool::add( SocketHandle socket, SocketActionMask actionMask )  // nofail
+struct UringPoll
 {
-    //$ WARNING: this is nofail only if SocketPool::reserve was called
-    // to ensure capacity.
+    SocketHandle    socket;
+    UInt32          events;
+    UInt32          generation;     // of the armed poll
+    bool            armed;
+    bool            present;
+};
 
-    epoll_event ev = {};
-    ev.events = ( actionMask & SA_POLL_IN ? ( EPOLLIN | EPOLLRDHUP ) : 0 ) | 
-        ( actionMask & SA_POLL_OUT ? ( EPOLLOUT | EPOLLRDHUP ) : 0 );
-    ev.data.fd = socket;
+class Uring
+{
+public:
+                    Uring();
+                    ~Uring();
 
-    int res = epoll_ctl( m_pool->epoll, EPOLL_CTL_ADD, socket, &ev );
-    int err = errno;
-    dbgAssert( !res || res == -1 && ( err == EEXIST || res == ENOMEM ) );
+    bool            init( int interruptFd, int timerFd );
 
-    // Note: we cannot fail in this method so ignore ENOMEM and still add 
-    // the socket to our list (the block below).
-    // The socket is not in the epoll and won't participate
-    // in the epoll_wait but we can rely on the wait timeout to ensure
-    // we won't stuck.
+    bool            add( SocketHandle socket, UInt32 events );  // nofail, false if out of memory
+    void            remove( SocketHandle socket );  // nofail
+    void            reserve( size_t size );
 
-    if( res == -1 && err == EEXIST )
-    {
-        res = epoll_ctl( m_pool->epoll, EPOLL_CTL_MOD, socket, &ev );
-        dbgAssert( !res );
-    }
+    // Returns true if there is socket activity, an interrupt or the timer is 
+    // readable.
+
+    bool            wait( UInt32 msTimeout, bool *interrupted, bool *timerReadable,
+                        SocketActions *socketActions );  // nofail
+
+    // Writes count queued event writes, false if that failed.
+
+    bool            flushWrites( size_t count );  // nofail
 
-    // Add the socket to our list.
+    // True once a poll could not be kept for lack of memory: its socket is
+    // left to the caller, as an unwatched one.
 
-    std::vector< SocketHandle >::iterator it = std::lower_bound( m_pool->sockets.begin(), 
-        m_pool->sockets.end(), socket );  // nofail
+    bool            lost() const { return m_lost; }
 
-    if( it == m_pool->sockets.end() || *it != socket )
+    io_uring_sqe *  getSqe();  // nofail, NULL if the ring is full
+
+private:
+                    Uring( const Uring & );  // forbidden
+    Uring &         operator=( const Uring & );  // forbidden
+
+    int             enter( unsigned minComplete, UInt32 msTimeout );  // nofail, returns errno
+    bool            popCqe( io_uring_cqe *cqe );  // nofail
+
+    UringPoll *     find( SocketHandle socket );  // nofail
+    void            arm( UringPoll *poll );  // nofail
+    void            cancel( UringPoll *poll );  // nofail
+    void            armFile( int file );  // nofail
+
+    template< class T >
+    void            keep( std::vector< T > *items, const T &item );  // nofail
+
+    // Handles a completion; without socketActions, poll completions are 
+    // deferred to the next wait(..).
+
+    void            handle( const io_uring_cqe &cqe, SocketActions *socketActions, 
+                        size_t *writes );  // nofail
+
+    static UInt64   tag( const UringPoll *poll ) 
+                    { return ( ( UInt64 )poll->generation << 34 ) | ( ( UInt64 )( UInt32 )poll->socket << 2 ) | c_tagPoll; }
+
+    int             m_fd;
+
+    void *          m_sqRing;
+    size_t          m_sqRingSize;
+    void *          m_cqRing;
+    size_t          m_cqRingSize;
+    io_uring_sqe *  m_sqes;
+    size_t          m_sqesSize;
+
+    unsigned *      m_sqHead;
+    unsigned *      m_sqTail;
+    unsigned *      m_sqArray;
+    unsigned        m_sqMask;
+    unsigned        m_sqEntries;
+    unsigned        m_sqLocalTail;
+
+    unsigned *      m_cqHead;
+    unsigned *      m_cqTail;
+    io_uring_cqe *  m_cqes;
+    unsigned        m_cqMask;
+
+    std::vector< UringPoll >    m_polls;        // by socket
+    std::vector< SocketHandle > m_rearm;        // polls to arm by the next wait
+    std::vector< io_uring_cqe > m_deferred;     // poll completions seen by flushWrites(..)
+    UInt32                      m_generation;
+    bool                        m_lost;
+    bool                        m_fileArmed[ c_fileCount ];
+    bool                        m_fileReadable[ c_fileCount ];
+};
+
+Uring::Uring()
+    : m_fd( -1 )
+    , m_sqRing( MAP_FAILED )
+    , m_sqRingSize( 0 )
+    , m_cqRing( MAP_FAILED )
+    , m_cqRingSize( 0 )
+    , m_sqes( ( io_uring_sqe * )MAP_FAILED )
+    , m_sqesSize( 0 )
+    , m_generation( 0 )
+    , m_lost( false )
+{
+    for( int i = 0; i < c_fileCount; ++i )
     {
-        dbgAssert( m_pool->sockets.capacity() > m_pool->sockets.size() );
-        m_pool->sockets.insert( it, socket );  // nofail because we checked capacity above.
-        return true;
+        m_fileArmed[ i ] = false;
+        m_fileReadable[ i ] = false;
     }
+}
 
-    return false;
+Uring::~Uring()
+{
+    if( m_sqes != MAP_FAILED )
+        munmap( m_sqes, m_sqesSize );
+    if( m_cqRing != MAP_FAILED && m_cqRing != m_sqRing )
+        munmap( m_cqRing, m_cqRingSize );
+    if( m_sqRing != MAP_FAILED )
+        munmap( m_sqRing, m_sqRingSize );
+    if( m_fd != -1 )
+        close( m_fd );
 }
 
 bool
-SocketPool::remove( SocketHandle socket )  // nofail
+Uring::init( int interruptFd, int timerFd )
 {
-    epoll_event unused = {};
-    int res = epoll_ctl( m_pool->epoll, EPOLL_CTL_DEL, socket, &unused );
-    int err = errno;
-    dbgAssert( !res || res == -1 && ( err == ENOENT || err == EBADF ) ); // EBADF - if the socket has been closed already.
+    io_uring_params params;
+    memset( &params, 0, sizeof( params ) );
 
-    std::vector< SocketHandle >::iterator it = std::lower_bound( m_pool->sockets.begin(), m_pool->sockets.end(), socket );
+#ifdef IORING_SETUP_COOP_TASKRUN
+    // No interprocessor interrupt to run completions, we enter the ring 
+    // right away anyway.
 
-    if( it == m_pool->sockets.end() || *it != socket )
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    m_fd = syscall( __NR_io_uring_setup, c_uringEntries, &params );
+
+    if( m_fd == -1 && errno == EINVAL )
     {
-        return false;
+        memset( &params, 0, sizeof( params ) );
+        m_fd = syscall( __NR_io_uring_setup, c_uringEntries, &params );
     }
+#else
+    m_fd = syscall( __NR_io_uring_setup, c_uringEntries, &params );
+#endif
 
-    m_pool->sockets.erase( it );  // nofail
-    return true;
-}
-
-void
-SocketPool::reserve( size_t size ) 
-{
-    m_pool->sockets.reserve( size );
-}
+    // Timeouts of io_uring_enter(..) need EXT_ARG (5.11).
 
-size_t
-SocketPool::size() const
-{ 
-    return m_pool->sockets.size();
-}
+    if( m_fd == -1 || !( params.features & IORING_FEAT_EXT_ARG ) || !( params.features & IORING_FEAT_NODROP ) )
+    {
+        return false;
+    }
 
-static inline SocketActionMask
-getActionMask( UInt32 events )
-{
-    SocketActionMask actionMask = 0;
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe );
 
-    if( events & ( EPOLLIN  | EPOLLERR | EPOLLHUP ) )
+    if( params.features & IORING_FEAT_SINGLE_MMAP )
     {
-        actionMask |= SA_POLL_IN;
+        m_sqRingSize = m_cqRingSize = std::max( m_sqRingSize, m_cqRingSize );
     }
 
-    if( events & ( EPOLLOUT ) )
+    m_sqRing = mmap( 0, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING );
+
+    if( m_sqRing == MAP_FAILED )
     {
-        actionMask |= SA_POLL_OUT;
+        return false;
     }
 
-    if( events & ( EPOLLERR | EPOLLHUP  | EPOLLPRI ) )
+    m_cqRing = params.features & IORING_FEAT_SINGLE_MMAP ? m_sqRing :
+        mmap( 0, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING );
+    m_sqesSize = params.sq_entries * sizeof( io_uring_sqe );
+    m_sqes = ( io_uring_sqe * )mmap( 0, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+        m_fd, IORING_OFF_SQES );
+
+    if( m_cqRing == MAP_FAILED || m_sqes == MAP_FAILED )
     {
-        actionMask |= SA_POLL_ERR;
+        return false;
     }
 
-    return actionMask;
-}
+    char *sq = static_cast< char * >( m_sqRing );
+    char *cq = static_cast< char * >( m_cqRing );
 
-bool
-SocketPool::wait( UInt32 msTimeout, UInt32 msInterruptOnlyTimeout, SocketActions *socketActions )
-{
-    dbgAssert( socketActions );
-    socketActions->clear();
+    m_sqHead = ( unsigned * )( sq + params.sq_off.head );
+    m_sqTail = ( unsigned * )( sq + params.sq_off.tail );
+    m_sqArray = ( unsigned * )( sq + params.sq_off.array );
+    m_sqMask = *( unsigned * )( sq + params.sq_off.ring_mask );
+    m_sqEntries = params.sq_entries;
+    m_sqLocalTail = *m_sqTail;
 
-    int res = 0;
+    m_cqHead = ( unsigned * )( cq + params.cq_off.head );
+    m_cqTail = ( unsigned * )( cq + params.cq_off.tail );
+    m_cqes = ( io_uring_cqe * )( cq + params.cq_off.cqes );
+    m_cqMask = *( unsigned * )( cq + params.cq_off.ring_mask );
 
-    epoll_event events[ 32 ];
+    int files[ c_fileCount ] = { interruptFd, timerFd };
 
-    // If we have at least one socket, make sure that timeout is not infinite,
-    // see the comments in the add(..) method.
-    dbgAssert( !m_pool->sockets.size() || msTimeout < ( UInt32 ) -1 );
+    if( syscall( __NR_io_uring_register, m_fd, IORING_REGISTER_FILES, files, c_fileCount ) == -1 )
+    {
+        return false;
+    }
 
-    UInt32 initTimeout = m_pool->sockets.size() > 0 ? msTimeout : msInterruptOnlyTimeout;
-    Timeout timeout( initTimeout ); 
+    armFile( c_fileInterrupt );
+    armFile( c_fileTimer );
+    return m_fileArmed[ c_fileInterrupt ] && m_fileArmed[ c_fileTimer ];
+}
 
-    while( true ) 
+io_uring_sqe *
+Uring::getSqe()  // nofail
+{
+    if( m_sqLocalTail - __atomic_load_n( m_sqHead, __ATOMIC_ACQUIRE ) == m_sqEntries )
     {
-#ifdef PERF
-        Stopwatch stopwatch( true );
-#endif
-        res = epoll_wait( m_pool->epoll, events, dimensionOf( events ), timeout.left() );
+        // Full, submit what is queued.
 
-#ifdef PERF
-        LOG_TRACE( "SocketPoolSync:epoll_wait, timeout=%d, actual=%llu, size=%llu, result=%d", 
-            initTimeout, stopwatch.elapsed(), static_cast< UInt64 >( m_pool->sockets.size() ), res );
-#endif
-        if( res == -1 )
+        enter( 0, 0 );
+
+        if( m_sqLocalTail - __atomic_load_n( m_sqHead, __ATOMIC_ACQUIRE ) == m_sqEntries )
         {
-            int e = errno;
+            return NULL;
+        }
+    }
 
-            if( e == EINTR )
-            {
-                // Make sure we don't end up in infinite loop when timeout is not infinite.
+    // The kernel reads the ring only in io_uring_enter(..), so the entry can
+    // be filled after it is published.
 
-                if( timeout.left() )
-                    continue;
+    unsigned index = m_sqLocalTail & m_sqMask;
+    io_uring_sqe *sqe = &m_sqes[ index ];
 
-                break;
-            }
+    memset( sqe, 0, sizeof( *sqe ) );
+    m_sqArray[ index ] = index;
+    __atomic_store_n( m_sqTail, ++m_sqLocalTail, __ATOMIC_RELEASE );
+    return sqe;
+}
 
-            if( e == ENOMEM )
-            {
-                // Out of memory, we cannot do anything better than just wait for a while.
+int
+Uring::enter( unsigned minComplete, UInt32 msTimeout )  // nofail
+{
+    // Submits everything queued, the kernel tells what it has consumed.
 
-                taskSleep( 3000 );
-                break;
-            }
+    unsigned toSubmit = m_sqLocalTail - __atomic_load_n( m_sqHead, __ATOMIC_ACQUIRE );
+    io_uring_getevents_arg arg;
+    __kernel_timespec ts;
 
-            dbgPanicSz( "BUG: epoll_wait failed!!!" );
-        }
+    memset( &arg, 0, sizeof( arg ) );
 
-        break;
-    } 
+    if( msTimeout != ( UInt32 )EventSync::c_infinite )
+    {
+        ts.tv_sec = msTimeout / 1000;
+        ts.tv_nsec = ( msTimeout % 1000 ) * 1000000;
+        arg.ts = ( UInt64 )&ts;
+    }
 
-    // Get the events.
+    int res = syscall( __NR_io_uring_enter, m_fd, toSubmit, minComplete, 
+        IORING_ENTER_EXT_ARG | ( minComplete ? IORING_ENTER_GETEVENTS : 0 ), &arg, sizeof( arg ) );
 
-    size_t eventCount = res > 0 ? res : 0;
+    return res == -1 ? errno : 0;
+}
 
-    for( size_t i = 0; i < eventCount; ++i )  
-    {
-        const epoll_event &ev = events[ i ];
+bool
+Uring::popCqe( io_uring_cqe *cqe )  // nofail
+{
+    unsigned head = *m_cqHead;
 
-        if( ev.data.fd == m_interrupt.m_handle )
-        {
-            m_interrupt.reset();
-        }
-        else
-        {
-            socketActions->push_back( SocketActions::value_type( ev.data.fd, 
-                getActionMask( ev.events ) ) );
-        }
+    if( head == __atomic_load_n( m_cqTail, __ATOMIC_ACQUIRE ) )
+    {
+        return false;
     }
 
-    return eventCount != 0;  // true if socket activity or interrupt.
+    *cqe = m_cqes[ head & m_cqMask ];
+    __atomic_store_n( m_cqHead, head + 1, __ATOMIC_RELEASE );
+    return true;
 }
-#endif  // !_WIN32
 
-SocketPool::~SocketPool()
+UringPoll *
+Uring::find( SocketHandle socket )  // nofail
 {
-    delete m_pool;
+    return ( size_t )socket < m_polls.size() && m_polls[ socket ].present ? &m_polls[ socket ] : NULL;
 }
 
-void 
-SocketPool::signal()  // nofail
-{ 
-    m_interrupt.set(); 
-} 
+void
+Uring::arm( UringPoll *poll )  // nofail
+{
+    dbgAssert( !poll->armed );
 
+    io_uring_sqe *sqe = getSqe();
 
-//////////////////////////////////////////////////////////////////////////////
-// Socket tuning.
+    if( !sqe )
+    {
+        // Try again by the next wait.
 
-#ifdef _WIN32
+        keep( &m_rearm, poll->socket );  // nofail
+        return;
+    }
+
+    // A new generation tells completions of this poll from those of 
+    // previous polls of the same socket.
+
+    poll->generation = ++m_generation & 0x3fffffff;
+    poll->armed = true;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = poll->socket;
+    sqe->poll32_events = poll->events;
+    sqe->user_data = tag( poll );
+}
 
 void
-setTcpKeepAlive( SocketHandle socket, const TcpKeepAliveParams *params )
+Uring::cancel( UringPoll *poll )  // nofail
 {
-    // Set TCP KeepAlive.
+    dbgAssert( poll->armed );
 
-    // probeCount can be set only through registry:
-    // HKLM\SYSTEM\CurrentControlSet\Services\Tcpip\Parameters [DWORD TcpMaxDataRetransmissions]
-    // On Windows Vista and later, the number of keep-alive probes (data retransmissions) 
-    // is set to 10.
-    // On Windows Server 2003, Windows XP, and Windows 2000, 
-    // the default setting for number of keep-alive probes is 5.
+    // If this fails, the poll stays until the socket is ready; its completion
+    // is ignored.
 
-    tcp_keepalive vals = {};
-    vals.keepalivetime = params ? params->probeStartTime : 0;        //  milliseconds  
-    vals.keepaliveinterval = params ? params->probeIntervalTime : 0; //  milliseconds  
-    vals.onoff = params ? 1 : 0; 
-    DWORD unused = 0; 
+    if( io_uring_sqe *sqe = getSqe() )
+    {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = tag( poll );
+        sqe->user_data = c_tagIgnore;
+    }
 
-    int res = WSAIoctl( s( socket ), SIO_KEEPALIVE_VALS, 
+    poll->armed = false;
+}
+
+void
+Uring::armFile( int file )  // nofail
+{
+    io_uring_sqe *sqe = getSqe();
+
+    m_fileArmed[ file ] = !!sqe;
+
+    if( sqe )
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = file;  // the index of the registered file
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = ( ( UInt64 )file << 2 ) | c_tagInterrupt;
+    }
+}
+
+bool
+Uring::add( SocketHandle socket, UInt32 events )  // nofail
+{
+    if( !coverSocket( &m_polls, socket ) )  // nofail
+    {
+        return false;
+    }
+
+    UringPoll *poll = &m_polls[ socket ];
+
+    if( !poll->present )
+    {
+        poll->socket = socket;
+        poll->armed = false;
+        poll->present = true;
+    }
+    else if( poll->armed && poll->events == events )
+    {
+        return true;
+    }
+    else if( poll->armed )
+    {
+        cancel( poll );
+    }
+
+    poll->events = events;
+    arm( poll );
+    return true;
+}
+
+void
+Uring::remove( SocketHandle socket )  // nofail
+{
+    if( UringPoll *poll = find( socket ) )
+    {
+        if( poll->armed )
+            cancel( poll );
+
+        poll->present = false;
+    }
+}
+
+void
+Uring::reserve( size_t size )
+{
+    m_rearm.reserve( size );
+    m_deferred.reserve( size );
+}
+
+// Appends to m_rearm or m_deferred, which are reserved for the sockets but
+// may still need to grow, e.g. when a socket is rearmed twice.
+
+template< class T >
+void
+Uring::keep( std::vector< T > *items, const T &item )  // nofail
+{
+    try
+    {
+        items->push_back( item );  // can throw std::bad_alloc
+    }
+    catch( ... )
+    {
+        m_lost = true;
+    }
+}
+
+void
+Uring::handle( const io_uring_cqe &cqe, SocketActions *socketActions, size_t *writes )  // nofail
+{
+    switch( cqe.user_data & 3 )
+    {
+    case c_tagPoll:
+        {
+            UringPoll *poll = find( ( SocketHandle )( ( cqe.user_data >> 2 ) & 0xffffffff ) );
+
+            if( !poll || !poll->armed || poll->generation != cqe.user_data >> 34 )
+            {
+                break;  // canceled
+            }
+
+            if( !socketActions )
+            {
+                size_t deferred = m_deferred.size();
+
+                keep( &m_deferred, cqe );  // nofail
+
+                // If lost, the poll has fired all the same: let add(..) arm it again.
+
+                if( m_deferred.size() == deferred )
+                    poll->armed = false;
+                break;
+            }
+
+            poll->armed = false;
+            keep( &m_rearm, poll->socket );  // nofail
+
+            SocketActionMask actionMask = cqe.res > 0 ? getActionMask( cqe.res ) : SA_POLL_IN | SA_POLL_ERR;
+            socketActions->push_back( SocketActions::value_type( poll->socket, actionMask ) );
+        }
+        break;
+
+    case c_tagWrite:
+        if( cqe.res < 0 )
+        {
+            reinterpret_cast< EventSync * >( cqe.user_data & ~( UInt64 )3 )->set();  // nofail
+        }
+
+        ++*writes;
+        break;
+
+    case c_tagInterrupt:
+        {
+            int file = ( int )( cqe.user_data >> 2 );
+            dbgAssert( file < c_fileCount );
+
+            m_fileReadable[ file ] = true;
+
+            if( !( cqe.flags & IORING_CQE_F_MORE ) )
+                m_fileArmed[ file ] = false;  // no more completions, arm it again
+        }
+        break;
+    }
+}
+
+bool
+Uring::wait( UInt32 msTimeout, bool *interrupted, bool *timerReadable, 
+    SocketActions *socketActions )  // nofail
+{
+    dbgAssert( interrupted );
+    dbgAssert( timerReadable );
+    dbgAssert( socketActions );
+
+    size_t writes = 0;
+
+    // Arm the polls that have completed, unless curl has done that meanwhile.
+    // Those that find the ring full are appended again, for the next wait.
+
+    size_t rearmed = m_rearm.size();
+
+    for( size_t i = 0; i < rearmed; ++i )
+    {
+        UringPoll *poll = find( m_rearm[ i ] );
+
+        if( poll && !poll->armed )
+            arm( poll );
+    }
+
+    m_rearm.erase( m_rearm.begin(), m_rearm.begin() + rearmed );
+
+    for( int i = 0; i < c_fileCount; ++i )
+    {
+        if( !m_fileArmed[ i ] )
+            armFile( i );
+    }
+
+    Timeout timeout( !m_deferred.empty() || m_fileReadable[ c_fileInterrupt ] || 
+        m_fileReadable[ c_fileTimer ] ? 0 : msTimeout );
+
+    while( true )
+    {
+        UInt32 left = timeout.left();
+        int err = enter( left ? 1 : 0, left );
+
+        if( err == EINTR && timeout.left() )
+            continue;
+
+        dbgAssert( !err || err == EINTR || err == ETIME || err == EBUSY || err == EAGAIN || err == ENOMEM );
+
+        if( err == ENOMEM )
+        {
+            // Out of memory, we cannot do anything better than just wait for a while.
+
+            taskSleep( 3000 );
+        }
+
+        break;
+    }
+
+    for( size_t i = 0; i < m_deferred.size(); ++i )
+    {
+        handle( m_deferred[ i ], socketActions, &writes );
+    }
+
+    m_deferred.clear();
+
+    io_uring_cqe cqe;
+
+    while( popCqe( &cqe ) )
+    {
+        handle( cqe, socketActions, &writes );
+    }
+
+    *interrupted = m_fileReadable[ c_fileInterrupt ];
+    *timerReadable = m_fileReadable[ c_fileTimer ];
+    m_fileReadable[ c_fileInterrupt ] = m_fileReadable[ c_fileTimer ] = false;
+    return *interrupted || *timerReadable || !socketActions->empty();
+}
+
+bool
+Uring::flushWrites( size_t count )  // nofail
+{
+    size_t writes = 0;
+
+    // Eventfd writes don't block, so they are usually done by the time the 
+    // submission returns.
+
+    int err = enter( 0, 0 );
+
+    while( true )
+    {
+        if( err && err != EINTR )
+        {
+            return false;
+        }
+
+        io_uring_cqe cqe;
+
+        while( popCqe( &cqe ) )
+        {
+            handle( cqe, NULL, &writes );
+        }
+
+        if( writes >= count )
+        {
+            return true;
+        }
+
+        err = enter( 1, EventSync::c_infinite );
+    }
+}
+
+#endif  // WEBSTOR_URING
+
+// The state of a socket in SocketPoolState::sockets.
+
+enum
+{
+    c_socketPresent = 1,
+    c_socketIn = 2,
+    c_socketOut = 4,
+    c_socketArmed = 8       // edge-triggered: its one-shot poll is armed
+};
+
+struct SocketPoolState
+{
+                    SocketPoolState();
+                    ~SocketPoolState();
+
+    std::vector< unsigned char >    sockets;    // by socket
+    size_t                          count;
+    std::vector< epoll_event >      events;     // taken by one epoll_wait
+    std::vector< SocketHandle >     rearm;      // edge-triggered: fired, arm them by the next wait
+    int                             epoll;
+    int                             timer;      // timerfd
+    bool                            edgeTriggered;
+    bool                            unwatched;  // a socket could not be watched
+
+#ifdef WEBSTOR_URING
+    Uring *                         uring;  // NULL if epoll is used
+#endif
+};
+
+
+SocketPoolState::SocketPoolState()
+    : count( 0 )
+    , epoll( -1 )
+    , timer( -1 )
+    , edgeTriggered( false )
+    , unwatched( false )
+#ifdef WEBSTOR_URING
+    , uring( NULL )
+#endif
+{
+}
+
+SocketPoolState::~SocketPoolState()
+{
+    if( epoll != -1 )
+        dbgVerify( !close( epoll ) );
+
+    if( timer != -1 )
+        dbgVerify( !close( timer ) );
+
+#ifdef WEBSTOR_URING
+    delete uring;
+#endif
+}
+
+SocketPool::SocketPool( bool useUring, bool edgeTriggered, size_t eventBatch ) 
+    : m_pool( NULL )
+{
+    std::auto_ptr< SocketPoolState > pool( new SocketPoolState() );
+
+    pool->timer = timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK );
+
+    if( pool->timer == -1 )
+    {
+        throwSystemError( errno, "timerfd_create" );
+    }
+
+#ifdef WEBSTOR_URING
+    if( useUring )
+    {
+        std::auto_ptr< Uring > uring( new Uring() );
+
+        if( uring->init( m_interrupt.m_handle, pool->timer ) )
+        {
+            pool->uring = uring.release();
+            m_pool = pool.release();  // nofail
+            return;
+        }
+
+        // Fall back to epoll: io_uring is not supported by the kernel or 
+        // is disabled.
+
+        LOG_TRACE( "io_uring is not available, using epoll" );
+    }
+#endif
+
+    pool->events.resize( eventBatch ? eventBatch : ( size_t )c_defaultEventBatch );
+    pool->edgeTriggered = edgeTriggered;
+
+    if( edgeTriggered )
+    {
+        // A wait fires one batch at most.
+
+        pool->rearm.reserve( pool->events.size() );
+    }
+
+    pool->epoll = epoll_create( 32 /* hint */ );
+
+    if( pool->epoll == -1 )
+    {
+        throwSystemError( errno, "epoll_create" );
+    }
+
+    // Add the interrupt handler to the epoll.
+
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = m_interrupt.m_handle;
+
+    if( epoll_ctl( pool->epoll, EPOLL_CTL_ADD, m_interrupt.m_handle, &ev ) == -1 )
+    {
+        throwSystemError( errno, "epoll_ctl" );
+    }
+
+    // And the timer.
+
+    ev.data.fd = pool->timer;
+
+    if( epoll_ctl( pool->epoll, EPOLL_CTL_ADD, pool->timer, &ev ) == -1 )
+    {
+        throwSystemError( errno, "epoll_ctl" );
+    }
+
+    // Commit changes.
+
+    m_pool = pool.release();  // nofail
+}
+
+static UInt32
+epollEvents( unsigned char state, bool edgeTriggered )  // nofail
+{
+    return ( state & c_socketIn ? ( EPOLLIN | EPOLLRDHUP ) : 0 ) | 
+        ( state & c_socketOut ? ( EPOLLOUT | EPOLLRDHUP ) : 0 ) |
+        ( edgeTriggered ? ( EPOLLET | EPOLLONESHOT ) : 0 );
+}
+
+// Puts the socket to the epoll or changes its events, which arms a one-shot 
+// poll again; false if out of memory.
+
+static bool
+epollArm( int epoll, SocketHandle socket, UInt32 events, bool present )  // nofail
+{
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = socket;
+
+    int res = epoll_ctl( epoll, present ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, socket, &ev );
+    int err = errno;
+
+    if( res == -1 && ( err == ENOENT || err == EEXIST ) )
+    {
+        // The socket has been closed without being removed and its number reused, 
+        // or it is in the epoll already.
+
+        res = epoll_ctl( epoll, err == ENOENT ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, socket, &ev );
+        err = errno;
+    }
+
+    dbgAssert( !res || err == ENOMEM || err == ENOSPC );
+    return !res;
+}
+
+bool 
+SocketPool::add( SocketHandle socket, SocketActionMask actionMask )  // nofail
+{
+    // Note: we cannot fail in this method. If the socket cannot be watched 
+    // (out of memory) it is still reported as added, watchesAll() tells 
+    // the caller to bound its waits and check the sockets itself.
+
+    if( !coverSocket( &m_pool->sockets, socket ) )  // nofail
+    {
+        m_pool->unwatched = true;
+        return false;
+    }
+
+    unsigned char &current = m_pool->sockets[ socket ];
+    bool added = !( current & c_socketPresent );
+    unsigned char state = c_socketPresent | ( actionMask & SA_POLL_IN ? c_socketIn : 0 ) | 
+        ( actionMask & SA_POLL_OUT ? c_socketOut : 0 );
+
+#ifdef WEBSTOR_URING
+    if( m_pool->uring )
+    {
+        if( !m_pool->uring->add( socket, epollEvents( state, false ) ) )  // nofail
+            m_pool->unwatched = true;
+    }
+    else
+#endif
+    if( epollArm( m_pool->epoll, socket, epollEvents( state, m_pool->edgeTriggered ), !added ) )
+    {
+        state |= c_socketArmed;
+    }
+    else
+    {
+        m_pool->unwatched = true;
+    }
+
+    current = state;
+    m_pool->count += added;
+    return added;
+}
+
+bool
+SocketPool::remove( SocketHandle socket )  // nofail
+{
+    if( ( size_t )socket >= m_pool->sockets.size() || !( m_pool->sockets[ socket ] & c_socketPresent ) )
+    {
+        return false;
+    }
+
+#ifdef WEBSTOR_URING
+    if( m_pool->uring )
+    {
+        m_pool->uring->remove( socket );  // nofail
+    }
+    else
+#endif
+    {
+        epoll_event unused = {};
+        int res = epoll_ctl( m_pool->epoll, EPOLL_CTL_DEL, socket, &unused );
+        int err = errno;
+        dbgAssert( !res || res == -1 && ( err == ENOENT || err == EBADF ) ); // EBADF - if the socket has been closed already.
+    }
+
+    m_pool->sockets[ socket ] = 0;
+    --m_pool->count;
+    return true;
+}
+
+void
+SocketPool::reserve( size_t size ) 
+{
+#ifdef WEBSTOR_URING
+    if( m_pool->uring )
+        m_pool->uring->reserve( size );
+#endif
+}
+
+size_t
+SocketPool::size() const
+{ 
+    return m_pool->count;
+}
+
+// Consumes the expirations of the timer, false if there are none: it was
+// re-armed or disarmed since it became readable.
+
+static bool
+readTimer( int timer )  // nofail
+{
+    UInt64 expirations = 0;
+    return read( timer, &expirations, sizeof( expirations ) ) == sizeof( expirations ) && expirations;
+}
+
+void
+SocketPool::setTimer( UInt32 msDelay )  // nofail
+{
+    itimerspec spec = {};
+
+    if( msDelay != ( UInt32 )EventSync::c_infinite )
+    {
+        // A zero value would disarm it.
+
+        spec.it_value.tv_sec = msDelay / 1000;
+        spec.it_value.tv_nsec = ( msDelay % 1000 ) * 1000000 + !msDelay;
+    }
+
+    dbgVerify( !timerfd_settime( m_pool->timer, 0, &spec, NULL ) );
+}
+
+bool
+SocketPool::watchesAll() const  // nofail
+{
+    return !m_pool->unwatched;
+}
+
+bool
+SocketPool::wait( UInt32 msTimeout, UInt32 msInterruptOnlyTimeout, SocketActions *socketActions,
+    bool *timerExpired )
+{
+    dbgAssert( socketActions );
+    dbgAssert( timerExpired );
+    socketActions->clear();
+    *timerExpired = false;
+
+    int res = 0;
+
+    // If a socket is not watched, make sure that timeout is not infinite,
+    // see the comments in the add(..) method.
+    dbgAssert( !m_pool->unwatched || msTimeout < ( UInt32 ) -1 );
+
+    UInt32 initTimeout = m_pool->count > 0 ? msTimeout : msInterruptOnlyTimeout;
+
+#ifdef WEBSTOR_URING
+    if( m_pool->uring )
+    {
+        bool interrupted = false;
+        bool timerReadable = false;
+        bool activity = m_pool->uring->wait( initTimeout, &interrupted, &timerReadable, socketActions );  // nofail
+
+        if( m_pool->uring->lost() )
+            m_pool->unwatched = true;
+
+        if( interrupted )
+            m_interrupt.reset();
+
+        if( timerReadable )
+            *timerExpired = readTimer( m_pool->timer );  // nofail
+
+        return activity;
+    }
+#endif
+
+    // Edge-triggered: a poll is one-shot, so curl never misses data it left
+    // unread. Arm again the polls that have fired, unless curl has done that 
+    // meanwhile; arming checks readiness, as the level-triggered mode does.
+
+    for( size_t i = 0; i < m_pool->rearm.size(); ++i )
+    {
+        SocketHandle socket = m_pool->rearm[ i ];
+        unsigned char &state = m_pool->sockets[ socket ];
+
+        if( ( state & ( c_socketPresent | c_socketArmed ) ) != c_socketPresent )
+            continue;
+
+        if( epollArm( m_pool->epoll, socket, epollEvents( state, true ), true ) )
+            state |= c_socketArmed;
+        else
+            m_pool->unwatched = true;
+    }
+
+    m_pool->rearm.clear();
+
+    Timeout timeout( initTimeout ); 
+    epoll_event *events = &m_pool->events[ 0 ];
+
+    while( true ) 
+    {
+#ifdef PERF
+        Stopwatch stopwatch( true );
+#endif
+        res = epoll_wait( m_pool->epoll, events, m_pool->events.size(), timeout.left() );
+
+#ifdef PERF
+        LOG_TRACE( "SocketPoolSync:epoll_wait, timeout=%d, actual=%llu, size=%llu, result=%d", 
+            initTimeout, stopwatch.elapsed(), static_cast< UInt64 >( m_pool->count ), res );
+#endif
+        if( res == -1 )
+        {
+            int e = errno;
+
+            if( e == EINTR )
+            {
+                // Make sure we don't end up in infinite loop when timeout is not infinite.
+
+                if( timeout.left() )
+                    continue;
+
+                break;
+            }
+
+            if( e == ENOMEM )
+            {
+                // Out of memory, we cannot do anything better than just wait for a while.
+
+                taskSleep( 3000 );
+                break;
+            }
+
+            dbgPanicSz( "BUG: epoll_wait failed!!!" );
+        }
+
+        break;
+    } 
+
+    // Get the events.
+
+    size_t eventCount = res > 0 ? res : 0;
+
+    for( size_t i = 0; i < eventCount; ++i )  
+    {
+        const epoll_event &ev = events[ i ];
+
+        if( ev.data.fd == m_interrupt.m_handle )
+        {
+            m_interrupt.reset();
+        }
+        else if( ev.data.fd == m_pool->timer )
+        {
+            *timerExpired = readTimer( m_pool->timer );  // nofail
+        }
+        else
+        {
+            if( m_pool->edgeTriggered )
+            {
+                dbgAssert( m_pool->rearm.size() < m_pool->rearm.capacity() );
+                m_pool->sockets[ ev.data.fd ] &= ~c_socketArmed;
+                m_pool->rearm.push_back( ev.data.fd );  // nofail, a batch at most
+            }
+
+            socketActions->push_back( SocketActions::value_type( ev.data.fd, 
+                getActionMask( ev.events ) ) );
+        }
+    }
+
+    return eventCount != 0;  // true if socket activity, interrupt or timer.
+}
+
+void
+SocketPool::setEvents( EventSync *const *events, size_t count )  // nofail
+{
+#ifdef WEBSTOR_URING
+    // A single event is a system call either way.
+
+    if( m_pool->uring && count > 1 )
+    {
+        size_t queued = 0;
+
+        for( size_t i = 0; i < count; ++i )
+        {
+            io_uring_sqe *sqe = m_pool->uring->getSqe();
+
+            if( !sqe )
+            {
+                events[ i ]->set();  // nofail
+                continue;
+            }
+
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = events[ i ]->m_handle;
+            sqe->addr = ( UInt64 )&s_eventIncrement;
+            sqe->len = sizeof( s_eventIncrement );
+            sqe->user_data = ( UInt64 )events[ i ] | c_tagWrite;
+            ++queued;
+        }
+
+        if( m_pool->uring->flushWrites( queued ) )
+        {
+            return;
+        }
+
+        // Setting an event twice is harmless.
+    }
+#endif
+
+    for( size_t i = 0; i < count; ++i )
+        events[ i ]->set();  // nofail
+}
+
+bool
+SocketPool::usesUring() const  // nofail
+{
+#ifdef WEBSTOR_URING
+    return m_pool->uring != NULL;
+#else
+    return false;
+#endif
+}
+#endif  // !_WIN32
+
+SocketPool::~SocketPool()
+{
+    delete m_pool;
+}
+
+void 
+SocketPool::signal()  // nofail
+{ 
+    m_interrupt.set(); 
+} 
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Socket tuning.
+
+#ifdef _WIN32
+
+void
+setTcpKeepAlive( SocketHandle socket, const TcpKeepAliveParams *params )
+{
+    // Set TCP KeepAlive.
+
+    // probeCount can be set only through registry:
+    // HKLM\SYSTEM\CurrentControlSet\Services\Tcpip\Parameters [DWORD TcpMaxDataRetransmissions]
+    // On Windows Vista and later, the number of keep-alive probes (data retransmissions) 
+    // is set to 10.
+    // On Windows Server 2003, Windows XP, and Windows 2000, 
+    // the default setting for number of keep-alive probes is 5.
+
+    tcp_keepalive vals = {};
+    vals.keepalivetime = params ? params->probeStartTime : 0;        //  milliseconds  
+    vals.keepaliveinterval = params ? params->probeIntervalTime : 0; //  milliseconds  
+    vals.onoff = params ? 1 : 0; 
+    DWORD unused = 0; 
+
+    int res = WSAIoctl( s( socket ), SIO_KEEPALIVE_VALS, 
         &vals, sizeof( vals ), NULL, 0, &unused, NULL, NULL );
     dbgAssert( !res );
 }
@@ -1169,6 +2141,66 @@ taskSleep( UInt32 msTimeout )  // nofail
     Sleep( msTimeout );
 }
 
+bool
+taskSetCpu( int cpu )  // nofail
+{
+    if( cpu < 0 || cpu >= ( int )( sizeof( DWORD_PTR ) * 8 ) )
+        return false;
+
+    return !!SetThreadAffinityMask( GetCurrentThread(), ( DWORD_PTR )1 << cpu );
+}
+
+size_t
+taskCpus( int *cpus, size_t maxCount )  // nofail
+{
+    DWORD_PTR processMask = 0;
+    DWORD_PTR systemMask = 0;
+
+    if( !GetProcessAffinityMask( GetCurrentProcess(), &processMask, &systemMask ) )
+        return 0;
+
+    size_t count = 0;
+
+    for( int cpu = 0; cpu < ( int )( sizeof( DWORD_PTR ) * 8 ) && count < maxCount; ++cpu )
+    {
+        if( processMask & ( ( DWORD_PTR )1 << cpu ) )
+            cpus[ count++ ] = cpu;
+    }
+
+    return count;
+}
+
+int
+cpuNode( int cpu )  // nofail
+{
+    UCHAR node = 0;
+
+    if( cpu < 0 || cpu > 255 || !GetNumaProcessorNode( ( UCHAR )cpu, &node ) || node == 0xff )
+        return -1;
+
+    return node;
+}
+
+void *
+nodeAlloc( size_t size, int node )
+{
+    void *p = node < 0 
+        ? VirtualAlloc( 0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE ) 
+        : VirtualAllocExNuma( GetCurrentProcess(), 0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node );
+
+    if( !p )
+        throw std::bad_alloc();
+
+    return p;
+}
+
+void
+nodeFree( void *p, size_t size )  // nofail
+{
+    if( p )
+        dbgVerify( VirtualFree( p, 0, MEM_RELEASE ) );
+}
+
 #else  // !_WIN32
 
 void
@@ -1224,6 +2256,96 @@ taskSleep( UInt32 msTimeout )  // nofail
         // in case of EINTR the timeout is supposed to be adjusted to repeat.
     }
 }
+
+bool
+taskSetCpu( int cpu )  // nofail
+{
+    if( cpu < 0 || cpu >= CPU_SETSIZE )
+        return false;
+
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+
+    return !pthread_setaffinity_np( pthread_self(), sizeof( set ), &set );
+}
+
+size_t
+taskCpus( int *cpus, size_t maxCount )  // nofail
+{
+    cpu_set_t set;
+
+    if( pthread_getaffinity_np( pthread_self(), sizeof( set ), &set ) )
+        return 0;
+
+    size_t count = 0;
+
+    for( int cpu = 0; cpu < CPU_SETSIZE && count < maxCount; ++cpu )
+    {
+        if( CPU_ISSET( cpu, &set ) )
+            cpus[ count++ ] = cpu;
+    }
+
+    return count;
+}
+
+int
+cpuNode( int cpu )  // nofail
+{
+    // The node is a 'nodeN' link in the directory of the cpu.
+
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/sys/devices/system/cpu/cpu%d", cpu );
+
+    DIR *dir = cpu < 0 ? NULL : opendir( path );
+
+    if( !dir )
+        return -1;
+
+    int node = -1;
+
+    while( dirent *entry = readdir( dir ) )
+    {
+        if( !strncmp( entry->d_name, "node", 4 ) && entry->d_name[ 4 ] >= '0' && entry->d_name[ 4 ] <= '9' )
+        {
+            node = atoi( entry->d_name + 4 );
+            break;
+        }
+    }
+
+    closedir( dir );
+    return node;
+}
+
+void *
+nodeAlloc( size_t size, int node )
+{
+    void *p = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+    if( p == MAP_FAILED )
+        throw std::bad_alloc();
+
+#ifdef __NR_mbind
+    if( node >= 0 && node < ( int )( sizeof( unsigned long ) * 8 ) )
+    {
+        // MPOL_BIND without libnuma; the pages are placed as they are touched.
+        // If the kernel refuses (no NUMA, or not allowed), the memory is still usable.
+
+        const int c_mpolBind = 2;
+        unsigned long nodeMask = 1UL << node;
+        syscall( __NR_mbind, p, size, c_mpolBind, &nodeMask, sizeof( nodeMask ) * 8, 0 );
+    }
+#endif
+
+    return p;
+}
+
+void
+nodeFree( void *p, size_t size )  // nofail
+{
+    if( p )
+        dbgVerify( !munmap( p, size ) );
+}
 #endif  // !_WIN32
 
 #ifdef WEBSTOR_ENABLE_DBG_TRACING
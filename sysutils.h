@@ -198,6 +198,84 @@ cpuMemFullFence()
 }
 #endif // !_MSC_VER
 
+//////////////////////////////////////////////////////////////////////////////
+// Atomic operations, all of them are full barriers.
+
+#ifdef _MSC_VER
+extern "C" long _InterlockedExchange( long volatile *target, long value );
+extern "C" long _InterlockedExchangeAdd( long volatile *target, long value );
+extern "C" long _InterlockedCompareExchange( long volatile *target, long value, long comparand );
+extern "C" void *_InterlockedExchangePointer( void *volatile *target, void *value );
+extern "C" void *_InterlockedCompareExchangePointer( void *volatile *target, void *value, void *comparand );
+#pragma intrinsic (_InterlockedExchange)
+#pragma intrinsic (_InterlockedExchangeAdd)
+#pragma intrinsic (_InterlockedCompareExchange)
+
+inline int
+atomicExchange( volatile int *target, int value )
+{
+    return _InterlockedExchange( reinterpret_cast< long volatile * >( target ), value );
+}
+
+inline int
+atomicAdd( volatile int *target, int value )  // returns the old value
+{
+    return _InterlockedExchangeAdd( reinterpret_cast< long volatile * >( target ), value );
+}
+
+inline bool
+atomicCompareExchange( volatile int *target, int value, int comparand )
+{
+    return _InterlockedCompareExchange( reinterpret_cast< long volatile * >( target ), 
+        value, comparand ) == comparand;
+}
+
+template< class T > inline T *
+atomicExchangePointer( T *volatile *target, T *value )
+{
+    return static_cast< T * >( _InterlockedExchangePointer( 
+        reinterpret_cast< void *volatile * >( target ), value ) );
+}
+
+template< class T > inline bool
+atomicCompareExchangePointer( T *volatile *target, T *value, T *comparand )
+{
+    return _InterlockedCompareExchangePointer( reinterpret_cast< void *volatile * >( target ), 
+        value, comparand ) == comparand;
+}
+#else // !_MSC_VER
+
+inline int
+atomicExchange( volatile int *target, int value )
+{
+    return __atomic_exchange_n( target, value, __ATOMIC_SEQ_CST );
+}
+
+inline int
+atomicAdd( volatile int *target, int value )  // returns the old value
+{
+    return __sync_fetch_and_add( target, value );
+}
+
+inline bool
+atomicCompareExchange( volatile int *target, int value, int comparand )
+{
+    return __sync_bool_compare_and_swap( target, comparand, value );
+}
+
+template< class T > inline T *
+atomicExchangePointer( T *volatile *target, T *value )
+{
+    return __atomic_exchange_n( target, value, __ATOMIC_SEQ_CST );
+}
+
+template< class T > inline bool
+atomicCompareExchangePointer( T *volatile *target, T *value, T *comparand )
+{
+    return __sync_bool_compare_and_swap( target, comparand, value );
+}
+#endif // !_MSC_VER
+
 //////////////////////////////////////////////////////////////////////////////
 // EventSync -- event synchronization primitive.
 
@@ -338,10 +416,24 @@ typedef std::vector< std::pair< SocketHandle, SocketActionMask > > SocketActions
 
 struct SocketPoolState;
 
+// SocketPool -- sockets to wait for, with epoll or, if useUring is set and
+// the kernel supports it, io_uring (Linux only).
+//
+// The state of a socket is found by its number, so adding, removing and 
+// reporting a socket doesn't depend on how many there are. An epoll_wait 
+// takes up to eventBatch events (0 for c_defaultEventBatch). With 
+// edgeTriggered, epoll polls are one-shot: a socket fires once, then is 
+// armed again by the next wait, after the caller has handled it.
+//
+// All methods but signal() must be called by the same thread.
+
 class SocketPool 
 {
 public:
-                    SocketPool();
+    enum { c_defaultEventBatch = 256 };
+
+    explicit        SocketPool( bool useUring = false, bool edgeTriggered = false, 
+                        size_t eventBatch = 0 );
                     ~SocketPool();
 
     bool            add( SocketHandle socket, SocketActionMask actionMask );  // nofail
@@ -350,7 +442,27 @@ public:
     size_t          size() const;  // nofail
 
     void            signal();  // nofail
-    bool            wait( UInt32 msTimeout, UInt32 msInterruptOnlyTimeout, SocketActions *socketActions );
+
+    // Arms the one-shot timer of the wait set to expire msDelay from now, 
+    // 0 expires at once and c_infinite disarms it (timerfd on Linux).
+    // The wait(..) that sees it expire sets *timerExpired.
+
+    void            setTimer( UInt32 msDelay );  // nofail
+    bool            wait( UInt32 msTimeout, UInt32 msInterruptOnlyTimeout, SocketActions *socketActions,
+                        bool *timerExpired );
+
+    // False once a socket couldn't be added to the wait set (out of memory): 
+    // its activity goes unnoticed, so from then on the waits must be bounded 
+    // and the sockets checked when they time out.
+
+    bool            watchesAll() const;  // nofail
+
+    // Sets the events, with io_uring in a single system call; returns 
+    // when all of them are set.
+
+    void            setEvents( EventSync *const *events, size_t count );  // nofail
+
+    bool            usesUring() const;  // nofail
 
 private:
                     SocketPool( const SocketPool & );  // forbidden
@@ -414,9 +526,11 @@ public:
 #ifdef _WIN32
 typedef unsigned long TaskResult;
 #define TASKAPI __stdcall
+#define THREAD_LOCAL __declspec( thread )
 #else
 typedef void * TaskResult;
 #define TASKAPI
+#define THREAD_LOCAL __thread
 #endif
 
 typedef UInt64 TaskId;
@@ -431,6 +545,30 @@ taskStartAsync( TaskFn *taskFn, void *arg, TaskCtrl *pctrl );
 void
 taskSleep( UInt32 msTimeout );  // nofail
 
+// Pins the calling task to a cpu, false if the cpu is not available.
+
+bool
+taskSetCpu( int cpu );  // nofail
+
+// The cpus the calling task may run on, up to maxCount of them; returns their number.
+
+size_t
+taskCpus( int *cpus, size_t maxCount );  // nofail
+
+// NUMA node of a cpu, -1 if unknown.
+
+int
+cpuNode( int cpu );  // nofail
+
+// Page-aligned memory bound to a NUMA node (-1: not bound), 
+// released with nodeFree(..).
+
+void *
+nodeAlloc( size_t size, int node );
+
+void
+nodeFree( void *p, size_t size );  // nofail
+
 //////////////////////////////////////////////////////////////////////////////
 // Stopwatch to measure time intervals.
 
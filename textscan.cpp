@@ -0,0 +1,303 @@
+/*
+ * File:   textscan.cpp
+ * Author: taozou
+ *
+ * Text objects.
+ */
+
+#include "textscan.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+bool parseTextField(const char *spec, TextField *field)
+{
+    const char *colon = strchr(spec, ':');
+
+    if (!colon || !colon[1])
+        return false;
+
+    std::string format(spec, colon);
+
+    if (format == "json")
+    {
+        field->format = TextField::Json;
+        field->name = colon + 1;
+        return true;
+    }
+
+    if (format != "csv" && format != "tsv")
+        return false;
+
+    char *end;
+    field->format = TextField::Csv;
+    field->delimiter = format == "csv" ? ',' : '\t';
+    field->column = strtol(colon + 1, &end, 10);
+    return !*end && field->column >= 0;
+}
+
+// Bit i is set if p[i] is a newline, the delimiter or a quote; the block
+// is 16 bytes or what is left before end.
+
+static inline UInt32 structural(const char *p, const char *end, char delimiter)
+{
+#ifdef __SSE2__
+    if (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                                              _mm_cmpeq_epi8(v, _mm_set1_epi8(delimiter))),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+        return _mm_movemask_epi8(m);
+    }
+#endif
+
+    UInt32 mask = 0;
+    int n = std::min(end - p, (ptrdiff_t)16);
+
+    for (int i = 0; i < n; ++i)
+        if (p[i] == '\n' || p[i] == delimiter || p[i] == '"')
+            mask |= 1u << i;
+    return mask;
+}
+
+static inline bool allDigits(UInt64 chunk)
+{
+    return (chunk & 0xf0f0f0f0f0f0f0f0ULL) == 0x3030303030303030ULL &&
+           ((chunk + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) == 0x3030303030303030ULL;
+}
+
+// Eight ASCII digits, the first one in the low byte, to their value.
+
+static inline UInt32 eightDigits(UInt64 chunk)
+{
+    chunk -= 0x3030303030303030ULL;
+    chunk = chunk * 10 + (chunk >> 8);
+    return (((chunk & 0x000000ff000000ffULL) * (100 + (1000000ULL << 32))) +
+            (((chunk >> 16) & 0x000000ff000000ffULL) * (1 + (10000ULL << 32)))) >> 32;
+}
+
+// An int at p, after blanks and an opening quote; values out of range
+// saturate. False if there is no number.
+
+static inline bool parseInt(const char *p, const char *end, int *value)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '"'))
+        ++p;
+
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+        ++p;
+
+    if (p == end || (unsigned)(*p - '0') > 9)
+        return false;
+
+    // Once past INT_MAX the value saturates, so stop accumulating there:
+    // the next step stays far from overflowing a long long.
+
+    const long long limit = (long long)INT_MAX + 1;
+    long long v = 0;
+    UInt64 chunk;
+
+    while (end - p >= 8 && (memcpy(&chunk, p, 8), allDigits(chunk)))
+    {
+        v = v < limit ? v * 100000000 + eightDigits(chunk) : v;
+        p += 8;
+    }
+
+    for ( ; p < end && (unsigned)(*p - '0') <= 9; ++p)
+        v = v < limit ? v * 10 + (*p - '0') : v;
+
+    if (negative)
+        v = -v;
+    *value = v > INT_MAX ? INT_MAX : v < INT_MIN ? INT_MIN : (int)v;
+    return true;
+}
+
+void TextScanner::reset(const TextField &field, QuerySet *queries)
+{
+    format = field;
+    pattern = "\"" + field.name + "\"";
+    this->queries = queries;
+    records = 0;
+    skipped = 0;
+    carry.clear();
+    values.clear();
+}
+
+inline bool TextScanner::field(const char *p, const char *end)
+{
+    int value;
+
+    if (!parseInt(p, end, &value))
+        return false;
+
+    values.push_back(value);
+    if (values.size() == TextBatchValues)
+        flush();
+    return true;
+}
+
+void TextScanner::flush()
+{
+    if (!values.empty())
+        queries->scan(&values[0], values.size());
+    values.clear();
+}
+
+// Complete records, end is just past a newline. A newline always ends a
+// record, quotes only hide delimiters.
+
+void TextScanner::csvLines(const char *p, const char *end)
+{
+    const char *start = p;
+    int column = 0;
+    bool quoted = false;
+    bool found = false;
+
+    for (const char *block = p; block < end; block += 16)
+    {
+        for (UInt32 mask = structural(block, end, format.delimiter); mask; mask &= mask - 1)
+        {
+            const char *c = block + __builtin_ctz(mask);
+
+            if (*c == '\n' && !column && (c == start || (c == start + 1 && *start == '\r')))
+                start = c + 1;
+            else if (*c == '\n')
+            {
+                if (column == format.column)
+                    found = field(start, c);
+                ++records;
+                skipped += !found;
+                start = c + 1;
+                column = 0;
+                quoted = found = false;
+            }
+            else if (*c == '"')
+                quoted = !quoted;
+            else if (!quoted)
+            {
+                if (column == format.column)
+                    found = field(start, c);
+                start = c + 1;
+                ++column;
+            }
+        }
+    }
+}
+
+void TextScanner::jsonLine(const char *p, const char *end)
+{
+    ++records;
+
+    // The name, then blanks and a colon: not a string value that looks
+    // like the name.
+
+    for (const char *at = p; ; )
+    {
+        const char *name = (const char *)memmem(at, end - at, pattern.data(), pattern.size());
+
+        if (!name)
+            break;
+
+        const char *c = name + pattern.size();
+        while (c < end && (*c == ' ' || *c == '\t'))
+            ++c;
+
+        if (c < end && *c == ':' && field(c + 1, end))
+            return;
+        at = name + 1;
+    }
+
+    ++skipped;
+}
+
+void TextScanner::scanLines(const char *p, const char *end)
+{
+    if (format.format == TextField::Csv)
+    {
+        csvLines(p, end);
+        return;
+    }
+
+    const char *start = p;
+
+    for (const char *block = p; block < end; block += 16)
+        for (UInt32 mask = structural(block, end, '\n'); mask; mask &= mask - 1)
+        {
+            const char *c = block + __builtin_ctz(mask);
+
+            if (*c != '\n')
+                continue;
+            if (c > start && !(c == start + 1 && *start == '\r'))
+                jsonLine(start, c);
+            start = c + 1;
+        }
+}
+
+void TextScanner::feed(const char *data, size_t size)
+{
+    const char *end = data + size;
+
+    if (!carry.empty())
+    {
+        const char *newline = (const char *)memchr(data, '\n', size);
+
+        if (!newline)
+        {
+            carry.append(data, size);
+            return;
+        }
+
+        carry.append(data, newline + 1);
+        scanLines(carry.data(), carry.data() + carry.size());
+        carry.clear();
+        data = newline + 1;
+    }
+
+    const char *last = (const char *)memrchr(data, '\n', end - data);
+
+    if (last)
+    {
+        scanLines(data, last + 1);
+        data = last + 1;
+    }
+    carry.assign(data, end);
+}
+
+void TextScanner::finish()
+{
+    if (!carry.empty())
+    {
+        carry.append(1, '\n');
+        scanLines(carry.data(), carry.data() + carry.size());
+        carry.clear();
+    }
+    flush();
+}
+
+bool TextLoader::init(const TextField &field, const char *querySpec, const char *filter)
+{
+    this->field = field;
+    if (!queries.parse(querySpec, filter))
+        return false;
+    scanner.reset(field, &queries);
+    return true;
+}
+
+void TextLoader::reset()
+{
+    queries.reset();
+    scanner.reset(field, &queries);
+}
+
+size_t TextLoader::onLoad(const void *chunkData, size_t chunkSize, size_t /* totalSizeHint */)
+{
+    scanner.feed(static_cast<const char *>(chunkData), chunkSize);
+    return chunkSize;
+}
@@ -0,0 +1,86 @@
+/*
+ * File:   textscan.h
+ * Author: taozou
+ *
+ * Text objects: CSV/TSV or newline-delimited JSON records with numeric
+ * fields. One field per record is parsed as an int (a fraction is
+ * dropped) and fed to the queries; records without it are skipped.
+ *
+ * The scanner takes the object in chunks as it arrives, a record may span
+ * chunks. Newlines, delimiters and quotes are found 16 bytes at a time
+ * with SSE2, and digits are converted 8 at a time.
+ */
+
+#ifndef TEXTSCAN_H
+#define	TEXTSCAN_H
+
+#include "s3conn.h"
+#include "query.h"
+#include "columnar.h"
+#include <string>
+#include <vector>
+
+#define TextBatchValues 4096
+
+struct TextField
+{
+    enum Format { Csv, Json };
+
+    Format format;
+    char delimiter;     // Csv
+    int column;         // Csv, from 0
+    std::string name;   // Json, a key of the top-level object
+};
+
+// Parses "csv:Column", "tsv:Column" or "json:Name", returns false if the
+// spec is none of them.
+
+bool parseTextField(const char *spec, TextField *field);
+
+class TextScanner {
+public:
+    TextScanner() : records(0), skipped(0), queries(NULL) {}
+
+    void reset(const TextField &field, QuerySet *queries);
+
+    void feed(const char *data, size_t size);
+
+    // The object is over: its last record may lack the newline.
+
+    void finish();
+
+    UInt64 records;
+    UInt64 skipped;
+
+private:
+    void scanLines(const char *p, const char *end);
+    void csvLines(const char *p, const char *end);
+    void jsonLine(const char *p, const char *end);
+    inline bool field(const char *p, const char *end);
+    void flush();
+
+    TextField format;
+    std::string pattern;        // Json: "name"
+    QuerySet *queries;
+    std::string carry;          // a record split across chunks
+    std::vector<int> values;
+};
+
+// Scans a 'get' payload with its own queries, on the thread that loads
+// it; the caller merges their state when the request completes.
+
+class TextLoader : public webstor::S3GetResponseLoader {
+public:
+    bool init(const TextField &field, const char *querySpec, const char *filter);
+    void reset();
+
+    size_t onLoad(const void *chunkData, size_t chunkSize, size_t /* totalSizeHint */);
+
+    TextScanner scanner;
+    QuerySet queries;
+
+private:
+    TextField field;
+};
+
+#endif	/* TEXTSCAN_H */
@@ -0,0 +1,196 @@
+/*
+ * File:   topindex.cpp
+ * Author: taozou
+ *
+ * Top-N index objects.
+ */
+
+#include "topindex.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+using namespace webstor;
+
+static bool largerFirst(const TopIndexEntry &a, const TopIndexEntry &b)
+{
+    return a.value > b.value;
+}
+
+bool TopIndex::parse(const void *data, size_t size)
+{
+    TopIndexHeader header;
+
+    if (size < sizeof(header))
+        return false;
+
+    memcpy(&header, data, sizeof(header));
+
+    size_t entriesSize = (size_t)header.entryCount * sizeof(TopIndexEntry);
+
+    if (header.magic != TopIndexMagic || header.version != TopIndexVersion ||
+        size - sizeof(header) < entriesSize)
+        return false;
+
+    const char *p = static_cast<const char *>(data) + sizeof(header);
+    const char *end = static_cast<const char *>(data) + size;
+
+    capacity = header.capacity;
+    complete = (header.flags & TopIndexComplete) != 0;
+    entries.resize(header.entryCount);
+    if (header.entryCount)
+        memcpy(&entries[0], p, entriesSize);
+    p += entriesSize;
+
+    keys.clear();
+    numbers.clear();
+
+    for (UInt32 i = 0; i < header.objectCount; ++i)
+    {
+        UInt32 keySize;
+
+        if ((size_t)(end - p) < sizeof(keySize))
+            return false;
+        memcpy(&keySize, p, sizeof(keySize));
+        p += sizeof(keySize);
+        if ((size_t)(end - p) < keySize)
+            return false;
+        keys.push_back(std::string(p, keySize));
+        numbers[keys.back()] = i;
+        p += keySize;
+    }
+
+    for (size_t i = 0; i < entries.size(); ++i)
+        if (entries[i].object >= keys.size())
+            return false;
+    return p == end;
+}
+
+void TopIndex::serialize(std::vector<char> *object) const
+{
+    TopIndexHeader header = { TopIndexMagic, TopIndexVersion, capacity, (UInt32)(complete ? TopIndexComplete : 0),
+                              (UInt32)entries.size(), (UInt32)keys.size() };
+    size_t at = object->size();
+
+    object->resize(at + sizeof(header) + entries.size() * sizeof(TopIndexEntry));
+
+    char *p = &(*object)[at];
+    memcpy(p, &header, sizeof(header));
+    if (!entries.empty())
+        memcpy(p + sizeof(header), &entries[0], entries.size() * sizeof(TopIndexEntry));
+
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        UInt32 keySize = keys[i].size();
+
+        object->insert(object->end(), (const char *)&keySize, (const char *)&keySize + sizeof(keySize));
+        object->insert(object->end(), keys[i].begin(), keys[i].end());
+    }
+}
+
+int TopIndex::find(const std::string &key) const
+{
+    std::map<std::string, UInt32>::const_iterator it = numbers.find(key);
+    return it == numbers.end() ? -1 : (int)it->second;
+}
+
+void TopIndex::add(const char *key, const int *values, size_t count)
+{
+    int found = find(key);
+    UInt32 object;
+
+    if (found >= 0)
+    {
+        // Without the old values of the object, the entries are still the
+        // largest values of the others.
+
+        object = found;
+        size_t n = 0;
+        for (size_t i = 0; i < entries.size(); ++i)
+            if (entries[i].object != object)
+                entries[n++] = entries[i];
+        entries.resize(n);
+    }
+    else
+    {
+        object = keys.size();
+        keys.push_back(key);
+        numbers[keys.back()] = object;
+    }
+
+    // The largest values of the object, through a min-heap.
+
+    std::vector<TopIndexEntry> fresh;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        TopIndexEntry e = { values[i], object, i };
+
+        if (fresh.size() < capacity)
+        {
+            fresh.push_back(e);
+            std::push_heap(fresh.begin(), fresh.end(), largerFirst);
+        }
+        else if (capacity && values[i] > fresh.front().value)
+        {
+            std::pop_heap(fresh.begin(), fresh.end(), largerFirst);
+            fresh.back() = e;
+            std::push_heap(fresh.begin(), fresh.end(), largerFirst);
+        }
+    }
+
+    // Values left out, on either side, are at most bound: the merged
+    // entries are exact down to it.
+
+    long long bound = LLONG_MIN;
+
+    if (!complete)
+        bound = entries.empty() ? INT_MAX : entries.back().value;
+    if (count > fresh.size())
+        bound = std::max(bound, fresh.empty() ? (long long)INT_MAX : fresh.front().value);
+
+    complete = complete && count == fresh.size();
+    entries.insert(entries.end(), fresh.begin(), fresh.end());
+    std::stable_sort(entries.begin(), entries.end(), largerFirst);
+
+    size_t n = 0;
+    while (n < entries.size() && n < capacity && entries[n].value >= bound)
+        ++n;
+    if (n < entries.size())
+        complete = false;
+    entries.resize(n);
+}
+
+bool readTopIndex(S3Connection *con, const char *bucketName, const char *key, TopIndex *index,
+                  std::string *etag)
+{
+    S3HeadResponse head;
+
+    con->head(bucketName, key, &head);
+    if (head.contentLength == (size_t)-1)
+        return false;
+
+    std::vector<char> data(head.contentLength + 1);
+    S3GetResponse response;
+
+    // One byte more, to tell whether the index grew meanwhile.
+
+    con->get(bucketName, key, &data[0], data.size(), &response);
+    if (response.loadedContentLength != head.contentLength)
+        throw std::runtime_error(std::string(key) + " changed while reading it");
+    if (!index->parse(&data[0], head.contentLength))
+        throw std::runtime_error(std::string(key) + " is not a top index");
+    if (etag)
+        *etag = response.etag;
+    return true;
+}
+
+bool writeTopIndex(S3Connection *con, const char *bucketName, const char *key, const TopIndex &index,
+                   const std::string &etag)
+{
+    std::vector<char> object;
+
+    index.serialize(&object);
+    return con->putIf(bucketName, key, &object[0], object.size(), etag);
+}
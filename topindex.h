@@ -0,0 +1,99 @@
+/*
+ * File:   topindex.h
+ * Author: taozou
+ *
+ * Top-N index: a small object kept next to the data, holding the N largest
+ * values of the objects ingested so far with where they are, so top-k for
+ * k <= N is one read plus a scan of the objects ingested after it.
+ *
+ * Layout, little endian:
+ *
+ *   [TopIndexHeader][entryCount TopIndexEntry][objectCount keys]
+ *
+ *   entries = largest values first
+ *   key     = UInt32 size, then the bytes of an object key covered by the
+ *             index, entries refer to keys by number
+ *
+ * The index is updated by read-modify-write at ingest (smartput -x), the
+ * write being conditional on the etag read, so concurrent ingests retry
+ * rather than lose each other's objects.
+ */
+
+#ifndef TOPINDEX_H
+#define	TOPINDEX_H
+
+#include "s3conn.h"
+#include "columnar.h"
+#include <map>
+#include <string>
+#include <vector>
+
+#define TopIndexMagic 0x504f5453     // "STOP"
+#define TopIndexVersion 1
+#define TopIndexCapacity 1000
+
+// Every value of the covered objects is in the entries.
+
+#define TopIndexComplete 1
+
+struct TopIndexHeader
+{
+    UInt32 magic;
+    UInt32 version;
+    UInt32 capacity;
+    UInt32 flags;
+    UInt32 entryCount;
+    UInt32 objectCount;
+};
+
+struct TopIndexEntry
+{
+    int value;
+    UInt32 object;      // number of the key
+    UInt64 position;    // of the value in the object, in ints
+};
+
+class TopIndex {
+public:
+    explicit TopIndex(UInt32 capacity = TopIndexCapacity) : capacity(capacity), complete(true) {}
+
+    bool parse(const void *data, size_t size);
+    void serialize(std::vector<char> *object) const;
+
+    // Covers the object key holding values, or covers it again with new
+    // values if it was already. The entries stay the largest values of
+    // the covered objects but may get fewer than capacity: values that
+    // can't be told apart from the ones left out are dropped.
+
+    void add(const char *key, const int *values, size_t count);
+
+    // Number of the key, -1 if the index doesn't cover it.
+
+    int find(const std::string &key) const;
+
+    // True if the entries hold the k largest values of the covered objects.
+
+    bool answers(size_t k) const { return complete || k <= entries.size(); }
+
+    UInt32 capacity;
+    bool complete;
+    std::vector<TopIndexEntry> entries;
+    std::vector<std::string> keys;
+
+private:
+    std::map<std::string, UInt32> numbers;
+};
+
+// Reads the index bucketName/key and its etag; false if there is none.
+// Throws like S3Connection does, and if the object is not an index.
+
+bool readTopIndex(webstor::S3Connection *con, const char *bucketName, const char *key, TopIndex *index,
+                  std::string *etag = NULL);
+
+// Writes the index if bucketName/key still has the etag it was read with,
+// or is still missing if etag is empty; false if another writer was first.
+
+bool writeTopIndex(webstor::S3Connection *con, const char *bucketName, const char *key, const TopIndex &index,
+                   const std::string &etag);
+
+#endif	/* TOPINDEX_H */
@@ -0,0 +1,155 @@
+/*
+ * File:   upload.cpp
+ * Author: taozou
+ *
+ * Uploads of objects built in memory by the ingest tools.
+ */
+
+#include "upload.h"
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+using namespace webstor;
+
+void uploadObject(S3Connection *con, const char *bucketName, const char *key,
+                  const void *data, size_t size, const S3Metadata *metadata, std::string *etag)
+{
+    if (size <= MultipartThreshold)
+    {
+        S3PutResponse response;
+
+        con->put(bucketName, key, data, size, false, false, NULL, &response, metadata);
+        if (etag)
+            etag->swap(response.etag);
+        return;
+    }
+
+    S3InitiateMultipartUploadResponse upload;
+    con->initiateMultipartUpload(bucketName, key, false, false, NULL, &upload, metadata);
+
+    try
+    {
+        std::vector<S3PutResponse> parts;
+
+        for (size_t off = 0; off < size; off += MultipartPartSize)
+        {
+            parts.push_back(S3PutResponse());
+            con->putPart(bucketName, key, upload.uploadId.c_str(), parts.size(),
+                         static_cast<const char *>(data) + off,
+                         std::min((size_t)MultipartPartSize, size - off), &parts.back());
+        }
+
+        S3CompleteMultipartUploadResponse response;
+
+        con->completeMultipartUpload(bucketName, key, upload.uploadId.c_str(), &parts[0], parts.size(), &response);
+        if (etag)
+            etag->swap(response.etag);
+    }
+    catch (...)
+    {
+        try
+        {
+            con->abortMultipartUpload(bucketName, key, upload.uploadId.c_str());
+        }
+        catch (...)
+        {
+        }
+        throw;
+    }
+}
+
+MultipartWriter::MultipartWriter(S3Connection *con, const char *bucketName, const char *key,
+                                 const S3Metadata *metadata)
+    : con(con)
+    , bucketName(bucketName)
+    , key(key)
+    , finished(false)
+{
+    if (metadata)
+        this->metadata = *metadata;
+}
+
+MultipartWriter::~MultipartWriter()
+{
+    if (finished || parts.empty())
+        return;
+
+    if (con->isAsyncPending())
+        con->cancelAsync();
+    try
+    {
+        con->abortMultipartUpload(bucketName.c_str(), key.c_str(), upload.uploadId.c_str());
+    }
+    catch (...)
+    {
+    }
+}
+
+void MultipartWriter::sendPart(size_t size)
+{
+    if (parts.empty())
+        con->initiateMultipartUpload(bucketName.c_str(), key.c_str(), false, false, NULL, &upload, &metadata);
+    else
+        con->completePut(&parts.back());
+
+    sending.assign(pending.begin(), pending.begin() + size);
+    pending.erase(pending.begin(), pending.begin() + size);
+
+    parts.push_back(S3PutResponse());
+    parts.back().partNumber = parts.size();
+    con->pendPutPart(&asyncMan, bucketName.c_str(), key.c_str(), upload.uploadId.c_str(), parts.size(),
+                     &sending[0], sending.size());
+}
+
+void MultipartWriter::write(const void *data, size_t size)
+{
+    pending.insert(pending.end(), static_cast<const char *>(data), static_cast<const char *>(data) + size);
+
+    while (pending.size() >= MultipartPartSize)
+        sendPart(MultipartPartSize);
+}
+
+void MultipartWriter::finish()
+{
+    if (parts.empty())
+    {
+        con->put(bucketName.c_str(), key.c_str(), pending.empty() ? NULL : &pending[0], pending.size(),
+                 false, false, NULL, NULL, &metadata);
+        finished = true;
+        return;
+    }
+
+    if (!pending.empty())
+        sendPart(pending.size());
+
+    con->completePut(&parts.back());
+    con->completeMultipartUpload(bucketName.c_str(), key.c_str(), upload.uploadId.c_str(), &parts[0], parts.size());
+    finished = true;
+}
+
+void uploadCompressed(S3Connection *con, const char *bucketName, const char *key,
+                      const void *data, size_t size, Codec codec)
+{
+    S3Metadata metadata;
+    metadata[CodecMetadataName] = codecName(codec);
+
+    MultipartWriter writer(con, bucketName, key, &metadata);
+    Compressor compressor(codec);
+    std::vector<char> out;
+
+    for (size_t off = 0; off < size; off += MultipartCompressSlice)
+    {
+        size_t n = std::min((size_t)MultipartCompressSlice, size - off);
+
+        if (!compressor.write(static_cast<const char *>(data) + off, n, &out))
+            throw std::runtime_error(std::string("cannot compress with ") + codecName(codec));
+        writer.write(out.empty() ? NULL : &out[0], out.size());
+        out.clear();
+    }
+
+    if (!compressor.finish(&out))
+        throw std::runtime_error(std::string("cannot compress with ") + codecName(codec));
+    writer.write(out.empty() ? NULL : &out[0], out.size());
+    writer.finish();
+}
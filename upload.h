@@ -0,0 +1,77 @@
+/*
+ * File:   upload.h
+ * Author: taozou
+ *
+ * Uploads of objects built in memory by the ingest tools.
+ */
+
+#ifndef UPLOAD_H
+#define	UPLOAD_H
+
+#include "s3conn.h"
+#include "codec.h"
+#include <string>
+#include <vector>
+
+// Objects above this size go through a multipart upload.
+
+#define MultipartThreshold (64 * 1024 * 1024)
+#define MultipartPartSize (16 * 1024 * 1024)
+
+// User metadata "sorted: 1" marks a flat object of plain ints stored in
+// ascending order: its largest values are its last ones.
+
+#define SortedMetadataName "sorted"
+
+// Puts data as bucketName/key, with a multipart upload of MultipartPartSize
+// parts when it's large, and with the given user metadata; etag, if given,
+// gets the etag of the object. Throws like S3Connection does; a failed
+// multipart upload is aborted first.
+
+void uploadObject(webstor::S3Connection *con, const char *bucketName, const char *key,
+                  const void *data, size_t size, const webstor::S3Metadata *metadata = NULL,
+                  std::string *etag = NULL);
+
+// Uploads a stream of unknown size as bucketName/key, with the given user
+// metadata: it is cut into MultipartPartSize parts, each sent while the
+// caller produces the next one, or put in one go if it ends up smaller
+// than a part. Methods throw like S3Connection does; an upload that isn't
+// finished is aborted.
+
+class MultipartWriter {
+public:
+    MultipartWriter(webstor::S3Connection *con, const char *bucketName, const char *key,
+                    const webstor::S3Metadata *metadata = NULL);
+    ~MultipartWriter();
+
+    void write(const void *data, size_t size);
+    void finish();
+
+private:
+    MultipartWriter(const MultipartWriter &);
+    void operator=(const MultipartWriter &);
+
+    void sendPart(size_t size);
+
+    webstor::S3Connection *con;
+    std::string bucketName;
+    std::string key;
+    webstor::S3Metadata metadata;
+    std::vector<char> pending;
+    std::vector<char> sending;
+    std::vector<webstor::S3PutResponse> parts;
+    webstor::S3InitiateMultipartUploadResponse upload;
+    webstor::AsyncMan asyncMan;
+    bool finished;
+};
+
+// Same as uploadObject, compressed with codec MultipartCompressSlice bytes
+// at a time, through a MultipartWriter. The codec is recorded as the
+// CodecMetadataName user metadata, which tells readers how to decode it.
+
+#define MultipartCompressSlice (1024 * 1024)
+
+void uploadCompressed(webstor::S3Connection *con, const char *bucketName, const char *key,
+                      const void *data, size_t size, Codec codec);
+
+#endif	/* UPLOAD_H */